@@ -8,17 +8,23 @@ close PROFILE;
 open(METRICS,"> metrics.h") || die "Unable to open metrics.h for output\n";
 
 print METRICS "#define COUNT_TIME_INDOM 0\n";
-print METRICS "#define BYTE_INDOM       1\n\n";
+print METRICS "#define BYTE_INDOM       1\n";
+print METRICS "#define LATENCY_INDOM    2\n";
+print METRICS "#define SHARE_INDOM      3\n";
+print METRICS "#define CLIENT_INDOM     4\n\n";
 print METRICS "#define FIELD_OFF(x) (unsigned)\&(((struct profile_stats *)NULL)->x)\n\n";
 print METRICS "typedef struct {\n";
 print METRICS "\tchar *name;\n";
 print METRICS "\tunsigned offset;\n";
 print METRICS "} samba_instance;\n\n";
 
-@instnames = grep(/unsigned .*_time;/,@profile);
-foreach $instnames (@instnames) {
-    chomp $instnames;
-    $instnames =~ s/^.*unsigned (.*)_time.*$/$1/;
+@timedefs = grep(/^#define .*_time __profile_stats_value\(/,@profile);
+@instnames = ();
+@instvalues = ();
+foreach $_ (@timedefs) {
+    /^#define (.*)_time __profile_stats_value\((PR_VALUE_\w+),.*$/;
+    push(@instnames, $1);
+    push(@instvalues, $2);
 }
 
 print METRICS "static samba_instance samba_counts[] = {";
@@ -46,9 +52,9 @@ foreach $1 (@instnames) {
 }
 print METRICS "\n};\n\n";
 print METRICS "static samba_instance samba_bytes[] = {";
-@instnames = grep(/unsigned .*_bytes;/,@profile);
+@bytenames = grep(/unsigned .*_bytes;/,@profile);
 $first = 1;
-foreach $_ (@instnames) {
+foreach $_ (@bytenames) {
     if ($first == 1) {
 	$first = 0;
 	print METRICS "\n";
@@ -58,6 +64,18 @@ foreach $_ (@instnames) {
     /^.*unsigned (.*)_bytes.*$/;
     print METRICS "\t{\"$1\", FIELD_OFF($1_bytes)}";
 }
+print METRICS "\n};\n\n";
+print METRICS "static samba_instance samba_latency[] = {";
+$first = 1;
+for ($i = 0; $i <= $#instnames; $i++) {
+    if ($first == 1) {
+	$first = 0;
+	print METRICS "\n";
+    } else {
+	print METRICS ",\n";
+    }
+    print METRICS "\t{\"$instnames[$i]\", FIELD_OFF(histogram[$instvalues[$i]])}";
+}
 print METRICS "\n};\n";
 
 close METRICS
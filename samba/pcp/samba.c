@@ -37,6 +37,7 @@ typedef int BOOL;
 #define IRIX 1
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/shm.h>
 #include <pcp/pmapi.h>
 #ifdef IRIX
@@ -49,6 +50,9 @@ typedef int BOOL;
 
 static pmdaInstid *counttime = NULL;
 static pmdaInstid *bytes = NULL;
+static pmdaInstid *latency = NULL;
+static pmdaInstid shares[IOSTATS_MAX_SHARES];
+static pmdaInstid clients[IOSTATS_MAX_CLIENTS];
 
 /*
  * List of instance domains
@@ -56,7 +60,10 @@ static pmdaInstid *bytes = NULL;
 
 static pmdaIndom indomtab[] = {
 	{COUNT_TIME_INDOM,0,NULL},
-	{BYTE_INDOM,0,NULL}
+	{BYTE_INDOM,0,NULL},
+	{LATENCY_INDOM,0,NULL},
+	{SHARE_INDOM,0,shares},
+	{CLIENT_INDOM,0,clients}
 };
 /*
  * all metrics supported in this PMDA - one table entry for each
@@ -137,7 +144,64 @@ static pmdaMetric metrictab[] = {
 		{ 0,1,0,0,PM_TIME_USEC,0} }, },
 /* bytes instance domain */
     { NULL, { PMDA_PMID(5,0), PM_TYPE_U32, BYTE_INDOM, PM_SEM_COUNTER, 
-		{ 1,0,0,PM_SPACE_BYTE,0,0} }, }
+		{ 1,0,0,PM_SPACE_BYTE,0,0} }, },
+/* latency instance domain */
+    { NULL, { PMDA_PMID(6,0), PM_TYPE_U32, LATENCY_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.read_bytes */
+    { NULL, { PMDA_PMID(7,0), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 1,0,0,PM_SPACE_BYTE,0,0} }, },
+/* share.write_bytes */
+    { NULL, { PMDA_PMID(7,1), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 1,0,0,PM_SPACE_BYTE,0,0} }, },
+/* share.read_ops */
+    { NULL, { PMDA_PMID(7,2), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.write_ops */
+    { NULL, { PMDA_PMID(7,3), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.meta_ops */
+    { NULL, { PMDA_PMID(7,4), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.dir_ops */
+    { NULL, { PMDA_PMID(7,5), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.lock_ops */
+    { NULL, { PMDA_PMID(7,6), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.other_ops */
+    { NULL, { PMDA_PMID(7,7), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* share.time */
+    { NULL, { PMDA_PMID(7,8), PM_TYPE_U64, SHARE_INDOM, PM_SEM_COUNTER, 
+		{ 0,1,0,0,PM_TIME_USEC,0} }, },
+/* client.read_bytes */
+    { NULL, { PMDA_PMID(8,0), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 1,0,0,PM_SPACE_BYTE,0,0} }, },
+/* client.write_bytes */
+    { NULL, { PMDA_PMID(8,1), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 1,0,0,PM_SPACE_BYTE,0,0} }, },
+/* client.read_ops */
+    { NULL, { PMDA_PMID(8,2), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.write_ops */
+    { NULL, { PMDA_PMID(8,3), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.meta_ops */
+    { NULL, { PMDA_PMID(8,4), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.dir_ops */
+    { NULL, { PMDA_PMID(8,5), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.lock_ops */
+    { NULL, { PMDA_PMID(8,6), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.other_ops */
+    { NULL, { PMDA_PMID(8,7), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,0,1,0,0,PM_COUNT_ONE} }, },
+/* client.time */
+    { NULL, { PMDA_PMID(8,8), PM_TYPE_U64, CLIENT_INDOM, PM_SEM_COUNTER, 
+		{ 0,1,0,0,PM_TIME_USEC,0} }, }
 
 };
 
@@ -145,6 +209,86 @@ extern int	errno;
 struct profile_stats	*stats;
 struct profile_header	*shmheader;
 int		shmid = -1;
+struct iostats_header	*iostats;
+
+
+/*
+ * The io stats area only exists while smbd runs with "io stats" set,
+ * and shares and clients come and go, so re-read the instance lists
+ * before each fetch or instance request.
+ */
+
+static void
+samba_iostats_refresh(void)
+{
+    int i, n;
+
+    if (iostats == NULL) {
+	int id = shmget(IOSTATS_SHMEM_KEY, 0, 0);
+	struct iostats_header *h;
+
+	if (id == -1)
+	    return;
+	h = (struct iostats_header *)shmat(id, NULL, SHM_RDONLY);
+	if (h == (struct iostats_header *)-1)
+	    return;
+	if (h->iostats_shm_magic != IOSTATS_SHM_MAGIC ||
+	    h->iostats_shm_version != IOSTATS_SHM_VERSION) {
+	    shmdt(h);
+	    return;
+	}
+	iostats = h;
+    }
+
+    for (i = n = 0; i < IOSTATS_MAX_SHARES && iostats->shares[i].name[0]; i++, n++) {
+	shares[n].i_inst = i;
+	shares[n].i_name = iostats->shares[i].name;
+    }
+    indomtab[SHARE_INDOM].it_numinst = n;
+
+    for (i = n = 0; i < IOSTATS_MAX_CLIENTS && iostats->clients[i].name[0]; i++, n++) {
+	clients[n].i_inst = i;
+	clients[n].i_name = iostats->clients[i].name;
+    }
+    indomtab[CLIENT_INDOM].it_numinst = n;
+}
+
+static int
+samba_iostats_fetch(struct iostats_slot *slots, int num_slots,
+		    unsigned int item, unsigned int inst, pmAtomValue *atom)
+{
+    struct iostats_counters	*c;
+    int				i;
+
+    if (iostats == NULL || inst >= num_slots || slots[inst].name[0] == '\0')
+	return PM_ERR_INST;
+    c = &slots[inst].counters;
+
+    switch (item) {
+	case 0:
+	    atom->ull = c->read_bytes;
+	    break;
+	case 1:
+	    atom->ull = c->write_bytes;
+	    break;
+	case 2:
+	case 3:
+	case 4:
+	case 5:
+	case 6:
+	case 7:			/* ops by class, in iostats_op_class order */
+	    atom->ull = c->ops[item - 2];
+	    break;
+	case 8:
+	    atom->ull = 0;
+	    for (i = 0; i < IOSTATS_NUM_OP_CLASSES; i++)
+		atom->ull += c->usec[i];
+	    break;
+	default:
+	    return PM_ERR_PMID;
+    }
+    return 0;
+}
 
 
 int
@@ -282,11 +426,49 @@ samba_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
 	else
 	    return PM_ERR_PMID;
     }
+    else if (idp->cluster == 6) {	/* latency */
+	if (idp->item == 0) {
+	    if (inst < indomtab[LATENCY_INDOM].it_numinst) {
+		unsigned *p;
+
+		p = (unsigned *)((char *)stats +
+			samba_latency[inst / PROF_HISTOGRAM_BUCKETS].offset);
+		atom->ul = p[inst % PROF_HISTOGRAM_BUCKETS];
+	    }
+	    else
+		return PM_ERR_INST;
+	}
+	else
+	    return PM_ERR_PMID;
+    }
+    else if (idp->cluster == 7) {	/* share */
+	return samba_iostats_fetch(iostats ? iostats->shares : NULL,
+				   IOSTATS_MAX_SHARES, idp->item, inst, atom);
+    }
+    else if (idp->cluster == 8) {	/* client */
+	return samba_iostats_fetch(iostats ? iostats->clients : NULL,
+				   IOSTATS_MAX_CLIENTS, idp->item, inst, atom);
+    }
     else
 	return PM_ERR_PMID;
     return 0;
 }
 
+static int
+samba_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
+{
+    samba_iostats_refresh();
+    return pmdaFetch(numpmid, pmidlist, resp, pmda);
+}
+
+static int
+samba_instance(pmInDom indom, int inst, char *name, __pmInResult **result,
+	       pmdaExt *pmda)
+{
+    samba_iostats_refresh();
+    return pmdaInstance(indom, inst, name, result, pmda);
+}
+
 
 void 
 samba_init(pmdaInterface *dp)
@@ -337,7 +519,41 @@ samba_init(pmdaInterface *dp)
     indomtab[BYTE_INDOM].it_numinst = inst_count;
     indomtab[BYTE_INDOM].it_set = bytes;
 
+    /* one instance for each bucket of each latency histogram */
+    inst_count = sizeof(samba_latency)/sizeof(samba_latency[0]) *
+		 PROF_HISTOGRAM_BUCKETS;
+    latency = (pmdaInstid *)malloc(inst_count * sizeof(pmdaInstid));
+    if (latency == NULL) {
+	__pmNoMem("latency",inst_count * sizeof(pmdaInstid),PM_FATAL_ERR);
+	/* NOTREACHED*/
+    }
+    for (i = 0; i < inst_count; i++) {
+	int bucket = i % PROF_HISTOGRAM_BUCKETS;
+	unsigned long lower = bucket ? (1UL << (bucket - 1)) : 0;
+	char name[128];
+
+	if (bucket == PROF_HISTOGRAM_BUCKETS - 1)
+	    snprintf(name, sizeof(name), "%s:%lu-",
+		     samba_latency[i / PROF_HISTOGRAM_BUCKETS].name, lower);
+	else
+	    snprintf(name, sizeof(name), "%s:%lu-%lu",
+		     samba_latency[i / PROF_HISTOGRAM_BUCKETS].name, lower,
+		     (1UL << bucket) - 1);
+	latency[i].i_inst = i;
+	latency[i].i_name = strdup(name);
+	if (latency[i].i_name == NULL) {
+	    __pmNoMem("latency name",strlen(name) + 1,PM_FATAL_ERR);
+	    /* NOTREACHED*/
+	}
+    }
+    indomtab[LATENCY_INDOM].it_numinst = inst_count;
+    indomtab[LATENCY_INDOM].it_set = latency;
+
+
+    samba_iostats_refresh();
 
+    dp->version.two.fetch = samba_fetch;
+    dp->version.two.instance = samba_instance;
     pmdaSetFetchCallBack(dp, samba_fetchCallBack);
     pmdaInit(dp, indomtab, sizeof(indomtab)/sizeof(indomtab[0]), 
 	     metrictab, sizeof(metrictab)/sizeof(metrictab[0]));
@@ -51,6 +51,13 @@
 /* maximum number of file caches per smbd */
 #define MAX_WRITE_CACHES 10
 
+/* maximum number of bytes held in write caches per smbd */
+#define MAX_WRITE_CACHE_BYTES (16*1024*1024)
+
+/* flush a write cache once the file hasn't been written for this many
+   seconds */
+#define WRITE_CACHE_IDLE_TIMEOUT 2
+
 /* define what facility to use for syslog */
 #ifndef SYSLOG_FACILITY
 #define SYSLOG_FACILITY LOG_DAEMON
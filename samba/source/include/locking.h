@@ -56,8 +56,12 @@ struct byte_range_lock {
 	unsigned int num_locks;
 	BOOL modified;
 	BOOL read_only;
+	BOOL was_stored; /* there was a record when we fetched */
 	struct lock_key key;
 	void *lock_data;
+	TDB_VIEW view; /* read only: lock_data points into the record */
+	unsigned int num_unchanged; /* leading locks still as stored */
+	br_off max_size; /* no lock is larger, see brl_lock_range() */
 };
 
 #define BRLOCK_FN_CAST() \
@@ -73,9 +77,11 @@ struct byte_range_lock {
 				 br_off start, br_off size)
 
 /* Internal structure in brlock.tdb. 
-   The data in brlock records is an unsorted linear array of these
-   records.  It is unnecessary to store the count as tdb provides the
-   size of the record */
+   The data in brlock records is a linear array of these records,
+   sorted by start offset. Locks with the same start are kept in the
+   order they were taken. Unsorted records written by older versions
+   are sorted when read. It is unnecessary to store the count as tdb
+   provides the size of the record */
 
 struct lock_struct {
 	struct lock_context context;
@@ -40,6 +40,10 @@
 #define SAFETY_MARGIN 1024
 #define LARGE_WRITEX_HDR_SIZE 65
 
+/* Offset of the data in an SMBwriteX with 14 words and a pad byte.
+   This is the part of the packet we read before using recvfile. */
+#define STANDARD_WRITE_AND_X_HEADER_SIZE (smb_size - 4 + 14*2 + 1)
+
 #define NMB_PORT 137
 #define DGRAM_PORT 138
 #define SMB_PORT1 445
@@ -414,12 +418,22 @@ typedef struct {
 	BOOL  wr_discard; /* discard all further data */
 } write_bmpx_struct;
 
-typedef struct write_cache {
-	SMB_OFF_T file_size;
+/* One contiguous range of cached, not yet written data. */
+struct write_cache_extent {
+	struct write_cache_extent *next, *prev;
 	SMB_OFF_T offset;
-	size_t alloc_size;
 	size_t data_size;
 	char *data;
+};
+
+typedef struct write_cache {
+	struct write_cache *next, *prev; /* All write caches in this smbd. */
+	struct files_struct *fsp;
+	SMB_OFF_T file_size;
+	size_t alloc_size; /* Max bytes cached for this file. */
+	size_t data_size; /* Bytes cached in all extents. */
+	struct write_cache_extent *extents; /* Sorted, never overlap or abut. */
+	time_t last_write;
 } write_cache;
 
 typedef struct {
@@ -452,6 +466,7 @@ struct timed_event;
 struct idle_event;
 struct share_mode_entry;
 struct uuid;
+struct dir_index;
 
 struct vfs_fsp_data {
     struct vfs_fsp_data *next;
@@ -540,6 +555,8 @@ typedef struct files_struct {
 	BOOL is_sendfile_capable;
 	BOOL aio_write_behind;
 	BOOL lockdb_clean;
+	BOOL brl_none; /* no byte range locks while brlock.tdb is at brl_seqnum */
+	int brl_seqnum;
 	BOOL initial_delete_on_close; /* Only set at NTCreateX if file was created. */
 	BOOL posix_open;
 	char *fsp_name;
@@ -697,6 +714,7 @@ typedef struct connection_struct {
 	struct dfree_cached_info *dfree_info;
 	struct trans_state *pending_trans;
 	struct notify_context *notify_ctx;
+	struct iostats_conn *iostats; /* "io stats" counters, NULL until used. */
 } connection_struct;
 
 struct current_user {
@@ -239,6 +239,7 @@ static inline void sys_kernel_debug(int code, int a1, int a2,
 #define kdebug_syscall_lchown 166 /* added by jra in rev 23105 */
 #define kdebug_syscall_ntimes 167 /* added by jra in rev 21714 */
 #define kdebug_syscall_linux_setlease 168 /* added by jmcd in rev 21324 */
+#define kdebug_syscall_recvfile		169
 
 /* XXX jpeach added chflags in rev 21757 and didn't update the profiling */
 
@@ -37,7 +37,7 @@
 
 #define PROF_SHMEM_KEY ((key_t)0x07021999)
 #define PROF_SHM_MAGIC 0x6349985
-#define PROF_SHM_VERSION 11
+#define PROF_SHM_VERSION 14
 
 /* time values in the following structure are in microseconds */
 
@@ -114,6 +114,10 @@ enum profile_stats_values
 #define syscall_sendfile_count __profile_stats_value(PR_VALUE_SYSCALL_SENDFILE, count)
 #define syscall_sendfile_time __profile_stats_value(PR_VALUE_SYSCALL_SENDFILE, time)
 
+	PR_VALUE_SYSCALL_RECVFILE,
+#define syscall_recvfile_count __profile_stats_value(PR_VALUE_SYSCALL_RECVFILE, count)
+#define syscall_recvfile_time __profile_stats_value(PR_VALUE_SYSCALL_RECVFILE, time)
+
 	PR_VALUE_SYSCALL_RENAME,
 #define syscall_rename_count __profile_stats_value(PR_VALUE_SYSCALL_RENAME, count)
 #define syscall_rename_time __profile_stats_value(PR_VALUE_SYSCALL_RENAME, time)
@@ -733,6 +737,13 @@ enum profile_stats_values
 
 const char * profile_value_name(enum profile_stats_values val);
 
+/* Latency histograms are kept in log2 microsecond buckets. Bucket 0
+ * counts operations that took less than 1 usec, bucket n counts those
+ * that took [2^(n-1), 2^n) usec. The last bucket also collects
+ * everything slower than that (about 4 seconds and up).
+ */
+#define PROF_HISTOGRAM_BUCKETS 24
+
 struct profile_stats {
 /* general counters */
 	unsigned smb_count; /* how many SMB packets we have processed */
@@ -742,12 +753,16 @@ struct profile_stats {
 	unsigned count[PR_VALUE_MAX];
 	unsigned time[PR_VALUE_MAX];
 
+/* per operation latency histograms, see PROF_HISTOGRAM_BUCKETS */
+	unsigned histogram[PR_VALUE_MAX][PROF_HISTOGRAM_BUCKETS];
+
 /* cumulative byte counts */
 	unsigned syscall_pread_bytes;
 	unsigned syscall_pwrite_bytes;
 	unsigned syscall_read_bytes;
 	unsigned syscall_write_bytes;
 	unsigned syscall_sendfile_bytes;
+	unsigned syscall_recvfile_bytes;
 
 /* stat cache counters */
 	unsigned statcache_lookups;
@@ -788,6 +803,26 @@ extern BOOL do_profile_times;
 #define DEC_PROFILE_COUNT(x) profile_p->x--
 #define ADD_PROFILE_COUNT(x,y) profile_p->x += (y)
 
+/* The x_time names expand to time[PR_VALUE_X], so the offset of that
+ * element into the time array gives us the value index.
+ */
+#define PROFILE_VALUE_INDEX(t) (&profile_p->t - &profile_p->time[0])
+#define ADD_PROFILE_HISTOGRAM(t,usec) \
+	profile_p->histogram[PROFILE_VALUE_INDEX(t)] \
+			    [profile_histogram_bucket(usec)]++
+
+static inline unsigned profile_histogram_bucket(SMB_BIG_UINT usec)
+{
+	unsigned bucket = 0;
+
+	while (usec != 0 && bucket < (PROF_HISTOGRAM_BUCKETS - 1)) {
+		usec >>= 1;
+		++bucket;
+	}
+
+	return bucket;
+}
+
 #if defined(HAVE_CLOCK_GETTIME)
 
 extern clockid_t __profile_clock;
@@ -858,9 +893,11 @@ static inline SMB_BIG_UINT profile_timestamp(void)
 
 #define END_PROFILE(x) \
 	KDEBUG_TRACE_END(kdebug_##x); \
-	if (do_profile_times) { \
-		ADD_PROFILE_COUNT(x##_time, \
-		    profile_timestamp() - __profstamp_##x); \
+	if (do_profile_times && __profstamp_##x != 0) { \
+		SMB_BIG_UINT __profdelta_##x = \
+		    profile_timestamp() - __profstamp_##x; \
+		ADD_PROFILE_COUNT(x##_time, __profdelta_##x); \
+		ADD_PROFILE_HISTOGRAM(x##_time, __profdelta_##x); \
 	}
 
 
@@ -908,4 +945,71 @@ extern service_stats *service_c;
 	}
 #endif /*WITH_DARWIN_STATS*/
 
+/*
+ * Per-share and per-client I/O accounting, enabled with "io stats".
+ * Each smbd adds its counters straight into a slot of a shared memory
+ * area that smbstatus and the PCP agent can read without talking to
+ * smbd. Like the profile counters, the slots are updated without
+ * locking, so the occasional concurrent increment may be lost.
+ */
+
+#define IOSTATS_SHMEM_KEY ((key_t)0x07021998)
+#define IOSTATS_SHM_MAGIC 0x10574a75
+#define IOSTATS_SHM_VERSION 1
+
+#define IOSTATS_MAX_SHARES 256
+#define IOSTATS_MAX_CLIENTS 1024
+#define IOSTATS_NAME_LEN 64
+
+enum iostats_op_class {
+	IOSTATS_OP_READ = 0,
+	IOSTATS_OP_WRITE,
+	IOSTATS_OP_META,	/* open, close, stat, setinfo, rename ... */
+	IOSTATS_OP_DIR,		/* directory listing and mkdir/rmdir */
+	IOSTATS_OP_LOCK,
+	IOSTATS_OP_OTHER,
+	IOSTATS_NUM_OP_CLASSES
+};
+
+struct iostats_counters {
+	SMB_BIG_UINT read_bytes;
+	SMB_BIG_UINT write_bytes;
+	SMB_BIG_UINT ops[IOSTATS_NUM_OP_CLASSES];
+	SMB_BIG_UINT usec[IOSTATS_NUM_OP_CLASSES]; /* time spent serving ops */
+};
+
+/* A slot is in use once its name is set. Slots are never released. */
+struct iostats_slot {
+	char name[IOSTATS_NAME_LEN];
+	struct iostats_counters counters;
+};
+
+struct iostats_header {
+	int iostats_shm_magic;
+	int iostats_shm_version;
+	struct iostats_slot shares[IOSTATS_MAX_SHARES];
+	struct iostats_slot clients[IOSTATS_MAX_CLIENTS];
+};
+
+/* Per connection_struct counters, allocated the first time the
+ * connection does some accounted work.
+ */
+struct iostats_conn {
+	struct iostats_counters counters;
+	struct iostats_slot *share;
+};
+
+extern struct iostats_header *iostats_h;
+extern BOOL iostats_enabled;
+
+#define IOSTATS_ADD_READ(conn, n) \
+	if (iostats_enabled && (conn) != NULL) { \
+		iostats_add_bytes((conn), (n), 0); \
+	}
+
+#define IOSTATS_ADD_WRITE(conn, n) \
+	if (iostats_enabled && (conn) != NULL) { \
+		iostats_add_bytes((conn), 0, (n)); \
+	}
+
 #endif
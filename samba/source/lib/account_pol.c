@@ -213,9 +213,9 @@ BOOL init_account_policy(void)
 		return True;
 	}
 
-	tdb = tdb_open_log(lock_path("account_policy.tdb"), 0, TDB_DEFAULT, O_RDWR, 0600);
+	tdb = tdb_open_log(lock_path("account_policy.tdb"), 0, TDB_WAL, O_RDWR, 0600);
 	if (!tdb) { /* the account policies files does not exist or open failed, try to create a new one */
-		tdb = tdb_open_log(lock_path("account_policy.tdb"), 0, TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+		tdb = tdb_open_log(lock_path("account_policy.tdb"), 0, TDB_WAL, O_RDWR|O_CREAT, 0600);
 		if (!tdb) {
 			DEBUG(0,("Failed to open account policy database\n"));
 			return False;
@@ -314,8 +314,19 @@ BOOL account_policy_set(int field, uint32 value)
 		return False;
 	}
 
+	if (tdb_transaction_start(tdb) != 0) {
+		DEBUG(1, ("account_policy_set: tdb_transaction_start failed\n"));
+		return False;
+	}
+
 	if (!tdb_store_uint32(tdb, name, value)) {
 		DEBUG(1, ("tdb_store_uint32 failed for field %d (%s) on value %u\n", field, name, value));
+		tdb_transaction_cancel(tdb);
+		return False;
+	}
+
+	if (tdb_transaction_commit(tdb) != 0) {
+		DEBUG(1, ("account_policy_set: tdb_transaction_commit failed\n"));
 		return False;
 	}
 
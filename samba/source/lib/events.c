@@ -21,6 +21,10 @@
 
 #include "includes.h"
 
+#if defined(HAVE_EPOLL) && defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#endif
+
 struct timed_event {
 	struct timed_event *next, *prev;
 	struct event_context *event_ctx;
@@ -38,6 +42,7 @@ struct fd_event {
 	struct event_context *event_ctx;
 	int fd;
 	uint16_t flags; /* see EVENT_FD_* flags */
+	BOOL backend_registered; /* the backend (epoll) knows about fd */
 	void (*handler)(struct event_context *event_ctx,
 			struct fd_event *event,
 			uint16 flags,
@@ -55,11 +60,294 @@ struct fd_event {
 #define EVENT_FD_NOT_READABLE(fde) \
 	event_set_fd_flags(fde, event_get_fd_flags(fde) & ~EVENT_FD_READ)
 
+/*
+ * The fd_event backend. All backends keep the list of fd_events in
+ * event_ctx->fd_events, the backend decides how to wait for them. Callers
+ * that run their own select() get the backend's fds from
+ * event_add_to_select_args() and hand the result to run_events().
+ */
+
+struct event_ops {
+	const char *name;
+	BOOL (*context_init)(struct event_context *event_ctx);
+	void (*fd_update)(struct event_context *event_ctx,
+			  struct fd_event *fde);
+	void (*fd_remove)(struct event_context *event_ctx,
+			  struct fd_event *fde);
+	void (*add_to_select_args)(struct event_context *event_ctx,
+				   fd_set *read_fds, fd_set *write_fds,
+				   int *maxfd);
+	BOOL (*run_fd_events)(struct event_context *event_ctx, int selrtn,
+			      fd_set *read_fds, fd_set *write_fds);
+};
+
 struct event_context {
 	struct timed_event *timed_events;
 	struct fd_event *fd_events;
+	const struct event_ops *ops;
+
+	/* Bumped when an fd_event goes away, see epoll_run_fd_events() */
+	unsigned destruction_count;
+
+	/* epoll backend state */
+	int epoll_fd;
+	pid_t epoll_pid;
+};
+
+/****************************************************************************
+ The select backend. Every fd_event is put into the fd_sets each time
+ round the loop.
+****************************************************************************/
+
+static void select_add_to_select_args(struct event_context *event_ctx,
+				      fd_set *read_fds, fd_set *write_fds,
+				      int *maxfd)
+{
+	struct fd_event *fde;
+
+	for (fde = event_ctx->fd_events; fde; fde = fde->next) {
+		if (fde->fd < 0 || fde->fd >= FD_SETSIZE) {
+			/* We ignore here, as it shouldn't be
+			   possible to add an invalid fde->fd
+			   but we don't want FD_SET to see an
+			   invalid fd. */
+			continue;
+		}
+
+		if (fde->flags & EVENT_FD_READ) {
+			FD_SET(fde->fd, read_fds);
+		}
+		if (fde->flags & EVENT_FD_WRITE) {
+			FD_SET(fde->fd, write_fds);
+		}
+
+		if ((fde->flags & (EVENT_FD_READ|EVENT_FD_WRITE))
+		    && (fde->fd > *maxfd)) {
+			*maxfd = fde->fd;
+		}
+	}
+}
+
+static BOOL select_run_fd_events(struct event_context *event_ctx, int selrtn,
+				 fd_set *read_fds, fd_set *write_fds)
+{
+	BOOL fired = False;
+	struct fd_event *fde, *next;
+
+	for (fde = event_ctx->fd_events; fde; fde = next) {
+		uint16 flags = 0;
+
+		next = fde->next;
+		if (fde->fd < 0 || fde->fd >= FD_SETSIZE) {
+			continue;
+		}
+		if (FD_ISSET(fde->fd, read_fds)) flags |= EVENT_FD_READ;
+		if (FD_ISSET(fde->fd, write_fds)) flags |= EVENT_FD_WRITE;
+
+		if (flags) {
+			fde->handler(event_ctx, fde, flags, fde->private_data);
+			fired = True;
+		}
+	}
+
+	return fired;
+}
+
+static const struct event_ops select_event_ops = {
+	"select",
+	NULL,
+	NULL,
+	NULL,
+	select_add_to_select_args,
+	select_run_fd_events
 };
 
+#if defined(HAVE_EPOLL) && defined(HAVE_SYS_EPOLL_H)
+
+/****************************************************************************
+ The epoll backend. The fd_events live in the kernel's interest list, the
+ caller only has to wait for the epoll fd itself to become readable and
+ we get back just the fds that are ready.
+****************************************************************************/
+
+#define EPOLL_MAX_EVENTS 64
+
+static uint32_t epoll_map_flags(uint16_t flags)
+{
+	uint32_t ret = 0;
+	if (flags & EVENT_FD_READ) ret |= (EPOLLIN | EPOLLERR | EPOLLHUP);
+	if (flags & EVENT_FD_WRITE) ret |= (EPOLLOUT | EPOLLERR | EPOLLHUP);
+	return ret;
+}
+
+static BOOL epoll_context_init(struct event_context *event_ctx)
+{
+	event_ctx->epoll_fd = epoll_create(EPOLL_MAX_EVENTS);
+	if (event_ctx->epoll_fd == -1) {
+		DEBUG(3, ("epoll_create failed: %s\n", strerror(errno)));
+		return False;
+	}
+	event_ctx->epoll_pid = sys_getpid();
+	return True;
+}
+
+static void epoll_fd_update(struct event_context *event_ctx,
+			    struct fd_event *fde);
+
+/****************************************************************************
+ The epoll interest list is shared with our parent after a fork. Get our
+ own one and register all fd_events with it again.
+****************************************************************************/
+
+static BOOL epoll_check_reopen(struct event_context *event_ctx)
+{
+	struct fd_event *fde;
+
+	if (event_ctx->epoll_pid == sys_getpid()) {
+		return True;
+	}
+
+	close(event_ctx->epoll_fd);
+	if (!epoll_context_init(event_ctx)) {
+		smb_panic("epoll_check_reopen: could not re-create epoll fd\n");
+	}
+
+	for (fde = event_ctx->fd_events; fde; fde = fde->next) {
+		fde->backend_registered = False;
+		epoll_fd_update(event_ctx, fde);
+	}
+	return True;
+}
+
+static void epoll_fd_update(struct event_context *event_ctx,
+			    struct fd_event *fde)
+{
+	struct epoll_event event;
+	int op;
+
+	if (event_ctx->epoll_pid != sys_getpid()) {
+		/* epoll_check_reopen() re-registers everything. */
+		epoll_check_reopen(event_ctx);
+		return;
+	}
+
+	if (fde->flags & (EVENT_FD_READ|EVENT_FD_WRITE)) {
+		op = fde->backend_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	} else if (fde->backend_registered) {
+		op = EPOLL_CTL_DEL;
+	} else {
+		return;
+	}
+
+	ZERO_STRUCT(event);
+	event.events = epoll_map_flags(fde->flags);
+	event.data.ptr = fde;
+
+	if (epoll_ctl(event_ctx->epoll_fd, op, fde->fd, &event) != 0) {
+		DEBUG(0, ("epoll_ctl(%d) for fd %d failed: %s\n", op, fde->fd,
+			  strerror(errno)));
+		return;
+	}
+
+	fde->backend_registered = (op != EPOLL_CTL_DEL);
+}
+
+static void epoll_fd_remove(struct event_context *event_ctx,
+			    struct fd_event *fde)
+{
+	struct epoll_event event;
+
+	if (!fde->backend_registered ||
+	    event_ctx->epoll_pid != sys_getpid()) {
+		return;
+	}
+
+	/* The fd might already be closed, which removes it anyway. */
+	ZERO_STRUCT(event);
+	epoll_ctl(event_ctx->epoll_fd, EPOLL_CTL_DEL, fde->fd, &event);
+	fde->backend_registered = False;
+}
+
+static void epoll_add_to_select_args(struct event_context *event_ctx,
+				     fd_set *read_fds, fd_set *write_fds,
+				     int *maxfd)
+{
+	epoll_check_reopen(event_ctx);
+
+	if (event_ctx->epoll_fd >= FD_SETSIZE) {
+		return;
+	}
+
+	FD_SET(event_ctx->epoll_fd, read_fds);
+	*maxfd = MAX(*maxfd, event_ctx->epoll_fd);
+}
+
+static BOOL epoll_run_fd_events(struct event_context *event_ctx, int selrtn,
+				fd_set *read_fds, fd_set *write_fds)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	unsigned destruction_count = event_ctx->destruction_count;
+	int i, ret;
+
+	if (!FD_ISSET(event_ctx->epoll_fd, read_fds)) {
+		return False;
+	}
+
+	/*
+	 * From here on we return True even if no handler fired: the
+	 * caller's select returned because of our fd, not because of
+	 * any of its own, so it has to go round again.
+	 */
+
+	ret = epoll_wait(event_ctx->epoll_fd, events, EPOLL_MAX_EVENTS, 0);
+	if (ret == -1) {
+		if (errno != EINTR) {
+			DEBUG(0, ("epoll_wait failed: %s\n", strerror(errno)));
+		}
+		return True;
+	}
+
+	for (i = 0; i < ret; i++) {
+		struct fd_event *fde = (struct fd_event *)events[i].data.ptr;
+		uint16 flags = 0;
+
+		if (events[i].events & (EPOLLHUP|EPOLLERR)) {
+			/* Let the handler find out about the error. */
+			flags = fde->flags;
+		}
+		if (events[i].events & EPOLLIN) flags |= EVENT_FD_READ;
+		if (events[i].events & EPOLLOUT) flags |= EVENT_FD_WRITE;
+		flags &= fde->flags;
+
+		if (flags) {
+			fde->handler(event_ctx, fde, flags, fde->private_data);
+		}
+
+		if (destruction_count != event_ctx->destruction_count) {
+			/*
+			 * The handler freed an fd_event, which might be
+			 * one of the events we still have in our array.
+			 * epoll is level triggered, so we'll see the rest
+			 * again next time round.
+			 */
+			break;
+		}
+	}
+
+	return True;
+}
+
+static const struct event_ops epoll_event_ops = {
+	"epoll",
+	epoll_context_init,
+	epoll_fd_update,
+	epoll_fd_remove,
+	epoll_add_to_select_args,
+	epoll_run_fd_events
+};
+
+#endif /* HAVE_EPOLL */
+
 static int timed_event_destructor(struct timed_event *te)
 {
 	DEBUG(10, ("Destroying timed event %lx \"%s\"\n", (unsigned long)te,
@@ -134,10 +422,23 @@ static int fd_event_destructor(struct fd_event *fde)
 {
 	struct event_context *event_ctx = fde->event_ctx;
 
+	if (event_ctx->ops->fd_remove) {
+		event_ctx->ops->fd_remove(event_ctx, fde);
+	}
+	event_ctx->destruction_count++;
 	DLIST_REMOVE(event_ctx->fd_events, fde);
 	return 0;
 }
 
+static void fd_event_update(struct fd_event *fde)
+{
+	struct event_context *event_ctx = fde->event_ctx;
+
+	if (event_ctx->ops->fd_update) {
+		event_ctx->ops->fd_update(event_ctx, fde);
+	}
+}
+
 struct fd_event *event_add_fd(struct event_context *event_ctx,
 			      TALLOC_CTX *mem_ctx,
 			      int fd, uint16_t flags,
@@ -149,7 +450,13 @@ struct fd_event *event_add_fd(struct event_context *event_ctx,
 {
 	struct fd_event *fde;
 
-	if (fd < 0 || fd >= FD_SETSIZE) {
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	/* Only the select backend is limited by FD_SETSIZE. */
+	if (event_ctx->ops == &select_event_ops && fd >= FD_SETSIZE) {
 		errno = EBADF;
 		return NULL;
 	}
@@ -163,31 +470,51 @@ struct fd_event *event_add_fd(struct event_context *event_ctx,
 	fde->flags = flags;
 	fde->handler = handler;
 	fde->private_data = private_data;
+	fde->backend_registered = False;
 
 	DLIST_ADD(event_ctx->fd_events, fde);
 
 	talloc_set_destructor(fde, fd_event_destructor);
+	fd_event_update(fde);
 	return fde;
 }
 
 void event_fd_set_writeable(struct fd_event *fde)
 {
 	fde->flags |= EVENT_FD_WRITE;
+	fd_event_update(fde);
 }
 
 void event_fd_set_not_writeable(struct fd_event *fde)
 {
 	fde->flags &= ~EVENT_FD_WRITE;
+	fd_event_update(fde);
 }
 
 void event_fd_set_readable(struct fd_event *fde)
 {
 	fde->flags |= EVENT_FD_READ;
+	fd_event_update(fde);
 }
 
 void event_fd_set_not_readable(struct fd_event *fde)
 {
 	fde->flags &= ~EVENT_FD_READ;
+	fd_event_update(fde);
+}
+
+uint16 event_get_fd_flags(struct fd_event *fde)
+{
+	return fde->flags;
+}
+
+void event_set_fd_flags(struct fd_event *fde, uint16 flags)
+{
+	if (fde->flags == flags) {
+		return;
+	}
+	fde->flags = flags;
+	fd_event_update(fde);
 }
 
 void event_add_to_select_args(struct event_context *event_ctx,
@@ -195,30 +522,10 @@ void event_add_to_select_args(struct event_context *event_ctx,
 			      fd_set *read_fds, fd_set *write_fds,
 			      struct timeval *timeout, int *maxfd)
 {
-	struct fd_event *fde;
 	struct timeval diff;
 
-	for (fde = event_ctx->fd_events; fde; fde = fde->next) {
-		if (fde->fd < 0 || fde->fd >= FD_SETSIZE) {
-			/* We ignore here, as it shouldn't be
-			   possible to add an invalid fde->fd
-			   but we don't want FD_SET to see an
-			   invalid fd. */
-			continue;
-		}
-
-		if (fde->flags & EVENT_FD_READ) {
-			FD_SET(fde->fd, read_fds);
-		}
-		if (fde->flags & EVENT_FD_WRITE) {
-			FD_SET(fde->fd, write_fds);
-		}
-
-		if ((fde->flags & (EVENT_FD_READ|EVENT_FD_WRITE))
-		    && (fde->fd > *maxfd)) {
-			*maxfd = fde->fd;
-		}
-	}
+	event_ctx->ops->add_to_select_args(event_ctx, read_fds, write_fds,
+					   maxfd);
 
 	if (event_ctx->timed_events == NULL) {
 		return;
@@ -232,7 +539,6 @@ BOOL run_events(struct event_context *event_ctx,
 		int selrtn, fd_set *read_fds, fd_set *write_fds)
 {
 	BOOL fired = False;
-	struct fd_event *fde, *next;
 
 	/* Run all events that are pending, not just one (as we
 	   did previously. */
@@ -268,27 +574,15 @@ BOOL run_events(struct event_context *event_ctx,
 		return True;
 	}
 
-	if (selrtn == 0) {
+	if (selrtn <= 0) {
 		/*
 		 * No fd ready
 		 */
 		return fired;
 	}
 
-	for (fde = event_ctx->fd_events; fde; fde = next) {
-		uint16 flags = 0;
-
-		next = fde->next;
-		if (FD_ISSET(fde->fd, read_fds)) flags |= EVENT_FD_READ;
-		if (FD_ISSET(fde->fd, write_fds)) flags |= EVENT_FD_WRITE;
-
-		if (flags) {
-			fde->handler(event_ctx, fde, flags, fde->private_data);
-			fired = True;
-		}
-	}
-
-	return fired;
+	return event_ctx->ops->run_fd_events(event_ctx, selrtn,
+					     read_fds, write_fds);
 }
 
 
@@ -310,9 +604,53 @@ struct timeval *get_timed_events_timeout(struct event_context *event_ctx,
 	return to_ret;
 }
 
+static int event_context_destructor(struct event_context *event_ctx)
+{
+	if (event_ctx->epoll_fd != -1) {
+		close(event_ctx->epoll_fd);
+		event_ctx->epoll_fd = -1;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ Create an event context. We use epoll if the system has it and fall back
+ to select otherwise.
+****************************************************************************/
+
 struct event_context *event_context_init(TALLOC_CTX *mem_ctx)
 {
-	return TALLOC_ZERO_P(NULL, struct event_context);
+	struct event_context *event_ctx;
+
+	event_ctx = TALLOC_ZERO_P(NULL, struct event_context);
+	if (event_ctx == NULL) {
+		return NULL;
+	}
+
+	event_ctx->epoll_fd = -1;
+	event_ctx->ops = &select_event_ops;
+
+#if defined(HAVE_EPOLL) && defined(HAVE_SYS_EPOLL_H)
+	if (epoll_context_init(event_ctx)) {
+		event_ctx->ops = &epoll_event_ops;
+	}
+#endif
+
+	talloc_set_destructor(event_ctx, event_context_destructor);
+
+	DEBUG(10, ("event_context_init: using %s backend\n",
+		   event_ctx->ops->name));
+
+	return event_ctx;
+}
+
+/****************************************************************************
+ Name of the fd backend in use, for debugging.
+****************************************************************************/
+
+const char *event_backend_name(struct event_context *event_ctx)
+{
+	return event_ctx->ops->name;
 }
 
 int set_event_dispatch_time(struct event_context *event_ctx,
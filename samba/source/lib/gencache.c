@@ -60,11 +60,11 @@ BOOL gencache_init(void)
 
 	DEBUG(5, ("Opening cache file at %s\n", cache_fname));
 
-	cache = tdb_open_log(cache_fname, 0, TDB_DEFAULT,
+	cache = tdb_open_log(cache_fname, 0, TDB_FETCH_CACHE,
 	                     O_RDWR|O_CREAT, 0644);
 
 	if (!cache && (errno == EACCES)) {
-		cache = tdb_open_log(cache_fname, 0, TDB_DEFAULT, O_RDONLY, 0644);
+		cache = tdb_open_log(cache_fname, 0, TDB_FETCH_CACHE, O_RDONLY, 0644);
 		if (cache) {
 			cache_readonly = True;
 			DEBUG(5, ("gencache_init: Opening cache file %s read-only.\n", cache_fname));
@@ -43,6 +43,14 @@
    very efficient for large messages or when messages are sent in very
    quick succession.
 
+   A process that calls message_listen() also gets messages as
+   datagrams on a unix domain socket, lock_path("msg")/<pid>, which
+   its event context watches. Senders try that socket first and fall
+   back to messages.tdb and SIGUSR1 if the message is too large for a
+   datagram, if the caller doesn't want duplicates queued, or if the
+   socket isn't there or is full. Messages that take different paths
+   may be dispatched out of order.
+
 */
 
 #include "includes.h"
@@ -51,6 +59,19 @@
 static TDB_CONTEXT *tdb;
 static int received_signal;
 
+/* the largest message sent as a datagram */
+#define MESSAGE_SOCK_MAX 16384
+
+/* our datagram socket, see message_listen() */
+static int msg_sock = -1;
+static pid_t msg_sock_pid;
+static struct fd_event *msg_fde;
+static BOOL msg_sock_pending;
+
+/* unbound socket used to send datagrams if we don't listen */
+static int msg_send_sock = -1;
+static pid_t msg_send_pid;
+
 /* change the message version with any incompatible changes in the protocol */
 #define MESSAGE_VERSION 1
 
@@ -224,6 +245,109 @@ static NTSTATUS message_notify(struct process_id procid)
 	return NT_STATUS_OK;
 }
 
+/****************************************************************************
+ Fill in the address of the datagram socket of a process.
+****************************************************************************/
+
+#ifdef HAVE_UNIXSOCKET
+static BOOL message_sock_addr(pid_t pid, struct sockaddr_un *sunaddr)
+{
+	pstring path;
+
+	pstr_sprintf(path, "%s/%u", lock_path("msg"), (unsigned int)pid);
+	if (strlen(path) >= sizeof(sunaddr->sun_path)) {
+		return False;
+	}
+
+	memset(sunaddr, 0, sizeof(*sunaddr));
+	sunaddr->sun_family = AF_UNIX;
+	safe_strcpy(sunaddr->sun_path, path, sizeof(sunaddr->sun_path)-1);
+	return True;
+}
+#endif
+
+/****************************************************************************
+ Try to send a message as a datagram to the process's socket. Returns
+ False if the caller has to queue it in the tdb instead.
+****************************************************************************/
+
+static BOOL message_sock_send(struct process_id pid,
+			      const struct message_rec *rec,
+			      const void *buf, size_t len)
+{
+#ifdef HAVE_UNIXSOCKET
+	struct sockaddr_un sunaddr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t ret;
+	int fd, saved_errno;
+	BOOL restore_credentials = False;
+
+	if (len > MESSAGE_SOCK_MAX ||
+	    !message_sock_addr(procid_to_pid(&pid), &sunaddr)) {
+		return False;
+	}
+
+	if (msg_sock != -1 && msg_sock_pid == sys_getpid()) {
+		fd = msg_sock;
+	} else {
+		if (msg_send_sock != -1 && msg_send_pid != sys_getpid()) {
+			/* Our parent's, don't share it. */
+			close(msg_send_sock);
+			msg_send_sock = -1;
+		}
+		if (msg_send_sock == -1) {
+			msg_send_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+			if (msg_send_sock == -1) {
+				return False;
+			}
+			set_blocking(msg_send_sock, False);
+			msg_send_pid = sys_getpid();
+		}
+		fd = msg_send_sock;
+	}
+
+	iov[0].iov_base = (void *)rec;
+	iov[0].iov_len = sizeof(*rec);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	ZERO_STRUCT(msg);
+	msg.msg_name = (void *)&sunaddr;
+	msg.msg_namelen = sizeof(sunaddr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+
+	/* The socket directory is only open to root. */
+	if (geteuid() != 0) {
+		become_root();
+		restore_credentials = True;
+	}
+
+	ret = sendmsg(fd, &msg, 0);
+	saved_errno = errno;
+
+	if (restore_credentials) {
+		unbecome_root();
+	}
+
+	if (ret != (ssize_t)(sizeof(*rec) + len)) {
+		/* ENOENT and ECONNREFUSED just mean nobody listens there */
+		DEBUG(10,("message_sock_send: %s: %s\n", sunaddr.sun_path,
+			  ret == -1 ? strerror(saved_errno) : "short send"));
+		return False;
+	}
+
+	if (procid_is_me(&pid)) {
+		/* see message_dispatch() */
+		msg_sock_pending = True;
+	}
+	return True;
+#else
+	return False;
+#endif
+}
+
 /****************************************************************************
  Send a message to a particular pid.
 ****************************************************************************/
@@ -258,6 +382,11 @@ static NTSTATUS message_send_pid_internal(struct process_id pid, int msg_type,
 	rec.src = procid_self();
 	rec.len = buf ? len : 0;
 
+	/* A datagram can't be checked against what's queued already. */
+	if (duplicates_allowed && message_sock_send(pid, &rec, buf, rec.len)) {
+		return NT_STATUS_OK;
+	}
+
 	kbuf = message_key_pid(pid);
 
 	dbuf.dptr = (char *)SMB_MALLOC(len + sizeof(rec));
@@ -494,6 +623,94 @@ static BOOL message_recv(char *msgs_buf, size_t total_len, int *msg_type,
 	return True;
 }
 
+/****************************************************************************
+ Hand one message to the function registered for its type.
+****************************************************************************/
+
+static void message_dispatch_one(int msg_type, struct process_id src,
+				 char *buf, size_t len)
+{
+	struct dispatch_fns *dfn;
+
+	DEBUG(10,("message_dispatch: received msg_type=%d "
+		  "src_pid=%u\n", msg_type,
+		  (unsigned int) procid_to_pid(&src)));
+
+	for (dfn = dispatch_fns; dfn; dfn = dfn->next) {
+		if (dfn->msg_type == msg_type) {
+			DEBUG(10,("message_dispatch: processing message of type %d.\n", msg_type));
+			dfn->fn(msg_type, src,
+				len ? (void *)buf : NULL, len,
+				dfn->private_data);
+			return;
+		}
+	}
+
+	DEBUG(5,("message_dispatch: warning: no handler registed for "
+		 "msg_type %d in pid %u\n",
+		 msg_type, (unsigned int)sys_getpid()));
+}
+
+/****************************************************************************
+ Dispatch the datagrams waiting on our socket. Stops after a batch so a
+ flood of messages can't starve the caller, the fd_event brings us back.
+****************************************************************************/
+
+static void message_sock_receive(void)
+{
+	static char *msg_buf;
+	struct message_rec rec;
+	ssize_t ret;
+	int i;
+
+	msg_sock_pending = False;
+
+	if (msg_buf == NULL) {
+		msg_buf = SMB_MALLOC_ARRAY(char, sizeof(rec) + MESSAGE_SOCK_MAX);
+		if (msg_buf == NULL) {
+			return;
+		}
+	}
+
+	for (i = 0; i < 64; i++) {
+		ret = sys_recv(msg_sock, msg_buf, sizeof(rec) + MESSAGE_SOCK_MAX,
+			       0);
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR) {
+				DEBUG(1,("message_sock_receive: recv failed: "
+					 "%s\n", strerror(errno)));
+			}
+			return;
+		}
+
+		if ((size_t)ret < sizeof(rec)) {
+			DEBUG(0,("message_sock_receive: short message of %d "
+				 "bytes\n", (int)ret));
+			continue;
+		}
+		memcpy(&rec, msg_buf, sizeof(rec));
+		if (rec.msg_version != MESSAGE_VERSION ||
+		    rec.len != (size_t)ret - sizeof(rec)) {
+			DEBUG(0,("message version %d length %u received "
+				 "(expected %d)\n", rec.msg_version,
+				 (unsigned int)rec.len, MESSAGE_VERSION));
+			continue;
+		}
+
+		message_dispatch_one(rec.msg_type, rec.src,
+				     msg_buf + sizeof(rec), rec.len);
+
+		if (msg_sock == -1) {
+			/* a handler called message_end() */
+			return;
+		}
+	}
+
+	/* more may be waiting */
+	msg_sock_pending = True;
+}
+
 /****************************************************************************
  Receive and dispatch any messages pending for this process.
  JRA changed Dec 13 2006. Only one message handler now permitted per type.
@@ -508,7 +725,15 @@ void message_dispatch(void)
 	char *buf;
 	char *msgs_buf;
 	size_t len, total_len;
-	int n_handled;
+
+	/*
+	 * Messages we sent ourselves are expected to be handled by the
+	 * time we get back here, don't wait for the fd_event.
+	 */
+	if (msg_sock_pending && msg_sock != -1 &&
+	    msg_sock_pid == sys_getpid()) {
+		message_sock_receive();
+	}
 
 	if (!received_signal)
 		return;
@@ -521,30 +746,137 @@ void message_dispatch(void)
 		return;
 
 	for (buf = msgs_buf; message_recv(msgs_buf, total_len, &msg_type, &src, &buf, &len); buf += len) {
-		struct dispatch_fns *dfn;
-
-		DEBUG(10,("message_dispatch: received msg_type=%d "
-			  "src_pid=%u\n", msg_type,
-			  (unsigned int) procid_to_pid(&src)));
-
-		n_handled = 0;
-		for (dfn = dispatch_fns; dfn; dfn = dfn->next) {
-			if (dfn->msg_type == msg_type) {
-				DEBUG(10,("message_dispatch: processing message of type %d.\n", msg_type));
-				dfn->fn(msg_type, src,
-					len ? (void *)buf : NULL, len,
-					dfn->private_data);
-				n_handled++;
-				break;
-			}
+		message_dispatch_one(msg_type, src, buf, len);
+	}
+	SAFE_FREE(msgs_buf);
+}
+
+/****************************************************************************
+ Our socket is readable.
+****************************************************************************/
+
+static void message_sock_handler(struct event_context *ev,
+				 struct fd_event *fde,
+				 uint16 flags, void *private_data)
+{
+	if (msg_sock_pid != sys_getpid()) {
+		/* We were forked by the listener, leave its messages alone. */
+		TALLOC_FREE(msg_fde);
+		close(msg_sock);
+		msg_sock = -1;
+		return;
+	}
+	message_sock_receive();
+}
+
+/****************************************************************************
+ Receive messages on a datagram socket watched by ev as well as
+ through messages.tdb. Needs to be called as root, in each process
+ that wants it.
+****************************************************************************/
+
+BOOL message_listen(struct event_context *ev)
+{
+#ifdef HAVE_UNIXSOCKET
+	struct sockaddr_un sunaddr;
+	const char *socket_dir;
+	SMB_STRUCT_STAT st;
+	mode_t old_umask;
+
+	if (msg_sock != -1) {
+		if (msg_sock_pid == sys_getpid()) {
+			return True;
 		}
-		if (!n_handled) {
-			DEBUG(5,("message_dispatch: warning: no handler registed for "
-				 "msg_type %d in pid %u\n",
-				 msg_type, (unsigned int)sys_getpid()));
+		/* Inherited, the socket is our parent's. */
+		TALLOC_FREE(msg_fde);
+		close(msg_sock);
+		msg_sock = -1;
+	}
+
+	socket_dir = lock_path("msg");
+	if (sys_lstat(socket_dir, &st) == -1) {
+		if (errno != ENOENT || mkdir(socket_dir, 0700) == -1) {
+			DEBUG(0,("message_listen: can't create %s: %s\n",
+				 socket_dir, strerror(errno)));
+			return False;
 		}
+	} else if (!S_ISDIR(st.st_mode) ||
+		   st.st_uid != sec_initial_uid() ||
+		   (st.st_mode & 0777) != 0700) {
+		DEBUG(0,("message_listen: invalid permissions on socket "
+			 "directory %s\n", socket_dir));
+		return False;
 	}
-	SAFE_FREE(msgs_buf);
+
+	if (!message_sock_addr(sys_getpid(), &sunaddr)) {
+		DEBUG(0,("message_listen: %s is too long for a socket name\n",
+			 socket_dir));
+		return False;
+	}
+
+	msg_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (msg_sock == -1) {
+		DEBUG(0,("message_listen: socket failed: %s\n",
+			 strerror(errno)));
+		return False;
+	}
+
+	/* left over by an earlier process with our pid */
+	unlink(sunaddr.sun_path);
+
+	old_umask = umask(0077);
+	if (bind(msg_sock, (struct sockaddr *)&sunaddr,
+		 sizeof(sunaddr)) == -1) {
+		DEBUG(0,("message_listen: bind to %s failed: %s\n",
+			 sunaddr.sun_path, strerror(errno)));
+		umask(old_umask);
+		goto fail;
+	}
+	umask(old_umask);
+
+	set_blocking(msg_sock, False);
+
+	msg_fde = event_add_fd(ev, NULL, msg_sock, EVENT_FD_READ,
+			       message_sock_handler, NULL);
+	if (msg_fde == NULL) {
+		unlink(sunaddr.sun_path);
+		goto fail;
+	}
+
+	msg_sock_pid = sys_getpid();
+	return True;
+
+ fail:
+	close(msg_sock);
+	msg_sock = -1;
+	return False;
+#else
+	return False;
+#endif
+}
+
+/****************************************************************************
+ Stop listening on our socket and remove it. Senders go back to the tdb.
+****************************************************************************/
+
+void message_end(void)
+{
+#ifdef HAVE_UNIXSOCKET
+	struct sockaddr_un sunaddr;
+
+	if (msg_sock == -1) {
+		return;
+	}
+
+	TALLOC_FREE(msg_fde);
+	if (msg_sock_pid == sys_getpid() &&
+	    message_sock_addr(msg_sock_pid, &sunaddr)) {
+		unlink(sunaddr.sun_path);
+	}
+	close(msg_sock);
+	msg_sock = -1;
+	msg_sock_pending = False;
+#endif
 }
 
 /****************************************************************************
@@ -605,63 +937,244 @@ void message_deregister(int msg_type)
 	}	
 }
 
-struct msg_all {
-	int msg_type;
-	uint32 msg_flag;
-	const void *buf;
-	size_t len;
-	BOOL duplicates;
-	int n_sent;
+/*******************************************************************
+ Form a static tdb key for the processes interested in a class of
+ broadcast messages.
+******************************************************************/
+
+static TDB_DATA message_key_bcast(uint32 msg_flag)
+{
+	static char key[20];
+	TDB_DATA kbuf;
+
+	slprintf(key, sizeof(key)-1, "BCAST/%x", (unsigned int)msg_flag);
+
+	kbuf.dptr = (char *)key;
+	kbuf.dsize = strlen(key)+1;
+	return kbuf;
+}
+
+/*
+ * A BCAST/<flag> record is this header followed by an array of the
+ * process_ids interested in the class. Processes are appended when
+ * they register. Nothing is removed when a process exits:
+ * message_send_all() drops the pids it finds gone, and once the array
+ * has grown to twice what the last clean up left the next
+ * registration cleans it up, so registering stays O(1) on average.
+ */
+
+struct message_bcast_hdr {
+	uint32 num_live;	/* pids left by the last clean up */
 };
 
+#define MESSAGE_BCAST_MIN_CLEANUP 64
+
+static struct process_id *message_bcast_pids(TDB_DATA dbuf,
+					     struct message_bcast_hdr *hdr,
+					     size_t *num_pids)
+{
+	if (dbuf.dptr == NULL || dbuf.dsize < sizeof(*hdr)) {
+		hdr->num_live = 0;
+		*num_pids = 0;
+		return NULL;
+	}
+	memcpy(hdr, dbuf.dptr, sizeof(*hdr));
+	*num_pids = (dbuf.dsize - sizeof(*hdr)) / sizeof(struct process_id);
+	return (struct process_id *)(dbuf.dptr + sizeof(*hdr));
+}
+
 /****************************************************************************
- Send one of the messages for the broadcast.
+ Add a process to the list of processes interested in one class of
+ broadcasts.
 ****************************************************************************/
 
-static int traverse_fn(TDB_CONTEXT *the_tdb, TDB_DATA kbuf, TDB_DATA dbuf, void *state)
+static BOOL message_bcast_add(uint32 msg_flag, struct process_id pid)
 {
-	struct connections_data crec;
-	struct msg_all *msg_all = (struct msg_all *)state;
-	NTSTATUS status;
+	TDB_DATA kbuf, dbuf;
+	struct message_bcast_hdr hdr;
+	struct process_id *pids;
+	size_t i, num_pids, unchanged;
+	char *p;
+	BOOL ret = True;
 
-	if (dbuf.dsize != sizeof(crec))
-		return 0;
+	kbuf = message_key_bcast(msg_flag);
 
-	memcpy(&crec, dbuf.dptr, sizeof(crec));
+	if (tdb_chainlock(tdb, kbuf) == -1) {
+		return False;
+	}
 
-	if (crec.cnum != -1)
-		return 0;
+	dbuf = tdb_fetch(tdb, kbuf);
+	pids = message_bcast_pids(dbuf, &hdr, &num_pids);
+	unchanged = dbuf.dptr ? dbuf.dsize : 0;
 
-	/* Don't send if the receiver hasn't registered an interest. */
+	if (num_pids >= MAX(2*hdr.num_live, MESSAGE_BCAST_MIN_CLEANUP)) {
+		size_t num_live = 0;
 
-	if(!(crec.bcast_msg_flags & msg_all->msg_flag))
-		return 0;
+		for (i = 0; i < num_pids; i++) {
+			if (process_exists(pids[i])) {
+				pids[num_live++] = pids[i];
+			}
+		}
+		DEBUG(10,("message_bcast_add: cleaned up %s, %u of %u "
+			  "processes left\n", kbuf.dptr,
+			  (unsigned int)num_live, (unsigned int)num_pids));
+		num_pids = num_live;
+		hdr.num_live = num_live + 1;
+		unchanged = 0;
+	}
+
+	p = SMB_REALLOC_ARRAY(dbuf.dptr, char,
+			      sizeof(hdr) + (num_pids+1) * sizeof(pid));
+	if (p == NULL) {
+		ret = False;
+		goto done;
+	}
+	dbuf.dptr = p;
+	dbuf.dsize = sizeof(hdr) + (num_pids+1) * sizeof(pid);
+
+	memcpy(dbuf.dptr, &hdr, sizeof(hdr));
+	memcpy(dbuf.dptr + sizeof(hdr) + num_pids * sizeof(pid), &pid,
+	       sizeof(pid));
+
+	/* Usually only the new pid has to be written. */
+	if (tdb_store_tail(tdb, kbuf, dbuf, unchanged) == -1) {
+		DEBUG(0,("message_bcast_add: tdb_store failed: %s\n",
+			 tdb_errorstr(tdb)));
+		ret = False;
+	}
+
+ done:
+	tdb_chainunlock(tdb, kbuf);
+	SAFE_FREE(dbuf.dptr);
+	return ret;
+}
 
-	/* If the msg send fails because the pid was not found (i.e. smbd died), 
-	 * the msg has already been deleted from the messages.tdb.*/
+/****************************************************************************
+ Take processes off the list for one class of broadcasts.
+****************************************************************************/
 
-	status = message_send_pid(crec.pid, msg_all->msg_type,
-				  msg_all->buf, msg_all->len,
-				  msg_all->duplicates);
+static BOOL message_bcast_remove(uint32 msg_flag,
+				 const struct process_id *gone,
+				 size_t num_gone)
+{
+	TDB_DATA kbuf, dbuf;
+	struct message_bcast_hdr hdr;
+	struct process_id *pids;
+	size_t i, j, num_pids, num_left = 0;
+	BOOL ret = True;
 
-	if (NT_STATUS_EQUAL(status, NT_STATUS_INVALID_HANDLE)) {
-		
-		/* If the pid was not found delete the entry from connections.tdb */
+	kbuf = message_key_bcast(msg_flag);
 
-		DEBUG(2,("pid %s doesn't exist - deleting connections %d [%s]\n",
-			 procid_str_static(&crec.pid), crec.cnum, crec.servicename));
-		tdb_delete(the_tdb, kbuf);
+	if (tdb_chainlock(tdb, kbuf) == -1) {
+		return False;
 	}
-	msg_all->n_sent++;
-	return 0;
+
+	dbuf = tdb_fetch(tdb, kbuf);
+	pids = message_bcast_pids(dbuf, &hdr, &num_pids);
+
+	for (i = 0; i < num_pids; i++) {
+		for (j = 0; j < num_gone; j++) {
+			if (procid_equal(&pids[i], &gone[j])) {
+				break;
+			}
+		}
+		if (j == num_gone) {
+			pids[num_left++] = pids[i];
+		}
+	}
+
+	if (num_left == num_pids) {
+		goto done;
+	}
+
+	if (num_left == 0) {
+		tdb_delete(tdb, kbuf);
+		goto done;
+	}
+
+	hdr.num_live = MIN(hdr.num_live, num_left);
+	memcpy(dbuf.dptr, &hdr, sizeof(hdr));
+	dbuf.dsize = sizeof(hdr) + num_left * sizeof(*pids);
+
+	if (tdb_store(tdb, kbuf, dbuf, TDB_REPLACE) == -1) {
+		DEBUG(0,("message_bcast_remove: tdb_store failed: %s\n",
+			 tdb_errorstr(tdb)));
+		ret = False;
+	}
+
+ done:
+	tdb_chainunlock(tdb, kbuf);
+	SAFE_FREE(dbuf.dptr);
+	return ret;
+}
+
+/****************************************************************************
+ Set the classes of broadcast messages (FLAG_MSG_*) this process wants
+ message_send_all() to send it. A process that is about to exit needn't
+ clear them, the lists forget it once it's gone.
+****************************************************************************/
+
+BOOL message_set_bcast_flags(uint32 msg_flags)
+{
+	static uint32 bcast_flags;
+	static pid_t bcast_pid;
+	struct process_id self = procid_self();
+	uint32 changed;
+	BOOL ret = True;
+	int i;
+
+	if (!tdb) {
+		return False;
+	}
+
+	if (bcast_pid != sys_getpid()) {
+		/* What our parent registered is on the lists under its pid. */
+		bcast_flags = 0;
+		bcast_pid = sys_getpid();
+	}
+
+	changed = bcast_flags ^ msg_flags;
+
+	for (i = 0; i < 32; i++) {
+		uint32 flag = ((uint32)1) << i;
+		BOOL ok;
+
+		if (!(changed & flag)) {
+			continue;
+		}
+		if (msg_flags & flag) {
+			ok = message_bcast_add(flag, self);
+		} else {
+			ok = message_bcast_remove(flag, &self, 1);
+		}
+		if (!ok) {
+			ret = False;
+			continue;
+		}
+		bcast_flags ^= flag;
+	}
+
+	return ret;
+}
+
+static int procid_compare(const void *p1, const void *p2)
+{
+	const struct process_id *pid1 = (const struct process_id *)p1;
+	const struct process_id *pid2 = (const struct process_id *)p2;
+
+	if (pid1->pid == pid2->pid) {
+		return 0;
+	}
+	return (pid1->pid < pid2->pid) ? -1 : 1;
 }
 
 /**
- * Send a message to all smbd processes.
+ * Send a message to all processes that registered an interest in its
+ * class with message_set_bcast_flags().
  *
- * It isn't very efficient, but should be OK for the sorts of
- * applications that use it. When we need efficient broadcast we can add
- * it.
+ * The processes are read from one record of messages.tdb and each
+ * one is sent the message once. Processes that turn out to be gone
+ * are taken off the list. conn_tdb is no longer used.
  *
  * @param n_sent Set to the number of messages sent.  This should be
  * equal to the number of processes, but be careful for races.
@@ -673,30 +1186,75 @@ BOOL message_send_all(TDB_CONTEXT *conn_tdb, int msg_type,
 		      BOOL duplicates_allowed,
 		      int *n_sent)
 {
-	struct msg_all msg_all;
+	uint32 msg_flag;
+	TDB_DATA dbuf;
+	struct message_bcast_hdr hdr;
+	struct process_id *pids, *gone = NULL;
+	size_t i, num_pids, num_gone = 0;
+	int sent = 0;
 
-	msg_all.msg_type = msg_type;
 	if (msg_type < 1000)
-		msg_all.msg_flag = FLAG_MSG_GENERAL;
+		msg_flag = FLAG_MSG_GENERAL;
 	else if (msg_type > 1000 && msg_type < 2000)
-		msg_all.msg_flag = FLAG_MSG_NMBD;
+		msg_flag = FLAG_MSG_NMBD;
 	else if (msg_type > 2000 && msg_type < 2100)
-		msg_all.msg_flag = FLAG_MSG_PRINT_NOTIFY;
+		msg_flag = FLAG_MSG_PRINT_NOTIFY;
 	else if (msg_type > 2100 && msg_type < 3000)
-		msg_all.msg_flag = FLAG_MSG_PRINT_GENERAL;
+		msg_flag = FLAG_MSG_PRINT_GENERAL;
 	else if (msg_type > 3000 && msg_type < 4000)
-		msg_all.msg_flag = FLAG_MSG_SMBD;
+		msg_flag = FLAG_MSG_SMBD;
 	else
 		return False;
 
-	msg_all.buf = buf;
-	msg_all.len = len;
-	msg_all.duplicates = duplicates_allowed;
-	msg_all.n_sent = 0;
+	if (!tdb) {
+		return False;
+	}
+
+	dbuf = tdb_fetch(tdb, message_key_bcast(msg_flag));
+	pids = message_bcast_pids(dbuf, &hdr, &num_pids);
+
+	/* A pid can be on the list twice if it was reused */
+	if (num_pids > 1) {
+		qsort(pids, num_pids, sizeof(*pids), procid_compare);
+	}
+
+	for (i = 0; i < num_pids; i++) {
+		NTSTATUS status;
+
+		if (i > 0 && procid_equal(&pids[i], &pids[i-1])) {
+			continue;
+		}
+
+		/* If the msg send fails because the pid was not found
+		 * (i.e. smbd died), the msg has already been deleted from
+		 * the messages.tdb.*/
+
+		status = message_send_pid(pids[i], msg_type, buf, len,
+					  duplicates_allowed);
+
+		if (NT_STATUS_EQUAL(status, NT_STATUS_INVALID_HANDLE)) {
+			DEBUG(2,("pid %s doesn't exist - removing it from the "
+				 "broadcast list\n", procid_str_static(&pids[i])));
+			if (gone == NULL) {
+				gone = SMB_MALLOC_ARRAY(struct process_id,
+							num_pids);
+			}
+			if (gone != NULL) {
+				gone[num_gone++] = pids[i];
+			}
+		}
+		sent++;
+	}
+
+	if (num_gone != 0) {
+		message_bcast_remove(msg_flag, gone, num_gone);
+	}
+
+	SAFE_FREE(gone);
+	SAFE_FREE(dbuf.dptr);
 
-	tdb_traverse(conn_tdb, traverse_fn, &msg_all);
 	if (n_sent)
-		*n_sent = msg_all.n_sent;
+		*n_sent = sent;
 	return True;
 }
 
@@ -0,0 +1,226 @@
+/*
+ Unix SMB/Netbios implementation.
+ Version 3.0.x
+ recvfile implementations.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * This file handles the OS dependent recvfile implementations.
+ * The API is such that it returns -1 on error, else returns the
+ * number of bytes written. This is the receive side of lib/sendfile.c,
+ * moving the data portion of an SMBwriteX from the client socket into
+ * the file without staging it in InBuffer.
+ *
+ * All implementations guarantee that on return exactly count bytes
+ * have been taken off the socket unless the socket read itself
+ * failed, so the SMB stream stays in sync even if the write to the
+ * file fails half way through.
+ */
+
+#include "includes.h"
+
+/* Size of the bounce buffer used when we can't move the data in kernel. */
+#define TRANSFER_BUF_SIZE (128*1024)
+
+/****************************************************************************
+ Read count bytes from fromfd and write them at offset into tofd using a
+ bounce buffer. If tofd is -1 the data is just discarded. If a write
+ fails we keep reading until count bytes have been consumed, then return
+ -1 with the errno of the failed write.
+****************************************************************************/
+
+static ssize_t default_sys_recvfile(int fromfd, int tofd, SMB_OFF_T offset, size_t count)
+{
+	int saved_errno = 0;
+	size_t total = 0;
+	size_t bufsize = MIN(TRANSFER_BUF_SIZE, count);
+	char *buffer = NULL;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	DEBUG(10,("default_sys_recvfile: from = %d, to = %d, offset=%.0f, count = %lu\n",
+		fromfd, tofd, (double)offset, (unsigned long)count));
+
+	buffer = SMB_MALLOC_ARRAY(char, bufsize);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	while (total < count) {
+		size_t num_written = 0;
+		ssize_t read_ret;
+		size_t toread = MIN(bufsize, count - total);
+
+		read_ret = read_data(fromfd, buffer, toread);
+		if (read_ret <= 0) {
+			/* EOF or socket error. */
+			SAFE_FREE(buffer);
+			return -1;
+		}
+
+		/* Don't write any more after a write error. */
+		while (tofd != -1 && num_written < (size_t)read_ret) {
+			ssize_t write_ret;
+
+			write_ret = sys_pwrite(tofd, buffer + num_written,
+					read_ret - num_written,
+					offset + total + num_written);
+			if (write_ret <= 0) {
+				/* write error - stash errno and drain the rest. */
+				saved_errno = (write_ret == 0) ? ENOSPC : errno;
+				tofd = -1;
+				break;
+			}
+			num_written += write_ret;
+		}
+
+		total += read_ret;
+	}
+
+	SAFE_FREE(buffer);
+	if (saved_errno) {
+		errno = saved_errno;
+		return -1;
+	}
+	return (ssize_t)total;
+}
+
+#if defined(LINUX_SENDFILE_API) && defined(SPLICE_F_MOVE)
+
+/*
+ * Linux splice(2) based recvfile. The data is moved from the socket
+ * into a pipe and from the pipe into the file without ever being
+ * copied into user space. Older kernels refuse to splice from a
+ * socket with EINVAL, in which case we permanently fall back to the
+ * bounce buffer version.
+ */
+
+ssize_t sys_recvfile(int fromfd, int tofd, SMB_OFF_T offset, size_t count)
+{
+	static int pipefd[2] = { -1, -1 };
+	static BOOL try_splice_call = True;
+	size_t total_written = 0;
+	loff_t splice_offset = offset;
+
+	DEBUG(10,("sys_recvfile: from = %d, to = %d, offset=%.0f, count = %lu\n",
+		fromfd, tofd, (double)offset, (unsigned long)count));
+
+	if (count == 0) {
+		return 0;
+	}
+
+	if (!try_splice_call || tofd == -1) {
+		return default_sys_recvfile(fromfd, tofd, offset, count);
+	}
+
+	if ((pipefd[0] == -1) && (pipe(pipefd) == -1)) {
+		try_splice_call = False;
+		return default_sys_recvfile(fromfd, tofd, offset, count);
+	}
+
+	while (total_written < count) {
+		ssize_t nread;
+		ssize_t to_write;
+
+		nread = splice(fromfd, NULL, pipefd[1], NULL,
+			       MIN(count - total_written, 16384),
+			       SPLICE_F_MOVE);
+		if (nread == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (total_written == 0 &&
+			    (errno == EBADF || errno == EINVAL)) {
+				try_splice_call = False;
+				return default_sys_recvfile(fromfd, tofd,
+							offset, count);
+			}
+			return -1;
+		}
+		if (nread == 0) {
+			/* EOF from the client. */
+			return -1;
+		}
+
+		to_write = nread;
+		while (to_write > 0) {
+			ssize_t thistime;
+
+			thistime = splice(pipefd[0], NULL, tofd,
+					  &splice_offset, to_write,
+					  SPLICE_F_MOVE);
+			if (thistime == -1) {
+				int saved_errno;
+				char discard[4096];
+
+				if (errno == EINTR) {
+					continue;
+				}
+
+				/*
+				 * The file write failed. Empty the pipe
+				 * and the rest of the socket so the next
+				 * SMB is read correctly.
+				 */
+				saved_errno = errno;
+				while (to_write > 0) {
+					ssize_t ret = sys_read(pipefd[0], discard,
+						MIN(to_write, sizeof(discard)));
+					if (ret <= 0) {
+						break;
+					}
+					to_write -= ret;
+				}
+				total_written += nread;
+				if (drain_socket(fromfd, count - total_written) !=
+						(ssize_t)(count - total_written)) {
+					return -1;
+				}
+				errno = saved_errno;
+				return -1;
+			}
+			to_write -= thistime;
+		}
+
+		total_written += nread;
+	}
+
+	return (ssize_t)total_written;
+}
+
+#else
+
+/*****************************************************************
+ No kernel assisted recvfile available, use the bounce buffer.
+*****************************************************************/
+
+ssize_t sys_recvfile(int fromfd, int tofd, SMB_OFF_T offset, size_t count)
+{
+	return default_sys_recvfile(fromfd, tofd, offset, count);
+}
+
+#endif
+
+/*****************************************************************
+ Throw away "count" bytes from the client socket.
+*****************************************************************/
+
+ssize_t drain_socket(int sockfd, size_t count)
+{
+	return default_sys_recvfile(sockfd, -1, (SMB_OFF_T)-1, count);
+}
@@ -47,7 +47,7 @@ BOOL share_info_db_init(void)
 		return True;
 	}
 
-	share_tdb = tdb_open_log(lock_path("share_info.tdb"), 0, TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	share_tdb = tdb_open_log(lock_path("share_info.tdb"), 0, TDB_GROUP_COMMIT|TDB_FETCH_CACHE, O_RDWR|O_CREAT, 0600);
 	if (!share_tdb) {
 		DEBUG(0,("Failed to open share info database %s (%s)\n",
 			lock_path("share_info.tdb"), strerror(errno) ));
@@ -723,6 +723,56 @@ BOOL receive_smb_raw(int fd, char *buffer, size_t buflen, unsigned int timeout)
 	return True;
 }
 
+/****************************************************************************
+ Read an smb from a fd, but if the packet is at least hdr_len + min_unread
+ bytes long only read the first hdr_len bytes of it and leave the rest in
+ the socket for the caller. Returns the number of bytes left unread, or
+ -1 on error. Doesn't check the MAC on signed packets.
+****************************************************************************/
+
+ssize_t receive_smb_raw_header(int fd, char *buffer, size_t buflen,
+			       size_t hdr_len, size_t min_unread)
+{
+	ssize_t len,ret;
+	size_t toread;
+
+	smb_read_error = 0;
+
+	len = read_smb_length_return_keepalive(fd,buffer,0);
+	if (len < 0) {
+		DEBUG(10,("receive_smb_raw_header: length < 0!\n"));
+		if (smb_read_error == 0)
+			smb_read_error = READ_ERROR;
+		return -1;
+	}
+
+	if (len > buflen) {
+		DEBUG(0,("Invalid packet length! (%lu bytes).\n",(unsigned long)len));
+		if (smb_read_error == 0)
+			smb_read_error = READ_ERROR;
+		return -1;
+	}
+
+	toread = len;
+	if (CVAL(buffer,0) == 0 && len >= hdr_len + min_unread) {
+		toread = hdr_len;
+	}
+
+	if (toread > 0) {
+		ret = read_data(fd,buffer+4,toread);
+		if (ret != toread) {
+			if (smb_read_error == 0) {
+				smb_read_error = READ_ERROR;
+			}
+			return -1;
+		}
+		/* Terminate what we have, see receive_smb_raw(). */
+		SSVAL(buffer+4,toread, 0);
+	}
+
+	return len - toread;
+}
+
 /****************************************************************************
  Wrapper for receive_smb_raw().
  Checks the MAC on signed packets.
@@ -266,7 +266,7 @@ void brl_init(int read_only)
 	}
 	tdb = tdb_open_log(lock_path("brlock.tdb"),
 			lp_open_files_db_hash_size(),
-			TDB_DEFAULT|(read_only?0x0:TDB_CLEAR_IF_FIRST),
+			TDB_VOLATILE|(read_only?0x0:TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING),
 			read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644 );
 	if (!tdb) {
 		DEBUG(0,("Failed to open byte range locking database %s\n",
@@ -290,6 +290,192 @@ void brl_shutdown(int read_only)
 	tdb_close(tdb);
 }
 
+/****************************************************************************
+ The lock array is kept sorted by start offset. Find the first lock
+ starting at or after (or, if strict, after) an offset.
+****************************************************************************/
+
+static unsigned int brl_lock_index(const struct byte_range_lock *br_lck,
+				   br_off start, BOOL strict)
+{
+	const struct lock_struct *locks =
+		(const struct lock_struct *)br_lck->lock_data;
+	unsigned int lo = 0, hi = br_lck->num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (locks[mid].start < start ||
+		    (strict && locks[mid].start == start)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Find the locks that might overlap a range. No lock is larger than
+ max_size, so only those starting from max_size before the range up to
+ its end can. Neither brl_overlap() nor brl_pending_overlap() is true
+ for a lock outside [*plo, *phi).
+****************************************************************************/
+
+static void brl_lock_range(const struct byte_range_lock *br_lck,
+			   br_off start, br_off size,
+			   unsigned int *plo, unsigned int *phi)
+{
+	if (start <= br_lck->max_size) {
+		*plo = 0;
+	} else {
+		*plo = brl_lock_index(br_lck, start - br_lck->max_size, False);
+	}
+
+	if (start + size < start) {
+		/* Wraps, the end of the array is the end of the range. */
+		*phi = br_lck->num_locks;
+	} else {
+		*phi = brl_lock_index(br_lck, start + size, True);
+	}
+}
+
+/****************************************************************************
+ Take note of the size of a lock. One going beyond the end of 64 bit file
+ space could overlap anything.
+****************************************************************************/
+
+static void brl_note_size(struct byte_range_lock *br_lck,
+			  const struct lock_struct *lock)
+{
+	br_off size = lock->size;
+
+	if (lock->start + lock->size < lock->start) {
+		size = (br_off)-1;
+	}
+	if (size > br_lck->max_size) {
+		br_lck->max_size = size;
+	}
+}
+
+/****************************************************************************
+ Work out max_size for the lock array. Returns False if it isn't sorted.
+ Only needed for a record without max_size stored after the locks, or
+ one that was rebuilt. Removing locks leaves max_size alone, it stays
+ an upper bound.
+****************************************************************************/
+
+static BOOL brl_index_locks(struct byte_range_lock *br_lck)
+{
+	const struct lock_struct *locks =
+		(const struct lock_struct *)br_lck->lock_data;
+	BOOL sorted = True;
+	unsigned int i;
+
+	br_lck->max_size = 0;
+	for (i = 0; i < br_lck->num_locks; i++) {
+		brl_note_size(br_lck, &locks[i]);
+		if (i > 0 && locks[i].start < locks[i-1].start) {
+			sorted = False;
+		}
+	}
+	return sorted;
+}
+
+static int brl_start_compare(const void *p1, const void *p2)
+{
+	const struct lock_struct *lck1 = (const struct lock_struct *)p1;
+	const struct lock_struct *lck2 = (const struct lock_struct *)p2;
+
+	if (lck1->start == lck2->start) {
+		return 0;
+	}
+	return (lck1->start < lck2->start) ? -1 : 1;
+}
+
+/****************************************************************************
+ Sort a lock array that was rebuilt, or written by an older version.
+ The whole record has to be stored again.
+****************************************************************************/
+
+static void brl_sort_locks(struct byte_range_lock *br_lck)
+{
+	if (!brl_index_locks(br_lck)) {
+		qsort(br_lck->lock_data, (size_t)br_lck->num_locks,
+		      sizeof(struct lock_struct), brl_start_compare);
+	}
+	br_lck->num_unchanged = 0;
+}
+
+/****************************************************************************
+ Should a pending lock's owner hear that plock was released ? Not if it's
+ our own pending lock on a file being closed.
+****************************************************************************/
+
+static BOOL brl_pending_woken(const struct lock_struct *plock,
+			      const struct lock_struct *pend_lock,
+			      BOOL readers_only, BOOL closing)
+{
+	if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
+		return False;
+	}
+	if (readers_only && pend_lock->lock_type != PENDING_READ_LOCK) {
+		return False;
+	}
+	if (closing && pend_lock->context.tid == plock->context.tid &&
+	    procid_equal(&pend_lock->context.pid, &plock->context.pid) &&
+	    pend_lock->fnum == plock->fnum) {
+		return False;
+	}
+	return brl_pending_overlap(plock, pend_lock);
+}
+
+/****************************************************************************
+ The pending locks are the queue of waiters for a file. Tell the processes
+ waiting for a range plock overlapped that it was released, each once, in
+ the order the waiters are recorded. The message names the file so they
+ only retry their requests on it.
+****************************************************************************/
+
+static void brl_wake_pending(struct byte_range_lock *br_lck,
+			     const struct lock_struct *plock,
+			     BOOL readers_only, BOOL closing)
+{
+	const struct lock_struct *locks =
+		(const struct lock_struct *)br_lck->lock_data;
+	unsigned int i, j, lo, hi;
+
+	brl_lock_range(br_lck, plock->start, plock->size, &lo, &hi);
+
+	for (i = lo; i < hi; i++) {
+		const struct lock_struct *pend_lock = &locks[i];
+
+		if (!brl_pending_woken(plock, pend_lock, readers_only, closing)) {
+			continue;
+		}
+
+		/* Told it already ? */
+		for (j = lo; j < i; j++) {
+			if (procid_equal(&locks[j].context.pid,
+					 &pend_lock->context.pid) &&
+			    brl_pending_woken(plock, &locks[j],
+					      readers_only, closing)) {
+				break;
+			}
+		}
+		if (j < i) {
+			continue;
+		}
+
+		DEBUG(10,("brl_wake_pending: sending unlock message to pid %s\n",
+			procid_str_static(&pend_lock->context.pid )));
+
+		message_send_pid(pend_lock->context.pid,
+				MSG_SMB_UNLOCK,
+				&br_lck->key, sizeof(br_lck->key), True);
+	}
+}
+
 #if ZERO_ZERO
 /****************************************************************************
  Compare two locks for sorting.
@@ -315,11 +501,13 @@ static int lock_compare(const struct lock_struct *lck1,
 static NTSTATUS brl_lock_windows(struct byte_range_lock *br_lck,
 			struct lock_struct *plock, BOOL blocking_lock)
 {
-	unsigned int i;
+	unsigned int i, lo, hi;
 	files_struct *fsp = br_lck->fsp;
 	struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 
-	for (i=0; i < br_lck->num_locks; i++) {
+	brl_lock_range(br_lck, plock->start, plock->size, &lo, &hi);
+
+	for (i=lo; i < hi; i++) {
 		/* Do any Windows or POSIX locks conflict ? */
 		if (brl_conflict(&locks[i], plock)) {
 			/* Remember who blocked us. */
@@ -360,15 +548,23 @@ static NTSTATUS brl_lock_windows(struct byte_range_lock *br_lck,
 		}
 	}
 
-	/* no conflicts - add it to the list of locks */
+	/* no conflicts - add it to the list of locks, after any others
+	   with the same start */
 	locks = (struct lock_struct *)SMB_REALLOC(locks, (br_lck->num_locks + 1) * sizeof(*locks));
 	if (!locks) {
 		return NT_STATUS_NO_MEMORY;
 	}
+	br_lck->lock_data = (void *)locks;
 
-	memcpy(&locks[br_lck->num_locks], plock, sizeof(struct lock_struct));
+	i = brl_lock_index(br_lck, plock->start, True);
+	if (i < br_lck->num_locks) {
+		memmove(&locks[i+1], &locks[i],
+			sizeof(*locks)*(br_lck->num_locks - i));
+	}
+	memcpy(&locks[i], plock, sizeof(struct lock_struct));
 	br_lck->num_locks += 1;
-	br_lck->lock_data = (void *)locks;
+	br_lck->num_unchanged = MIN(br_lck->num_unchanged, i);
+	brl_note_size(br_lck, plock);
 	br_lck->modified = True;
 
 	return NT_STATUS_OK;
@@ -593,7 +789,7 @@ OR
 static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 			struct lock_struct *plock)
 {
-	unsigned int i, count;
+	unsigned int i, lo, hi, count;
 	struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	struct lock_struct *tp;
 	BOOL lock_was_added = False;
@@ -610,6 +806,30 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 		return NT_STATUS_INVALID_PARAMETER;
 	}
 
+	/* Check for conflicts before splitting anything, only locks
+	   in range can conflict. */
+	brl_lock_range(br_lck, plock->start, plock->size, &lo, &hi);
+	for (i=lo; i < hi; i++) {
+		struct lock_struct *curr_lock = &locks[i];
+
+		if (curr_lock->lock_flav == WINDOWS_LOCK) {
+			/* Do any Windows flavour locks conflict ? */
+			if (!brl_conflict(curr_lock, plock)) {
+				continue;
+			}
+		} else {
+			/* POSIX conflict semantics are different. */
+			/* Can't block ourselves with POSIX locks. */
+			if (!brl_conflict_posix(curr_lock, plock)) {
+				continue;
+			}
+		}
+		/* No games with error messages. */
+		/* Remember who blocked us. */
+		plock->context.smbpid = curr_lock->context.smbpid;
+		return NT_STATUS_FILE_LOCK_CONFLICT;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, and add our lock,
 	   so we need at most 2 more entries. */
@@ -631,28 +851,10 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 		}
 
 		if (curr_lock->lock_flav == WINDOWS_LOCK) {
-			/* Do any Windows flavour locks conflict ? */
-			if (brl_conflict(curr_lock, plock)) {
-				/* No games with error messages. */
-				SAFE_FREE(tp);
-				/* Remember who blocked us. */
-				plock->context.smbpid = curr_lock->context.smbpid;
-				return NT_STATUS_FILE_LOCK_CONFLICT;
-			}
 			/* Just copy the Windows lock into the new array. */
 			memcpy(&tp[count], curr_lock, sizeof(struct lock_struct));
 			count++;
 		} else {
-			/* POSIX conflict semantics are different. */
-			if (brl_conflict_posix(curr_lock, plock)) {
-				/* Can't block ourselves with POSIX locks. */
-				/* No games with error messages. */
-				SAFE_FREE(tp);
-				/* Remember who blocked us. */
-				plock->context.smbpid = curr_lock->context.smbpid;
-				return NT_STATUS_FILE_LOCK_CONFLICT;
-			}
-
 			/* Work out overlaps. */
 			count += brlock_posix_split_merge(&tp[count], curr_lock, plock, &lock_was_added);
 		}
@@ -704,29 +906,15 @@ static NTSTATUS brl_lock_posix(struct byte_range_lock *br_lck,
 	locks = tp;
 	br_lck->modified = True;
 
+	/* A merge can move a lock's start down past others. */
+	brl_sort_locks(br_lck);
+
 	/* A successful downgrade from write to read lock can trigger a lock
 	   re-evalutation where waiting readers can now proceed. */
 
 	if (signal_pending_read) {
 		/* Send unlock messages to any pending read waiters that overlap. */
-		for (i=0; i < br_lck->num_locks; i++) {
-			struct lock_struct *pend_lock = &locks[i];
-
-			/* Ignore non-pending locks. */
-			if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-				continue;
-			}
-
-			if (pend_lock->lock_type == PENDING_READ_LOCK &&
-					brl_pending_overlap(plock, pend_lock)) {
-				DEBUG(10,("brl_lock_posix: sending unlock message to pid %s\n",
-					procid_str_static(&pend_lock->context.pid )));
-
-				message_send_pid(pend_lock->context.pid,
-						MSG_SMB_UNLOCK,
-						NULL, 0, True);
-			}
-		}
+		brl_wake_pending(br_lck, plock, True, False);
 	}
 
 	return NT_STATUS_OK;
@@ -788,7 +976,7 @@ NTSTATUS brl_lock(struct byte_range_lock *br_lck,
 
 static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock_struct *plock)
 {
-	unsigned int i, j;
+	unsigned int i;
 	struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	enum brl_type deleted_lock_type = READ_LOCK; /* shut the compiler up.... */
 
@@ -818,7 +1006,8 @@ static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock
 	}
 #endif
 
-	for (i = 0; i < br_lck->num_locks; i++) {
+	for (i = brl_lock_index(br_lck, plock->start, False);
+	     i < br_lck->num_locks && locks[i].start == plock->start; i++) {
 		struct lock_struct *lock = &locks[i];
 
 		/* Only remove our own locks that match in start, size, and flavour. */
@@ -832,7 +1021,7 @@ static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock
 		}
 	}
 
-	if (i == br_lck->num_locks) {
+	if (i == br_lck->num_locks || locks[i].start != plock->start) {
 		/* we didn't find it */
 		return False;
 	}
@@ -848,6 +1037,7 @@ static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock
 	}
 
 	br_lck->num_locks -= 1;
+	br_lck->num_unchanged = MIN(br_lck->num_unchanged, i);
 	br_lck->modified = True;
 
 	/* Unlock the underlying POSIX regions. */
@@ -862,24 +1052,7 @@ static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock
 	}
 
 	/* Send unlock messages to any pending waiters that overlap. */
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
-
-			message_send_pid(pend_lock->context.pid,
-					MSG_SMB_UNLOCK,
-					NULL, 0, True);
-		}
-	}
+	brl_wake_pending(br_lck, plock, False, False);
 
 	return True;
 }
@@ -890,7 +1063,7 @@ static BOOL brl_unlock_windows(struct byte_range_lock *br_lck, const struct lock
 
 static BOOL brl_unlock_posix(struct byte_range_lock *br_lck, const struct lock_struct *plock)
 {
-	unsigned int i, j, count;
+	unsigned int i, count;
 	struct lock_struct *tp;
 	struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	BOOL overlap_found = False;
@@ -1028,26 +1201,11 @@ static BOOL brl_unlock_posix(struct byte_range_lock *br_lck, const struct lock_s
 	br_lck->lock_data = (void *)tp;
 	br_lck->modified = True;
 
-	/* Send unlock messages to any pending waiters that overlap. */
-
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
+	/* Truncating a lock from below moves its start up. */
+	brl_sort_locks(br_lck);
 
-			message_send_pid(pend_lock->context.pid,
-					MSG_SMB_UNLOCK,
-					NULL, 0, True);
-		}
-	}
+	/* Send unlock messages to any pending waiters that overlap. */
+	brl_wake_pending(br_lck, plock, False, False);
 
 	return True;
 }
@@ -1095,7 +1253,7 @@ BOOL brl_locktest(struct byte_range_lock *br_lck,
 		enum brl_flavour lock_flav)
 {
 	BOOL ret = True;
-	unsigned int i;
+	unsigned int i, lo, hi;
 	struct lock_struct lock;
 	const struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	files_struct *fsp = br_lck->fsp;
@@ -1110,7 +1268,8 @@ BOOL brl_locktest(struct byte_range_lock *br_lck,
 	lock.lock_flav = lock_flav;
 
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
+	brl_lock_range(br_lck, start, size, &lo, &hi);
+	for (i=lo; i < hi; i++) {
 		/*
 		 * Our own locks don't conflict.
 		 */
@@ -1152,7 +1311,7 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		enum brl_type *plock_type,
 		enum brl_flavour lock_flav)
 {
-	unsigned int i;
+	unsigned int i, lo, hi;
 	struct lock_struct lock;
 	const struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	files_struct *fsp = br_lck->fsp;
@@ -1167,7 +1326,8 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 	lock.lock_flav = lock_flav;
 
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
+	brl_lock_range(br_lck, lock.start, lock.size, &lo, &hi);
+	for (i=lo; i < hi; i++) {
 		const struct lock_struct *exlock = &locks[i];
 		BOOL conflict = False;
 
@@ -1227,7 +1387,8 @@ BOOL brl_lock_cancel(struct byte_range_lock *br_lck,
 	context.pid = pid;
 	context.tid = br_lck->fsp->conn->cnum;
 
-	for (i = 0; i < br_lck->num_locks; i++) {
+	for (i = brl_lock_index(br_lck, start, False);
+	     i < br_lck->num_locks && locks[i].start == start; i++) {
 		struct lock_struct *lock = &locks[i];
 
 		/* For pending locks we *always* care about the fnum. */
@@ -1241,7 +1402,7 @@ BOOL brl_lock_cancel(struct byte_range_lock *br_lck,
 		}
 	}
 
-	if (i == br_lck->num_locks) {
+	if (i == br_lck->num_locks || locks[i].start != start) {
 		/* Didn't find it. */
 		return False;
 	}
@@ -1253,6 +1414,7 @@ BOOL brl_lock_cancel(struct byte_range_lock *br_lck,
 	}
 
 	br_lck->num_locks -= 1;
+	br_lck->num_unchanged = MIN(br_lck->num_unchanged, i);
 	br_lck->modified = True;
 	return True;
 }
@@ -1268,7 +1430,7 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 	files_struct *fsp = br_lck->fsp;
 	uint16 tid = fsp->conn->cnum;
 	int fnum = fsp->fnum;
-	unsigned int i, j, dcount=0;
+	unsigned int i, dcount=0;
 	int num_deleted_windows_locks = 0;
 	struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 	struct process_id pid = procid_self();
@@ -1348,30 +1510,10 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 		}
 
 		if (del_this_lock) {
-			/* Send unlock messages to any pending waiters that overlap. */
-			for (j=0; j < br_lck->num_locks; j++) {
-				struct lock_struct *pend_lock = &locks[j];
-
-				/* Ignore our own or non-pending locks. */
-				if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-					continue;
-				}
-
-				/* Optimisation - don't send to this fnum as we're
-				   closing it. */
-				if (pend_lock->context.tid == tid &&
-				    procid_equal(&pend_lock->context.pid, &pid) &&
-				    pend_lock->fnum == fnum) {
-					continue;
-				}
-
-				/* We could send specific lock info here... */
-				if (brl_pending_overlap(lock, pend_lock)) {
-					message_send_pid(pend_lock->context.pid,
-							MSG_SMB_UNLOCK,
-							NULL, 0, True);
-				}
-			}
+			/* Send unlock messages to any pending waiters that
+			   overlap. Optimisation - don't send to this fnum as
+			   we're closing it. */
+			brl_wake_pending(br_lck, lock, False, True);
 
 			/* found it - delete it */
 			if (br_lck->num_locks > 1 && i < br_lck->num_locks - 1) {
@@ -1379,6 +1521,7 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 					sizeof(*locks)*((br_lck->num_locks-1) - i));
 			}
 			br_lck->num_locks--;
+			br_lck->num_unchanged = MIN(br_lck->num_unchanged, i);
 			br_lck->modified = True;
 			i--;
 			dcount++;
@@ -1392,10 +1535,12 @@ void brl_close_fnum(struct byte_range_lock *br_lck)
 }
 
 /****************************************************************************
- Ensure this set of lock entries is valid.
+ Ensure this set of lock entries is valid. If pdead isn't NULL it is
+ set to a malloced array of the granted locks that were removed.
 ****************************************************************************/
 
-static BOOL validate_lock_entries(unsigned int *pnum_entries, struct lock_struct **pplocks)
+static BOOL validate_lock_entries(unsigned int *pnum_entries, struct lock_struct **pplocks,
+				  struct lock_struct **pdead, unsigned int *pnum_dead)
 {
 	unsigned int i;
 	unsigned int num_valid_entries = 0;
@@ -1404,6 +1549,16 @@ static BOOL validate_lock_entries(unsigned int *pnum_entries, struct lock_struct
 	for (i = 0; i < *pnum_entries; i++) {
 		struct lock_struct *lock_data = &locks[i];
 		if (!process_exists(lock_data->context.pid)) {
+			/* Whoever waits for this lock has to be told. */
+			if (pdead && !IS_PENDING_LOCK(lock_data->lock_type)) {
+				struct lock_struct *dead = SMB_REALLOC_ARRAY(
+					*pdead, struct lock_struct,
+					*pnum_dead + 1);
+				if (dead) {
+					dead[(*pnum_dead)++] = *lock_data;
+					*pdead = dead;
+				}
+			}
 			/* This process no longer exists - mark this
 			   entry as invalid by zeroing it. */
 			ZERO_STRUCTP(lock_data);
@@ -1454,7 +1609,6 @@ static int traverse_fn(TDB_CONTEXT *ttdb, TDB_DATA kbuf, TDB_DATA dbuf, void *st
 	struct lock_key *key;
 	unsigned int i;
 	unsigned int num_locks = 0;
-	unsigned int orig_num_locks = 0;
 
 	BRLOCK_FN(traverse_callback) = (BRLOCK_FN_CAST())state;
 
@@ -1467,26 +1621,17 @@ static int traverse_fn(TDB_CONTEXT *ttdb, TDB_DATA kbuf, TDB_DATA dbuf, void *st
 	}
 
 	key = (struct lock_key *)kbuf.dptr;
-	orig_num_locks = num_locks = dbuf.dsize/sizeof(*locks);
+	num_locks = dbuf.dsize/sizeof(*locks);
 
-	/* Ensure the lock db is clean of entries from invalid processes. */
+	/* Skip entries from invalid processes. The record may have
+	   changed since the traverse copied it, so leave removing them
+	   to the next brl_get_locks(). */
 
-	if (!validate_lock_entries(&num_locks, &locks)) {
+	if (!validate_lock_entries(&num_locks, &locks, NULL, NULL)) {
 		SAFE_FREE(locks);
 		return -1; /* Terminate traversal */
 	}
 
-	if (orig_num_locks != num_locks) {
-		dbuf.dptr = (char *)locks;
-		dbuf.dsize = num_locks * sizeof(*locks);
-
-		if (dbuf.dsize) {
-			tdb_store(ttdb, kbuf, dbuf, TDB_REPLACE);
-		} else {
-			tdb_delete(ttdb, kbuf);
-		}
-	}
-
 	for ( i=0; i<num_locks; i++) {
 		traverse_callback(key->device,
 				  key->inode,
@@ -1510,7 +1655,7 @@ int brl_forall(BRLOCK_FN(fn))
 	if (!tdb) {
 		return 0;
 	}
-	return tdb_traverse(tdb, traverse_fn, (void *)fn);
+	return tdb_traverse_snapshot(tdb, traverse_fn, (void *)fn);
 }
 
 /*******************************************************************
@@ -1541,12 +1686,30 @@ static int byte_range_lock_destructor(struct byte_range_lock *br_lck)
 		}
 	} else {
 		TDB_DATA data;
-		data.dptr = (char *)br_lck->lock_data;
-		data.dsize = br_lck->num_locks * sizeof(struct lock_struct);
+		size_t len = br_lck->num_locks * sizeof(struct lock_struct);
 
-		if (tdb_store(tdb, key, data, TDB_REPLACE) == -1) {
+		/* The sorted locks are followed by max_size, so the next
+		   reader needn't look at all of them to find it. */
+		data.dptr = (char *)SMB_REALLOC(br_lck->lock_data,
+						len + sizeof(br_off));
+		if (data.dptr == NULL) {
 			smb_panic("Could not store byte range mode entry\n");
 		}
+		br_lck->lock_data = (void *)data.dptr;
+		memcpy(data.dptr + len, &br_lck->max_size, sizeof(br_off));
+		data.dsize = len + sizeof(br_off);
+
+		/* Only the locks from the first one we changed on move. */
+		if (tdb_store_tail(tdb, key, data, br_lck->num_unchanged *
+				   sizeof(struct lock_struct)) == -1) {
+			smb_panic("Could not store byte range mode entry\n");
+		}
+
+		/* A file with no locks has some now. Tell anyone relying on
+		   brl_none, before anyone can see the record. */
+		if (!br_lck->was_stored) {
+			tdb_bump_seqnum(tdb);
+		}
 	}
 
  done:
@@ -1554,7 +1717,12 @@ static int byte_range_lock_destructor(struct byte_range_lock *br_lck)
 	if (!br_lck->read_only) {
 		tdb_chainunlock(tdb, key);
 	}
-	SAFE_FREE(br_lck->lock_data);
+	if (br_lck->view.data.dptr != NULL) {
+		tdb_release_view(tdb, &br_lck->view);
+		br_lck->lock_data = NULL;
+	} else {
+		SAFE_FREE(br_lck->lock_data);
+	}
 	return 0;
 }
 
@@ -1569,6 +1737,10 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 {
 	TDB_DATA key;
 	TDB_DATA data;
+	BOOL indexed = False;
+	int seqnum = 0;
+	struct lock_struct *dead_locks = NULL;
+	unsigned int i, num_dead_locks = 0;
 	struct byte_range_lock *br_lck = TALLOC_P(mem_ctx, struct byte_range_lock);
 
 	if (br_lck == NULL) {
@@ -1578,6 +1750,11 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 	br_lck->fsp = fsp;
 	br_lck->num_locks = 0;
 	br_lck->modified = False;
+	br_lck->was_stored = False;
+	br_lck->lock_data = NULL;
+	br_lck->view.data = tdb_null;
+	br_lck->num_unchanged = 0;
+	br_lck->max_size = 0;
 	memset(&br_lck->key, '\0', sizeof(struct lock_key));
 	br_lck->key.device = fsp->dev;
 	br_lck->key.inode = fsp->inode;
@@ -1593,6 +1770,18 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 
 	if (read_only) {
 		br_lck->read_only = True;
+
+		/* Records are only created with the sequence number bumped
+		   (see the destructor), so if it hasn't moved since we last
+		   found none for this file there still isn't one. That makes
+		   the usual read and write lock test on a file no one has
+		   locked a read of the tdb header. The number is read before
+		   the record, a lock taken in between moves it. */
+		seqnum = tdb_get_seqnum(tdb);
+		if (fsp->brl_none && fsp->brl_seqnum == seqnum) {
+			talloc_set_destructor(br_lck, byte_range_lock_destructor);
+			return br_lck;
+		}
 	} else {
 		if (tdb_chainlock(tdb, key) != 0) {
 			DEBUG(3, ("Could not lock byte range lock entry\n"));
@@ -1604,9 +1793,48 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 
 	talloc_set_destructor(br_lck, byte_range_lock_destructor);
 
-	data = tdb_fetch(tdb, key);
+	if (read_only) {
+		/* Nothing will change the locks, so look at them in
+		   place, under the chain read lock, until the destructor.
+		   The lock structs need 8 byte alignment on some CPUs
+		   and the record is only 4 byte aligned. */
+		if (tdb_fetch_view(tdb, key, &br_lck->view) == -1) {
+			data = tdb_null;
+			if (tdb_error(tdb) == TDB_ERR_NOEXIST) {
+				fsp->brl_none = True;
+				fsp->brl_seqnum = seqnum;
+			}
+		} else if (((size_t)br_lck->view.data.dptr &
+			    (sizeof(SMB_BIG_UINT)-1)) == 0) {
+			data = br_lck->view.data;
+		} else {
+			data = br_lck->view.data;
+			data.dptr = (char *)memdup(data.dptr, data.dsize);
+			tdb_release_view(tdb, &br_lck->view);
+			if (data.dptr == NULL) {
+				TALLOC_FREE(br_lck);
+				return NULL;
+			}
+		}
+	} else {
+		data = tdb_fetch(tdb, key);
+	}
 	br_lck->lock_data = (void *)data.dptr;
+	br_lck->was_stored = (data.dptr != NULL);
 	br_lck->num_locks = data.dsize / sizeof(struct lock_struct);
+	br_lck->num_unchanged = br_lck->num_locks;
+
+	if (br_lck->was_stored) {
+		fsp->brl_none = False;
+	}
+
+	if (data.dsize == br_lck->num_locks * sizeof(struct lock_struct) +
+	    sizeof(br_off)) {
+		/* Stored by the destructor, sorted and with max_size. */
+		memcpy(&br_lck->max_size, data.dptr + data.dsize -
+		       sizeof(br_off), sizeof(br_off));
+		indexed = True;
+	}
 
 	if (!fsp->lockdb_clean) {
 		int orig_num_locks = br_lck->num_locks;
@@ -1618,7 +1846,9 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 		struct lock_struct *locks =
 			(struct lock_struct *)br_lck->lock_data;
 
-		if (!validate_lock_entries(&br_lck->num_locks, &locks)) {
+		if (!validate_lock_entries(&br_lck->num_locks, &locks,
+					   &dead_locks, &num_dead_locks)) {
+			SAFE_FREE(dead_locks);
 			SAFE_FREE(br_lck->lock_data);
 			TALLOC_FREE(br_lck);
 			return NULL;
@@ -1627,6 +1857,7 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
                 /* Ensure invalid locks are cleaned up in the destructor. */
 		if (orig_num_locks != br_lck->num_locks) {
 			br_lck->modified = True;
+			br_lck->num_unchanged = 0;
 		}
 
 		/*
@@ -1640,8 +1871,34 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 		fsp->lockdb_clean = True;
 	}
 
+	if (!indexed && !brl_index_locks(br_lck)) {
+		/* Written by an older version, sort our own copy. */
+		if (br_lck->view.data.dptr != NULL) {
+			void *copy = memdup(br_lck->lock_data,
+				br_lck->num_locks * sizeof(struct lock_struct));
+
+			tdb_release_view(tdb, &br_lck->view);
+			br_lck->lock_data = copy;
+			if (copy == NULL) {
+				br_lck->num_locks = 0;
+				SAFE_FREE(dead_locks);
+				TALLOC_FREE(br_lck);
+				return NULL;
+			}
+		}
+		brl_sort_locks(br_lck);
+		if (!br_lck->read_only) {
+			br_lck->modified = True;
+		}
+	}
+
+	/* Nobody else will wake the waiters for locks a dead smbd held. */
+	for (i = 0; i < num_dead_locks; i++) {
+		brl_wake_pending(br_lck, &dead_locks[i], False, False);
+	}
+	SAFE_FREE(dead_locks);
+
 	if (DEBUGLEVEL >= 10) {
-		unsigned int i;
 		struct lock_struct *locks = (struct lock_struct *)br_lck->lock_data;
 		DEBUG(10,("brl_get_locks_internal: %u current locks on dev=%.0f, inode=%.0f\n",
 			br_lck->num_locks,
@@ -392,7 +392,7 @@ BOOL locking_init(int read_only)
 
 	tdb = tdb_open_log(lock_path("locking.tdb"), 
 			lp_open_files_db_hash_size(),
-			TDB_DEFAULT|(read_only?0x0:TDB_CLEAR_IF_FIRST), 
+			TDB_VOLATILE|(read_only?0x0:TDB_CLEAR_IF_FIRST|TDB_MUTEX_LOCKING), 
 			read_only?O_RDONLY:O_RDWR|O_CREAT,
 			0644);
 
@@ -752,7 +752,7 @@ struct share_mode_lock *get_share_mode_lock(TALLOC_CTX *mem_ctx,
 {
 	struct share_mode_lock *lck;
 	TDB_DATA key = locking_key(dev, ino);
-	TDB_DATA data;
+	TDB_VIEW view;
 
 	lck = TALLOC_P(mem_ctx, struct share_mode_lock);
 	if (lck == NULL) {
@@ -786,8 +786,9 @@ struct share_mode_lock *get_share_mode_lock(TALLOC_CTX *mem_ctx,
 
 	talloc_set_destructor(lck, share_mode_lock_destructor);
 
-	data = tdb_fetch(tdb, key);
-	lck->fresh = (data.dptr == NULL);
+	/* parse_share_modes copies out everything it keeps, so it can
+	   read the record in place */
+	lck->fresh = (tdb_fetch_view(tdb, key, &view) == -1);
 
 	if (lck->fresh) {
 
@@ -803,16 +804,16 @@ struct share_mode_lock *get_share_mode_lock(TALLOC_CTX *mem_ctx,
 			return NULL;
 		}
 	} else {
-		if (!parse_share_modes(data, lck)) {
+		BOOL ok = parse_share_modes(view.data, lck);
+
+		tdb_release_view(tdb, &view);
+		if (!ok) {
 			DEBUG(0, ("Could not parse share modes\n"));
 			TALLOC_FREE(lck);
-			SAFE_FREE(data.dptr);
 			return NULL;
 		}
 	}
 
-	SAFE_FREE(data.dptr);
-
 	return lck;
 }
 
@@ -1420,5 +1421,6 @@ int share_mode_forall(void (*fn)(const struct share_mode_entry *, const char *,
 	state.fn = fn;
 	state.private_data = private_data;
 
-	return tdb_traverse(tdb, traverse_fn, (void *)&state);
+	/* listings must not stall opens and closes on a busy server */
+	return tdb_traverse_snapshot(tdb, traverse_fn, (void *)&state);
 }
@@ -0,0 +1,502 @@
+/*
+ * Simulate the Posix AIO using a pool of pthreads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * This module replaces the SMB_VFS_AIO_* calls that smbd/aio.c uses for
+ * async SMBreadX/SMBwriteX with a fixed pool of worker threads doing
+ * plain pread/pwrite/fsync. Completed requests are passed back to the
+ * main smbd thread through a pipe that is watched by the smbd event
+ * context, and handed to smbd_aio_complete_mid(). No realtime signals
+ * are involved, so we're not limited by the signal queue length.
+ *
+ * Enable it per share with "vfs objects = aio_pthread" together with
+ * "aio read size" / "aio write size". The number of worker threads is
+ * set with "aio_pthread:aio num threads" (default 4). The pool is per
+ * smbd process, the first share that uses it determines its size.
+ *
+ * The worker threads do nothing but the system call. All the
+ * bookkeeping, DEBUG and talloc calls happen in the main thread.
+ */
+
+#include "includes.h"
+
+#if defined(WITH_AIO) && defined(HAVE_PTHREAD_H)
+
+#include <pthread.h>
+
+#define MODULE "aio_pthread"
+#define AIO_PTHREAD_DEFAULT_THREADS 4
+
+enum aio_pthread_op { AIO_PTHREAD_READ, AIO_PTHREAD_WRITE, AIO_PTHREAD_FSYNC };
+
+struct aio_pthread_job {
+	struct aio_pthread_job *prev, *next;	/* all jobs, main thread only */
+	struct aio_pthread_job *queue_next;	/* work queue, under the mutex */
+	SMB_STRUCT_AIOCB *aiocb;
+	enum aio_pthread_op op;
+	BOOL queued;		/* still waiting for a worker */
+	BOOL done;		/* main thread has seen the completion */
+	BOOL orphaned;		/* cancelled, smbd won't call aio_return */
+	ssize_t ret;		/* set by the worker */
+	int err;		/* set by the worker */
+};
+
+static struct aio_pthread_job *aio_jobs;
+
+static pthread_mutex_t aio_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct aio_pthread_job *aio_queue_head;
+static struct aio_pthread_job *aio_queue_tail;
+
+static int aio_pipe[2] = { -1, -1 };
+static struct fd_event *aio_pipe_event;
+static BOOL aio_pool_initialized;
+
+/************************************************************************
+ Worker thread. Take jobs off the queue, do the I/O and write the job
+ pointer down the pipe so the main thread picks up the result.
+***********************************************************************/
+
+static void *aio_pthread_worker(void *arg)
+{
+	for (;;) {
+		struct aio_pthread_job *job;
+		SMB_STRUCT_AIOCB *a;
+		ssize_t ret;
+
+		pthread_mutex_lock(&aio_queue_mutex);
+		while (aio_queue_head == NULL) {
+			pthread_cond_wait(&aio_queue_cond, &aio_queue_mutex);
+		}
+		job = aio_queue_head;
+		aio_queue_head = job->queue_next;
+		if (aio_queue_head == NULL) {
+			aio_queue_tail = NULL;
+		}
+		job->queued = False;
+		pthread_mutex_unlock(&aio_queue_mutex);
+
+		a = job->aiocb;
+
+		switch (job->op) {
+		case AIO_PTHREAD_READ:
+			ret = sys_pread(a->aio_fildes, (void *)a->aio_buf,
+					a->aio_nbytes, a->aio_offset);
+			break;
+		case AIO_PTHREAD_WRITE:
+			ret = sys_pwrite(a->aio_fildes,
+					 (const void *)a->aio_buf,
+					 a->aio_nbytes, a->aio_offset);
+			break;
+		case AIO_PTHREAD_FSYNC:
+		default:
+			ret = fsync(a->aio_fildes);
+			break;
+		}
+
+		job->err = (ret == -1) ? errno : 0;
+		job->ret = ret;
+
+		/* A pointer is less than PIPE_BUF, so this is atomic. */
+		while (sys_write(aio_pipe[1], &job, sizeof(job)) != sizeof(job)) {
+			;
+		}
+	}
+
+	return NULL;
+}
+
+/************************************************************************
+ Pick up the completed jobs from the pipe. smbd is told about every
+ completed job except the ones in the "waiting" list, which the caller
+ (aio_suspend) hands back to smbd itself.
+***********************************************************************/
+
+static void aio_pthread_read_completions(const SMB_STRUCT_AIOCB * const waiting[],
+					 int num_waiting)
+{
+	struct aio_pthread_job *job;
+
+	while (sys_read(aio_pipe[0], &job, sizeof(job)) == sizeof(job)) {
+		uint16 mid = job->aiocb->aio_sigevent.sigev_value.sival_int;
+		BOOL notify = True;
+		int i;
+
+		job->done = True;
+
+		for (i = 0; i < num_waiting; i++) {
+			if (waiting[i] == job->aiocb) {
+				notify = False;
+				break;
+			}
+		}
+
+		if (job->orphaned) {
+			/* smbd only needs to release its aio record. */
+			DLIST_REMOVE(aio_jobs, job);
+			SAFE_FREE(job);
+		}
+
+		if (notify) {
+			smbd_aio_complete_mid(mid);
+		}
+	}
+}
+
+static void aio_pthread_handler(struct event_context *event_ctx,
+				struct fd_event *event,
+				uint16 flags,
+				void *private_data)
+{
+	aio_pthread_read_completions(NULL, 0);
+}
+
+/************************************************************************
+ Start the worker threads the first time we need them.
+***********************************************************************/
+
+static BOOL aio_pthread_init_pool(vfs_handle_struct *handle)
+{
+	int num_threads;
+	sigset_t sigmask, oldmask;
+	int i;
+
+	if (aio_pool_initialized) {
+		return True;
+	}
+
+	num_threads = lp_parm_int(SNUM(handle->conn), MODULE,
+				  "aio num threads",
+				  AIO_PTHREAD_DEFAULT_THREADS);
+	if (num_threads <= 0) {
+		num_threads = AIO_PTHREAD_DEFAULT_THREADS;
+	}
+
+	if (pipe(aio_pipe) == -1) {
+		DEBUG(0,("aio_pthread_init_pool: pipe failed: %s\n",
+			 strerror(errno)));
+		return False;
+	}
+
+	/* Only the main thread reads, and it must never block. */
+	set_blocking(aio_pipe[0], False);
+
+	aio_pipe_event = event_add_fd(smbd_event_context(), NULL,
+				      aio_pipe[0], EVENT_FD_READ,
+				      aio_pthread_handler, NULL);
+	if (aio_pipe_event == NULL) {
+		DEBUG(0,("aio_pthread_init_pool: event_add_fd failed\n"));
+		close(aio_pipe[0]);
+		close(aio_pipe[1]);
+		aio_pipe[0] = aio_pipe[1] = -1;
+		return False;
+	}
+
+	/* The workers must not take the oplock/notify/aio signals
+	   meant for the main thread. */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &oldmask);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		int ret;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, aio_pthread_worker, NULL);
+		pthread_attr_destroy(&attr);
+
+		if (ret != 0) {
+			DEBUG(0,("aio_pthread_init_pool: pthread_create "
+				 "failed: %s\n", strerror(ret)));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (i == 0) {
+		TALLOC_FREE(aio_pipe_event);
+		close(aio_pipe[0]);
+		close(aio_pipe[1]);
+		aio_pipe[0] = aio_pipe[1] = -1;
+		return False;
+	}
+
+	DEBUG(10,("aio_pthread_init_pool: started %d worker threads\n", i));
+
+	aio_pool_initialized = True;
+	return True;
+}
+
+static struct aio_pthread_job *find_aio_job(const SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_pthread_job *job;
+
+	for (job = aio_jobs; job; job = job->next) {
+		if (job->aiocb == aiocb) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+/************************************************************************
+ Queue an aio request for the worker threads.
+***********************************************************************/
+
+static int aio_pthread_queue(vfs_handle_struct *handle,
+			     SMB_STRUCT_AIOCB *aiocb,
+			     enum aio_pthread_op op)
+{
+	struct aio_pthread_job *job;
+
+	if (!aio_pthread_init_pool(handle)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	job = SMB_MALLOC_P(struct aio_pthread_job);
+	if (job == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+	ZERO_STRUCTP(job);
+	job->aiocb = aiocb;
+	job->op = op;
+	job->queued = True;
+	DLIST_ADD(aio_jobs, job);
+
+	pthread_mutex_lock(&aio_queue_mutex);
+	if (aio_queue_tail != NULL) {
+		aio_queue_tail->queue_next = job;
+	} else {
+		aio_queue_head = job;
+	}
+	aio_queue_tail = job;
+	pthread_cond_signal(&aio_queue_cond);
+	pthread_mutex_unlock(&aio_queue_mutex);
+
+	return 0;
+}
+
+static int aio_pthread_read(vfs_handle_struct *handle, files_struct *fsp,
+			    SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_queue(handle, aiocb, AIO_PTHREAD_READ);
+}
+
+static int aio_pthread_write(vfs_handle_struct *handle, files_struct *fsp,
+			     SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_queue(handle, aiocb, AIO_PTHREAD_WRITE);
+}
+
+static int aio_pthread_fsync(vfs_handle_struct *handle, files_struct *fsp,
+			     int op, SMB_STRUCT_AIOCB *aiocb)
+{
+	return aio_pthread_queue(handle, aiocb, AIO_PTHREAD_FSYNC);
+}
+
+static ssize_t aio_pthread_return_fn(vfs_handle_struct *handle,
+				     files_struct *fsp,
+				     SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_pthread_job *job = find_aio_job(aiocb);
+	ssize_t ret;
+
+	if (job == NULL || !job->done) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = job->ret;
+	if (ret == -1) {
+		errno = job->err;
+	}
+
+	DLIST_REMOVE(aio_jobs, job);
+	SAFE_FREE(job);
+	return ret;
+}
+
+static int aio_pthread_error_fn(vfs_handle_struct *handle,
+				files_struct *fsp,
+				SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_pthread_job *job = find_aio_job(aiocb);
+
+	if (job == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!job->done) {
+		return EINPROGRESS;
+	}
+	return job->err;
+}
+
+/************************************************************************
+ Cancel a request. Jobs that haven't been picked up by a worker yet are
+ taken off the queue and completed with ECANCELED. Running ones can't
+ be stopped, smbd will be told about them when they finish.
+***********************************************************************/
+
+static int aio_pthread_cancel(vfs_handle_struct *handle, files_struct *fsp,
+			      int fd, SMB_STRUCT_AIOCB *aiocb)
+{
+	struct aio_pthread_job *job;
+	int ret = AIO_ALLDONE;
+
+	for (job = aio_jobs; job; job = job->next) {
+		BOOL dequeued = False;
+
+		if (aiocb != NULL ? (job->aiocb != aiocb)
+		    : (job->aiocb->aio_fildes != fd)) {
+			continue;
+		}
+
+		if (job->done) {
+			continue;
+		}
+
+		/* smbd drops its interest in this request. */
+		job->orphaned = True;
+
+		pthread_mutex_lock(&aio_queue_mutex);
+		if (job->queued) {
+			struct aio_pthread_job **pp = &aio_queue_head;
+			struct aio_pthread_job *prev = NULL;
+
+			while (*pp != job) {
+				prev = *pp;
+				pp = &(*pp)->queue_next;
+			}
+			*pp = job->queue_next;
+			if (aio_queue_tail == job) {
+				aio_queue_tail = prev;
+			}
+			job->queued = False;
+			dequeued = True;
+		}
+		pthread_mutex_unlock(&aio_queue_mutex);
+
+		if (dequeued) {
+			job->ret = -1;
+			job->err = ECANCELED;
+			/* Completed through the pipe like any other job. */
+			sys_write(aio_pipe[1], &job, sizeof(job));
+			if (ret != AIO_NOTCANCELED) {
+				ret = AIO_CANCELED;
+			}
+		} else {
+			ret = AIO_NOTCANCELED;
+		}
+	}
+
+	return ret;
+}
+
+/************************************************************************
+ Wait for one of the listed requests to complete. Completions of other
+ requests that come in while we wait are passed to smbd as usual.
+***********************************************************************/
+
+static int aio_pthread_suspend(vfs_handle_struct *handle, files_struct *fsp,
+			       const SMB_STRUCT_AIOCB * const aiocb[], int n,
+			       const struct timespec *timeout)
+{
+	struct timeval end_time;
+
+	if (!aio_pool_initialized) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (timeout != NULL) {
+		end_time = timeval_current_ofs(timeout->tv_sec,
+					       timeout->tv_nsec / 1000);
+	}
+
+	for (;;) {
+		struct timeval tv, now;
+		fd_set rfds;
+		int i, ret;
+
+		for (i = 0; i < n; i++) {
+			struct aio_pthread_job *job;
+
+			if (aiocb[i] == NULL) {
+				continue;
+			}
+			job = find_aio_job(aiocb[i]);
+			if (job == NULL || job->done) {
+				return 0;
+			}
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(aio_pipe[0], &rfds);
+
+		if (timeout != NULL) {
+			GetTimeOfDay(&now);
+			if (timeval_compare(&now, &end_time) >= 0) {
+				errno = EAGAIN;
+				return -1;
+			}
+			tv = timeval_until(&now, &end_time);
+		}
+
+		ret = sys_select_intr(aio_pipe[0]+1, &rfds, NULL, NULL,
+				      timeout != NULL ? &tv : NULL);
+		if (ret == -1) {
+			return -1;
+		}
+
+		aio_pthread_read_completions(aiocb, n);
+	}
+}
+
+/* VFS operations structure */
+
+static vfs_op_tuple aio_pthread_ops[] = {
+	{SMB_VFS_OP(aio_pthread_read), SMB_VFS_OP_AIO_READ, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_write), SMB_VFS_OP_AIO_WRITE, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_return_fn), SMB_VFS_OP_AIO_RETURN, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_cancel), SMB_VFS_OP_AIO_CANCEL, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_error_fn), SMB_VFS_OP_AIO_ERROR, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_fsync), SMB_VFS_OP_AIO_FSYNC, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(aio_pthread_suspend), SMB_VFS_OP_AIO_SUSPEND, SMB_VFS_LAYER_OPAQUE},
+	{SMB_VFS_OP(NULL), SMB_VFS_OP_NOOP, SMB_VFS_LAYER_NOOP}
+};
+
+#else
+
+static vfs_op_tuple aio_pthread_ops[] = {
+	{SMB_VFS_OP(NULL), SMB_VFS_OP_NOOP, SMB_VFS_LAYER_NOOP}
+};
+
+#endif /* WITH_AIO && HAVE_PTHREAD_H */
+
+NTSTATUS vfs_aio_pthread_init(void);
+NTSTATUS vfs_aio_pthread_init(void)
+{
+	return smb_register_vfs(SMB_VFS_INTERFACE_VERSION, "aio_pthread",
+				aio_pthread_ops);
+}
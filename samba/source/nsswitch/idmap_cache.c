@@ -59,7 +59,7 @@ struct idmap_cache_ctx *idmap_cache_init(TALLOC_CTX *memctx)
 
 	DEBUG(10, ("Opening cache file at %s\n", cache_fname));
 
-	cache->tdb = tdb_open_log(cache_fname, 0, TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	cache->tdb = tdb_open_log(cache_fname, 0, TDB_GROWABLE|TDB_FETCH_CACHE, O_RDWR|O_CREAT, 0600);
 
 	if (!cache->tdb) {
 		DEBUG(5, ("Attempt to open %s has failed.\n", cache_fname));
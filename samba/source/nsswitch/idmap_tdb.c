@@ -124,7 +124,7 @@ static BOOL idmap_tdb_convert(const char *idmap_name)
 	TDB_CONTEXT *idmap_tdb;
 
 	if (!(idmap_tdb = tdb_open_log(idmap_name, 0,
-					TDB_DEFAULT, O_RDWR,
+					TDB_SEQNUM, O_RDWR,
 					0600))) {
 		DEBUG(0, ("Unable to open idmap database\n"));
 		return False;
@@ -261,7 +261,7 @@ static NTSTATUS idmap_tdb_open_db(TALLOC_CTX *memctx, TDB_CONTEXT **tdbctx)
 	DEBUG(10,("Opening tdbfile %s\n", tdbfile ));
 
 	/* Open idmap repository */
-	if (!(idmap_tdb_common_ctx = tdb_open_log(tdbfile, 0, TDB_DEFAULT, O_RDWR | O_CREAT, 0644))) {
+	if (!(idmap_tdb_common_ctx = tdb_open_log(tdbfile, 0, TDB_GROWABLE|TDB_FETCH_CACHE, O_RDWR | O_CREAT, 0644))) {
 		DEBUG(0, ("Unable to open idmap database\n"));
 		ret = NT_STATUS_UNSUCCESSFUL;
 		goto done;
@@ -291,7 +291,7 @@ static NTSTATUS idmap_tdb_open_db(TALLOC_CTX *memctx, TDB_CONTEXT **tdbctx)
 		}
 
 		/* Re-Open idmap repository */
-		if (!(idmap_tdb_common_ctx = tdb_open_log(tdbfile, 0, TDB_DEFAULT, O_RDWR | O_CREAT, 0644))) {
+		if (!(idmap_tdb_common_ctx = tdb_open_log(tdbfile, 0, TDB_GROWABLE|TDB_FETCH_CACHE, O_RDWR | O_CREAT, 0644))) {
 			DEBUG(0, ("Unable to open idmap database\n"));
 			ret = NT_STATUS_UNSUCCESSFUL;
 			goto done;
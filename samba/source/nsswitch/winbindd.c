@@ -320,17 +320,34 @@ static void process_request(struct winbindd_cli_state *state)
 }
 
 /*
- * A list of file descriptors being monitored by select in the main processing
- * loop. fd_event->handler is called whenever the socket is readable/writable.
+ * A list of file descriptors being monitored in the main processing
+ * loop. Each one is registered with winbind_event_context(), so the event
+ * backend (epoll where available) only hands us the sockets that are
+ * ready. winbindd_fd_event->handler is called whenever the socket is
+ * readable/writable.
  */
 
-static struct fd_event *fd_events = NULL;
+static struct winbindd_fd_event *fd_events = NULL;
 
-void add_fd_event(struct fd_event *ev)
+static void winbindd_fd_event_handler(struct event_context *event_ctx,
+				      struct fd_event *fde,
+				      uint16 flags,
+				      void *private_data)
 {
-	struct fd_event *match;
+	struct winbindd_fd_event *ev = (struct winbindd_fd_event *)private_data;
 
-	/* only add unique fd_event structs */
+	/* The backend might report a hangup for both directions. */
+	flags &= ev->flags;
+	if (flags) {
+		ev->handler(ev, flags);
+	}
+}
+
+void add_fd_event(struct winbindd_fd_event *ev)
+{
+	struct winbindd_fd_event *match;
+
+	/* only add unique winbindd_fd_event structs */
 
 	for (match=fd_events; match; match=match->next ) {
 #ifdef DEVELOPER
@@ -341,20 +358,40 @@ void add_fd_event(struct fd_event *ev)
 #endif
 	}
 
+	ev->fde = event_add_fd(winbind_event_context(), NULL, ev->fd,
+			       ev->flags, winbindd_fd_event_handler, ev);
+	if (ev->fde == NULL) {
+		DEBUG(0, ("add_fd_event: could not add fd %d\n", ev->fd));
+	}
+
 	DLIST_ADD(fd_events, ev);
 }
 
-void remove_fd_event(struct fd_event *ev)
+void remove_fd_event(struct winbindd_fd_event *ev)
 {
+	TALLOC_FREE(ev->fde);
 	DLIST_REMOVE(fd_events, ev);
 }
 
+/*
+ * Change the flags of a winbindd_fd_event, keeping the event backend
+ * in sync.
+ */
+
+static void set_fd_event_flags(struct winbindd_fd_event *ev, int flags)
+{
+	ev->flags = flags;
+	if (ev->fde != NULL) {
+		event_set_fd_flags(ev->fde, (uint16)flags);
+	}
+}
+
 /*
  * Handler for fd_events to complete a read/write request, set up by
  * setup_async_read/setup_async_write.
  */
 
-static void rw_callback(struct fd_event *event, int flags)
+static void rw_callback(struct winbindd_fd_event *event, int flags)
 {
 	size_t todo;
 	ssize_t done = 0;
@@ -368,7 +405,7 @@ static void rw_callback(struct fd_event *event, int flags)
 				 todo);
 
 		if (done <= 0) {
-			event->flags = 0;
+			set_fd_event_flags(event, 0);
 			event->finished(event->private_data, False);
 			return;
 		}
@@ -380,7 +417,7 @@ static void rw_callback(struct fd_event *event, int flags)
 				todo);
 
 		if (done <= 0) {
-			event->flags = 0;
+			set_fd_event_flags(event, 0);
 			event->finished(event->private_data, False);
 			return;
 		}
@@ -389,7 +426,7 @@ static void rw_callback(struct fd_event *event, int flags)
 	event->done += done;
 
 	if (event->done == event->length) {
-		event->flags = 0;
+		set_fd_event_flags(event, 0);
 		event->finished(event->private_data, True);
 	}
 }
@@ -399,7 +436,7 @@ static void rw_callback(struct fd_event *event, int flags)
  * when the request is completed or an error had occurred.
  */
 
-void setup_async_read(struct fd_event *event, void *data, size_t length,
+void setup_async_read(struct winbindd_fd_event *event, void *data, size_t length,
 		      void (*finished)(void *private_data, BOOL success),
 		      void *private_data)
 {
@@ -410,10 +447,10 @@ void setup_async_read(struct fd_event *event, void *data, size_t length,
 	event->handler = rw_callback;
 	event->finished = finished;
 	event->private_data = private_data;
-	event->flags = EVENT_FD_READ;
+	set_fd_event_flags(event, EVENT_FD_READ);
 }
 
-void setup_async_write(struct fd_event *event, void *data, size_t length,
+void setup_async_write(struct winbindd_fd_event *event, void *data, size_t length,
 		       void (*finished)(void *private_data, BOOL success),
 		       void *private_data)
 {
@@ -424,7 +461,7 @@ void setup_async_write(struct fd_event *event, void *data, size_t length,
 	event->handler = rw_callback;
 	event->finished = finished;
 	event->private_data = private_data;
-	event->flags = EVENT_FD_WRITE;
+	set_fd_event_flags(event, EVENT_FD_WRITE);
 }
 
 /*
@@ -657,8 +694,9 @@ static void remove_client(struct winbindd_cli_state *state)
 		return;
 	}
 		
-	/* Close socket */
-		
+	/* Close socket, once the event loop has forgotten it */
+
+	remove_fd_event(&state->fd_event);
 	close(state->sock);
 		
 	/* Free any getent state */
@@ -676,8 +714,6 @@ static void remove_client(struct winbindd_cli_state *state)
 		state->mem_ctx = NULL;
 	}
 
-	remove_fd_event(&state->fd_event);
-		
 	/* Remove from list and free */
 		
 	winbindd_remove_client(state);
@@ -721,10 +757,9 @@ static BOOL remove_idle_client(void)
 static int process_loop(int listen_sock, int listen_priv_sock)
 {
 	struct winbindd_cli_state *state;
-	struct fd_event *ev;
 	fd_set r_fds, w_fds;
 	int maxfd, selret;
-	struct timeval timeout, ev_timeout;
+	struct timeval timeout, now;
 
 	/* We'll be doing this a lot */
 
@@ -759,11 +794,6 @@ static int process_loop(int listen_sock, int listen_priv_sock)
 	timeout.tv_sec = WINBINDD_ESTABLISH_LOOP;
 	timeout.tv_usec = 0;
 
-	/* Check for any event timeouts. */
-	if (get_timed_events_timeout(winbind_event_context(), &ev_timeout)) {
-		timeout = timeval_min(&timeout, &ev_timeout);
-	}
-
 	/* Set up client readers and writers */
 
 	state = winbindd_client_list();
@@ -781,22 +811,11 @@ static int process_loop(int listen_sock, int listen_priv_sock)
 		state = next;
 	}
 
-	for (ev = fd_events; ev; ev = ev->next) {
-		if (ev->fd < 0 || ev->fd >= FD_SETSIZE) {
-			/* Ignore here - event_add_to_select_args
-			   should make this impossible. */
-			continue;
-		}
+	/* Client and child sockets plus any event timeouts. */
 
-		if (ev->flags & EVENT_FD_READ) {
-			FD_SET(ev->fd, &r_fds);
-			maxfd = MAX(ev->fd, maxfd);
-		}
-		if (ev->flags & EVENT_FD_WRITE) {
-			FD_SET(ev->fd, &w_fds);
-			maxfd = MAX(ev->fd, maxfd);
-		}
-	}
+	now = timeval_current();
+	event_add_to_select_args(winbind_event_context(), &now,
+				 &r_fds, &w_fds, &timeout, &maxfd);
 
 	/* Call select */
         
@@ -819,18 +838,7 @@ static int process_loop(int listen_sock, int listen_priv_sock)
 
 	/* selret > 0 */
 
-	ev = fd_events;
-	while (ev != NULL) {
-		struct fd_event *next = ev->next;
-		int flags = 0;
-		if (FD_ISSET(ev->fd, &r_fds))
-			flags |= EVENT_FD_READ;
-		if (FD_ISSET(ev->fd, &w_fds))
-			flags |= EVENT_FD_WRITE;
-		if (flags)
-			ev->handler(ev, flags);
-		ev = next;
-	}
+	run_events(winbind_event_context(), selret, &r_fds, &w_fds);
 
 	if (FD_ISSET(listen_sock, &r_fds)) {
 		while (winbindd_num_clients() >
@@ -2183,7 +2183,7 @@ static BOOL init_wcache(void)
 	/* when working offline we must not clear the cache on restart */
 	wcache->tdb = tdb_open_log(lock_path("winbindd_cache.tdb"),
 				WINBINDD_CACHE_TDB_DEFAULT_HASH_SIZE, 
-				lp_winbind_offline_logon() ? TDB_DEFAULT : (TDB_DEFAULT | TDB_CLEAR_IF_FIRST), 
+				TDB_GROWABLE | (lp_winbind_offline_logon() ? TDB_DEFAULT : TDB_CLEAR_IF_FIRST), 
 				O_RDWR|O_CREAT, 0600);
 
 	if (wcache->tdb == NULL) {
@@ -2490,7 +2490,7 @@ void wcache_flush_cache(void)
 	/* when working offline we must not clear the cache on restart */
 	wcache->tdb = tdb_open_log(lock_path("winbindd_cache.tdb"),
 				WINBINDD_CACHE_TDB_DEFAULT_HASH_SIZE, 
-				lp_winbind_offline_logon() ? TDB_DEFAULT : (TDB_DEFAULT | TDB_CLEAR_IF_FIRST), 
+				TDB_GROWABLE | (lp_winbind_offline_logon() ? TDB_DEFAULT : TDB_CLEAR_IF_FIRST), 
 				O_RDWR|O_CREAT, 0600);
 
 	if (!wcache->tdb) {
@@ -300,6 +300,7 @@ typedef struct {
 	BOOL bEnableCoreFiles;
 	BOOL bHostMSDfs;
 	BOOL bUseMmap;
+	BOOL bIoStats;
 	BOOL bHostnameLookups;
 	BOOL bUnixExtensions;
 	BOOL bDisableNetbios;
@@ -462,8 +463,10 @@ typedef struct {
 	int iallocation_roundup_size;
 	int iAioReadSize;
 	int iAioWriteSize;
+	int iMinReceivefileSize;
 	int iMap_readonly;
 	int iDirectoryNameCacheSize;
+	int iDirectoryStatCacheTime;
 	param_opt_struct *param_opt;
 
 	char dummy[3];		/* for alignment */
@@ -606,12 +609,14 @@ static service sDefault = {
 	SMB_ROUNDUP_ALLOCATION_SIZE,		/* iallocation_roundup_size */
 	0,			/* iAioReadSize */
 	0,			/* iAioWriteSize */
+	0,			/* iMinReceivefileSize */
 	MAP_READONLY_YES,	/* iMap_readonly */
 #ifdef BROKEN_DIRECTORY_HANDLING
 	0,			/* iDirectoryNameCacheSize */
 #else
 	100,			/* iDirectoryNameCacheSize */
 #endif
+	0,			/* iDirectoryStatCacheTime */
 	NULL,			/* Parametric options */
 
 	""			/* dummy */
@@ -1032,6 +1037,7 @@ static struct parm_struct parm_table[] = {
 	{"keepalive", P_INTEGER, P_GLOBAL, &keepalive, NULL, NULL, FLAG_ADVANCED}, 
 	{"change notify", P_BOOL, P_LOCAL, &sDefault.bChangeNotify, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE },
 	{"directory name cache size", P_INTEGER, P_LOCAL, &sDefault.iDirectoryNameCacheSize, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE },
+	{"directory stat cache time", P_INTEGER, P_LOCAL, &sDefault.iDirectoryStatCacheTime, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE },
 	{"kernel change notify", P_BOOL, P_LOCAL, &sDefault.bKernelChangeNotify, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE },
 
 	{"lpq cache time", P_INTEGER, P_GLOBAL, &Globals.lpqcachetime, NULL, NULL, FLAG_ADVANCED}, 
@@ -1048,7 +1054,9 @@ static struct parm_struct parm_table[] = {
 	{"strict sync", P_BOOL, P_LOCAL, &sDefault.bStrictSync, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE}, 
 	{"sync always", P_BOOL, P_LOCAL, &sDefault.bSyncAlways, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE}, 
 	{"use mmap", P_BOOL, P_GLOBAL, &Globals.bUseMmap, NULL, NULL, FLAG_ADVANCED}, 
+	{"io stats", P_BOOL, P_GLOBAL, &Globals.bIoStats, NULL, NULL, FLAG_ADVANCED}, 
 	{"use sendfile", P_BOOL, P_LOCAL, &sDefault.bUseSendfile, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE}, 
+	{"min receivefile size", P_INTEGER, P_LOCAL, &sDefault.iMinReceivefileSize, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE}, 
 	{"hostname lookups", P_BOOL, P_GLOBAL, &Globals.bHostnameLookups, NULL, NULL, FLAG_ADVANCED}, 
 	{"write cache size", P_INTEGER, P_LOCAL, &sDefault.iWriteCacheSize, NULL, NULL, FLAG_ADVANCED | FLAG_SHARE | FLAG_DEPRECATED}, 
 
@@ -1592,6 +1600,7 @@ static void init_globals(BOOL first_time_only)
 #else
 	Globals.bUseMmap = True;
 #endif
+	Globals.bIoStats = False;
 	Globals.bUnixExtensions = True;
 	Globals.bResetOnZeroVC = False;
 
@@ -2008,6 +2017,7 @@ FN_GLOBAL_BOOL(lp_host_msdfs, &Globals.bHostMSDfs)
 FN_GLOBAL_BOOL(lp_kernel_oplocks, &Globals.bKernelOplocks)
 FN_GLOBAL_BOOL(lp_enhanced_browsing, &Globals.enhanced_browsing)
 FN_GLOBAL_BOOL(lp_use_mmap, &Globals.bUseMmap)
+FN_GLOBAL_BOOL(lp_io_stats, &Globals.bIoStats)
 FN_GLOBAL_BOOL(lp_unix_extensions, &Globals.bUnixExtensions)
 FN_GLOBAL_BOOL(lp_use_spnego, &Globals.bUseSpnego)
 FN_GLOBAL_BOOL(lp_client_use_spnego, &Globals.bClientUseSpnego)
@@ -2178,8 +2188,10 @@ FN_LOCAL_INTEGER(lp_dfree_cache_time, iDfreeCacheTime)
 FN_LOCAL_INTEGER(lp_allocation_roundup_size, iallocation_roundup_size)
 FN_LOCAL_INTEGER(lp_aio_read_size, iAioReadSize)
 FN_LOCAL_INTEGER(lp_aio_write_size, iAioWriteSize)
+static FN_LOCAL_INTEGER(_lp_min_receivefile_size, iMinReceivefileSize)
 FN_LOCAL_INTEGER(lp_map_readonly, iMap_readonly)
 FN_LOCAL_INTEGER(lp_directory_name_cache_size, iDirectoryNameCacheSize)
+FN_LOCAL_INTEGER(lp_directory_stat_cache_time, iDirectoryStatCacheTime)
 FN_LOCAL_CHAR(lp_magicchar, magic_char)
 FN_GLOBAL_INTEGER(lp_winbind_cache_time, &Globals.winbind_cache_time)
 FN_GLOBAL_LIST(lp_winbind_nss_info, &Globals.szWinbindNssInfo)
@@ -5671,6 +5683,21 @@ void set_use_sendfile(int snum, BOOL val)
 		sDefault.bUseSendfile = val;
 }
 
+/*******************************************************************
+ Ensure we don't use recvfile if server smb signing is active, the
+ signature has to be checked over the whole packet.
+********************************************************************/
+
+int lp_min_receivefile_size(int snum)
+{
+	int min_size = _lp_min_receivefile_size(snum);
+
+	if (min_size <= 0 || srv_is_signing_active()) {
+		return 0;
+	}
+	return min_size;
+}
+
 /*******************************************************************
  Turn off storing DOS attributes if this share doesn't support it.
 ********************************************************************/
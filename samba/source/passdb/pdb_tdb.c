@@ -825,7 +825,7 @@ static BOOL tdbsam_open( const char *name )
 	
 	/* Try to open tdb passwd.  Create a new one if necessary */
 	
-	if (!(tdbsam = tdb_open_log(name, 0, TDB_DEFAULT, O_CREAT|O_RDWR, 0600))) {
+	if (!(tdbsam = tdb_open_log(name, 0, TDB_WAL, O_CREAT|O_RDWR, 0600))) {
 		DEBUG(0, ("tdbsam_open: Failed to open/create TDB passwd [%s]\n", name));
 		return False;
 	}
@@ -1197,6 +1197,12 @@ static NTSTATUS tdbsam_delete_sam_account(struct pdb_methods *my_methods, struct
 	
 	rid = pdb_get_user_rid(sam_pass);
 
+	if (tdb_transaction_start(tdbsam) != 0) {
+		DEBUG(0,("tdbsam_delete_sam_account: tdb_transaction_start failed\n"));
+		tdbsam_close();
+		return NT_STATUS_UNSUCCESSFUL;
+	}
+
 	/* it's outaa here!  8^) */
 
 	if ( tdb_delete(tdbsam, key) != TDB_SUCCESS ) {
@@ -1221,9 +1227,18 @@ static NTSTATUS tdbsam_delete_sam_account(struct pdb_methods *my_methods, struct
 		goto done;
 	}
 
+	if (tdb_transaction_commit(tdbsam) != 0) {
+		DEBUG(0,("tdbsam_delete_sam_account: tdb_transaction_commit failed\n"));
+		tdbsam_close();
+		return NT_STATUS_UNSUCCESSFUL;
+	}
+
 	nt_status = NT_STATUS_OK;
 	
  done:
+	if (!NT_STATUS_IS_OK(nt_status)) {
+		tdb_transaction_cancel(tdbsam);
+	}
 	tdbsam_close();
 	
 	return nt_status;
@@ -1347,10 +1362,24 @@ static BOOL tdb_update_sam(struct pdb_methods *my_methods, struct samu* newpwd,
 		return False;
 	}
 	
+	/* the account and its RID index go to disk together */
+	if (tdb_transaction_start(tdbsam) != 0) {
+		DEBUG(0,("tdb_update_sam: tdb_transaction_start failed\n"));
+		tdbsam_close();
+		return False;
+	}
+
 	if ( !tdb_update_samacct_only(newpwd, flag) || !tdb_update_ridrec_only(newpwd, flag)) {
 		result = False;
 	}
 
+	if (!result) {
+		tdb_transaction_cancel(tdbsam);
+	} else if (tdb_transaction_commit(tdbsam) != 0) {
+		DEBUG(0,("tdb_update_sam: tdb_transaction_commit failed\n"));
+		result = False;
+	}
+
 	/* cleanup */
 
 	tdbsam_close();
@@ -1560,7 +1589,7 @@ static BOOL tdbsam_new_rid(struct pdb_methods *methods, uint32 *prid)
 	BOOL ret = False;
 
 	tdb = tdb_open_log(lock_path("winbindd_idmap.tdb"), 0,
-			   TDB_DEFAULT, O_RDWR | O_CREAT, 0644);
+			   TDB_SEQNUM, O_RDWR | O_CREAT, 0644);
 
 	if (tdb == NULL) {
 		DEBUG(1, ("Could not open idmap: %s\n", strerror(errno)));
@@ -62,7 +62,7 @@ BOOL secrets_init(void)
 	pstrcpy(fname, lp_private_dir());
 	pstrcat(fname,"/secrets.tdb");
 
-	tdb = tdb_open_log(fname, 0, TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	tdb = tdb_open_log(fname, 0, TDB_GROUP_COMMIT|TDB_FETCH_CACHE, O_RDWR|O_CREAT, 0600);
 
 	if (!tdb) {
 		DEBUG(0,("Failed to open %s\n", fname));
@@ -551,7 +551,7 @@ BOOL nt_printing_init(void)
  
 	if (tdb_drivers)
 		tdb_close(tdb_drivers);
-	tdb_drivers = tdb_open_log(lock_path("ntdrivers.tdb"), 0, TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	tdb_drivers = tdb_open_log(lock_path("ntdrivers.tdb"), 0, TDB_WAL, O_RDWR|O_CREAT, 0600);
 	if (!tdb_drivers) {
 		DEBUG(0,("nt_printing_init: Failed to open nt drivers database %s (%s)\n",
 			lock_path("ntdrivers.tdb"), strerror(errno) ));
@@ -2026,7 +2026,7 @@ static uint32 add_a_printer_driver_3(NT_PRINTER_DRIVER_INFO_LEVEL_3 *driver)
 	dbuf.dptr = buf;
 	dbuf.dsize = len;
 	
-	ret = tdb_store(tdb_drivers, kbuf, dbuf, TDB_REPLACE);
+	ret = tdb_trans_store(tdb_drivers, kbuf, dbuf, TDB_REPLACE);
 
 done:
 	if (ret)
@@ -4212,7 +4212,7 @@ BOOL del_driver_init(char *drivername)
 
 	DEBUG(6,("del_driver_init: Removing driver init data for [%s]\n", drivername));
 
-	return (tdb_delete(tdb_drivers, kbuf) == 0);
+	return (tdb_trans_delete(tdb_drivers, kbuf) == 0);
 }
 
 /****************************************************************************
@@ -4257,7 +4257,7 @@ static uint32 update_driver_init_2(NT_PRINTER_INFO_LEVEL_2 *info)
 	dbuf.dptr = buf;
 	dbuf.dsize = len;
 
-	ret = tdb_store(tdb_drivers, kbuf, dbuf, TDB_REPLACE);
+	ret = tdb_trans_store(tdb_drivers, kbuf, dbuf, TDB_REPLACE);
 
 done:
 	if (ret == -1)
@@ -5057,7 +5057,7 @@ WERROR delete_printer_driver( NT_PRINTER_DRIVER_INFO_LEVEL_3 *info_3, struct cur
 	
 	/* ok... the driver exists so the delete should return success */
 		
-	if (tdb_delete(tdb_drivers, kbuf) == -1) {
+	if (tdb_trans_delete(tdb_drivers, kbuf) == -1) {
 		DEBUG (0,("delete_printer_driver: fail to delete %s!\n", key));
 		return WERR_ACCESS_DENIED;
 	}
@@ -286,6 +286,7 @@ BOOL profile_setup(BOOL rdonly)
 	    "syscall_pwrite",		/* PR_VALUE_SYSCALL_PWRITE */
 	    "syscall_lseek",		/* PR_VALUE_SYSCALL_LSEEK */
 	    "syscall_sendfile",		/* PR_VALUE_SYSCALL_SENDFILE */
+	    "syscall_recvfile",		/* PR_VALUE_SYSCALL_RECVFILE */
 	    "syscall_rename",		/* PR_VALUE_SYSCALL_RENAME */
 	    "syscall_fsync",		/* PR_VALUE_SYSCALL_FSYNC */
 	    "syscall_stat",		/* PR_VALUE_SYSCALL_STAT */
@@ -515,3 +516,91 @@ BOOL service_stats_setup(BOOL rdonly)
 }
 
 #endif /*WITH_DARWIN_STATS*/
+
+/*******************************************************************
+ Attach the "io stats" shared memory area, creating it if needed.
+ ******************************************************************/
+
+struct iostats_header *iostats_h;
+
+BOOL iostats_setup(BOOL rdonly)
+{
+	struct shmid_ds shm_ds;
+	struct iostats_header *h;
+	int shm_id;
+
+	if (iostats_h != NULL) {
+		return True;
+	}
+
+ again:
+	/* try to use an existing key */
+	shm_id = shmget(IOSTATS_SHMEM_KEY, 0, 0);
+
+	if (shm_id == -1) {
+		if (rdonly) {
+			return False;
+		}
+		shm_id = shmget(IOSTATS_SHMEM_KEY, sizeof(*iostats_h),
+				IPC_CREAT | IPC_EXCL |
+				(S_IRUSR | S_IWUSR) | S_IRGRP | S_IROTH);
+	}
+
+	if (shm_id == -1) {
+		DEBUG(0,("Can't create or use iostats IPC area. Error was %s\n",
+			 strerror(errno)));
+		return False;
+	}
+
+	h = (struct iostats_header *)shmat(shm_id, 0, rdonly ? SHM_RDONLY : 0);
+	if ((long)h == -1) {
+		DEBUG(0,("Can't attach to iostats IPC area. Error was %s\n",
+			 strerror(errno)));
+		return False;
+	}
+
+	if (shmctl(shm_id, IPC_STAT, &shm_ds) != 0) {
+		DEBUG(0,("ERROR shmctl : can't IPC_STAT. Error was %s\n",
+			 strerror(errno)));
+		shmdt(h);
+		return False;
+	}
+
+	if (shm_ds.shm_perm.cuid != sec_initial_uid() ||
+	    shm_ds.shm_perm.cgid != sec_initial_gid()) {
+		DEBUG(0,("ERROR: we did not create the iostats shmem "
+			 "(owned by another user, uid %u, gid %u)\n",
+			 shm_ds.shm_perm.cuid,
+			 shm_ds.shm_perm.cgid));
+		shmdt(h);
+		return False;
+	}
+
+	if (shm_ds.shm_segsz != sizeof(*iostats_h)) {
+		DEBUG(0,("WARNING: iostats size is %d (expected %lu). "
+			 "Deleting\n", (int)shm_ds.shm_segsz,
+			 (unsigned long)sizeof(*iostats_h)));
+		shmdt(h);
+		if (!rdonly && shmctl(shm_id, IPC_RMID, &shm_ds) == 0) {
+			goto again;
+		}
+		return False;
+	}
+
+	if (!rdonly && (shm_ds.shm_nattch == 1)) {
+		memset((char *)h, 0, sizeof(*h));
+		h->iostats_shm_magic = IOSTATS_SHM_MAGIC;
+		h->iostats_shm_version = IOSTATS_SHM_VERSION;
+		DEBUG(3,("Initialised iostats area\n"));
+	}
+
+	if (h->iostats_shm_magic != IOSTATS_SHM_MAGIC ||
+	    h->iostats_shm_version != IOSTATS_SHM_VERSION) {
+		DEBUG(0,("ERROR: iostats area has bad magic or version\n"));
+		shmdt(h);
+		return False;
+	}
+
+	iostats_h = h;
+	return True;
+}
@@ -79,7 +79,7 @@ static void send_sync_message(void)
         TDB_CONTEXT *tdb;
 
         tdb = tdb_open_log(lock_path("connections.tdb"), 0,
-                           TDB_DEFAULT, O_RDONLY, 0);
+                           TDB_VOLATILE, O_RDONLY, 0);
 
         if (!tdb) {
                 DEBUG(3, ("send_sync_message(): failed to open connections "
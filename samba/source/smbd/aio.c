@@ -139,13 +139,18 @@ static struct aio_extra *find_aio_ex(uint16 mid)
 }
 
 /****************************************************************************
- We can have these many aio buffers in flight.
+ We can have these many aio buffers in flight. The client can't have more
+ than "max mux" requests outstanding, so that is what we allow for, while
+ the main loop keeps processing the requests that don't go async.
 *****************************************************************************/
 
 #define AIO_PENDING_SIZE 10
 static sig_atomic_t signals_received;
+static sig_atomic_t signals_lost;
 static int outstanding_aio_calls;
-static uint16 aio_pending_array[AIO_PENDING_SIZE];
+static int aio_pending_size = AIO_PENDING_SIZE;
+static uint16 aio_pending_static[AIO_PENDING_SIZE];
+static uint16 *aio_pending_array = aio_pending_static;
 
 /****************************************************************************
  Signal handler when an aio request completes.
@@ -153,10 +158,14 @@ static uint16 aio_pending_array[AIO_PENDING_SIZE];
 
 static void signal_handler(int sig, siginfo_t *info, void *unused)
 {
-	if (signals_received < AIO_PENDING_SIZE) {
+	if (signals_received < aio_pending_size) {
 		aio_pending_array[signals_received] = info->si_value.sival_int;
 		signals_received++;
-	} /* Else signal is lost. */
+	} else {
+		/* No room for the mid, process_aio_queue will have to
+		 * look at all outstanding requests. */
+		signals_lost = 1;
+	}
 	sys_select_signal(RT_SIGNAL_AIO);
 }
 
@@ -166,7 +175,7 @@ static void signal_handler(int sig, siginfo_t *info, void *unused)
 
 BOOL aio_finished(void)
 {
-	return (signals_received != 0);
+	return (signals_received != 0 || signals_lost != 0);
 }
 
 /****************************************************************************
@@ -176,6 +185,19 @@ BOOL aio_finished(void)
 void initialize_async_io_handler(void)
 {
 	struct sigaction act;
+	int max_pending = lp_maxmux();
+
+	if (max_pending > AIO_PENDING_SIZE && aio_pending_array == aio_pending_static) {
+		uint16 *pending = SMB_MALLOC_ARRAY(uint16, max_pending);
+
+		if (pending != NULL) {
+			aio_pending_array = pending;
+			aio_pending_size = max_pending;
+		}
+	}
+
+	DEBUG(10,("initialize_async_io_handler: allowing %d aio requests "
+		  "in flight\n", aio_pending_size));
 
 	ZERO_STRUCT(act);
 	act.sa_sigaction = signal_handler;
@@ -220,7 +242,7 @@ BOOL schedule_aio_read_and_X(connection_struct *conn,
 		return False;
 	}
 
-	if (outstanding_aio_calls >= AIO_PENDING_SIZE) {
+	if (outstanding_aio_calls >= aio_pending_size) {
 		DEBUG(10,("schedule_aio_read_and_X: Already have %d aio "
 			  "activities outstanding.\n",
 			  outstanding_aio_calls ));
@@ -303,7 +325,7 @@ BOOL schedule_aio_write_and_X(connection_struct *conn,
 		return False;
 	}
 
-	if (outstanding_aio_calls >= AIO_PENDING_SIZE) {
+	if (outstanding_aio_calls >= aio_pending_size) {
 		DEBUG(3,("schedule_aio_write_and_X: Already have %d aio "
 			 "activities outstanding.\n",
 			  outstanding_aio_calls ));
@@ -423,6 +445,7 @@ static int handle_aio_read_complete(struct aio_extra *aio_ex)
 			    aio_ex->fsp->fsp_name,
 			    aio_ex->acb.aio_nbytes, (int)nread ) );
 
+		IOSTATS_ADD_READ(aio_ex->fsp->conn, nread);
 	}
 	smb_setlen(outbuf,outsize - 4);
 	show_msg(outbuf);
@@ -452,6 +475,10 @@ static int handle_aio_write_complete(struct aio_extra *aio_ex)
 	ssize_t numtowrite = aio_ex->acb.aio_nbytes;
 	ssize_t nwritten = SMB_VFS_AIO_RETURN(fsp,&aio_ex->acb);
 
+	if (nwritten > 0) {
+		IOSTATS_ADD_WRITE(fsp->conn, nwritten);
+	}
+
 	if (fsp->aio_write_behind) {
 		if (nwritten != numtowrite) {
 			if (nwritten == -1) {
@@ -560,6 +587,41 @@ static BOOL handle_aio_completed(struct aio_extra *aio_ex, int *perr)
 	return True;
 }
 
+/****************************************************************************
+ We lost track of which requests completed. Check every outstanding aio
+ request and deal with the ones that are done. Called with RT_SIGNAL_AIO
+ blocked.
+*****************************************************************************/
+
+static void process_aio_list(int *perr)
+{
+	struct aio_extra *aio_ex, *next;
+
+	DEBUG(3,("process_aio_list: aio completion signals lost, checking "
+		 "%d outstanding requests\n", outstanding_aio_calls));
+
+	for (aio_ex = aio_list_head; aio_ex; aio_ex = next) {
+		next = aio_ex->next;
+
+		if (aio_ex->fsp == NULL) {
+			/* File was closed whilst I/O was outstanding. */
+			if (sys_aio_error(&aio_ex->acb) == EINPROGRESS) {
+				continue;
+			}
+			srv_cancel_sign_response(aio_ex->mid);
+		} else if (!handle_aio_completed(aio_ex, perr)) {
+			continue;
+		}
+
+		delete_aio_ex(aio_ex);
+		outstanding_aio_calls--;
+	}
+
+	/* All the mids we were told about have been dealt with above. */
+	signals_received = 0;
+	signals_lost = 0;
+}
+
 /****************************************************************************
  Handle any aio completion inline.
  Returns non-zero errno if fail or zero if all ok.
@@ -577,6 +639,12 @@ int process_aio_queue(void)
 	DEBUG(10,("process_aio_queue: outstanding_aio_calls = %d\n",
 		  outstanding_aio_calls));
 
+	if (signals_lost) {
+		process_aio_list(&ret);
+		BlockSignals(False, RT_SIGNAL_AIO);
+		return ret;
+	}
+
 	if (!signals_received) {
 		BlockSignals(False, RT_SIGNAL_AIO);
 		return 0;
@@ -602,6 +670,8 @@ int process_aio_queue(void)
 			DEBUG( 3,( "process_aio_queue: file closed whilst "
 				   "aio outstanding.\n"));
 			srv_cancel_sign_response(mid);
+			delete_aio_ex(aio_ex);
+			outstanding_aio_calls--;
 			continue;
 		}
 
@@ -610,14 +680,48 @@ int process_aio_queue(void)
 		}
 
 		delete_aio_ex(aio_ex);
+		outstanding_aio_calls--;
 	}
 
-	outstanding_aio_calls -= signals_received;
+	/* Only count the requests we found. The signal for one that
+	 * process_aio_list() already dealt with can still arrive. */
 	signals_received = 0;
 	BlockSignals(False, RT_SIGNAL_AIO);
 	return ret;
 }
 
+/****************************************************************************
+ Handle the completion of the aio request for mid. This is for aio
+ implementations that don't signal completion with RT_SIGNAL_AIO, such
+ as the aio_pthread VFS module, which calls this from the main event loop.
+*****************************************************************************/
+
+void smbd_aio_complete_mid(uint16 mid)
+{
+	struct aio_extra *aio_ex = find_aio_ex(mid);
+	int ret = 0;
+
+	if (!aio_ex) {
+		DEBUG(3,("smbd_aio_complete_mid: Can't find record to "
+			 "match mid %u.\n", (unsigned int)mid));
+		srv_cancel_sign_response(mid);
+		return;
+	}
+
+	if (aio_ex->fsp == NULL) {
+		/* file was closed whilst I/O was outstanding. Just
+		 * ignore. */
+		DEBUG( 3,( "smbd_aio_complete_mid: file closed whilst "
+			   "aio outstanding.\n"));
+		srv_cancel_sign_response(mid);
+	} else if (!handle_aio_completed(aio_ex, &ret)) {
+		return;
+	}
+
+	delete_aio_ex(aio_ex);
+	outstanding_aio_calls--;
+}
+
 /****************************************************************************
  We're doing write behind and the client closed the file. Wait up to 30
  seconds (my arbitrary choice) for the aio to complete. Return 0 if all writes
@@ -710,7 +814,10 @@ int wait_for_aio_completion(files_struct *fsp)
 			if (!handle_aio_completed(aio_ex, &err)) {
 				continue;
 			}
+			/* The completion path won't find the record now,
+			 * so it's ours to count. */
 			delete_aio_ex(aio_ex);
+			outstanding_aio_calls--;
 		}
 
 		SAFE_FREE(aiocb_list);
@@ -771,6 +878,10 @@ BOOL schedule_aio_read_and_X(connection_struct *conn,
 	return False;
 }
 
+void smbd_aio_complete_mid(uint16 mid)
+{
+}
+
 BOOL schedule_aio_write_and_X(connection_struct *conn,
                                 char *inbuf, char *outbuf,
                                 int length, int len_outbuf,
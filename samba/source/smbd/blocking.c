@@ -44,6 +44,12 @@ typedef struct _blocking_lock_record {
 	enum brl_type lock_type;
 	char *inbuf;
 	int length;
+	/* A lockingX request blocked on a later lock than the one it was
+	   queued for also has a PENDING lock there, so unlocking it wakes us. */
+	BOOL extra_pending;
+	uint32 extra_lock_pid;
+	SMB_BIG_UINT extra_offset;
+	SMB_BIG_UINT extra_count;
 } blocking_lock_record;
 
 /* dlink list we store pending lock records on. */
@@ -74,6 +80,45 @@ static BOOL in_chained_smb(void)
 static void received_unlock_msg(int msg_type, struct process_id src,
 				void *buf, size_t len,
 				void *private_data);
+static void retry_blocking_locks(const struct lock_key *key, BOOL retry_all);
+
+/****************************************************************************
+ Remove the PENDING lock a lockingX request added on a later lock.
+****************************************************************************/
+
+static void cancel_extra_pending_lock(struct byte_range_lock *br_lck,
+				      blocking_lock_record *blr)
+{
+	if (!blr->extra_pending) {
+		return;
+	}
+
+	brl_lock_cancel(br_lck,
+		blr->extra_lock_pid,
+		procid_self(),
+		blr->extra_offset,
+		blr->extra_count,
+		blr->lock_flav);
+
+	blr->extra_pending = False;
+}
+
+/****************************************************************************
+ Remove all the PENDING locks of a blocking lock request.
+****************************************************************************/
+
+static void cancel_pending_locks(struct byte_range_lock *br_lck,
+				 blocking_lock_record *blr)
+{
+	brl_lock_cancel(br_lck,
+		blr->lock_pid,
+		procid_self(),
+		blr->offset,
+		blr->count,
+		blr->lock_flav);
+
+	cancel_extra_pending_lock(br_lck, blr);
+}
 
 /****************************************************************************
  Function to push a blocking lock request onto the lock queue.
@@ -137,6 +182,7 @@ BOOL push_blocking_lock_request( struct byte_range_lock *br_lck,
 	blr->count = count;
 	memcpy(blr->inbuf, inbuf, length);
 	blr->length = length;
+	blr->extra_pending = False;
 
 	/* Add a pending lock record for this. */
 	status = brl_lock(br_lck,
@@ -339,6 +385,53 @@ static void blocking_lock_reply_error(blocking_lock_record *blr, NTSTATUS status
 	}
 }
 
+/****************************************************************************
+ A lockingX request is blocked on one of its locks. Make sure there is a
+ PENDING lock for it there, so we are told when the range is unlocked.
+*****************************************************************************/
+
+static void wait_on_lock(struct byte_range_lock *br_lck,
+			 blocking_lock_record *blr,
+			 uint32 lock_pid,
+			 SMB_BIG_UINT offset,
+			 SMB_BIG_UINT count)
+{
+	NTSTATUS status;
+
+	if (lock_pid == blr->lock_pid && offset == blr->offset &&
+	    count == blr->count) {
+		/* The lock we were queued on. */
+		return;
+	}
+
+	if (blr->extra_pending && lock_pid == blr->extra_lock_pid &&
+	    offset == blr->extra_offset && count == blr->extra_count) {
+		return;
+	}
+
+	cancel_extra_pending_lock(br_lck, blr);
+
+	status = brl_lock(br_lck,
+			lock_pid,
+			procid_self(),
+			offset,
+			count,
+			blr->lock_type == READ_LOCK ? PENDING_READ_LOCK : PENDING_WRITE_LOCK,
+			blr->lock_flav,
+			True, /* blocking_lock. */
+			NULL);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(0,("wait_on_lock: failed to add PENDING_LOCK record.\n"));
+		return;
+	}
+
+	blr->extra_pending = True;
+	blr->extra_lock_pid = lock_pid;
+	blr->extra_offset = offset;
+	blr->extra_count = count;
+}
+
 /****************************************************************************
  Attempt to finish off getting all pending blocking locks for a lockingX call.
  Returns True if we want to be removed from the list.
@@ -388,6 +481,10 @@ static BOOL process_lockingX(blocking_lock_record *blr)
 				&status,
 				&blr->blocking_pid);
 
+		if (br_lck && ERROR_WAS_LOCK_DENIED(status)) {
+			wait_on_lock(br_lck, blr, lock_pid, offset, count);
+		}
+
 		TALLOC_FREE(br_lck);
 
 		if (NT_STATUS_IS_ERR(status)) {
@@ -515,12 +612,7 @@ void cancel_pending_lock_requests_by_fid(files_struct *fsp, struct byte_range_lo
 				DEBUG(10,("remove_pending_lock_requests_by_fid - removing request type %d for \
 file %s fnum = %d\n", blr->com_type, fsp->fsp_name, fsp->fnum ));
 
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 
 				blocking_lock_cancel(fsp,
 					blr->lock_pid,
@@ -552,12 +644,7 @@ void remove_pending_lock_requests_by_mid(int mid)
 				DEBUG(10,("remove_pending_lock_requests_by_mid - removing request type %d for \
 file %s fnum = %d\n", blr->com_type, fsp->fsp_name, fsp->fnum ));
 
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 				TALLOC_FREE(br_lck);
 			}
 
@@ -586,15 +673,26 @@ BOOL blocking_lock_was_deferred(int mid)
 }
 
 /****************************************************************************
-  Set a flag as an unlock request affects one of our pending locks.
+ An unlock request affects one of our pending locks. The message carries
+ the brlock.tdb key of the file, so only retry the requests waiting on it.
 *****************************************************************************/
 
 static void received_unlock_msg(int msg_type, struct process_id src,
 				void *buf, size_t len,
 				void *private_data)
 {
+	struct lock_key key;
+
 	DEBUG(10,("received_unlock_msg\n"));
-	process_blocking_lock_queue();
+
+	if (buf == NULL || len != sizeof(key)) {
+		/* Doesn't say which file, try them all. */
+		retry_blocking_locks(NULL, True);
+		return;
+	}
+
+	memcpy(&key, buf, sizeof(key));
+	retry_blocking_locks(&key, False);
 }
 
 /****************************************************************************
@@ -650,11 +748,47 @@ unsigned int blocking_locks_timeout_ms(unsigned int default_timeout_ms)
 	return timeout_ms;
 }
 
+/****************************************************************************
+ Should this blocking lock request be retried now ? Requests are woken by
+ an unlock message for their file. Without one, only those that timed out
+ or wait for a POSIX lock held outside Samba, which nobody will tell us
+ about, need looking at.
+*****************************************************************************/
+
+static BOOL blocking_lock_retry_wanted(blocking_lock_record *blr,
+				       const struct lock_key *key,
+				       BOOL retry_all,
+				       const struct timeval *tv_curr)
+{
+	if (key) {
+		return (blr->fsp->dev == key->device &&
+			blr->fsp->inode == key->inode);
+	}
+
+	if (retry_all || blr->blocking_pid == 0xFFFFFFFF) {
+		return True;
+	}
+
+	return (!timeval_is_zero(&blr->expire_time) &&
+		timeval_compare(&blr->expire_time, tv_curr) <= 0);
+}
+
 /****************************************************************************
  Process the blocking lock queue. Note that this is only called as root.
 *****************************************************************************/
 
 void process_blocking_lock_queue(void)
+{
+	retry_blocking_locks(NULL, False);
+}
+
+/****************************************************************************
+ Retry the blocking lock requests waiting on the file with this key, in
+ the order they were queued. With no key retry the ones that need it
+ without being woken, or all of them with retry_all.
+*****************************************************************************/
+
+static void retry_blocking_locks(const struct lock_key *key, BOOL retry_all)
 {
 	struct timeval tv_curr = timeval_current();
 	blocking_lock_record *blr, *next = NULL;
@@ -670,6 +804,10 @@ void process_blocking_lock_queue(void)
 
 		next = blr->next;
 
+		if (!blocking_lock_retry_wanted(blr, key, retry_all, &tv_curr)) {
+			continue;
+		}
+
 		/*
 		 * Ensure we don't have any old chain_fsp values
 		 * sitting around....
@@ -693,12 +831,7 @@ void process_blocking_lock_queue(void)
 			 */
 
 			if (br_lck) {
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 				TALLOC_FREE(br_lck);
 			}
 
@@ -718,12 +851,7 @@ void process_blocking_lock_queue(void)
 			 */
 
 			if (br_lck) {
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 				TALLOC_FREE(br_lck);
 			}
 
@@ -745,12 +873,7 @@ void process_blocking_lock_queue(void)
 			struct byte_range_lock *br_lck = brl_get_locks(NULL, fsp);
 
 			if (br_lck) {
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 				TALLOC_FREE(br_lck);
 			}
 
@@ -779,12 +902,7 @@ void process_blocking_lock_queue(void)
 				DEBUG(5,("process_blocking_lock_queue: pending lock fnum = %d for file %s timed out.\n",
 					fsp->fnum, fsp->fsp_name ));
 
-				brl_lock_cancel(br_lck,
-					blr->lock_pid,
-					procid_self(),
-					blr->offset,
-					blr->count,
-					blr->lock_flav);
+				cancel_pending_locks(br_lck, blr);
 				TALLOC_FREE(br_lck);
 			}
 
@@ -879,6 +997,16 @@ BOOL blocking_lock_cancel(files_struct *fsp,
 		return False;
 	}
 
+	/* The caller cancels the PENDING lock we were queued on. */
+	if (blr->extra_pending) {
+		struct byte_range_lock *br_lck = brl_get_locks(NULL, fsp);
+
+		if (br_lck) {
+			cancel_extra_pending_lock(br_lck, blr);
+			TALLOC_FREE(br_lck);
+		}
+	}
+
 	/* Move to cancelled queue. */
 	DLIST_REMOVE(blocking_lock_queue, blr);
 	DLIST_ADD(blocking_lock_cancelled_queue, blr);
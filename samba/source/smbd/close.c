@@ -278,6 +278,8 @@ static NTSTATUS close_remove_share_mode(files_struct *fsp,
 		goto done;
 	}
 
+	dir_index_prepare(conn, fsp->fsp_name);
+
 	if (SMB_VFS_UNLINK(conn,fsp->fsp_name) != 0) {
 		/*
 		 * This call can potentially fail as another smbd may
@@ -390,6 +392,11 @@ static NTSTATUS close_normal_file(files_struct *fsp, enum file_close_type close_
 		set_filetime(conn, fsp->fsp_name, fsp->last_write_time);
 	}
 
+	/* Listings may have cached the size and times we just changed. */
+	if (fsp->modified) {
+		dir_stat_cache_notify(conn, fsp->fsp_name);
+	}
+
 	if (NT_STATUS_IS_OK(status)) {
 		if (!NT_STATUS_IS_OK(saved_status1)) {
 			status = saved_status1;
@@ -64,6 +64,30 @@ BOOL conn_snum_used(int snum)
 	return(False);
 }
 
+/****************************************************************************
+ Return the smallest "min receivefile size" of any open connection, or 0 if
+ no connected share can use recvfile.
+****************************************************************************/
+
+size_t conn_min_receivefile_size(void)
+{
+	connection_struct *conn;
+	size_t min_size = 0;
+
+	for (conn=Connections;conn;conn=conn->next) {
+		size_t size;
+
+		if (IS_IPC(conn) || IS_PRINT(conn)) {
+			continue;
+		}
+		size = (size_t)lp_min_receivefile_size(SNUM(conn));
+		if (size && (min_size == 0 || size < min_size)) {
+			min_size = size;
+		}
+	}
+	return min_size;
+}
+
 
 /****************************************************************************
 find a conn given a cnum
@@ -259,6 +283,9 @@ void conn_free_internal(connection_struct *conn)
  	TALLOC_CTX *mem_ctx = NULL;
 	struct trans_state *state = NULL;
 
+	/* Charge the request that is closing us while we still exist. */
+	iostats_conn_closed(conn);
+
 	/* Free vfs_connection_struct */
 	handle = conn->vfs_handles;
 	while(handle) {
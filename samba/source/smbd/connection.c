@@ -29,7 +29,7 @@ static TDB_CONTEXT *tdb;
 TDB_CONTEXT *conn_tdb_ctx(void)
 {
 	if (!tdb)
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_DEFAULT, 
+		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_CLEAR_IF_FIRST|TDB_VOLATILE, 
 			       O_RDWR | O_CREAT, 0644);
 
 	return tdb;
@@ -228,6 +228,11 @@ BOOL claim_connection(connection_struct *conn, const char *name,int max_connecti
 		return False;
 	}
 
+	/* message_send_all() finds us through this, not connections.tdb */
+	if (!conn) {
+		message_set_bcast_flags(msg_flags);
+	}
+
 	return True;
 }
 
@@ -269,6 +274,8 @@ BOOL register_message_flags(BOOL doreg, uint32 msg_flags)
 	DEBUG(10,("register_message_flags: new flags 0x%x\n",
 		(unsigned int)pcrec->bcast_msg_flags ));
 
+	message_set_bcast_flags(pcrec->bcast_msg_flags);
+
 	SAFE_FREE(dbuf.dptr);
 	return True;
 }
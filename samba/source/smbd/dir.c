@@ -47,6 +47,42 @@ struct smb_Dir {
 	struct name_cache_entry *name_cache;
 	unsigned int name_cache_index;
 	unsigned int file_number;
+	struct dir_stat_cache *stat_cache;
+	BOOL stat_cache_tried;
+};
+
+/*
+ * Stat and DOS attribute results of a directory listing, kept for
+ * "directory stat cache time" seconds so that the enumerations clients
+ * issue back to back (Explorer does several when opening a folder)
+ * don't stat every entry again. Shared by all searches of the same
+ * directory on a connection and dropped when the directory's mtime
+ * changes or notify_fname() reports a change in it.
+ */
+
+#define DIR_STAT_CACHE_SLOTS 1024
+#define DIR_STAT_CACHE_MAX_DIRS 8
+#define DIR_STAT_CACHE_MAX_ENTRIES 65536
+
+struct dir_stat_entry {
+	struct dir_stat_entry *next;
+	unsigned int hash;
+	SMB_STRUCT_STAT st;
+	uint32 mode;
+	char name[1];
+};
+
+struct dir_stat_cache {
+	struct dir_stat_cache *next, *prev;
+	connection_struct *conn;
+	SMB_DEV_T dev;
+	SMB_INO_T ino;
+	struct timespec mtime;
+	time_t expires;
+	int refcount;			/* smb_Dirs using us */
+	BOOL linked;			/* still findable */
+	unsigned int num_entries;
+	struct dir_stat_entry *slots[DIR_STAT_CACHE_SLOTS];
 };
 
 struct dptr_struct {
@@ -66,6 +102,12 @@ struct dptr_struct {
 static struct bitmap *dptr_bmap;
 static struct dptr_struct *dirptrs;
 static int dirhandles_open = 0;
+static struct dir_stat_cache *dir_stat_caches;
+static int num_dir_stat_caches;
+
+static void dir_stat_cache_unlink(struct dir_stat_cache *c);
+static void dir_stat_cache_release(struct dir_stat_cache *c);
+static struct dir_stat_cache *dir_stat_cache_attach(struct smb_Dir *dirp);
 
 #define INVALID_DPTR_KEY (-3)
 
@@ -300,11 +342,20 @@ void dptr_close(int *key)
 void dptr_closecnum(connection_struct *conn)
 {
 	struct dptr_struct *dptr, *next;
+	struct dir_stat_cache *c, *cnext;
+
 	for(dptr = dirptrs; dptr; dptr = next) {
 		next = dptr->next;
 		if (dptr->conn == conn)
 			dptr_close_internal(dptr);
 	}
+
+	for (c = dir_stat_caches; c; c = cnext) {
+		cnext = c->next;
+		if (c->conn == conn) {
+			dir_stat_cache_unlink(c);
+		}
+	}
 }
 
 /****************************************************************************
@@ -706,6 +757,96 @@ void dptr_DirCacheAdd(struct dptr_struct *dptr, const char *name, long offset)
 	DirCacheAdd(dptr->dir_hnd, name, offset);
 }
 
+/****************************************************************************
+ Find a usable stat cache for a directory being searched.
+****************************************************************************/
+
+static struct dir_stat_cache *dptr_stat_cache(struct dptr_struct *dptr)
+{
+	struct smb_Dir *dirp = dptr->dir_hnd;
+	struct dir_stat_cache *c;
+
+	if (!dirp->stat_cache_tried) {
+		dirp->stat_cache_tried = True;
+		dirp->stat_cache = dir_stat_cache_attach(dirp);
+	}
+
+	c = dirp->stat_cache;
+	if (c == NULL || !c->linked) {
+		return NULL;
+	}
+	if (c->expires <= time(NULL)) {
+		dir_stat_cache_unlink(c);
+		return NULL;
+	}
+	return c;
+}
+
+static unsigned int dir_stat_hash(const char *name)
+{
+	TDB_DATA kbuf;
+
+	kbuf.dptr = CONST_DISCARD(char *, name);
+	kbuf.dsize = 0;
+	return fast_string_hash(&kbuf);
+}
+
+/****************************************************************************
+ Get the stat and DOS attributes of a directory entry from an earlier
+ listing, if we have them.
+****************************************************************************/
+
+BOOL dptr_get_cached_stat(struct dptr_struct *dptr, const char *name,
+			  SMB_STRUCT_STAT *pst, uint32 *pmode)
+{
+	struct dir_stat_cache *c = dptr_stat_cache(dptr);
+	struct dir_stat_entry *e;
+	unsigned int hash;
+
+	if (c == NULL) {
+		return False;
+	}
+
+	hash = dir_stat_hash(name);
+	for (e = c->slots[hash % DIR_STAT_CACHE_SLOTS]; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->name, name) == 0) {
+			*pst = e->st;
+			*pmode = e->mode;
+			return True;
+		}
+	}
+	return False;
+}
+
+/****************************************************************************
+ Remember the stat and DOS attributes of a directory entry.
+****************************************************************************/
+
+void dptr_cache_stat(struct dptr_struct *dptr, const char *name,
+		     const SMB_STRUCT_STAT *pst, uint32 mode)
+{
+	struct dir_stat_cache *c = dptr_stat_cache(dptr);
+	struct dir_stat_entry *e;
+	size_t len = strlen(name);
+
+	if (c == NULL || c->num_entries >= DIR_STAT_CACHE_MAX_ENTRIES) {
+		return;
+	}
+
+	e = (struct dir_stat_entry *)talloc_size(c, sizeof(*e) + len);
+	if (e == NULL) {
+		return;
+	}
+
+	e->hash = dir_stat_hash(name);
+	e->st = *pst;
+	e->mode = mode;
+	memcpy(e->name, name, len + 1);
+	e->next = c->slots[e->hash % DIR_STAT_CACHE_SLOTS];
+	c->slots[e->hash % DIR_STAT_CACHE_SLOTS] = e;
+	c->num_entries++;
+}
+
 /****************************************************************************
  Fill the 5 byte server reserved dptr field.
 ****************************************************************************/
@@ -1093,6 +1234,134 @@ BOOL is_visible_file(connection_struct *conn, const char *dir_path, const char *
 	return True;
 }
 
+/*******************************************************************
+ Make a directory stat cache unfindable, freeing it once no search
+ is using it.
+********************************************************************/
+
+static void dir_stat_cache_unlink(struct dir_stat_cache *c)
+{
+	if (c->linked) {
+		DLIST_REMOVE(dir_stat_caches, c);
+		c->linked = False;
+		num_dir_stat_caches--;
+	}
+	if (c->refcount == 0) {
+		TALLOC_FREE(c);
+	}
+}
+
+static void dir_stat_cache_release(struct dir_stat_cache *c)
+{
+	if (--c->refcount == 0 && !c->linked) {
+		TALLOC_FREE(c);
+	}
+}
+
+/*******************************************************************
+ Find or create the stat cache for a directory handle.
+********************************************************************/
+
+static struct dir_stat_cache *dir_stat_cache_attach(struct smb_Dir *dirp)
+{
+	connection_struct *conn = dirp->conn;
+	int ttl = lp_directory_stat_cache_time(SNUM(conn));
+	struct dir_stat_cache *c, *next;
+	struct timespec mtime;
+	SMB_STRUCT_STAT st;
+	time_t now;
+
+	if (ttl <= 0 || dirp->dir == NULL) {
+		return NULL;
+	}
+
+	if (SMB_VFS_STAT(conn, dirp->dir_path, &st) != 0) {
+		return NULL;
+	}
+	mtime = get_mtimespec(&st);
+	now = time(NULL);
+
+	for (c = dir_stat_caches; c; c = next) {
+		next = c->next;
+		if (c->expires <= now) {
+			dir_stat_cache_unlink(c);
+			continue;
+		}
+		if (c->conn != conn || c->dev != st.st_dev ||
+		    c->ino != st.st_ino) {
+			continue;
+		}
+		if (timespec_compare(&mtime, &c->mtime) != 0) {
+			/* Entries were added or removed. */
+			dir_stat_cache_unlink(c);
+			break;
+		}
+		c->refcount++;
+		return c;
+	}
+
+	c = TALLOC_ZERO_P(NULL, struct dir_stat_cache);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->conn = conn;
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->mtime = mtime;
+	c->expires = now + ttl;
+	c->refcount = 1;
+
+	while (num_dir_stat_caches >= DIR_STAT_CACHE_MAX_DIRS) {
+		struct dir_stat_cache *oldest = dir_stat_caches;
+
+		while (oldest->next) {
+			oldest = oldest->next;
+		}
+		dir_stat_cache_unlink(oldest);
+	}
+
+	DLIST_ADD(dir_stat_caches, c);
+	c->linked = True;
+	num_dir_stat_caches++;
+	return c;
+}
+
+/*******************************************************************
+ Something in the directory holding path changed. Forget what we
+ know about it.
+********************************************************************/
+
+void dir_stat_cache_notify(connection_struct *conn, const char *path)
+{
+	struct dir_stat_cache *c, *next;
+	SMB_STRUCT_STAT st;
+	pstring dir;
+	char *p;
+
+	if (dir_stat_caches == NULL) {
+		return;
+	}
+
+	pstrcpy(dir, path);
+	p = strrchr_m(dir, '/');
+	if (p != NULL) {
+		*p = '\0';
+	} else {
+		pstrcpy(dir, ".");
+	}
+
+	if (SMB_VFS_STAT(conn, dir, &st) != 0) {
+		return;
+	}
+
+	for (c = dir_stat_caches; c; c = next) {
+		next = c->next;
+		if (c->dev == st.st_dev && c->ino == st.st_ino) {
+			dir_stat_cache_unlink(c);
+		}
+	}
+}
+
 /*******************************************************************
  Open a directory.
 ********************************************************************/
@@ -1180,6 +1449,9 @@ int CloseDir(struct smb_Dir *dirp)
 		}
 	}
 	SAFE_FREE(dirp->name_cache);
+	if (dirp->stat_cache) {
+		dir_stat_cache_release(dirp->stat_cache);
+	}
 	SAFE_FREE(dirp);
 	dirhandles_open--;
 	return ret;
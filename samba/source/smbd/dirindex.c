@@ -0,0 +1,672 @@
+/*
+   Unix SMB/CIFS implementation.
+   Case insensitive name index for large directories
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * On a case sensitive filesystem shared case insensitively, a name
+ * whose exact case doesn't exist can only be resolved by reading the
+ * whole directory (see scan_directory()). For big directories that
+ * makes every create of a new file O(n).
+ *
+ * When scan_directory() has to read a directory with at least
+ * DIR_INDEX_MIN_NAMES entries it builds an index of the upper cased
+ * names, so that later lookups in that directory, found or not, are a
+ * hash lookup. An index is kept coherent in one of two ways:
+ *
+ *  - with inotify, a watch on the directory reports every name added
+ *    or removed by anyone. Pending events are applied before each use.
+ *
+ *  - otherwise the directory mtime is remembered and the index is
+ *    thrown away when it changes. Our own creates, renames and
+ *    deletes (see notify_fname()) update the index and the remembered
+ *    mtime, so a client filling a directory doesn't cause rebuilds.
+ *    That is only safe if nobody else changed the directory first, so
+ *    dir_index_prepare() checks the mtime just before each of them.
+ */
+
+#include "includes.h"
+
+#ifdef HAVE_INOTIFY
+#ifdef HAVE_INOTIFY_INIT
+#include <sys/inotify.h>
+#else
+#undef HAVE_INOTIFY
+#endif
+#endif
+
+#define DIR_INDEX_MIN_NAMES 256
+#define DIR_INDEX_MAX_DIRS 16
+#define DIR_INDEX_MAX_NAMES (1024*1024)
+
+struct dir_index_name {
+	struct dir_index_name *next;
+	unsigned int hash;
+	BOOL ambiguous;		/* more than one name folds to key */
+	char *key;		/* upper cased */
+	char name[1];		/* as on disk */
+};
+
+struct dir_index {
+	struct dir_index *prev, *next;	/* most recently used first */
+	SMB_DEV_T dev;
+	SMB_INO_T ino;
+	struct timespec mtime;
+	BOOL prepared;			/* mtime checked before our change */
+	int wd;				/* inotify watch, or -1 */
+	unsigned int num_slots;
+	unsigned int num_names;
+	struct dir_index_name **slots;
+};
+
+static struct dir_index *dir_indexes;
+static unsigned int num_dir_indexes;
+static unsigned int num_dir_index_names;
+
+#ifdef HAVE_INOTIFY
+static int dir_index_inotify_fd = -1;
+static BOOL dir_index_inotify_failed;
+#endif
+
+/****************************************************************************
+ Hash an upper cased name.
+****************************************************************************/
+
+static unsigned int dir_index_hash(const char *key)
+{
+	TDB_DATA kbuf;
+
+	kbuf.dptr = CONST_DISCARD(char *, key);
+	kbuf.dsize = 0;
+	return fast_string_hash(&kbuf);
+}
+
+static struct dir_index_name **dir_index_find(struct dir_index *idx,
+					      const char *key,
+					      unsigned int hash)
+{
+	struct dir_index_name **pn;
+
+	for (pn = &idx->slots[hash % idx->num_slots]; *pn; pn = &(*pn)->next) {
+		if ((*pn)->hash == hash && strcmp((*pn)->key, key) == 0) {
+			break;
+		}
+	}
+	return pn;
+}
+
+/****************************************************************************
+ Add an on disk name to an index.
+****************************************************************************/
+
+static BOOL dir_index_add_name(struct dir_index *idx, const char *name)
+{
+	struct dir_index_name **pn, *n;
+	size_t len = strlen(name);
+	unsigned int hash;
+	pstring key;
+
+	pstrcpy(key, name);
+	strupper_m(key);
+	hash = dir_index_hash(key);
+
+	pn = dir_index_find(idx, key, hash);
+	if (*pn != NULL) {
+		if (strcmp((*pn)->name, name) != 0) {
+			(*pn)->ambiguous = True;
+		}
+		return True;
+	}
+
+	n = (struct dir_index_name *)SMB_MALLOC(sizeof(*n) + len + 1 +
+						 strlen(key) + 1);
+	if (n == NULL) {
+		return False;
+	}
+	n->next = NULL;
+	n->hash = hash;
+	n->ambiguous = False;
+	memcpy(n->name, name, len + 1);
+	n->key = n->name + len + 1;
+	memcpy(n->key, key, strlen(key) + 1);
+
+	*pn = n;
+	idx->num_names++;
+	num_dir_index_names++;
+	return True;
+}
+
+/****************************************************************************
+ Remove an on disk name from an index. If other names fold to the same
+ key we can't tell which are left, so the key stays ambiguous.
+****************************************************************************/
+
+static void dir_index_remove_name(struct dir_index *idx, const char *name)
+{
+	struct dir_index_name **pn, *n;
+	pstring key;
+
+	pstrcpy(key, name);
+	strupper_m(key);
+
+	pn = dir_index_find(idx, key, dir_index_hash(key));
+	n = *pn;
+	if (n == NULL || n->ambiguous) {
+		return;
+	}
+
+	*pn = n->next;
+	SAFE_FREE(n);
+	idx->num_names--;
+	num_dir_index_names--;
+}
+
+static void dir_index_free(struct dir_index *idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < idx->num_slots; i++) {
+		struct dir_index_name *n, *next;
+
+		for (n = idx->slots[i]; n; n = next) {
+			next = n->next;
+			SAFE_FREE(n);
+		}
+	}
+	num_dir_index_names -= idx->num_names;
+
+#ifdef HAVE_INOTIFY
+	if (idx->wd != -1) {
+		inotify_rm_watch(dir_index_inotify_fd, idx->wd);
+	}
+#endif
+
+	if (dir_indexes != NULL) {
+		DLIST_REMOVE(dir_indexes, idx);
+	}
+	num_dir_indexes--;
+	SAFE_FREE(idx->slots);
+	SAFE_FREE(idx);
+}
+
+static void dir_index_free_all(void)
+{
+	while (dir_indexes != NULL) {
+		dir_index_free(dir_indexes);
+	}
+}
+
+#ifdef HAVE_INOTIFY
+
+/****************************************************************************
+ Apply the names added and removed since we last looked.
+****************************************************************************/
+
+static void dir_index_read_events(void)
+{
+	char buf[8192];
+	ssize_t len;
+
+	if (dir_index_inotify_fd == -1) {
+		return;
+	}
+
+	while ((len = read(dir_index_inotify_fd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+
+		while (p + sizeof(struct inotify_event) <= buf + len) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			struct dir_index *idx;
+
+			p += sizeof(*e) + e->len;
+
+			if (e->mask & IN_Q_OVERFLOW) {
+				DEBUG(3,("dir_index_read_events: event queue "
+					 "overflowed, dropping all indexes\n"));
+				dir_index_free_all();
+				continue;
+			}
+
+			for (idx = dir_indexes; idx; idx = idx->next) {
+				if (idx->wd == e->wd) {
+					break;
+				}
+			}
+			if (idx == NULL) {
+				continue;
+			}
+
+			if (e->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED)) {
+				if (e->mask & IN_IGNORED) {
+					idx->wd = -1;
+				}
+				dir_index_free(idx);
+				continue;
+			}
+
+			if (e->len == 0) {
+				continue;
+			}
+
+			if (e->mask & (IN_CREATE|IN_MOVED_TO)) {
+				if (!dir_index_add_name(idx, e->name)) {
+					dir_index_free(idx);
+				}
+			} else if (e->mask & (IN_DELETE|IN_MOVED_FROM)) {
+				dir_index_remove_name(idx, e->name);
+			}
+		}
+	}
+}
+
+/****************************************************************************
+ Watch a directory for names coming and going. Returns -1 if we can't,
+ in which case the index falls back to checking the directory mtime.
+****************************************************************************/
+
+static int dir_index_watch(const char *path)
+{
+	if (dir_index_inotify_fd == -1) {
+		if (dir_index_inotify_failed) {
+			return -1;
+		}
+		dir_index_inotify_fd = inotify_init();
+		if (dir_index_inotify_fd == -1) {
+			DEBUG(3,("dir_index_watch: inotify_init failed: %s\n",
+				 strerror(errno)));
+			dir_index_inotify_failed = True;
+			return -1;
+		}
+		set_blocking(dir_index_inotify_fd, False);
+	}
+
+	return inotify_add_watch(dir_index_inotify_fd, path,
+				 IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|
+				 IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+}
+
+#else
+
+static void dir_index_read_events(void)
+{
+}
+
+static int dir_index_watch(const char *path)
+{
+	return -1;
+}
+
+#endif
+
+/****************************************************************************
+ Find the index for the directory with the given stat, dropping it if
+ it can't be trusted any more.
+****************************************************************************/
+
+static struct dir_index *dir_index_get(const SMB_STRUCT_STAT *pst)
+{
+	struct dir_index *idx;
+
+	for (idx = dir_indexes; idx; idx = idx->next) {
+		if (idx->dev == pst->st_dev && idx->ino == pst->st_ino) {
+			break;
+		}
+	}
+	if (idx == NULL) {
+		return NULL;
+	}
+
+	if (idx->wd == -1) {
+		struct timespec mtime = get_mtimespec(pst);
+
+		if (timespec_compare(&mtime, &idx->mtime) != 0) {
+			DEBUG(10,("dir_index_get: directory changed, dropping "
+				  "index\n"));
+			dir_index_free(idx);
+			return NULL;
+		}
+	}
+
+	DLIST_PROMOTE(dir_indexes, idx);
+	return idx;
+}
+
+/****************************************************************************
+ Look a name up in the index of directory path, if there is one.
+ Returns False if there is no usable index, otherwise True with *found
+ saying whether the name exists and, if so, its on disk name in name.
+****************************************************************************/
+
+BOOL dir_index_lookup(connection_struct *conn, const char *path,
+		      char *name, size_t maxlength, BOOL *found)
+{
+	struct dir_index *idx;
+	struct dir_index_name *n;
+	SMB_STRUCT_STAT st;
+	pstring key;
+
+	dir_index_read_events();
+
+	if (dir_indexes == NULL) {
+		return False;
+	}
+
+	if (SMB_VFS_STAT(conn, path, &st) != 0) {
+		return False;
+	}
+
+	idx = dir_index_get(&st);
+	if (idx == NULL) {
+		return False;
+	}
+
+	pstrcpy(key, name);
+	strupper_m(key);
+
+	n = *dir_index_find(idx, key, dir_index_hash(key));
+	if (n != NULL && n->ambiguous) {
+		/* Let the directory scan decide. */
+		return False;
+	}
+
+	*found = (n != NULL);
+	if (n != NULL) {
+		safe_strcpy(name, n->name, maxlength);
+	}
+
+	DEBUG(10,("dir_index_lookup: %s/%s %s\n", path, key,
+		  *found ? "found" : "not found"));
+	return True;
+}
+
+/****************************************************************************
+ Start building an index for directory path while it is being scanned.
+ Returns NULL if this directory isn't worth indexing.
+****************************************************************************/
+
+struct dir_index *dir_index_start(connection_struct *conn, const char *path)
+{
+	struct dir_index *idx;
+	SMB_STRUCT_STAT st;
+
+	if (!lp_stat_cache() || conn->case_sensitive) {
+		return NULL;
+	}
+
+	if (SMB_VFS_STAT(conn, path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		return NULL;
+	}
+
+	/* Already indexed, but the index couldn't answer. */
+	for (idx = dir_indexes; idx; idx = idx->next) {
+		if (idx->dev == st.st_dev && idx->ino == st.st_ino) {
+			return NULL;
+		}
+	}
+
+	idx = SMB_MALLOC_P(struct dir_index);
+	if (idx == NULL) {
+		return NULL;
+	}
+	ZERO_STRUCTP(idx);
+
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->mtime = get_mtimespec(&st);
+	idx->wd = -1;
+	idx->num_slots = 1021;
+	idx->slots = SMB_CALLOC_ARRAY(struct dir_index_name *, idx->num_slots);
+	if (idx->slots == NULL) {
+		SAFE_FREE(idx);
+		return NULL;
+	}
+
+	num_dir_indexes++;
+	return idx;
+}
+
+/****************************************************************************
+ Add a name read while scanning. Returns False (and frees the index) if
+ the index had to be abandoned.
+****************************************************************************/
+
+BOOL dir_index_add(struct dir_index **pidx, const char *name)
+{
+	struct dir_index *idx = *pidx;
+
+	if (idx == NULL) {
+		return False;
+	}
+
+	if (num_dir_index_names >= DIR_INDEX_MAX_NAMES ||
+	    !dir_index_add_name(idx, name)) {
+		dir_index_free(idx);
+		*pidx = NULL;
+		return False;
+	}
+
+	/* Keep the chains short. */
+	if (idx->num_names > idx->num_slots * 2) {
+		struct dir_index_name **slots;
+		unsigned int num_slots = idx->num_slots * 4 + 1;
+		unsigned int i;
+
+		slots = SMB_CALLOC_ARRAY(struct dir_index_name *, num_slots);
+		if (slots != NULL) {
+			for (i = 0; i < idx->num_slots; i++) {
+				struct dir_index_name *n, *next;
+
+				for (n = idx->slots[i]; n; n = next) {
+					next = n->next;
+					n->next = slots[n->hash % num_slots];
+					slots[n->hash % num_slots] = n;
+				}
+			}
+			SAFE_FREE(idx->slots);
+			idx->slots = slots;
+			idx->num_slots = num_slots;
+		}
+	}
+	return True;
+}
+
+/****************************************************************************
+ The whole of directory path has been read into the index. Keep it if
+ the directory is big enough to be worth it and didn't change while we
+ were reading it.
+****************************************************************************/
+
+void dir_index_finish(connection_struct *conn, struct dir_index *idx,
+		      const char *path)
+{
+	SMB_STRUCT_STAT st;
+	struct timespec mtime;
+
+	if (idx == NULL) {
+		return;
+	}
+
+	if (idx->num_names < DIR_INDEX_MIN_NAMES) {
+		dir_index_free(idx);
+		return;
+	}
+
+	idx->wd = dir_index_watch(path);
+
+	if (SMB_VFS_STAT(conn, path, &st) != 0) {
+		dir_index_free(idx);
+		return;
+	}
+	mtime = get_mtimespec(&st);
+	if (st.st_dev != idx->dev || st.st_ino != idx->ino ||
+	    timespec_compare(&mtime, &idx->mtime) != 0) {
+		DEBUG(10,("dir_index_finish: %s changed while being read\n",
+			  path));
+		dir_index_free(idx);
+		return;
+	}
+
+	/*
+	 * Without a watch we rely on the mtime, which on filesystems with
+	 * one second timestamps can't show a change made in the same
+	 * second as the one we saw. Only trust those once they are quiet.
+	 */
+	if (idx->wd == -1 && mtime.tv_nsec == 0 &&
+	    mtime.tv_sec + 1 >= time(NULL)) {
+		dir_index_free(idx);
+		return;
+	}
+
+	while (num_dir_indexes > DIR_INDEX_MAX_DIRS && dir_indexes != NULL) {
+		struct dir_index *last = dir_indexes;
+
+		while (last->next) {
+			last = last->next;
+		}
+		dir_index_free(last);
+	}
+
+	DLIST_ADD(dir_indexes, idx);
+
+	DEBUG(5,("dir_index_finish: indexed %u names in %s%s\n",
+		 idx->num_names, path,
+		 idx->wd != -1 ? " (watched)" : ""));
+}
+
+/****************************************************************************
+ Find the unwatched index of the directory path is in, and its stat.
+ Sets *pname to the last component of path.
+****************************************************************************/
+
+static struct dir_index *dir_index_parent(connection_struct *conn,
+					  const char *path,
+					  SMB_STRUCT_STAT *pst,
+					  const char **pname)
+{
+	struct dir_index *idx;
+	pstring dir;
+	char *p;
+
+	pstrcpy(dir, path);
+	p = strrchr_m(dir, '/');
+	if (p != NULL) {
+		*p = '\0';
+		*pname = path + (p - dir) + 1;
+	} else {
+		pstrcpy(dir, ".");
+		*pname = path;
+	}
+
+	if (SMB_VFS_STAT(conn, dir, pst) != 0) {
+		return NULL;
+	}
+
+	for (idx = dir_indexes; idx; idx = idx->next) {
+		if (idx->dev == pst->st_dev && idx->ino == pst->st_ino) {
+			break;
+		}
+	}
+	if (idx == NULL || idx->wd != -1) {
+		return NULL;
+	}
+	return idx;
+}
+
+/****************************************************************************
+ Called just before this smbd creates, removes or renames path. An
+ unwatched index may only take the directory mtime our change leaves if
+ it was still current before it, otherwise someone else's change would
+ be absorbed.
+****************************************************************************/
+
+void dir_index_prepare(connection_struct *conn, const char *path)
+{
+	struct dir_index *idx;
+	SMB_STRUCT_STAT st;
+	struct timespec mtime;
+	const char *name;
+
+	if (dir_indexes == NULL) {
+		return;
+	}
+
+	idx = dir_index_parent(conn, path, &st, &name);
+	if (idx == NULL) {
+		return;
+	}
+
+	mtime = get_mtimespec(&st);
+	if (timespec_compare(&mtime, &idx->mtime) != 0) {
+		DEBUG(10,("dir_index_prepare: directory changed, dropping "
+			  "index\n"));
+		dir_index_free(idx);
+		return;
+	}
+
+	idx->prepared = True;
+}
+
+/****************************************************************************
+ Called through notify_fname() for changes made by this smbd. Indexes
+ that are watched see these changes through inotify, the rest are
+ updated here so that our own changes don't invalidate them.
+****************************************************************************/
+
+void dir_index_notify(connection_struct *conn, uint32 action,
+		      const char *path)
+{
+	struct dir_index *idx;
+	SMB_STRUCT_STAT st;
+	struct timespec mtime;
+	const char *name;
+
+	if (dir_indexes == NULL) {
+		return;
+	}
+
+	if (action != NOTIFY_ACTION_ADDED &&
+	    action != NOTIFY_ACTION_REMOVED &&
+	    action != NOTIFY_ACTION_OLD_NAME &&
+	    action != NOTIFY_ACTION_NEW_NAME) {
+		return;
+	}
+
+	idx = dir_index_parent(conn, path, &st, &name);
+	if (idx == NULL) {
+		return;
+	}
+
+	mtime = get_mtimespec(&st);
+	if (timespec_compare(&mtime, &idx->mtime) != 0) {
+		if (!idx->prepared) {
+			/* Nobody checked the mtime before the change. */
+			dir_index_free(idx);
+			return;
+		}
+		idx->mtime = mtime;
+	}
+	idx->prepared = False;
+
+	if (action == NOTIFY_ACTION_ADDED || action == NOTIFY_ACTION_NEW_NAME) {
+		if (!dir_index_add_name(idx, name)) {
+			dir_index_free(idx);
+			return;
+		}
+	} else {
+		dir_index_remove_name(idx, name);
+	}
+}
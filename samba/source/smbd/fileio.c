@@ -25,26 +25,89 @@
 static BOOL setup_write_cache(files_struct *, SMB_OFF_T);
 
 /****************************************************************************
- Read from write cache if we can.
+ Does the write cache hold any data for the given range ?
+****************************************************************************/
+
+BOOL write_cache_range_dirty(files_struct *fsp, SMB_OFF_T pos, size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+
+	if (!wcp) {
+		return False;
+	}
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		if (ext->offset + (SMB_OFF_T)ext->data_size > pos) {
+			return True;
+		}
+	}
+	return False;
+}
+
+/****************************************************************************
+ Read from write cache if we can. If the range is entirely cached we copy
+ it out and return True. Otherwise the caller reads from disk and then calls
+ overlay_write_cache() to get the dirty parts.
 ****************************************************************************/
 
 static BOOL read_from_write_cache(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 {
 	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
 
 	if(!wcp) {
 		return False;
 	}
 
-	if( n > wcp->data_size || pos < wcp->offset || pos + n > wcp->offset + wcp->data_size) {
-		return False;
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset > pos) {
+			break;
+		}
+		if (pos + (SMB_OFF_T)n <= ext->offset + (SMB_OFF_T)ext->data_size) {
+			memcpy(data, ext->data + (pos - ext->offset), n);
+			DO_PROFILE_INC(writecache_read_hits);
+			return True;
+		}
 	}
 
-	memcpy(data, wcp->data + (pos - wcp->offset), n);
+	return False;
+}
 
-	DO_PROFILE_INC(writecache_read_hits);
+/****************************************************************************
+ Copy any cached data within [pos, pos+n) over data just read from disk.
+ Returns the number of valid bytes in data, which can be more than was read
+ if the cache extends past what is on disk.
+****************************************************************************/
 
-	return True;
+static ssize_t overlay_write_cache(files_struct *fsp, char *data, SMB_OFF_T pos,
+				   size_t n, ssize_t nread)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T start, end;
+
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		start = MAX(pos, ext->offset);
+		end = MIN(pos + (SMB_OFF_T)n,
+			  ext->offset + (SMB_OFF_T)ext->data_size);
+		if (start >= end) {
+			continue;
+		}
+		memcpy(data + (start - pos), ext->data + (start - ext->offset),
+		       (size_t)(end - start));
+		if (end - pos > nread) {
+			nread = end - pos;
+		}
+	}
+	return nread;
 }
 
 /****************************************************************************
@@ -67,11 +130,10 @@ ssize_t read_file(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 	if(read_from_write_cache(fsp, data, pos, n)) {
 		fsp->fh->pos = pos + n;
 		fsp->fh->position_information = fsp->fh->pos;
+		IOSTATS_ADD_READ(fsp->conn, n);
 		return n;
 	}
 
-	flush_write_cache(fsp, READ_FLUSH);
-
 	fsp->fh->pos = pos;
 
 	if (n > 0) {
@@ -99,6 +161,15 @@ tryagain:
 		if (readret > 0) {
 			ret += readret;
 		}
+
+		/*
+		 * Pick up any cached data in the range. The disk copy is
+		 * stale there.
+		 */
+
+		if (fsp->wcp) {
+			ret = overlay_write_cache(fsp, data, pos, n, ret);
+		}
 	}
 
 	DEBUG(10,("read_file (%s): pos = %.0f, size = %lu, returned %lu\n",
@@ -107,6 +178,7 @@ tryagain:
 	fsp->fh->pos += ret;
 	fsp->fh->position_information = fsp->fh->pos;
 
+	IOSTATS_ADD_READ(fsp->conn, ret);
 	return(ret);
 }
 
@@ -115,6 +187,8 @@ static unsigned int allocated_write_caches;
 
 /****************************************************************************
  *Really* write to a file.
+ A NULL data pointer means the data is still in the client socket and is
+ moved into the file with recvfile.
 ****************************************************************************/
 
 static ssize_t real_write_file(files_struct *fsp,const char *data, SMB_OFF_T pos, size_t n)
@@ -122,6 +196,11 @@ static ssize_t real_write_file(files_struct *fsp,const char *data, SMB_OFF_T pos
 	ssize_t ret;
 
         if (pos == -1) {
+		if (data == NULL) {
+			/* recvfile needs an offset. */
+			errno = EINVAL;
+			return -1;
+		}
                 ret = vfs_write_data(fsp, data, n);
         } else {
 		fsp->fh->pos = pos;
@@ -130,7 +209,11 @@ static ssize_t real_write_file(files_struct *fsp,const char *data, SMB_OFF_T pos
 				return -1;
 			}
 		}
-                ret = vfs_pwrite_data(fsp, data, n, pos);
+		if (data == NULL) {
+			ret = vfs_recvfile_data(fsp, n, pos);
+		} else {
+			ret = vfs_pwrite_data(fsp, data, n, pos);
+		}
 	}
 
 	DEBUG(10,("real_write_file (%s): pos = %.0f, size = %lu, returned %ld\n",
@@ -169,17 +252,22 @@ static ssize_t real_write_file(files_struct *fsp,const char *data, SMB_OFF_T pos
 	return ret;
 }
 
+/* all write caches, and the bytes they hold, in this smbd */
+static write_cache *write_caches;
+static size_t write_cache_bytes;
+static struct idle_event *write_cache_idle_event;
+
 /****************************************************************************
  File size cache change.
  Updates size on disk but doesn't flush the cache.
 ****************************************************************************/
 
-static int wcp_file_size_change(files_struct *fsp)
+static int wcp_file_size_change(files_struct *fsp, SMB_OFF_T new_size)
 {
 	int ret;
 	write_cache *wcp = fsp->wcp;
 
-	wcp->file_size = wcp->offset + wcp->data_size;
+	wcp->file_size = new_size;
 	ret = SMB_VFS_FTRUNCATE(fsp, fsp->fh->fd, wcp->file_size);
 	if (ret == -1) {
 		DEBUG(0,("wcp_file_size_change (%s): ftruncate of size %.0f error %s\n",
@@ -188,6 +276,233 @@ static int wcp_file_size_change(files_struct *fsp)
 	return ret;
 }
 
+/****************************************************************************
+ Free an extent and account for it.
+****************************************************************************/
+
+static void free_write_cache_extent(write_cache *wcp,
+				    struct write_cache_extent *ext)
+{
+	DLIST_REMOVE(wcp->extents, ext);
+	wcp->data_size -= ext->data_size;
+	write_cache_bytes -= ext->data_size;
+	DO_PROFILE_DEC(writecache_num_write_caches);
+	SAFE_FREE(ext->data);
+	SAFE_FREE(ext);
+}
+
+/****************************************************************************
+ Write new data over any cached data in [pos, pos+n). Used after a direct
+ write so the cache never holds anything older than the disk.
+****************************************************************************/
+
+static void update_write_cache(write_cache *wcp, const char *data,
+			       SMB_OFF_T pos, size_t n)
+{
+	struct write_cache_extent *ext;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T start, end;
+
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		start = MAX(pos, ext->offset);
+		end = MIN(pos + (SMB_OFF_T)n,
+			  ext->offset + (SMB_OFF_T)ext->data_size);
+		if (start < end) {
+			memcpy(ext->data + (start - ext->offset),
+			       data + (start - pos), (size_t)(end - start));
+		}
+	}
+}
+
+/****************************************************************************
+ How many more bytes would the cache hold after adding [pos, pos+n) ?
+****************************************************************************/
+
+static size_t write_cache_growth(write_cache *wcp, SMB_OFF_T pos, size_t n)
+{
+	struct write_cache_extent *ext;
+	SMB_OFF_T start = pos;
+	SMB_OFF_T end = pos + n;
+	size_t old_bytes = 0;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T ext_end = ext->offset + (SMB_OFF_T)ext->data_size;
+
+		if (ext_end < pos) {
+			continue;
+		}
+		if (ext->offset > end) {
+			break;
+		}
+		start = MIN(start, ext->offset);
+		end = MAX(end, ext_end);
+		old_bytes += ext->data_size;
+	}
+
+	return (size_t)(end - start) - old_bytes;
+}
+
+/****************************************************************************
+ Add [pos, pos+n) to the cache, merging it with every extent it overlaps
+ or abutts. The caller has checked the budget. Returns False on malloc
+ failure, the cache is unchanged then.
+****************************************************************************/
+
+static BOOL write_cache_insert(write_cache *wcp, const char *data,
+			       SMB_OFF_T pos, size_t n)
+{
+	struct write_cache_extent *ext, *next, *first = NULL;
+	SMB_OFF_T start = pos;
+	SMB_OFF_T end = pos + n;
+	size_t old_bytes = 0;
+	size_t new_size, growth;
+	int merged = 0;
+	char *buf;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T ext_end = ext->offset + (SMB_OFF_T)ext->data_size;
+
+		if (ext_end < pos) {
+			continue;
+		}
+		if (ext->offset > end) {
+			break;
+		}
+		if (first == NULL) {
+			first = ext;
+		}
+		start = MIN(start, ext->offset);
+		end = MAX(end, ext_end);
+		old_bytes += ext->data_size;
+		merged++;
+	}
+
+	new_size = (size_t)(end - start);
+	growth = new_size - old_bytes;
+
+	if (merged == 0) {
+		/* A new extent. */
+		struct write_cache_extent *prev = NULL;
+
+		if ((ext = SMB_MALLOC_P(struct write_cache_extent)) == NULL) {
+			return False;
+		}
+		if ((ext->data = (char *)SMB_MALLOC(n)) == NULL) {
+			SAFE_FREE(ext);
+			return False;
+		}
+		ext->offset = pos;
+		ext->data_size = n;
+		memcpy(ext->data, data, n);
+
+		for (next = wcp->extents; next && next->offset < pos;
+		     next = next->next) {
+			prev = next;
+		}
+		DLIST_ADD_AFTER(wcp->extents, ext, prev);
+
+		DO_PROFILE_INC(writecache_init_writes);
+		DO_PROFILE_INC(writecache_num_write_caches);
+	} else if (merged == 1 && start == first->offset) {
+		/* Overwrite or append to a single extent - the common
+		   sequential case. */
+		if (new_size > first->data_size) {
+			if ((buf = (char *)SMB_REALLOC(first->data,
+						       new_size)) == NULL) {
+				return False;
+			}
+			first->data = buf;
+			first->data_size = new_size;
+		}
+		memcpy(first->data + (pos - first->offset), data, n);
+		DO_PROFILE_INC(writecache_abutted_writes);
+	} else {
+		/* Coalesce all touched extents into the first one. */
+		if ((buf = (char *)SMB_MALLOC(new_size)) == NULL) {
+			return False;
+		}
+		for (ext = first; merged--; ext = next) {
+			next = ext->next;
+			memcpy(buf + (ext->offset - start), ext->data,
+			       ext->data_size);
+			if (ext != first) {
+				free_write_cache_extent(wcp, ext);
+			}
+		}
+		wcp->data_size -= first->data_size;
+		write_cache_bytes -= first->data_size;
+		memcpy(buf + (pos - start), data, n);
+		SAFE_FREE(first->data);
+		first->data = buf;
+		first->offset = start;
+		first->data_size = new_size;
+		wcp->data_size += new_size;
+		write_cache_bytes += new_size;
+		DO_PROFILE_INC(writecache_abutted_writes);
+		return True;
+	}
+
+	wcp->data_size += growth;
+	write_cache_bytes += growth;
+	return True;
+}
+
+/****************************************************************************
+ Flush the least recently written cache other than wcp, to make room in
+ the per-smbd budget. Returns False if there was nothing to flush.
+****************************************************************************/
+
+static BOOL flush_oldest_write_cache(write_cache *wcp)
+{
+	write_cache *p, *oldest = NULL;
+
+	for (p = write_caches; p; p = p->next) {
+		if (p == wcp || p->data_size == 0) {
+			continue;
+		}
+		if (oldest == NULL || p->last_write < oldest->last_write) {
+			oldest = p;
+		}
+	}
+
+	if (oldest == NULL) {
+		return False;
+	}
+
+	flush_write_cache(oldest->fsp, WRITE_FLUSH);
+	return True;
+}
+
+/****************************************************************************
+ Idle handler. Write out the caches of files that haven't been written for
+ WRITE_CACHE_IDLE_TIMEOUT seconds, so dirty data doesn't sit in memory
+ while the client is doing something else.
+****************************************************************************/
+
+static BOOL write_cache_idle_flush(const struct timeval *now,
+				   void *private_data)
+{
+	write_cache *wcp, *next;
+
+	for (wcp = write_caches; wcp; wcp = next) {
+		next = wcp->next;
+		if (wcp->data_size &&
+		    now->tv_sec - wcp->last_write >= WRITE_CACHE_IDLE_TIMEOUT) {
+			flush_write_cache(wcp->fsp, IDLE_FLUSH);
+		}
+	}
+
+	if (write_caches == NULL) {
+		/* Returning False deletes the idle event. */
+		write_cache_idle_event = NULL;
+		return False;
+	}
+	return True;
+}
+
 /****************************************************************************
  Write to a file.
 ****************************************************************************/
@@ -195,8 +510,7 @@ static int wcp_file_size_change(files_struct *fsp)
 ssize_t write_file(files_struct *fsp, const char *data, SMB_OFF_T pos, size_t n)
 {
 	write_cache *wcp = fsp->wcp;
-	ssize_t total_written = 0;
-	int write_path = -1; 
+	ssize_t ret;
 
 	if (fsp->print_file) {
 		fstring sharename;
@@ -221,6 +535,8 @@ ssize_t write_file(files_struct *fsp, const char *data, SMB_OFF_T pos, size_t n)
 		SMB_STRUCT_STAT st;
 		fsp->modified = True;
 
+		dir_stat_cache_notify(fsp->conn, fsp->fsp_name);
+
 		if (SMB_VFS_FSTAT(fsp,fsp->fh->fd,&st) == 0) {
 			int dosmode = dos_mode(fsp->conn,fsp->fsp_name,&st);
 			if ((lp_store_dos_attributes(SNUM(fsp->conn)) || MAP_ARCHIVE(fsp->conn)) && !IS_DOS_ARCHIVE(dosmode)) {
@@ -270,443 +586,106 @@ nonop=%u allocated=%u active=%u direct=%u perfect=%u readhits=%u\n",
 			profile_p->writecache_num_perfect_writes,
 			profile_p->writecache_read_hits ));
 
-		DEBUG(3,("WRITECACHE: Flushes SEEK=%d, READ=%d, WRITE=%d, READRAW=%d, OPLOCK=%d, CLOSE=%d, SYNC=%d\n",
+		DEBUG(3,("WRITECACHE: Flushes SEEK=%d, READ=%d, WRITE=%d, READRAW=%d, OPLOCK=%d, CLOSE=%d, SYNC=%d, IDLE=%d\n",
 			profile_p->writecache_flushed_writes[SEEK_FLUSH],
 			profile_p->writecache_flushed_writes[READ_FLUSH],
 			profile_p->writecache_flushed_writes[WRITE_FLUSH],
 			profile_p->writecache_flushed_writes[READRAW_FLUSH],
 			profile_p->writecache_flushed_writes[OPLOCK_RELEASE_FLUSH],
 			profile_p->writecache_flushed_writes[CLOSE_FLUSH],
-			profile_p->writecache_flushed_writes[SYNC_FLUSH] ));
+			profile_p->writecache_flushed_writes[SYNC_FLUSH],
+			profile_p->writecache_flushed_writes[IDLE_FLUSH] ));
 	}
 #endif
 
-	if(!wcp) {
+	if(!wcp || data == NULL) {
 		DO_PROFILE_INC(writecache_direct_writes);
-		total_written = real_write_file(fsp, data, pos, n);
-		return total_written;
+		ret = real_write_file(fsp, data, pos, n);
+		if (ret > 0) {
+			IOSTATS_ADD_WRITE(fsp->conn, ret);
+		}
+		return ret;
 	}
 
-	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) wcp->offset=%.0f wcp->data_size=%u\n",
-		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size));
+	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) cached=%u\n",
+		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n,
+		(unsigned int)wcp->data_size));
 
-	fsp->fh->pos = pos + n;
+	wcp->last_write = time(NULL);
 
-	/* 
-	 * If we have active cache and it isn't contiguous then we flush.
-	 * NOTE: There is a small problem with running out of disk ....
+	/*
+	 * Try to cache the write. If this file is over its budget write
+	 * out what we have first. If the whole smbd is over budget push
+	 * out other files' data, least recently written first.
 	 */
 
-	if (wcp->data_size) {
-		BOOL cache_flush_needed = False;
-
-		if ((pos >= wcp->offset) && (pos <= wcp->offset + wcp->data_size)) {
-      
-			/* ASCII art.... JRA.
-
-      +--------------+-----
-      | Cached data  | Rest of allocated cache buffer....
-      +--------------+-----
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * Start of write overlaps or abutts the existing data.
-			 */
-
-			size_t data_used = MIN((wcp->alloc_size - (pos - wcp->offset)), n);
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
-
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
-			}
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 1;
-
-		} else if ((pos < wcp->offset) && (pos + n > wcp->offset) && 
-					(pos + n <= wcp->offset + wcp->alloc_size)) {
+	if (n <= wcp->alloc_size && n <= MAX_WRITE_CACHE_BYTES && pos != -1) {
+		size_t growth = write_cache_growth(wcp, pos, n);
 
-			/* ASCII art.... JRA.
-
-                        +---------------+
-                        | Cache buffer  |
-                        +---------------+
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * End of write overlaps the existing data.
-			 */
-
-			size_t data_used = pos + n - wcp->offset;
-
-			memcpy(wcp->data, data + n - data_used, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + n > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + n - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * We don't need to move the start of data, but we
-			 * cut down the amount left by the amount used.
-			 */
-
-			n -= data_used;
-
-			/*
-			 * We cannot have used all the data here.
-			 */
-
-			cache_flush_needed = True;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 2;
-
-		} else if ( (pos >= wcp->file_size) && 
-					(wcp->offset + wcp->data_size == wcp->file_size) &&
-					(pos > wcp->offset + wcp->data_size) && 
-					(pos < wcp->offset + wcp->alloc_size) ) {
-
-			/* ASCII art.... JRA.
-
-                       End of file ---->|
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                              +-------------------+
-                                              | Data to write     |
-                                              +-------------------+
-
-	    		*/
-
-			/*
-			 * Non-contiguous write part of which fits within
-			 * the cache buffer and is extending the file
-			 * and the cache contents reflect the current
-			 * data up to the current end of the file.
-			 */
-
-			size_t data_used;
-
-			if(pos + n <= wcp->offset + wcp->alloc_size) {
-				data_used = n;
-			} else {
-				data_used = wcp->offset + wcp->alloc_size - pos;
-			}
-
-			/*
-			 * Fill in the non-continuous area with zeros.
-			 */
-
-			memset(wcp->data + wcp->data_size, '\0',
-				pos - (wcp->offset + wcp->data_size) );
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
+		if (wcp->data_size + growth > wcp->alloc_size) {
+			DEBUG(9,("WRITE_FLUSH: cache full: fd = %d, pos = %.0f, "
+				 "n = %u, cached = %u\n", fsp->fh->fd,
+				 (double)pos, (unsigned int)n,
+				 (unsigned int)wcp->data_size ));
+			if (flush_write_cache(fsp, WRITE_FLUSH) == -1) {
+				return -1;
 			}
+			growth = n;
+		}
 
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
+		while (write_cache_bytes + growth > MAX_WRITE_CACHE_BYTES &&
+		       flush_oldest_write_cache(wcp)) {
+			;
+		}
 
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
+		if (write_cache_bytes + growth > MAX_WRITE_CACHE_BYTES) {
+			if (flush_write_cache(fsp, WRITE_FLUSH) == -1) {
+				return -1;
 			}
+		}
 
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 3;
-
-                } else if ( (pos >= wcp->file_size) &&
-			    (n == 1) &&
-			    (wcp->file_size == wcp->offset + wcp->data_size) &&
-			    (pos < wcp->file_size + wcp->alloc_size)) {
-
-                        /*
-
-                End of file ---->|
-
-                 +---------------+---------------+
-                 | Cached data   | Cache buffer  |
-                 +---------------+---------------+
-
-                                 |<------- allocated size ---------------->|
-
-                                                         +--------+
-                                                         | 1 Byte |
-                                                         +--------+
-
-			MS-Office seems to do this a lot to determine if there's enough
-			space on the filesystem to write a new file.
-
-			Change to :
-
-                End of file ---->|
-                                 +-----------------------+--------+
-                                 | Zeroed Cached data    | 1 Byte |
-                                 +-----------------------+--------+
-                        */
-
-			flush_write_cache(fsp, WRITE_FLUSH);
-			wcp->offset = wcp->file_size;
-			wcp->data_size = pos - wcp->file_size + 1;
-			memset(wcp->data, '\0', wcp->data_size);
-			memcpy(wcp->data + wcp->data_size-1, data, 1);
+		if (write_cache_insert(wcp, data, pos, n)) {
+			fsp->fh->pos = pos + n;
 
 			/*
 			 * Update the file size if changed.
 			 */
 
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
+			if (pos + (SMB_OFF_T)n > wcp->file_size) {
+				if (wcp_file_size_change(fsp, pos + n) == -1) {
 					return -1;
 				}
 			}
 
+			DEBUG(9,("write_file: cached %u bytes at %.0f, "
+				 "cache now %u bytes\n", (unsigned int)n,
+				 (double)pos, (unsigned int)wcp->data_size));
+			IOSTATS_ADD_WRITE(fsp->conn, n);
 			return n;
-
-		} else {
-
-			/* ASCII art..... JRA.
-
-   Case 1).
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                                              +-------------------+
-                                                              | Data to write     |
-                                                              +-------------------+
-
-   Case 2).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-   +-------------------+
-   | Data to write     |
-   +-------------------+
-
-    Case 3).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-                  +-----------------------------------------------------+
-                  | Data to write                                       |
-                  +-----------------------------------------------------+
-
-		  */
-
- 			/*
-			 * Write is bigger than buffer, or there is no overlap on the
-			 * low or high ends.
-			 */
-
-			DEBUG(9,("write_file: non cacheable write : fd = %d, pos = %.0f, len = %u, current cache pos = %.0f \
-len = %u\n",fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			/*
-			 * If write would fit in the cache, and is larger than
-			 * the data already in the cache, flush the cache and
-			 * preferentially copy the data new data into it. Otherwise
-			 * just write the data directly.
-			 */
-
-			if ( n <= wcp->alloc_size && n > wcp->data_size) {
-				cache_flush_needed = True;
-			} else {
-				ssize_t ret = real_write_file(fsp, data, pos, n);
-
-				/*
-				 * If the write overlaps the entire cache, then
-				 * discard the current contents of the cache.
-				 * Fix from Rasmus Borup Hansen rbh@math.ku.dk.
-				 */
-
-				if ((pos <= wcp->offset) &&
-						(pos + n >= wcp->offset + wcp->data_size) ) {
-					DEBUG(9,("write_file: discarding overwritten write \
-cache: fd = %d, off=%.0f, size=%u\n", fsp->fh->fd, (double)wcp->offset, (unsigned int)wcp->data_size ));
-					wcp->data_size = 0;
-				}
-
-				DO_PROFILE_INC(writecache_direct_writes);
-				if (ret == -1) {
-					return ret;
-				}
-
-				if (pos + ret > wcp->file_size) {
-					wcp->file_size = pos + ret;
-				}
-
-				return ret;
-			}
-
-			write_path = 4;
-
-		}
-
-		if (cache_flush_needed) {
-			DEBUG(3,("WRITE_FLUSH:%d: due to noncontinuous write: fd = %d, size = %.0f, pos = %.0f, \
-n = %u, wcp->offset=%.0f, wcp->data_size=%u\n",
-				write_path, fsp->fh->fd, (double)wcp->file_size, (double)pos, (unsigned int)n,
-				(double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			flush_write_cache(fsp, WRITE_FLUSH);
 		}
 	}
 
 	/*
-	 * If the write request is bigger than the cache
-	 * size, write it all out.
+	 * Too big for the cache. Write it out directly and update
+	 * anything cached in the same range so we never hand out stale
+	 * data.
 	 */
 
-	if (n > wcp->alloc_size ) {
-		ssize_t ret = real_write_file(fsp, data, pos, n);
-		if (ret == -1) {
-			return -1;
-		}
+	ret = real_write_file(fsp, data, pos, n);
+	DO_PROFILE_INC(writecache_direct_writes);
+	if (ret == -1) {
+		return -1;
+	}
 
+	if (pos != -1) {
+		update_write_cache(wcp, data, pos, ret);
 		if (pos + ret > wcp->file_size) {
-			wcp->file_size = pos + n;
+			wcp->file_size = pos + ret;
 		}
-
-		DO_PROFILE_INC(writecache_direct_writes);
-		return total_written + n;
 	}
 
-	/*
-	 * If there's any data left, cache it.
-	 */
-
-	if (n) {
-#ifdef WITH_PROFILE
-		if (wcp->data_size) {
-			DO_PROFILE_INC(writecache_abutted_writes);
-		} else {
-			DO_PROFILE_INC(writecache_init_writes);
-		}
-#endif
-		memcpy(wcp->data+wcp->data_size, data, n);
-		if (wcp->data_size == 0) {
-			wcp->offset = pos;
-			DO_PROFILE_INC(writecache_num_write_caches);
-		}
-		wcp->data_size += n;
-
-		/*
-		 * Update the file size if changed.
-		 */
-
-		if (wcp->offset + wcp->data_size > wcp->file_size) {
-			if (wcp_file_size_change(fsp) == -1) {
-				return -1;
-			}
-		}
-		DEBUG(9,("wcp->offset = %.0f wcp->data_size = %u cache return %u\n",
-			(double)wcp->offset, (unsigned int)wcp->data_size, (unsigned int)n));
-
-		total_written += n;
-		return total_written; /* .... that's a write :) */
-	}
-  
-	return total_written;
+	IOSTATS_ADD_WRITE(fsp->conn, ret);
+	return ret;
 }
 
 /****************************************************************************
@@ -730,7 +709,7 @@ void delete_write_cache(files_struct *fsp)
 
 	SMB_ASSERT(wcp->data_size == 0);
 
-	SAFE_FREE(wcp->data);
+	DLIST_REMOVE(write_caches, wcp);
 	SAFE_FREE(fsp->wcp);
 
 	DEBUG(10,("delete_write_cache: File %s deleted write cache\n", fsp->fsp_name ));
@@ -758,19 +737,19 @@ static BOOL setup_write_cache(files_struct *fsp, SMB_OFF_T file_size)
 		return False;
 	}
 
+	ZERO_STRUCTP(wcp);
+	wcp->fsp = fsp;
 	wcp->file_size = file_size;
-	wcp->offset = 0;
 	wcp->alloc_size = alloc_size;
-	wcp->data_size = 0;
-	if((wcp->data = (char *)SMB_MALLOC(wcp->alloc_size)) == NULL) {
-		DEBUG(0,("setup_write_cache: malloc fail for buffer size %u.\n",
-			(unsigned int)wcp->alloc_size ));
-		SAFE_FREE(wcp);
-		return False;
-	}
+	wcp->last_write = time(NULL);
 
-	memset(wcp->data, '\0', wcp->alloc_size );
+	if (write_cache_idle_event == NULL) {
+		write_cache_idle_event = add_idle_event(
+			NULL, timeval_set(WRITE_CACHE_IDLE_TIMEOUT, 0),
+			write_cache_idle_flush, NULL);
+	}
 
+	DLIST_ADD(write_caches, wcp);
 	fsp->wcp = wcp;
 	DO_PROFILE_INC(writecache_allocated_write_caches);
 	allocated_write_caches++;
@@ -800,44 +779,59 @@ on file %s with write cache size = %lu\n", fsp->fsp_name, (unsigned long)fsp->wc
 }
 
 /*******************************************************************
- Flush a write cache struct to disk.
+ Flush a write cache struct to disk. Extents are written in file
+ order. Returns the number of bytes written, or -1 if any of the
+ writes failed; the cache is empty afterwards either way.
 ********************************************************************/
 
 ssize_t flush_write_cache(files_struct *fsp, enum flush_reason_enum reason)
 {
 	write_cache *wcp = fsp->wcp;
-	size_t data_size;
-	ssize_t ret;
+	ssize_t total = 0;
+	int saved_errno = 0;
 
 	if(!wcp || !wcp->data_size) {
 		return 0;
 	}
 
-	data_size = wcp->data_size;
-	wcp->data_size = 0;
+	DO_PROFILE_INC(writecache_flushed_writes[reason]);
 
-	DO_PROFILE_DEC_INC(writecache_num_write_caches,writecache_flushed_writes[reason]);
+	DEBUG(9,("flushing write cache: fd = %d, size=%u\n",
+		fsp->fh->fd, (unsigned int)wcp->data_size));
 
-	DEBUG(9,("flushing write cache: fd = %d, off=%.0f, size=%u\n",
-		fsp->fh->fd, (double)wcp->offset, (unsigned int)data_size));
+	while (wcp->extents) {
+		struct write_cache_extent *ext = wcp->extents;
+		ssize_t ret;
 
-#ifdef WITH_PROFILE
-	if(data_size == wcp->alloc_size) {
-		DO_PROFILE_INC(writecache_num_perfect_writes);
-	}
-#endif
+		DEBUG(10,("flush_write_cache: off=%.0f, size=%u\n",
+			(double)ext->offset, (unsigned int)ext->data_size));
 
-	ret = real_write_file(fsp, wcp->data, wcp->offset, data_size);
+		ret = real_write_file(fsp, ext->data, ext->offset,
+				      ext->data_size);
+		if (ret == -1) {
+			saved_errno = errno;
+		} else {
+			total += ret;
 
-	/*
-	 * Ensure file size if kept up to date if write extends file.
-	 */
+			/*
+			 * Ensure file size if kept up to date if write
+			 * extends file.
+			 */
+
+			if (ext->offset + ret > wcp->file_size) {
+				wcp->file_size = ext->offset + ret;
+			}
+		}
 
-	if ((ret != -1) && (wcp->offset + ret > wcp->file_size)) {
-		wcp->file_size = wcp->offset + ret;
+		free_write_cache_extent(wcp, ext);
 	}
 
-	return ret;
+	if (saved_errno) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	return total;
 }
 
 /*******************************************************************
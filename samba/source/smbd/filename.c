@@ -215,6 +215,11 @@ NTSTATUS unix_convert(connection_struct *conn,
 	start = name;
 	pstrcpy(orig_path, name);
 
+	if(!conn->case_sensitive && stat_cache_lookup_negative(conn, name)) {
+		DEBUG(5,("conversion finished (cached new file) %s -> %s\n",orig_path, name));
+		return NT_STATUS_OK;
+	}
+
 	if(!conn->case_sensitive && stat_cache_lookup(conn, name, dirpath, &start, &st)) {
 		*pst = st;
 		return NT_STATUS_OK;
@@ -455,6 +460,9 @@ NTSTATUS unix_convert(connection_struct *conn,
 
 				if (mangle_is_mangled(start, conn->params)) {
 					mangle_check_cache( start, sizeof(pstring) - 1 - (start - name), conn->params);
+				} else if (!component_was_mangled && !name_has_wildcard) {
+					/* Save the directory scan next time. */
+					stat_cache_add_negative(conn, orig_path, name, dirpath);
 				}
 
 				DEBUG(5,("New file %s\n",start));
@@ -572,8 +580,10 @@ NTSTATUS check_name(connection_struct *conn, const pstring name)
 static BOOL scan_directory(connection_struct *conn, const char *path, char *name, size_t maxlength)
 {
 	struct smb_Dir *cur_dir;
+	struct dir_index *idx = NULL;
 	const char *dname;
 	BOOL mangled;
+	BOOL found = False;
 	long curpos;
 
 	mangled = mangle_is_mangled(name, conn->params);
@@ -610,9 +620,25 @@ static BOOL scan_directory(connection_struct *conn, const char *path, char *name
 		mangled = !mangle_check_cache( name, maxlength, conn->params);
 	}
 
+	/*
+	 * Big directories may have an index of their names, which can
+	 * answer found or not found without reading the directory.
+	 */
+
+	if (!mangled && !conn->case_sensitive) {
+		if (dir_index_lookup(conn, path, name, maxlength, &found)) {
+			if (!found) {
+				errno = ENOENT;
+			}
+			return found;
+		}
+		idx = dir_index_start(conn, path);
+	}
+
 	/* open the directory */
 	if (!(cur_dir = OpenDir(conn, path, NULL, 0))) {
 		DEBUG(3,("scan dir didn't open dir [%s]\n",path));
+		dir_index_finish(conn, idx, path);
 		return(False);
 	}
 
@@ -625,6 +651,19 @@ static BOOL scan_directory(connection_struct *conn, const char *path, char *name
 			continue;
 		}
 
+		/*
+		 * If we are building an index keep reading to the end
+		 * of the directory once we have our match.
+		 */
+
+		if (idx != NULL) {
+			dir_index_add(&idx, dname);
+		}
+
+		if (found) {
+			continue;
+		}
+
 		/*
 		 * At this point dname is the unmangled name.
 		 * name is either mangled or not, depending on the state of the "mangled"
@@ -639,12 +678,17 @@ static BOOL scan_directory(connection_struct *conn, const char *path, char *name
 		if ((mangled && mangled_equal(name,dname,conn->params)) || fname_equal(name, dname, conn->case_sensitive)) {
 			/* we've found the file, change it's name and return */
 			safe_strcpy(name, dname, maxlength);
-			CloseDir(cur_dir);
-			return(True);
+			found = True;
+			if (idx == NULL) {
+				break;
+			}
 		}
 	}
 
 	CloseDir(cur_dir);
-	errno = ENOENT;
-	return(False);
+	dir_index_finish(conn, idx, path);
+	if (!found) {
+		errno = ENOENT;
+	}
+	return(found);
 }
@@ -0,0 +1,344 @@
+/*
+   Unix SMB/CIFS implementation.
+   Per-share and per-client I/O accounting
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * When "io stats" is set every tree connection keeps a struct
+ * iostats_conn with its bytes read and written, its operation counts
+ * by class and the time spent serving them. The same numbers are
+ * added to the share's and the client's slot in the shared iostats
+ * area (see iostats_setup()) so that smbstatus and the PCP agent can
+ * see which share and which client is generating the load.
+ *
+ * With "io stats" off the only cost is a test of iostats_enabled per
+ * request and per read/write.
+ */
+
+#include "includes.h"
+
+BOOL iostats_enabled = False;
+
+/* Serialises slot allocation between smbd processes. */
+static TDB_CONTEXT *iostats_tdb;
+#define IOSTATS_SLOT_LOCK "IOSTATS_SLOTS"
+
+/* This smbd only ever serves one client. */
+static struct iostats_slot *client_slot;
+static BOOL client_slot_done;
+
+/* The outermost request being timed. */
+static connection_struct *op_conn;
+static enum iostats_op_class op_class;
+static struct timeval op_start;
+static int op_depth;
+
+/****************************************************************************
+ Enable or disable accounting after a config (re)load.
+****************************************************************************/
+
+void iostats_init(void)
+{
+	if (!lp_io_stats()) {
+		iostats_enabled = False;
+		return;
+	}
+
+	if (iostats_enabled) {
+		return;
+	}
+
+	if (!iostats_setup(False)) {
+		DEBUG(0,("iostats_init: failed to set up the iostats area, "
+			 "\"io stats\" disabled\n"));
+		return;
+	}
+
+	iostats_enabled = True;
+}
+
+/****************************************************************************
+ Find the slot for name, claiming an unused one if this is a new name.
+ Names are never changed once set, so a match can be looked for without
+ holding the lock.
+****************************************************************************/
+
+static struct iostats_slot *iostats_find_slot(struct iostats_slot *slots,
+					      int num_slots,
+					      const char *name)
+{
+	struct iostats_slot *slot = NULL;
+	int i;
+
+	for (i = 0; i < num_slots && slots[i].name[0]; i++) {
+		if (strncmp(slots[i].name, name, IOSTATS_NAME_LEN - 1) == 0) {
+			return &slots[i];
+		}
+	}
+
+	if (i == num_slots) {
+		return NULL;
+	}
+
+	if (iostats_tdb == NULL) {
+		become_root();
+		iostats_tdb = tdb_open_log(lock_path("iostats.tdb"), 0,
+					   TDB_DEFAULT, O_RDWR|O_CREAT, 0644);
+		unbecome_root();
+		if (iostats_tdb == NULL) {
+			return NULL;
+		}
+	}
+
+	if (tdb_lock_bystring(iostats_tdb, IOSTATS_SLOT_LOCK) == -1) {
+		return NULL;
+	}
+
+	/* Someone else may have claimed slots since we looked. */
+	for (; i < num_slots; i++) {
+		if (slots[i].name[0] == '\0') {
+			safe_strcpy(slots[i].name, name, IOSTATS_NAME_LEN - 1);
+			slot = &slots[i];
+			break;
+		}
+		if (strncmp(slots[i].name, name, IOSTATS_NAME_LEN - 1) == 0) {
+			slot = &slots[i];
+			break;
+		}
+	}
+
+	tdb_unlock_bystring(iostats_tdb, IOSTATS_SLOT_LOCK);
+
+	if (slot == NULL) {
+		DEBUG(1,("iostats_find_slot: no free slot for %s\n", name));
+	}
+	return slot;
+}
+
+static struct iostats_slot *iostats_client_slot(void)
+{
+	if (!client_slot_done) {
+		client_slot_done = True;
+		client_slot = iostats_find_slot(iostats_h->clients,
+						IOSTATS_MAX_CLIENTS,
+						client_addr());
+	}
+	return client_slot;
+}
+
+static struct iostats_conn *iostats_conn_stats(connection_struct *conn)
+{
+	if (conn->iostats == NULL) {
+		conn->iostats = TALLOC_ZERO_P(conn->mem_ctx,
+					      struct iostats_conn);
+		if (conn->iostats == NULL) {
+			return NULL;
+		}
+		conn->iostats->share = iostats_find_slot(iostats_h->shares,
+						IOSTATS_MAX_SHARES,
+						lp_servicename(SNUM(conn)));
+	}
+	return conn->iostats;
+}
+
+/****************************************************************************
+ Map an SMB to the class it is accounted under.
+****************************************************************************/
+
+static enum iostats_op_class iostats_op_class(int type, const char *inbuf)
+{
+	switch (type) {
+	case SMBread:
+	case SMBreadbraw:
+	case SMBreadX:
+	case SMBlockread:
+	case SMBreadBmpx:
+	case SMBreadBs:
+		return IOSTATS_OP_READ;
+
+	case SMBwrite:
+	case SMBwritebraw:
+	case SMBwritec:
+	case SMBwriteX:
+	case SMBwriteunlock:
+	case SMBwriteclose:
+	case SMBwriteBmpx:
+	case SMBwriteBs:
+	case SMBsplwr:
+	case SMBflush:
+		return IOSTATS_OP_WRITE;
+
+	case SMBlock:
+	case SMBunlock:
+	case SMBlockingX:
+		return IOSTATS_OP_LOCK;
+
+	case SMBmkdir:
+	case SMBrmdir:
+	case SMBsearch:
+	case SMBffirst:
+	case SMBfunique:
+	case SMBfclose:
+	case SMBfindclose:
+	case SMBfindnclose:
+	case SMBcheckpath:
+		return IOSTATS_OP_DIR;
+
+	case SMBtrans2:
+		switch (SVAL(inbuf, smb_setup0)) {
+		case TRANSACT2_FINDFIRST:
+		case TRANSACT2_FINDNEXT:
+		case TRANSACT2_MKDIR:
+			return IOSTATS_OP_DIR;
+		default:
+			return IOSTATS_OP_META;
+		}
+
+	case SMBopen:
+	case SMBcreate:
+	case SMBclose:
+	case SMBunlink:
+	case SMBmv:
+	case SMBgetatr:
+	case SMBsetatr:
+	case SMBctemp:
+	case SMBmknew:
+	case SMBlseek:
+	case SMBsetattrE:
+	case SMBgetattrE:
+	case SMBcopy:
+	case SMBmove:
+	case SMBopenX:
+	case SMBtranss2:
+	case SMBnttrans:
+	case SMBnttranss:
+	case SMBntcreateX:
+	case SMBntrename:
+	case SMBdskattr:
+		return IOSTATS_OP_META;
+
+	default:
+		return IOSTATS_OP_OTHER;
+	}
+}
+
+static void iostats_add_op(connection_struct *conn,
+			   enum iostats_op_class cls,
+			   SMB_BIG_UINT usec, int ops)
+{
+	struct iostats_conn *ic = iostats_conn_stats(conn);
+	struct iostats_slot *cs = iostats_client_slot();
+
+	if (ic != NULL) {
+		ic->counters.ops[cls] += ops;
+		ic->counters.usec[cls] += usec;
+		if (ic->share != NULL) {
+			ic->share->counters.ops[cls] += ops;
+			ic->share->counters.usec[cls] += usec;
+		}
+	}
+	if (cs != NULL) {
+		cs->counters.ops[cls] += ops;
+		cs->counters.usec[cls] += usec;
+	}
+}
+
+/****************************************************************************
+ Called around each SMB handler. Chained andX requests are counted as
+ operations of their own class but their time is charged to the
+ outermost request.
+****************************************************************************/
+
+void iostats_start_op(connection_struct *conn, int type, const char *inbuf)
+{
+	if (!iostats_enabled) {
+		return;
+	}
+
+	if (op_depth++ > 0) {
+		if (conn != NULL) {
+			iostats_add_op(conn, iostats_op_class(type, inbuf),
+				       0, 1);
+		}
+		return;
+	}
+
+	op_conn = conn;
+	op_class = iostats_op_class(type, inbuf);
+	GetTimeOfDay(&op_start);
+}
+
+void iostats_end_op(void)
+{
+	struct timeval now;
+	int64_t usec;
+
+	if (op_depth == 0 || --op_depth > 0) {
+		return;
+	}
+
+	if (op_conn == NULL) {
+		/* No connection, or it went away while we were in it. */
+		return;
+	}
+
+	GetTimeOfDay(&now);
+	usec = usec_time_diff(&now, &op_start);
+	iostats_add_op(op_conn, op_class, usec > 0 ? usec : 0, 1);
+	op_conn = NULL;
+}
+
+/****************************************************************************
+ A connection is being freed. Charge the request that is closing it
+ now, as the connection will be gone by the time it returns.
+****************************************************************************/
+
+void iostats_conn_closed(connection_struct *conn)
+{
+	int depth = op_depth;
+
+	if (op_conn != conn) {
+		return;
+	}
+
+	op_depth = 1;
+	iostats_end_op();
+	op_depth = depth;
+}
+
+/****************************************************************************
+ Account file data moved for a connection.
+****************************************************************************/
+
+void iostats_add_bytes(connection_struct *conn, size_t nread, size_t nwritten)
+{
+	struct iostats_conn *ic = iostats_conn_stats(conn);
+	struct iostats_slot *cs = iostats_client_slot();
+
+	if (ic != NULL) {
+		ic->counters.read_bytes += nread;
+		ic->counters.write_bytes += nwritten;
+		if (ic->share != NULL) {
+			ic->share->counters.read_bytes += nread;
+			ic->share->counters.write_bytes += nwritten;
+		}
+	}
+	if (cs != NULL) {
+		cs->counters.read_bytes += nread;
+		cs->counters.write_bytes += nwritten;
+	}
+}
@@ -293,6 +293,10 @@ static NTSTATUS open_file(files_struct *fsp,
 			return NT_STATUS_OBJECT_NAME_INVALID;
 		}
 
+		if ((local_flags & O_CREAT) && !file_existed) {
+			dir_index_prepare(conn, path);
+		}
+
 		/* Actually do the open */
 		status = fd_open(conn, path, fsp, local_flags, unx_mode);
 		if (!NT_STATUS_IS_OK(status)) {
@@ -2004,6 +2008,8 @@ static NTSTATUS mkdir_internal(connection_struct *conn,
 		mode = unix_mode(conn, aDIR, name, parent_dir);
 	}
 
+	dir_index_prepare(conn, name);
+
 	if (SMB_VFS_MKDIR(conn, name, mode) != 0) {
 		return map_nt_error_from_unix(errno);
 	}
@@ -30,6 +30,13 @@ static char *InBuffer = NULL;
 static char *OutBuffer = NULL;
 static char *current_inbuf = NULL;
 
+/*
+ * Number of bytes of the current SMBwriteX still sitting in the client
+ * socket. Set when we only read the header of a writeX so that the data
+ * can be moved into the file with recvfile.
+ */
+static size_t unread_bytes;
+
 /* 
  * Size of data we can send to client. Set
  *  by the client for all protocols above CORE.
@@ -328,6 +335,91 @@ static int select_on_fd(int fd, int maxfd, fd_set *fds)
 	return maxfd;
 }
 
+/****************************************************************************
+ Return the number of bytes of the current request left in the socket.
+****************************************************************************/
+
+size_t smbd_unread_bytes(void)
+{
+	return unread_bytes;
+}
+
+/****************************************************************************
+ The data left in the socket has been dealt with (by recvfile).
+****************************************************************************/
+
+void smbd_clear_unread_bytes(void)
+{
+	unread_bytes = 0;
+}
+
+/****************************************************************************
+ Read the rest of a request we only read the header of into inbuf. Used
+ when a writeX we left in the socket for recvfile can't use it after all.
+****************************************************************************/
+
+BOOL smbd_read_unread_bytes(char *inbuf)
+{
+	size_t len = unread_bytes;
+	size_t hdr_len = smb_len(inbuf) - len;
+
+	if (len == 0) {
+		return True;
+	}
+
+	unread_bytes = 0;
+
+	if (read_data(smbd_server_fd(), inbuf + 4 + hdr_len, len) != len) {
+		DEBUG(0,("smbd_read_unread_bytes: failed to read %u bytes\n",
+			(unsigned int)len));
+		return False;
+	}
+
+	SSVAL(inbuf+4, smb_len(inbuf), 0);
+	return True;
+}
+
+/****************************************************************************
+ Read an smb from the client. If any connected share uses recvfile and this
+ is a large enough SMBwriteX only read its header, the data is left in the
+ socket for reply_write_and_X() to move into the file.
+****************************************************************************/
+
+static BOOL receive_smb_or_writeX_header(char *buffer, size_t buflen)
+{
+	size_t min_size = conn_min_receivefile_size();
+	ssize_t ret;
+
+	if (min_size == 0) {
+		return receive_smb(smbd_server_fd(), buffer, buflen, 0);
+	}
+
+	/* lp_min_receivefile_size() is zero if signing is on. */
+	ret = receive_smb_raw_header(smbd_server_fd(), buffer, buflen,
+				STANDARD_WRITE_AND_X_HEADER_SIZE, min_size);
+	if (ret == -1) {
+		return False;
+	}
+
+	unread_bytes = (size_t)ret;
+
+	if (unread_bytes && !is_valid_writeX_buffer(buffer)) {
+		if (!smbd_read_unread_bytes(buffer)) {
+			if (smb_read_error == 0) {
+				smb_read_error = READ_ERROR;
+			}
+			return False;
+		}
+	}
+
+	if (unread_bytes) {
+		DEBUG(10,("receive_smb_or_writeX_header: left %u bytes of "
+			"writeX in the socket\n", (unsigned int)unread_bytes));
+	}
+
+	return True;
+}
+
 /****************************************************************************
   Do a select on an two fd's - with timeout. 
 
@@ -526,8 +618,8 @@ static BOOL receive_message_or_smb(char *buffer, int buffer_len, int timeout)
 		goto again;
 	}
 
-	return receive_smb(smbd_server_fd(), buffer,
-			BUFFER_SIZE + LARGE_WRITEX_HDR_SIZE, 0);
+	return receive_smb_or_writeX_header(buffer,
+			BUFFER_SIZE + LARGE_WRITEX_HDR_SIZE);
 }
 
 /*
@@ -1009,7 +1101,9 @@ static int switch_message(int type,char *inbuf,char *outbuf,int size,int bufsize
 		INC_BYTE_COUNT(SNUM(conn), size);
 
 		current_inbuf = inbuf; /* In case we need to defer this message in open... */
+		iostats_start_op(conn, type, inbuf);
 		outsize = smb_messages[type].fn(conn, inbuf,outbuf,size,bufsize);
+		iostats_end_op();
 
 		/* Handling the message can deallocate conn, eg. SMBtdis. */
 		if (conn && conn->params) {
@@ -1096,6 +1190,14 @@ static void process_smb(char *inbuf, char *outbuf)
 		return; /* Keepalive packet. */
 
 	nread = construct_reply(inbuf,outbuf,nread,max_send);
+
+	if (unread_bytes) {
+		/* The writeX failed before touching its data. Throw it away. */
+		if (drain_socket(smbd_server_fd(), unread_bytes) != unread_bytes) {
+			exit_server_cleanly("process_smb: drain_socket failed.");
+		}
+		unread_bytes = 0;
+	}
       
 	if(nread > 0) {
 		if (CVAL(outbuf,0) == 0)
@@ -1579,6 +1681,9 @@ void smbd_process(void)
 
 	max_recv = MIN(lp_maxxmit(),BUFFER_SIZE);
 
+	/* Take oplock breaks and other messages from a socket, not the tdb. */
+	message_listen(smbd_event_context());
+
 	while (True) {
 		int deadtime = lp_deadtime()*60;
 		int select_timeout = setup_select_timeout();
@@ -2040,6 +2040,7 @@ NTSTATUS unlink_internals(connection_struct *conn, uint32 dirtype,
 		}
 
 skip_delete_check:
+		dir_index_prepare(conn, directory);
 		if (SMB_VFS_UNLINK(conn,directory) == 0) {
 			count++;
 			notify_fname(conn, NOTIFY_ACTION_REMOVED,
@@ -2108,6 +2109,7 @@ skip_delete_check:
 			if (!NT_STATUS_IS_OK(status)) {
 				continue;
 			}
+			dir_index_prepare(conn, fname);
 			if (SMB_VFS_UNLINK(conn,fname) == 0) {
 				count++;
 				DEBUG(3,("unlink_internals: succesful unlink "
@@ -2243,7 +2245,8 @@ void send_file_readbraw(connection_struct *conn, files_struct *fsp, SMB_OFF_T st
 	 */
 
 	if ( (chain_size == 0) && (nread > 0) &&
-	    (fsp->wcp == NULL) && (fsp->is_sendfile_capable) ) {
+	    !write_cache_range_dirty(fsp, startpos, nread) &&
+	    (fsp->is_sendfile_capable) ) {
 		DATA_BLOB header;
 
 		_smb_setlen(outbuf,nread);
@@ -2280,6 +2283,7 @@ void send_file_readbraw(connection_struct *conn, files_struct *fsp, SMB_OFF_T st
 			exit_server_cleanly("send_file_readbraw sendfile failed");
 		}
 
+		IOSTATS_ADD_READ(conn, nread);
 		return;
 	}
 
@@ -2586,7 +2590,8 @@ int send_file_readX(connection_struct *conn, char *inbuf,char *outbuf,int length
 	 */
 
 	if ((chain_size == 0) && (CVAL(inbuf,smb_vwv0) == 0xFF) &&
-	    (fsp->is_sendfile_capable) && (fsp->wcp == NULL) ) {
+	    (fsp->is_sendfile_capable) &&
+	    !write_cache_range_dirty(fsp, startpos, smb_maxcnt) ) {
 		SMB_STRUCT_STAT sbuf;
 		DATA_BLOB header;
 
@@ -2655,6 +2660,7 @@ int send_file_readX(connection_struct *conn, char *inbuf,char *outbuf,int length
 
 		DEBUG( 3, ( "send_file_readX: sendfile fnum=%d max=%d nread=%d\n",
 			fsp->fnum, (int)smb_maxcnt, (int)nread ) );
+		IOSTATS_ADD_READ(conn, nread);
 		/* Returning -1 here means successful sendfile. */
 		return -1;
 	}
@@ -3090,6 +3096,66 @@ int reply_write(connection_struct *conn, char *inbuf,char *outbuf,int size,int d
  Reply to a write and X.
 ****************************************************************************/
 
+/****************************************************************************
+ Ensure a buffer is a valid writeX for recvfile purposes. We only get the
+ header here, the data is still in the socket.
+****************************************************************************/
+
+BOOL is_valid_writeX_buffer(const char *inbuf)
+{
+	connection_struct *conn = NULL;
+	unsigned int doff = 0;
+	size_t len = smb_len(inbuf);
+	size_t numtowrite;
+
+	if (strncmp(smb_base(inbuf),"\377SMB",4) != 0) {
+		return False;
+	}
+
+	if (CVAL(inbuf,smb_com) != SMBwriteX ||
+			CVAL(inbuf,smb_vwv0) != 0xFF ||
+			CVAL(inbuf,smb_wct) != 14) {
+		/* Not a plain, unchained 64 bit writeX. */
+		DEBUG(10,("is_valid_writeX_buffer: chained or "
+			"invalid word length.\n"));
+		return False;
+	}
+
+	conn = conn_find(SVAL(inbuf, smb_tid));
+	if (conn == NULL) {
+		DEBUG(10,("is_valid_writeX_buffer: bad tid\n"));
+		return False;
+	}
+	if (IS_IPC(conn) || IS_PRINT(conn)) {
+		DEBUG(10,("is_valid_writeX_buffer: IPC$ or printer tid\n"));
+		return False;
+	}
+
+	doff = SVAL(inbuf,smb_vwv11);
+	if (doff != STANDARD_WRITE_AND_X_HEADER_SIZE) {
+		DEBUG(10,("is_valid_writeX_buffer: doff mismatch "
+			"len = %u, doff = %u\n",
+			(unsigned int)len, (unsigned int)doff));
+		return False;
+	}
+
+	numtowrite = SVAL(inbuf,smb_vwv10) |
+		((((size_t)SVAL(inbuf,smb_vwv9)) & 1 ) << 16);
+	if (numtowrite != len - doff ||
+			numtowrite < (size_t)lp_min_receivefile_size(SNUM(conn))) {
+		DEBUG(10,("is_valid_writeX_buffer: numtowrite %u doesn't "
+			"qualify, len = %u\n",
+			(unsigned int)numtowrite, (unsigned int)len));
+		return False;
+	}
+
+	DEBUG(10,("is_valid_writeX_buffer: true "
+		"len = %u, doff = %u\n",
+		(unsigned int)len, (unsigned int)doff));
+
+	return True;
+}
+
 int reply_write_and_X(connection_struct *conn, char *inbuf,char *outbuf,int length,int bufsize)
 {
 	files_struct *fsp = file_fsp(inbuf,smb_vwv2);
@@ -3127,7 +3193,25 @@ int reply_write_and_X(connection_struct *conn, char *inbuf,char *outbuf,int leng
 		return ERROR_DOS(ERRDOS,ERRbadmem);
 	}
 
-	data = smb_base(inbuf) + smb_doff;
+	/*
+	 * If the data is still in the socket (see receive_smb_or_writeX_header)
+	 * we can only move it straight into the file if nothing needs to see
+	 * it in memory first. Otherwise read it in now.
+	 */
+
+	if (smbd_unread_bytes() &&
+			(fsp->print_file || fsp->wcp || lp_write_cache_size(SNUM(conn)))) {
+		if (!smbd_read_unread_bytes(inbuf)) {
+			exit_server_cleanly("reply_write_and_X: failed to read writeX data");
+		}
+	}
+
+	if (smbd_unread_bytes()) {
+		/* write_file() will recvfile the data from the socket. */
+		data = NULL;
+	} else {
+		data = smb_base(inbuf) + smb_doff;
+	}
 
 	if(CVAL(inbuf,smb_wct) == 14) {
 #ifdef LARGE_SMB_OFF_T
@@ -3166,7 +3250,7 @@ int reply_write_and_X(connection_struct *conn, char *inbuf,char *outbuf,int leng
 		nwritten = 0;
 	} else {
 
-		if (schedule_aio_write_and_X(conn, inbuf, outbuf, length, bufsize,
+		if (data && schedule_aio_write_and_X(conn, inbuf, outbuf, length, bufsize,
 					fsp,data,startpos,numtowrite)) {
 			END_PROFILE(SMBwriteX);
 			return -1;
@@ -3959,8 +4043,10 @@ NTSTATUS rmdir_internals(connection_struct *conn, const char *directory)
 		if (!(S_ISDIR(st.st_mode))) {
 			return NT_STATUS_NOT_A_DIRECTORY;
 		}
+		dir_index_prepare(conn, directory);
 		ret = SMB_VFS_UNLINK(conn,directory);
 	} else {
+		dir_index_prepare(conn, directory);
 		ret = SMB_VFS_RMDIR(conn,directory);
 	}
 	if (ret == 0) {
@@ -4033,6 +4119,7 @@ NTSTATUS rmdir_internals(connection_struct *conn, const char *directory)
 		}
 		CloseDir(dir_hnd);
 		/* Retry the rmdir */
+		dir_index_prepare(conn, directory);
 		ret = SMB_VFS_RMDIR(conn,directory);
 	}
 
@@ -4716,6 +4803,9 @@ NTSTATUS rename_internals(connection_struct *conn,
 		lck = get_share_mode_lock(NULL, sbuf1.st_dev, sbuf1.st_ino,
 					  NULL, NULL);
 
+		dir_index_prepare(conn, directory);
+		dir_index_prepare(conn, newname);
+
 		if(SMB_VFS_RENAME(conn,directory, newname) == 0) {
 			DEBUG(3,("rename_internals: succeeded doing rename "
 				 "on %s -> %s\n", directory, newname));
@@ -683,6 +683,8 @@ BOOL reload_services(BOOL test)
 	mangle_reset_cache();
 	reset_stat_cache();
 
+	iostats_init();
+
 	/* this forces service parameters to be flushed */
 	set_current_service(NULL,0,True);
 
@@ -733,6 +735,7 @@ static void exit_server_common(enum server_exit_reason how,
 
 	locking_end();
 	printing_end();
+	message_end();
 
 	if (how != SERVER_EXIT_NORMAL) {
 		int oldlevel = DEBUGLEVEL;
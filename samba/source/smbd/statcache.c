@@ -24,9 +24,254 @@
 
 /****************************************************************************
  Stat cache code used in unix_convert.
+
+ Each smbd keeps its own cache, so it is a plain open addressing hash
+ table (linear probing) that needs no locking. Entries are kept on an
+ LRU list and the least recently used ones are dropped once the cache
+ grows past "max stat cache size".
+
+ Besides the name translations the cache holds negative entries for
+ names that unix_convert() found not to exist in a case insensitive
+ share, which would otherwise cost a full directory scan every time a
+ client probes for them. A negative entry is only trusted while the
+ directory it was looked for in has the same device, inode and mtime,
+ so creations and renames done by any process invalidate it.
+*****************************************************************************/
+
+struct stat_cache_entry {
+	struct stat_cache_entry *prev, *next;	/* LRU list, newest first */
+	unsigned int hash;
+	size_t key_len;
+	char *key;				/* name as the client sent it */
+	size_t translated_len;
+	char *translated;			/* name on our filesystem */
+	size_t size;				/* bytes charged to the cache */
+
+	/* Negative entries only. */
+	BOOL negative;
+	int snum;
+	size_t dir_len;				/* length of the directory part of translated */
+	SMB_DEV_T dir_dev;
+	SMB_INO_T dir_ino;
+	struct timespec dir_mtime;
+};
+
+#define STAT_CACHE_MIN_SLOTS 1024
+
+static struct stat_cache_entry **sc_slots;
+static unsigned int sc_num_slots;
+static unsigned int sc_num_entries;
+static size_t sc_bytes;
+static struct stat_cache_entry *sc_lru;
+static struct stat_cache_entry *sc_lru_tail;
+
+static unsigned int stat_cache_hash(const char *key)
+{
+	TDB_DATA kbuf;
+
+	kbuf.dptr = CONST_DISCARD(char *, key);
+	kbuf.dsize = 0;
+	return fast_string_hash(&kbuf);
+}
+
+/****************************************************************************
+ Find the slot holding key, or the empty slot it would go in.
+*****************************************************************************/
+
+static unsigned int stat_cache_slot(const char *key, size_t key_len,
+				    unsigned int hash)
+{
+	unsigned int mask = sc_num_slots - 1;
+	unsigned int i;
+
+	for (i = hash & mask; sc_slots[i] != NULL; i = (i + 1) & mask) {
+		struct stat_cache_entry *e = sc_slots[i];
+
+		if (e->hash == hash && e->key_len == key_len &&
+		    memcmp(e->key, key, key_len) == 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+static struct stat_cache_entry *stat_cache_find(const char *key)
+{
+	if (sc_slots == NULL) {
+		return NULL;
+	}
+	return sc_slots[stat_cache_slot(key, strlen(key),
+					stat_cache_hash(key))];
+}
+
+/****************************************************************************
+ Remove an entry from the table and free it. The entries that follow it
+ in its probe run are moved back so no tombstones are needed.
+*****************************************************************************/
+
+static void stat_cache_remove(struct stat_cache_entry *e)
+{
+	unsigned int mask = sc_num_slots - 1;
+	unsigned int i, j;
+
+	i = stat_cache_slot(e->key, e->key_len, e->hash);
+	SMB_ASSERT(sc_slots[i] == e);
+
+	sc_slots[i] = NULL;
+	for (j = (i + 1) & mask; sc_slots[j] != NULL; j = (j + 1) & mask) {
+		unsigned int home = sc_slots[j]->hash & mask;
+
+		/* Leave it alone if its home slot lies in (i, j]. */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		sc_slots[i] = sc_slots[j];
+		sc_slots[j] = NULL;
+		i = j;
+	}
+
+	if (e == sc_lru_tail) {
+		sc_lru_tail = e->prev;
+	}
+	DLIST_REMOVE(sc_lru, e);
+
+	sc_num_entries--;
+	sc_bytes -= e->size;
+	SAFE_FREE(e);
+}
+
+static void stat_cache_promote(struct stat_cache_entry *e)
+{
+	if (e == sc_lru) {
+		return;
+	}
+	if (e == sc_lru_tail) {
+		sc_lru_tail = e->prev;
+	}
+	DLIST_PROMOTE(sc_lru, e);
+}
+
+/****************************************************************************
+ Double the table. Returns False (leaving the table as it was) if we
+ are out of memory.
 *****************************************************************************/
 
-static TDB_CONTEXT *tdb_stat_cache;
+static BOOL stat_cache_grow(void)
+{
+	struct stat_cache_entry **old_slots = sc_slots;
+	unsigned int old_num_slots = sc_num_slots;
+	unsigned int i;
+
+	sc_slots = SMB_CALLOC_ARRAY(struct stat_cache_entry *, old_num_slots * 2);
+	if (sc_slots == NULL) {
+		sc_slots = old_slots;
+		return False;
+	}
+	sc_num_slots = old_num_slots * 2;
+
+	for (i = 0; i < old_num_slots; i++) {
+		struct stat_cache_entry *e = old_slots[i];
+
+		if (e != NULL) {
+			sc_slots[stat_cache_slot(e->key, e->key_len, e->hash)] = e;
+		}
+	}
+
+	sc_bytes += (sc_num_slots - old_num_slots) * sizeof(*sc_slots);
+	SAFE_FREE(old_slots);
+	return True;
+}
+
+/****************************************************************************
+ Drop least recently used entries until we are within the configured
+ size, leaving room for an entry of size bytes.
+*****************************************************************************/
+
+static void stat_cache_trim(size_t size)
+{
+	size_t max_bytes = (size_t)lp_max_stat_cache_size() * 1024;
+
+	if (max_bytes == 0) {
+		return;
+	}
+
+	while (sc_lru_tail != NULL && sc_bytes + size > max_bytes) {
+		DEBUG(10,("stat_cache_trim: evicting %s\n", sc_lru_tail->key));
+		stat_cache_remove(sc_lru_tail);
+	}
+}
+
+/****************************************************************************
+ Allocate an entry for key (key_len bytes of it) with room for the
+ translated name, replacing any old entry for the same key.
+*****************************************************************************/
+
+static struct stat_cache_entry *stat_cache_new_entry(const char *key,
+						     size_t key_len,
+						     const char *translated,
+						     size_t translated_len)
+{
+	struct stat_cache_entry *e, *old;
+	size_t size;
+
+	if (sc_slots == NULL && (!reset_stat_cache() || sc_slots == NULL)) {
+		return NULL;
+	}
+
+	size = sizeof(*e) + key_len + 1 + translated_len + 1;
+
+	e = (struct stat_cache_entry *)SMB_MALLOC(size);
+	if (e == NULL) {
+		return NULL;
+	}
+	ZERO_STRUCTP(e);
+
+	e->size = size;
+	e->key = (char *)(e + 1);
+	e->key_len = key_len;
+	memcpy(e->key, key, key_len);
+	e->key[key_len] = '\0';
+	e->translated = e->key + key_len + 1;
+	e->translated_len = translated_len;
+	memcpy(e->translated, translated, translated_len);
+	e->translated[translated_len] = '\0';
+
+	e->hash = stat_cache_hash(e->key);
+
+	old = sc_slots[stat_cache_slot(e->key, key_len, e->hash)];
+	if (old != NULL) {
+		stat_cache_remove(old);
+	}
+
+	stat_cache_trim(size);
+
+	/*
+	 * Keep the load factor at or below 3/4, making room by eviction
+	 * rather than growing the table past the configured size.
+	 */
+	if ((sc_num_entries + 1) * 4 > sc_num_slots * 3) {
+		size_t max_bytes = (size_t)lp_max_stat_cache_size() * 1024;
+		size_t grown = sc_bytes + size + sc_num_slots * sizeof(*sc_slots);
+
+		if ((max_bytes != 0 && grown > max_bytes) || !stat_cache_grow()) {
+			if (sc_lru_tail == NULL) {
+				SAFE_FREE(e);
+				return NULL;
+			}
+			stat_cache_remove(sc_lru_tail);
+		}
+	}
+
+	sc_slots[stat_cache_slot(e->key, key_len, e->hash)] = e;
+	DLIST_ADD(sc_lru, e);
+	if (sc_lru_tail == NULL) {
+		sc_lru_tail = e;
+	}
+	sc_num_entries++;
+	sc_bytes += size;
+
+	return e;
+}
 
 /**
  * Add an entry into the stat cache.
@@ -44,20 +289,12 @@ void stat_cache_add( const char *full_orig_name, const char *orig_translated_pat
 {
 	char *translated_path;
 	size_t translated_path_length;
-	TDB_DATA data_val;
 	char *original_path;
 	size_t original_path_length;
-	size_t sc_size = lp_max_stat_cache_size();
 
 	if (!lp_stat_cache())
 		return;
 
-	if (sc_size && (tdb_map_size(tdb_stat_cache) > sc_size*1024)) {
-		reset_stat_cache();
-	}
-
-	ZERO_STRUCT(data_val);
-
 	/*
 	 * Don't cache trivial valid directory entries such as . and ..
 	 */
@@ -129,21 +366,178 @@ void stat_cache_add( const char *full_orig_name, const char *orig_translated_pat
 	/*
 	 * New entry or replace old entry.
 	 */
-  
-	data_val.dsize = translated_path_length + 1;
-	data_val.dptr = translated_path;
 
-	if (tdb_store_bystring(tdb_stat_cache, original_path, data_val, TDB_REPLACE) != 0) {
+	if (stat_cache_new_entry(original_path, original_path_length,
+				 translated_path, translated_path_length) == NULL) {
 		DEBUG(0,("stat_cache_add: Error storing entry %s -> %s\n", original_path, translated_path));
 	} else {
-		DEBUG(5,("stat_cache_add: Added entry (%lx:size%x) %s -> %s\n",
-			(unsigned long)data_val.dptr, (unsigned int)data_val.dsize, original_path, translated_path));
+		DEBUG(5,("stat_cache_add: Added entry %s -> %s\n",
+			original_path, translated_path));
 	}
 
 	SAFE_FREE(original_path);
 	SAFE_FREE(translated_path);
 }
 
+/**
+ * Remember that a name does not exist.
+ *
+ * @param conn            The connection the name was looked up on.
+ * @param full_orig_name  The original name as specified by the client.
+ * @param translated_path The name unix_convert() returned for it: the
+ *                        resolved directory plus the last component as
+ *                        it would be created.
+ * @param dirpath         The resolved directory the name was looked for in.
+ *
+ * @note Only used for case insensitive lookups, where finding out that a
+ *       name is not there means scanning the whole directory.
+ */
+
+void stat_cache_add_negative(connection_struct *conn, const char *full_orig_name,
+			     const char *translated_path, const char *dirpath)
+{
+	struct stat_cache_entry *e;
+	SMB_STRUCT_STAT st;
+	char *original_path;
+	size_t dir_len = strlen(dirpath);
+
+	if (!lp_stat_cache() || conn->case_sensitive)
+		return;
+
+	if (dir_len != 0 &&
+	    (strncmp(translated_path, dirpath, dir_len) != 0 ||
+	     translated_path[dir_len] != '/')) {
+		return;
+	}
+
+	if (SMB_VFS_STAT(conn, dir_len ? dirpath : ".", &st) != 0) {
+		return;
+	}
+
+	/*
+	 * A name created in the same clock tick as the directory was
+	 * last changed would not show up in its mtime. Only trust
+	 * directories that have been quiet for a while.
+	 */
+
+	if (st.st_mtime + 1 >= time(NULL)) {
+		return;
+	}
+
+	original_path = strdup_upper(full_orig_name);
+	if (!original_path) {
+		return;
+	}
+
+	e = stat_cache_new_entry(original_path, strlen(original_path),
+				 translated_path, strlen(translated_path));
+	if (e == NULL) {
+		DEBUG(0,("stat_cache_add_negative: Error storing entry %s\n",
+			 original_path));
+		SAFE_FREE(original_path);
+		return;
+	}
+
+	e->negative = True;
+	e->snum = SNUM(conn);
+	e->dir_len = dir_len;
+	e->dir_dev = st.st_dev;
+	e->dir_ino = st.st_ino;
+	e->dir_mtime = get_mtimespec(&st);
+
+	DEBUG(5,("stat_cache_add_negative: Added entry %s -> %s\n",
+		 original_path, translated_path));
+	SAFE_FREE(original_path);
+}
+
+/**
+ * Look for a name that unix_convert() found not to exist.
+ *
+ * @param conn The connection to look the name up on.
+ * @param name The name from the client. If it is still known not to
+ *             exist it is replaced by the name to create it under: the
+ *             cached directory and the client's last component.
+ *
+ * @return True if the name is known not to exist.
+ */
+
+BOOL stat_cache_lookup_negative(connection_struct *conn, pstring name)
+{
+	struct stat_cache_entry *e;
+	SMB_STRUCT_STAT st;
+	struct timespec mtime;
+	char *chk_name;
+	char *last_component;
+	pstring new_name;
+	BOOL ok;
+
+	if (!lp_stat_cache() || conn->case_sensitive || sc_num_entries == 0)
+		return False;
+
+	chk_name = strdup_upper(name);
+	if (!chk_name) {
+		return False;
+	}
+
+	e = stat_cache_find(chk_name);
+	SAFE_FREE(chk_name);
+
+	if (e == NULL || !e->negative || e->snum != SNUM(conn)) {
+		return False;
+	}
+
+	if (e->dir_len) {
+		e->translated[e->dir_len] = '\0';
+		ok = (SMB_VFS_STAT(conn, e->translated, &st) == 0);
+		e->translated[e->dir_len] = '/';
+	} else {
+		ok = (SMB_VFS_STAT(conn, ".", &st) == 0);
+	}
+
+	if (ok) {
+		mtime = get_mtimespec(&st);
+		ok = (st.st_dev == e->dir_dev && st.st_ino == e->dir_ino &&
+		      timespec_compare(&mtime, &e->dir_mtime) == 0);
+	}
+
+	if (!ok) {
+		DEBUG(10,("stat_cache_lookup_negative: directory of %s "
+			  "changed\n", e->key));
+		stat_cache_remove(e);
+		return False;
+	}
+
+	/*
+	 * The entry matched case insensitively. Keep the resolved
+	 * directory, but create the file under the client's spelling
+	 * of this lookup, treated as unix_convert() treats a new name.
+	 */
+
+	last_component = strrchr_m(name, '/');
+	pstrcpy(new_name, last_component ? last_component + 1 : name);
+	if (!conn->case_preserve ||
+	    (mangle_is_8_3(new_name, False, conn->params) &&
+	     !conn->short_case_preserve)) {
+		strnorm(new_name, lp_defaultcase(SNUM(conn)));
+	}
+
+	DEBUG(10,("stat_cache_lookup_negative: %s does not exist in %.*s\n",
+		  name, (int)e->dir_len, e->translated));
+	DO_PROFILE_INC(statcache_lookups);
+	DO_PROFILE_INC(statcache_hits);
+	stat_cache_promote(e);
+	if (e->dir_len) {
+		e->translated[e->dir_len] = '\0';
+		pstrcpy(name, e->translated);
+		e->translated[e->dir_len] = '/';
+		pstrcat(name, "/");
+		pstrcat(name, new_name);
+	} else {
+		pstrcpy(name, new_name);
+	}
+	return True;
+}
+
 /**
  * Look through the stat cache for an entry
  *
@@ -207,11 +601,11 @@ BOOL stat_cache_lookup(connection_struct *conn, pstring name, pstring dirpath,
 	}
 
 	while (1) {
-		TDB_DATA data_val;
+		struct stat_cache_entry *e;
 		char *sp;
 
-		data_val = tdb_fetch_bystring(tdb_stat_cache, chk_name);
-		if(data_val.dptr == NULL || data_val.dsize == 0) {
+		e = stat_cache_find(chk_name);
+		if(e == NULL || e->negative) {
 			DEBUG(10,("stat_cache_lookup: lookup failed for name [%s]\n", chk_name ));
 			/*
 			 * Didn't find it - remove last component for next try.
@@ -242,19 +636,20 @@ BOOL stat_cache_lookup(connection_struct *conn, pstring name, pstring dirpath,
 			}
 		} else {
 			BOOL retval;
-			char *translated_path = data_val.dptr;
-			size_t translated_path_length = data_val.dsize - 1;
+			char *translated_path = e->translated;
+			size_t translated_path_length = e->translated_len;
 
 			DEBUG(10,("stat_cache_lookup: lookup succeeded for name [%s] -> [%s]\n", chk_name, translated_path ));
 			DO_PROFILE_INC(statcache_hits);
 			if(SMB_VFS_STAT(conn,translated_path, pst) != 0) {
 				/* Discard this entry - it doesn't exist in the filesystem.  */
-				tdb_delete_bystring(tdb_stat_cache, chk_name);
+				stat_cache_remove(e);
 				SAFE_FREE(chk_name);
-				SAFE_FREE(data_val.dptr);
 				return False;
 			}
 
+			stat_cache_promote(e);
+
 			if (!sizechanged) {
 				memcpy(name, translated_path, MIN(sizeof(pstring)-1, translated_path_length));
 			} else if (num_components == 0) {
@@ -279,7 +674,6 @@ BOOL stat_cache_lookup(connection_struct *conn, pstring name, pstring dirpath,
 			pstrcpy(dirpath, translated_path);
 			retval = (namelen == translated_path_length) ? True : False;
 			SAFE_FREE(chk_name);
-			SAFE_FREE(data_val.dptr);
 			return retval;
 		}
 	}
@@ -307,6 +701,7 @@ void send_stat_cache_delete_message(const char *name)
 
 void stat_cache_delete(const char *name)
 {
+	struct stat_cache_entry *e;
 	char *lname = strdup_upper(name);
 
 	if (!lname) {
@@ -315,7 +710,10 @@ void stat_cache_delete(const char *name)
 	DEBUG(10,("stat_cache_delete: deleting name [%s] -> %s\n",
 			lname, name ));
 
-	tdb_delete_bystring(tdb_stat_cache, lname);
+	e = stat_cache_find(lname);
+	if (e != NULL) {
+		stat_cache_remove(e);
+	}
 	SAFE_FREE(lname);
 }
 
@@ -341,18 +739,25 @@ unsigned int fast_string_hash(TDB_DATA *key)
 
 BOOL reset_stat_cache( void )
 {
-	if (!lp_stat_cache())
-		return True;
+	struct stat_cache_entry *e, *next;
 
-	if (tdb_stat_cache) {
-		tdb_close(tdb_stat_cache);
+	for (e = sc_lru; e != NULL; e = next) {
+		next = e->next;
+		SAFE_FREE(e);
 	}
+	sc_lru = sc_lru_tail = NULL;
+	sc_num_entries = 0;
+	sc_bytes = 0;
+	SAFE_FREE(sc_slots);
+	sc_num_slots = 0;
 
-	/* Create the in-memory tdb using our custom hash function. */
-	tdb_stat_cache = tdb_open_ex("statcache", 1031, TDB_INTERNAL,
-                                    (O_RDWR|O_CREAT), 0644, NULL, fast_string_hash);
+	if (!lp_stat_cache())
+		return True;
 
-	if (!tdb_stat_cache)
+	sc_slots = SMB_CALLOC_ARRAY(struct stat_cache_entry *, STAT_CACHE_MIN_SLOTS);
+	if (!sc_slots)
 		return False;
+	sc_num_slots = STAT_CACHE_MIN_SLOTS;
+	sc_bytes = sc_num_slots * sizeof(*sc_slots);
 	return True;
 }
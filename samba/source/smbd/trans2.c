@@ -1145,6 +1145,7 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 	while (!found) {
 		BOOL got_match;
 		BOOL ms_dfs_link = False;
+		BOOL cached_stat = False;
 
 		/* Needed if we run out of space */
 		long curr_dirpos = prev_dirpos = dptr_TellDir(conn->dirptr);
@@ -1203,6 +1204,8 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 						pathreal,strerror(errno)));
 					continue;
 				}
+			} else if (dptr_get_cached_stat(conn->dirptr, dname, &sbuf, &mode)) {
+				cached_stat = True;
 			} else if (!VALID_STAT(sbuf) && SMB_VFS_STAT(conn,pathreal,&sbuf) != 0) {
 				pstring link_target;
 
@@ -1227,8 +1230,11 @@ static BOOL get_lanman2_dir_entry(connection_struct *conn,
 
 			if (ms_dfs_link) {
 				mode = dos_mode_msdfs(conn,pathreal,&sbuf);
-			} else {
+			} else if (!cached_stat) {
 				mode = dos_mode(conn,pathreal,&sbuf);
+				if (!INFO_LEVEL_IS_UNIX(info_level)) {
+					dptr_cache_stat(conn->dirptr, dname, &sbuf, mode);
+				}
 			}
 
 			if (!dir_check_ftype(conn,mode,dirtype)) {
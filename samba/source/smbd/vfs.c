@@ -450,6 +450,22 @@ ssize_t vfs_pwrite_data(files_struct *fsp,const char *buffer,
 	}
 	return (ssize_t)total;
 }
+
+/****************************************************************************
+ Write the N bytes of SMBwriteX data still waiting in the client socket
+ into the file at offset, without copying them through InBuffer.
+****************************************************************************/
+
+ssize_t vfs_recvfile_data(files_struct *fsp, size_t N, SMB_OFF_T offset)
+{
+	SMB_ASSERT(smbd_unread_bytes() == N);
+
+	/* Whatever happens now, recvfile consumes the data. */
+	smbd_clear_unread_bytes();
+
+	return SMB_VFS_RECVFILE(smbd_server_fd(), fsp, fsp->fh->fd, offset, N);
+}
+
 /****************************************************************************
  An allocate file space call using the vfs interface.
  Allocates space for a file from a filedescriptor.
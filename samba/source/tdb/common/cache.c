@@ -0,0 +1,205 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - per process fetch cache
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+  A database opened with TDB_FETCH_CACHE keeps the results of recent
+  lookups, hits and misses, in a small two way set associative table
+  indexed by the key hash. Every store and delete bumps the sequence number in
+  the header, so the whole table is good for as long as that number
+  hasn't changed. Checking it is a read from the mapping, so a hit
+  takes no lock and no system call.
+
+  The sequence number is read before the record is looked up. A
+  writer bumps it before it drops the chain lock, so if it changes
+  between the two reads the entry is thrown away on the next lookup.
+
+  Nothing is cached inside a transaction: the numbers it hands out
+  are lost if it is cancelled and may be reused by the next writer.
+*/
+
+#include "tdb_private.h"
+
+#define TDB_CACHE_BITS 8
+#define TDB_CACHE_SLOTS (1<<TDB_CACHE_BITS)
+#define TDB_CACHE_MAX_DATA 4096
+
+struct tdb_cache_entry {
+	u32 hash;
+	u32 used;
+	int found;
+	TDB_DATA key;
+	TDB_DATA data;	/* follows the key in the same allocation */
+};
+
+struct tdb_cache {
+	tdb_off_t seqnum;
+	u32 clock;
+	struct tdb_cache_entry slots[TDB_CACHE_SLOTS];
+};
+
+static void tdb_cache_empty(struct tdb_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < TDB_CACHE_SLOTS; i++) {
+		SAFE_FREE(cache->slots[i].key.dptr);
+	}
+	memset(cache->slots, 0, sizeof(cache->slots));
+}
+
+/* the default hash leaves keys that differ only near their end with
+   the same low bits, so mix it before picking a set */
+static u32 tdb_cache_set(u32 hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash >> (33 - TDB_CACHE_BITS);
+}
+
+/* forget everything, for a close or a reopen */
+void tdb_cache_free(struct tdb_context *tdb)
+{
+	if (tdb->cache == NULL) {
+		return;
+	}
+	tdb_cache_empty(tdb->cache);
+	SAFE_FREE(tdb->cache);
+}
+
+/*
+  look a key up in the cache. Returns 1 and the cached record if it
+  is there, 0 if the caller should fetch it and then call
+  tdb_cache_fill(), and -1 if the cache can't be used right now.
+*/
+int tdb_cache_lookup(struct tdb_context *tdb, TDB_DATA key, u32 hash,
+		     struct tdb_cache_entry **entry)
+{
+	struct tdb_cache *cache = tdb->cache;
+	struct tdb_cache_entry *e;
+	tdb_off_t seqnum;
+	int i;
+
+	if (tdb->transaction != NULL) {
+		return -1;
+	}
+	if (tdb_ofs_read(tdb, TDB_SEQNUM_OFS, &seqnum) == -1) {
+		return -1;
+	}
+
+	if (cache == NULL) {
+		cache = (struct tdb_cache *)calloc(1, sizeof(*cache));
+		if (cache == NULL) {
+			return -1;
+		}
+		cache->seqnum = seqnum;
+		tdb->cache = cache;
+	} else if (cache->seqnum != seqnum) {
+		tdb_cache_empty(cache);
+		cache->seqnum = seqnum;
+	}
+
+	e = &cache->slots[tdb_cache_set(hash) * 2];
+
+	for (i = 0; i < 2; i++) {
+		if (e[i].key.dptr != NULL && e[i].hash == hash &&
+		    e[i].key.dsize == key.dsize &&
+		    memcmp(e[i].key.dptr, key.dptr, key.dsize) == 0) {
+			e[i].used = ++cache->clock;
+			*entry = &e[i];
+			return 1;
+		}
+	}
+
+	/* replace whichever of the pair was used least recently */
+	*entry = (e[0].used <= e[1].used) ? &e[0] : &e[1];
+	return 0;
+}
+
+/*
+  remember what a fetch found, or that it found nothing, in the slot
+  tdb_cache_lookup() returned
+*/
+void tdb_cache_fill(struct tdb_context *tdb, struct tdb_cache_entry *e,
+		    TDB_DATA key, u32 hash, TDB_DATA data)
+{
+	char *p;
+
+	SAFE_FREE(e->key.dptr);
+
+	if (data.dptr != NULL && data.dsize > TDB_CACHE_MAX_DATA) {
+		return;
+	}
+	if (data.dptr == NULL && tdb->ecode != TDB_ERR_NOEXIST) {
+		/* an error, not an answer */
+		return;
+	}
+
+	p = (char *)malloc(key.dsize + data.dsize + 1);
+	if (p == NULL) {
+		return;
+	}
+	memcpy(p, key.dptr, key.dsize);
+	e->hash = hash;
+	e->key.dptr = p;
+	e->key.dsize = key.dsize;
+	e->used = ++tdb->cache->clock;
+	e->found = (data.dptr != NULL);
+	e->data.dptr = p + key.dsize;
+	e->data.dsize = 0;
+	if (e->found) {
+		memcpy(e->data.dptr, data.dptr, data.dsize);
+		e->data.dsize = data.dsize;
+	}
+}
+
+/* the record in a cache hit, or tdb_null if the key wasn't there */
+TDB_DATA tdb_cache_data(struct tdb_context *tdb, struct tdb_cache_entry *e)
+{
+	if (!e->found) {
+		tdb->ecode = TDB_ERR_NOEXIST;
+		return tdb_null;
+	}
+	return e->data;
+}
+
+/* as tdb_cache_data, but a copy the caller frees, like tdb_fetch() */
+TDB_DATA tdb_cache_copy(struct tdb_context *tdb, struct tdb_cache_entry *e)
+{
+	TDB_DATA ret = tdb_cache_data(tdb, e);
+	char *p;
+
+	if (ret.dptr == NULL) {
+		return ret;
+	}
+	/* some systems don't like zero length malloc */
+	if (!(p = (char *)malloc(ret.dsize ? ret.dsize : 1))) {
+		return TDB_ERRCODE(TDB_ERR_OOM, tdb_null);
+	}
+	memcpy(p, ret.dptr, ret.dsize);
+	ret.dptr = p;
+	return ret;
+}
@@ -59,17 +59,17 @@ static tdb_off_t tdb_dump_record(struct tdb_context *tdb, int hash,
 	return rec.next;
 }
 
-static int tdb_dump_chain(struct tdb_context *tdb, int i)
+/* dump the list at top, a hash chain i or a freelist (i == -1) */
+static int tdb_dump_list(struct tdb_context *tdb, int i, tdb_off_t top)
 {
-	tdb_off_t rec_ptr, top;
+	tdb_off_t rec_ptr;
+	int lock = (i == -1) ? -1 : (int)BUCKET(i);
 
-	top = TDB_HASH_TOP(i);
-
-	if (tdb_lock(tdb, i, F_WRLCK) != 0)
+	if (tdb_lock(tdb, lock, F_WRLCK) != 0)
 		return -1;
 
 	if (tdb_ofs_read(tdb, top, &rec_ptr) == -1)
-		return tdb_unlock(tdb, i, F_WRLCK);
+		return tdb_unlock(tdb, lock, F_WRLCK);
 
 	if (rec_ptr)
 		printf("hash=%d\n", i);
@@ -78,22 +78,25 @@ static int tdb_dump_chain(struct tdb_context *tdb, int i)
 		rec_ptr = tdb_dump_record(tdb, i, rec_ptr);
 	}
 
-	return tdb_unlock(tdb, i, F_WRLCK);
+	return tdb_unlock(tdb, lock, F_WRLCK);
 }
 
 void tdb_dump_all(struct tdb_context *tdb)
 {
-	int i;
-	for (i=0;i<tdb->header.hash_size;i++) {
-		tdb_dump_chain(tdb, i);
+	int i, n = tdb_hash_buckets(tdb);
+	for (i=0;i<n;i++) {
+		tdb_dump_list(tdb, i, TDB_HASH_TOP(i));
 	}
 	printf("freelist:\n");
-	tdb_dump_chain(tdb, -1);
+	tdb_dump_list(tdb, -1, FREELIST_TOP);
+	for (i=0;i<TDB_FREE_LISTS;i++) {
+		tdb_dump_list(tdb, -1, TDB_FREE_LIST_OFS(i));
+	}
 }
 
 int tdb_printfreelist(struct tdb_context *tdb)
 {
-	int ret;
+	int ret, i;
 	long total_free = 0;
 	tdb_off_t offset, rec_ptr;
 	struct list_struct rec;
@@ -101,38 +104,40 @@ int tdb_printfreelist(struct tdb_context *tdb)
 	if ((ret = tdb_lock(tdb, -1, F_WRLCK)) != 0)
 		return ret;
 
-	offset = FREELIST_TOP;
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
-		tdb_unlock(tdb, -1, F_WRLCK);
-		return 0;
-	}
+	/* the FREELIST_TOP list, then the lists of smaller records */
+	for (i = -1; i < TDB_FREE_LISTS; i++) {
+		offset = (i == -1) ? FREELIST_TOP : TDB_FREE_LIST_OFS(i);
 
-	printf("freelist top=[0x%08x]\n", rec_ptr );
-	while (rec_ptr) {
-		if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
-					   sizeof(rec), DOCONV()) == -1) {
+		/* read in the freelist top */
+		if (tdb_ofs_read(tdb, offset, &rec_ptr) == -1) {
 			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+			return 0;
 		}
 
-		if (rec.magic != TDB_FREE_MAGIC) {
-			printf("bad magic 0x%08x in free list\n", rec.magic);
-			tdb_unlock(tdb, -1, F_WRLCK);
-			return -1;
+		printf("freelist top=[0x%08x]\n", rec_ptr );
+		while (rec_ptr) {
+			if (tdb->methods->tdb_read(tdb, rec_ptr, (char *)&rec, 
+						   sizeof(rec), DOCONV()) == -1) {
+				tdb_unlock(tdb, -1, F_WRLCK);
+				return -1;
+			}
+
+			if (rec.magic != TDB_FREE_MAGIC) {
+				printf("bad magic 0x%08x in free list\n", rec.magic);
+				tdb_unlock(tdb, -1, F_WRLCK);
+				return -1;
+			}
+
+			printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
+			       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
+			total_free += rec.rec_len;
+
+			/* move to the next record */
+			rec_ptr = rec.next;
 		}
-
-		printf("entry offset=[0x%08x], rec.rec_len = [0x%08x (%d)] (end = 0x%08x)\n", 
-		       rec_ptr, rec.rec_len, rec.rec_len, rec_ptr + rec.rec_len);
-		total_free += rec.rec_len;
-
-		/* move to the next record */
-		rec_ptr = rec.next;
 	}
 	printf("total rec_len = [0x%08x (%d)]\n", (int)total_free, 
                (int)total_free);
 
 	return tdb_unlock(tdb, -1, F_WRLCK);
 }
-
@@ -58,23 +58,124 @@ int rec_free_read(struct tdb_context *tdb, tdb_off_t off, struct list_struct *re
 
 
 
-/* Remove an element from the freelist.  Must have alloc lock. */
-static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off, tdb_off_t next)
+/*
+  Free records are kept on lists by size. List c holds records of
+  rec_len 64*2^(c-1) up to 64*2^c - 1, list 0 those below 64 bytes, and
+  the list at FREELIST_TOP those of 64*2^(TDB_FREE_LISTS-1) bytes or
+  more. Older tdbs kept every free record on the FREELIST_TOP list, so
+  that list may also hold small records; they are moved to their own
+  lists as tdb_allocate() comes across them.
+*/
+static int tdb_free_class(tdb_len_t len)
+{
+	int c = 0;
+
+	for (len >>= 6; len != 0 && c < TDB_FREE_LISTS; len >>= 1) {
+		c++;
+	}
+	return c;
+}
+
+static tdb_off_t tdb_free_top(int c)
+{
+	if (c == TDB_FREE_LISTS) {
+		return FREELIST_TOP;
+	}
+	return TDB_FREE_LIST_OFS(c);
+}
+
+/* set the back pointer of a free record */
+static int set_free_prev(struct tdb_context *tdb, tdb_off_t off, tdb_off_t prev)
+{
+	return tdb_ofs_write(tdb, off + offsetof(struct list_struct, key_len),
+			     &prev);
+}
+
+/* is prev the pointer to the free record at off? */
+static int free_prev_ok(struct tdb_context *tdb, tdb_off_t off, tdb_off_t prev)
+{
+	struct list_struct r;
+	tdb_off_t v;
+
+	if (prev == FREELIST_TOP ||
+	    (prev >= TDB_FREE_LIST_OFS(0) &&
+	     prev < TDB_FREE_LIST_OFS(TDB_FREE_LISTS) &&
+	     (prev - TDB_FREE_LIST_OFS(0)) % sizeof(tdb_off_t) == 0)) {
+		return tdb_ofs_read(tdb, prev, &v) == 0 && v == off;
+	}
+
+	/* otherwise it must be the free record in front of us */
+	if (prev < TDB_DATA_START(tdb->header.hash_size) ||
+	    tdb->methods->tdb_oob(tdb, prev + sizeof(r), 1) != 0 ||
+	    tdb->methods->tdb_read(tdb, prev, &r, sizeof(r), DOCONV()) == -1) {
+		return 0;
+	}
+	return r.magic == TDB_FREE_MAGIC && r.next == off;
+}
+
+/* search a freelist for the pointer to off, 0 if it isn't there */
+static tdb_off_t find_free_prev(struct tdb_context *tdb, tdb_off_t top, tdb_off_t off)
 {
 	tdb_off_t last_ptr, i;
 
-	/* read in the freelist top */
-	last_ptr = FREELIST_TOP;
+	last_ptr = top;
 	while (tdb_ofs_read(tdb, last_ptr, &i) != -1 && i != 0) {
 		if (i == off) {
-			/* We've found it! */
-			return tdb_ofs_write(tdb, last_ptr, &next);
+			return last_ptr;
 		}
 		/* Follow chain (next offset is at start of record) */
 		last_ptr = i;
 	}
-	TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%d\n", off));
-	return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+	return 0;
+}
+
+/* Remove an element from the freelist.  Must have alloc lock. */
+static int remove_from_freelist(struct tdb_context *tdb, tdb_off_t off,
+				struct list_struct *rec)
+{
+	tdb_off_t prev = rec->key_len;
+
+	if (!free_prev_ok(tdb, off, prev)) {
+		/* freed by an older tdb, which didn't keep the back
+		   pointer. Search its list, then the one it used for
+		   everything. */
+		prev = find_free_prev(tdb, tdb_free_top(tdb_free_class(rec->rec_len)), off);
+		if (prev == 0) {
+			prev = find_free_prev(tdb, FREELIST_TOP, off);
+		}
+		if (prev == 0) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,"remove_from_freelist: not on list at off=%d\n", off));
+			return TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+		}
+	}
+
+	if (tdb_ofs_write(tdb, prev, &rec->next) == -1) {
+		return -1;
+	}
+	if (rec->next != 0 && set_free_prev(tdb, rec->next, prev) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Prepend a record to the freelist for its size. Must have alloc lock. */
+static int add_to_freelist(struct tdb_context *tdb, tdb_off_t off,
+			   struct list_struct *rec)
+{
+	tdb_off_t top = tdb_free_top(tdb_free_class(rec->rec_len));
+
+	rec->magic = TDB_FREE_MAGIC;
+	rec->key_len = top;
+
+	if (tdb_ofs_read(tdb, top, &rec->next) == -1 ||
+	    tdb_rec_write(tdb, off, rec) == -1 ||
+	    tdb_ofs_write(tdb, top, &off) == -1) {
+		return -1;
+	}
+	if (rec->next != 0 && set_free_prev(tdb, rec->next, off) == -1) {
+		return -1;
+	}
+	return 0;
 }
 
 
@@ -118,7 +219,7 @@ int tdb_free(struct tdb_context *tdb, tdb_off_t offset, struct list_struct *rec)
 
 		/* If it's free, expand to include it. */
 		if (r.magic == TDB_FREE_MAGIC) {
-			if (remove_from_freelist(tdb, right, r.next) == -1) {
+			if (remove_from_freelist(tdb, right, &r) == -1) {
 				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: right free failed at %u\n", right));
 				goto left;
 			}
@@ -154,7 +255,7 @@ left:
 
 		/* If it's free, expand to include it. */
 		if (l.magic == TDB_FREE_MAGIC) {
-			if (remove_from_freelist(tdb, left, l.next) == -1) {
+			if (remove_from_freelist(tdb, left, &l) == -1) {
 				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free: left free failed at %u\n", left));
 				goto update;
 			} else {
@@ -171,11 +272,7 @@ update:
 	}
 
 	/* Now, prepend to free list */
-	rec->magic = TDB_FREE_MAGIC;
-
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec->next) == -1 ||
-	    tdb_rec_write(tdb, offset, rec) == -1 ||
-	    tdb_ofs_write(tdb, FREELIST_TOP, &offset) == -1) {
+	if (add_to_freelist(tdb, offset, rec) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_free record write failed at offset=%d\n", offset));
 		goto fail;
 	}
@@ -221,6 +318,9 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, tdb_len_t length, tdb
 	if (tdb_ofs_write(tdb, last_ptr, &rec->next) == -1) {
 		return 0;
 	}
+	if (rec->next != 0 && set_free_prev(tdb, rec->next, last_ptr) == -1) {
+		return 0;
+	}
 	
 	/* Update header: do this before we drop alloc
 	   lock, otherwise tdb_free() might try to
@@ -249,6 +349,81 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, tdb_len_t length, tdb
 	return rec_ptr;
 }
 
+struct tdb_bestfit {
+	tdb_off_t rec_ptr, last_ptr;
+	tdb_len_t rec_len;
+};
+
+/*
+  find the best fit for length on freelist c. Returns 1 if a record was
+  moved off the FREELIST_TOP list to a smaller list it fits on, so the
+  smaller lists are worth searching again.
+ */
+static int tdb_free_search(struct tdb_context *tdb, int c, tdb_len_t length,
+			   struct list_struct *rec, struct tdb_bestfit *bestfit)
+{
+	tdb_off_t rec_ptr, last_ptr, good;
+	int n = 0, moved = 0;
+
+	bestfit->rec_ptr = 0;
+	bestfit->last_ptr = 0;
+	bestfit->rec_len = 0;
+
+	/* a fit that won't be split is as good as it gets on the sized
+	   lists. The FREELIST_TOP list isn't bounded in size, so there
+	   we are happy not to waste more than half the space */
+	good = (c == TDB_FREE_LISTS) ? 2*length : length + MIN_REC_SIZE;
+
+	last_ptr = tdb_free_top(c);
+	if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1) {
+		return -1;
+	}
+
+	while (rec_ptr) {
+		if (rec_free_read(tdb, rec_ptr, rec) == -1) {
+			return -1;
+		}
+		tdb->stats.freelist_walk++;
+
+		if (c == TDB_FREE_LISTS && tdb_free_class(rec->rec_len) < c) {
+			/* left here by an older tdb */
+			tdb_off_t next = rec->next;
+
+			if (tdb_ofs_write(tdb, last_ptr, &next) == -1 ||
+			    (next != 0 && set_free_prev(tdb, next, last_ptr) == -1) ||
+			    add_to_freelist(tdb, rec_ptr, rec) == -1) {
+				return -1;
+			}
+			moved |= (rec->rec_len >= length);
+			rec_ptr = next;
+			continue;
+		}
+
+		if (rec->rec_len >= length) {
+			if (bestfit->rec_ptr == 0 ||
+			    rec->rec_len < bestfit->rec_len) {
+				bestfit->rec_len = rec->rec_len;
+				bestfit->rec_ptr = rec_ptr;
+				bestfit->last_ptr = last_ptr;
+				if (bestfit->rec_len < good) {
+					break;
+				}
+			}
+		}
+
+		/* don't let a long list hold up the allocation */
+		if (c != TDB_FREE_LISTS && ++n == TDB_FREE_SCAN) {
+			break;
+		}
+
+		/* move to the next record */
+		last_ptr = rec_ptr;
+		rec_ptr = rec->next;
+	}
+
+	return (bestfit->rec_ptr == 0) ? moved : 0;
+}
+
 /* allocate some space from the free list. The offset returned points
    to a unconnected list_struct within the database with room for at
    least length bytes of total data
@@ -257,57 +432,36 @@ static tdb_off_t tdb_allocate_ofs(struct tdb_context *tdb, tdb_len_t length, tdb
  */
 tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct list_struct *rec)
 {
-	tdb_off_t rec_ptr, last_ptr, newrec_ptr;
-	struct {
-		tdb_off_t rec_ptr, last_ptr;
-		tdb_len_t rec_len;
-	} bestfit;
+	tdb_off_t newrec_ptr;
+	struct tdb_bestfit bestfit;
+	int c, ret;
 
 	if (tdb_lock(tdb, -1, F_WRLCK) == -1)
 		return 0;
 
 	/* Extra bytes required for tailer */
 	length += sizeof(tdb_off_t);
+	tdb->stats.allocs++;
 
  again:
-	last_ptr = FREELIST_TOP;
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1)
-		goto fail;
-
-	bestfit.rec_ptr = 0;
-	bestfit.last_ptr = 0;
-	bestfit.rec_len = 0;
-
 	/* 
 	   this is a best fit allocation strategy. Originally we used
 	   a first fit strategy, but it suffered from massive fragmentation
-	   issues when faced with a slowly increasing record size.
+	   issues when faced with a slowly increasing record size. Every
+	   record on a list above the one for our size fits, so we rarely
+	   have to look far.
 	 */
-	while (rec_ptr) {
-		if (rec_free_read(tdb, rec_ptr, rec) == -1) {
+	for (c = tdb_free_class(length); c <= TDB_FREE_LISTS; c++) {
+		ret = tdb_free_search(tdb, c, length, rec, &bestfit);
+		if (ret == -1) {
 			goto fail;
 		}
-
-		if (rec->rec_len >= length) {
-			if (bestfit.rec_ptr == 0 ||
-			    rec->rec_len < bestfit.rec_len) {
-				bestfit.rec_len = rec->rec_len;
-				bestfit.rec_ptr = rec_ptr;
-				bestfit.last_ptr = last_ptr;
-				/* consider a fit to be good enough if
-				   we aren't wasting more than half
-				   the space */
-				if (bestfit.rec_len < 2*length) {
-					break;
-				}
-			}
+		if (ret == 1) {
+			goto again;
+		}
+		if (bestfit.rec_ptr != 0) {
+			break;
 		}
-
-		/* move to the next record */
-		last_ptr = rec_ptr;
-		rec_ptr = rec->next;
 	}
 
 	if (bestfit.rec_ptr != 0) {
@@ -328,4 +482,3 @@ tdb_off_t tdb_allocate(struct tdb_context *tdb, tdb_len_t length, struct list_st
 	tdb_unlock(tdb, -1, F_WRLCK);
 	return 0;
 }
-
@@ -49,7 +49,7 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 	struct tdb_context *mem_tdb = NULL;
 	struct list_struct rec;
 	tdb_off_t rec_ptr, last_ptr;
-	int ret = -1;
+	int ret = -1, i;
 
 	*pnum_entries = 0;
 
@@ -64,38 +64,41 @@ int tdb_validate_freelist(struct tdb_context *tdb, int *pnum_entries)
 		return 0;
 	}
 
-	last_ptr = FREELIST_TOP;
+	/* the FREELIST_TOP list, then the lists of smaller records */
+	for (i = -1; i < TDB_FREE_LISTS; i++) {
+		last_ptr = (i == -1) ? FREELIST_TOP : TDB_FREE_LIST_OFS(i);
 
-	/* Store the FREELIST_TOP record. */
-	if (seen_insert(mem_tdb, last_ptr) == -1) {
-		ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
-		goto fail;
-	}
-
-	/* read in the freelist top */
-	if (tdb_ofs_read(tdb, FREELIST_TOP, &rec_ptr) == -1) {
-		goto fail;
-	}
-
-	while (rec_ptr) {
-
-		/* If we can't store this record (we've seen it
-		   before) then the free list has a loop and must
-		   be corrupt. */
-
-		if (seen_insert(mem_tdb, rec_ptr)) {
+		/* Store the list top. */
+		if (seen_insert(mem_tdb, last_ptr) == -1) {
 			ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
 			goto fail;
 		}
 
-		if (rec_free_read(tdb, rec_ptr, &rec) == -1) {
+		/* read in the freelist top */
+		if (tdb_ofs_read(tdb, last_ptr, &rec_ptr) == -1) {
 			goto fail;
 		}
 
-		/* move to the next record */
-		last_ptr = rec_ptr;
-		rec_ptr = rec.next;
-		*pnum_entries += 1;
+		while (rec_ptr) {
+
+			/* If we can't store this record (we've seen it
+			   before) then the free list has a loop and must
+			   be corrupt. */
+
+			if (seen_insert(mem_tdb, rec_ptr)) {
+				ret = TDB_ERRCODE(TDB_ERR_CORRUPT, -1);
+				goto fail;
+			}
+
+			if (rec_free_read(tdb, rec_ptr, &rec) == -1) {
+				goto fail;
+			}
+
+			/* move to the next record */
+			last_ptr = rec_ptr;
+			rec_ptr = rec.next;
+			*pnum_entries += 1;
+		}
 	}
 
 	ret = 0;
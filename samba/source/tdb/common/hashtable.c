@@ -0,0 +1,354 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - growable hash table
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+  A growable database (TDB_VERSION_GROWABLE) uses linear hashing. The
+  header's hash_buckets says how many chains are in use. With S the
+  hash_size the database was created with and size the largest S*2^n
+  not above that, a hash lives in chain hash % size, or in chain
+  hash % (2*size) if the first has already been split.
+
+  Chain b is split by moving the records that belong in chain
+  b + size there and bumping hash_buckets. Both chains are congruent
+  modulo S, so both are covered by lock BUCKET(b), which is the only
+  lock the split needs besides the one that stops two splits, a
+  traverse or a transaction from running at once. Nobody holding
+  another lock ever sees the mapping of its own chain change.
+
+  The first S chain heads are the usual hash table after the header.
+  Chains from S*2^i up to S*2^(i+1) live in segment i, a record that
+  is on no chain and is allocated when the split reaches it.
+*/
+
+#include "tdb_private.h"
+
+/* number of chains in use */
+u32 tdb_hash_buckets(struct tdb_context *tdb)
+{
+	u32 n;
+
+	/* always read it, another process may have split a chain or
+	   made the database growable since we looked */
+	if (tdb_ofs_read(tdb, TDB_HASH_BUCKETS_OFS, &n) == -1 ||
+	    n < tdb->header.hash_size) {
+		return tdb->header.hash_size;
+	}
+	return n;
+}
+
+/* the largest hash_size * 2^i that is <= n */
+static u32 tdb_hash_level_size(struct tdb_context *tdb, u32 n)
+{
+	u32 size = tdb->header.hash_size;
+
+	while (n / 2 >= size) {
+		size *= 2;
+	}
+	return size;
+}
+
+static u32 tdb_bucket_of(struct tdb_context *tdb, u32 n, u32 hash)
+{
+	u32 size, b;
+
+	if (n == tdb->header.hash_size) {
+		return BUCKET(hash);
+	}
+	size = tdb_hash_level_size(tdb, n);
+	b = hash % size;
+	if (b < n - size) {
+		b = hash % (2 * size);
+	}
+	return b;
+}
+
+/* the chain a hash lives in. Stable while lock BUCKET(hash) is held.
+   The chain number of a chain in use maps to itself. */
+u32 tdb_hash_bucket(struct tdb_context *tdb, u32 hash)
+{
+	return tdb_bucket_of(tdb, tdb_hash_buckets(tdb), hash);
+}
+
+/* offset of the head of chain b, or 0 if its segment isn't there. If
+   pend is given it is set to the first chain whose head doesn't follow
+   on from b's in the same array */
+tdb_off_t tdb_bucket_top(struct tdb_context *tdb, u32 b, u32 *pend)
+{
+	u32 base = tdb->header.hash_size;
+	int i = 0;
+
+	if (b < base) {
+		if (pend) {
+			*pend = base;
+		}
+		return FREELIST_TOP + (b+1)*sizeof(tdb_off_t);
+	}
+
+	while (b / 2 >= base) {
+		base *= 2;
+		i++;
+	}
+	if (pend) {
+		*pend = 2 * base;
+	}
+
+	if (tdb->header.hash_segments[i] == 0) {
+		/* allocated by someone else since we read the header */
+		tdb_ofs_read(tdb, TDB_HASH_SEGMENT_OFS(i),
+			     &tdb->header.hash_segments[i]);
+		if (tdb->header.hash_segments[i] == 0) {
+			return 0;
+		}
+	}
+	return tdb->header.hash_segments[i] + (b - base)*sizeof(tdb_off_t);
+}
+
+/* offset of the head of the chain for a hash */
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, u32 hash)
+{
+	return tdb_bucket_top(tdb, tdb_hash_bucket(tdb, hash), NULL);
+}
+
+/*
+  allocate segment i, holding the heads of the chains from
+  hash_size*2^i on
+*/
+static int tdb_hash_new_segment(struct tdb_context *tdb, int i, u32 size)
+{
+	struct list_struct rec;
+	tdb_off_t rec_ptr, seg, off;
+	tdb_len_t len = size * sizeof(tdb_off_t);
+	char buf[1024];
+
+	rec_ptr = tdb_allocate(tdb, len, &rec);
+	if (rec_ptr == 0) {
+		return -1;
+	}
+
+	/* this record is on no chain, so nothing will ever free it */
+	rec.next = 0;
+	rec.key_len = 0;
+	rec.data_len = len;
+	rec.full_hash = 0;
+	if (tdb_rec_write(tdb, rec_ptr, &rec) == -1) {
+		return -1;
+	}
+
+	seg = rec_ptr + sizeof(rec);
+	memset(buf, 0, sizeof(buf));
+	for (off = 0; off < len; off += sizeof(buf)) {
+		tdb_len_t n = MIN(sizeof(buf), len - off);
+		if (tdb->methods->tdb_write(tdb, seg + off, buf, n) == -1) {
+			return -1;
+		}
+	}
+
+	if (tdb_ofs_write(tdb, TDB_HASH_SEGMENT_OFS(i), &seg) == -1) {
+		return -1;
+	}
+	tdb->header.hash_segments[i] = seg;
+	return 0;
+}
+
+/*
+  split the next chain. The caller holds the transaction lock so no
+  other split, traverse or transaction is running.
+*/
+static int tdb_hash_split(struct tdb_context *tdb)
+{
+	u32 n, size, split, hash;
+	tdb_off_t rec_ptr, old_last, new_last, zero = 0;
+	struct list_struct rec;
+	int ret = -1;
+
+	n = tdb_hash_buckets(tdb);
+	size = tdb_hash_level_size(tdb, n);
+	split = n - size;
+
+	if (split == 0) {
+		int i = 0;
+		u32 s;
+
+		for (s = tdb->header.hash_size; s < size; s *= 2) {
+			i++;
+		}
+		if (i >= TDB_HASH_SEGMENTS || size * 2 < size) {
+			TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_hash_split: "
+				 "%s can't grow beyond %u chains\n",
+				 tdb->name, n));
+			tdb->ecode = TDB_ERR_EINVAL;
+			return -1;
+		}
+		if (tdb->header.hash_segments[i] == 0 &&
+		    tdb_ofs_read(tdb, TDB_HASH_SEGMENT_OFS(i),
+				 &tdb->header.hash_segments[i]) == -1) {
+			return -1;
+		}
+		if (tdb->header.hash_segments[i] == 0 &&
+		    tdb_hash_new_segment(tdb, i, size) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_hash_split: failed "
+				 "to allocate chains %u to %u\n", size,
+				 2*size - 1));
+			return -1;
+		}
+	}
+
+	if (tdb_lock(tdb, BUCKET(split), F_WRLCK) == -1) {
+		return -1;
+	}
+
+	old_last = tdb_bucket_top(tdb, split, NULL);
+	new_last = tdb_bucket_top(tdb, n, NULL);
+
+	if (tdb_ofs_read(tdb, old_last, &rec_ptr) == -1) {
+		goto out;
+	}
+
+	/* relink each record onto the end of the chain it now belongs in */
+	while (rec_ptr) {
+		if (tdb_rec_read(tdb, rec_ptr, &rec) == -1) {
+			goto out;
+		}
+		hash = rec.full_hash % (2 * size);
+		if (hash == split) {
+			if (tdb_ofs_write(tdb, old_last, &rec_ptr) == -1) {
+				goto out;
+			}
+			old_last = rec_ptr;
+		} else {
+			if (tdb_ofs_write(tdb, new_last, &rec_ptr) == -1) {
+				goto out;
+			}
+			new_last = rec_ptr;
+		}
+		rec_ptr = rec.next;
+	}
+
+	n++;
+	if (tdb_ofs_write(tdb, old_last, &zero) == -1 ||
+	    tdb_ofs_write(tdb, new_last, &zero) == -1 ||
+	    tdb_ofs_write(tdb, TDB_HASH_BUCKETS_OFS, &n) == -1) {
+		goto out;
+	}
+	ret = 0;
+
+ out:
+	tdb_unlock(tdb, BUCKET(split), F_WRLCK);
+	return ret;
+}
+
+/* make a fixed size database growable. The chains don't move. */
+static int tdb_hash_make_growable(struct tdb_context *tdb)
+{
+	u32 version = TDB_VERSION_GROWABLE;
+	u32 n = tdb->header.hash_size;
+
+	if (tdb_ofs_write(tdb, TDB_HASH_BUCKETS_OFS, &n) == -1 ||
+	    tdb_ofs_write(tdb, offsetof(struct tdb_header, version),
+			  &version) == -1) {
+		return -1;
+	}
+	tdb->header.version = TDB_VERSION_GROWABLE;
+	tdb->header.hash_buckets = n;
+	return 0;
+}
+
+static int tdb_hash_can_grow(struct tdb_context *tdb)
+{
+	/* fcntl locks don't nest: a split inside our own traverse or
+	   transaction would get the transaction lock */
+	return !(tdb->read_only || tdb->traverse_read ||
+		 tdb->transaction != NULL || tdb->travlocks.next != NULL ||
+		 tdb->num_locks != 0 || tdb->global_lock.count != 0);
+}
+
+/*
+  called after a store. If lookups have been walking long chains, split
+  one, unless someone else is already splitting, traversing or in a
+  transaction.
+*/
+void tdb_hash_maybe_grow(struct tdb_context *tdb)
+{
+	u32 n;
+
+	if (tdb->chain_walk <= 16*TDB_HASH_GROW_WALK ||
+	    !tdb_hash_can_grow(tdb)) {
+		return;
+	}
+	if (tdb_ofs_read(tdb, TDB_HASH_BUCKETS_OFS, &n) == -1 || n == 0) {
+		/* not a growable database */
+		return;
+	}
+
+	if (tdb->methods->tdb_brlock(tdb, TRANSACTION_LOCK, F_WRLCK,
+				     F_SETLK, 1, 1) == -1) {
+		return;
+	}
+	if (tdb_hash_split(tdb) == 0) {
+		/* let the next lookups tell us whether that was enough */
+		tdb->chain_walk = 16*TDB_HASH_GROW_WALK;
+	}
+	tdb->methods->tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLK, 1, 1);
+}
+
+/*
+  double the number of hash chains, making the database growable first
+  if it isn't. Other users can carry on while this runs.
+*/
+int tdb_hash_grow(struct tdb_context *tdb)
+{
+	u32 n, target;
+	int ret = -1;
+
+	if (!tdb_hash_can_grow(tdb)) {
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	if (tdb->methods->tdb_brlock(tdb, TRANSACTION_LOCK, F_WRLCK,
+				     F_SETLKW, 0, 1) == -1) {
+		return -1;
+	}
+
+	if (tdb_ofs_read(tdb, TDB_HASH_BUCKETS_OFS, &n) == -1) {
+		goto out;
+	}
+	if (n == 0) {
+		if (tdb_hash_make_growable(tdb) == -1) {
+			goto out;
+		}
+		n = tdb->header.hash_size;
+	}
+
+	for (target = 2*n; n < target; n++) {
+		if (tdb_hash_split(tdb) == -1) {
+			goto out;
+		}
+	}
+	ret = 0;
+
+ out:
+	tdb->methods->tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	return ret;
+}
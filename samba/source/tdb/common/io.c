@@ -63,11 +63,26 @@ static int tdb_oob(struct tdb_context *tdb, tdb_off_t len, int probe)
 		return TDB_ERRCODE(TDB_ERR_IO, -1);
 	}
 
+#if defined(HAVE_MMAP) && defined(HAVE_MREMAP)
+	/* grow the mapping where it is if we can, or let it move */
+	if (tdb->map_ptr) {
+		void *p = mremap(tdb->map_ptr, tdb->map_size, st.st_size,
+				 MREMAP_MAYMOVE);
+		if (p != MAP_FAILED) {
+			tdb->map_ptr = p;
+			tdb->map_size = st.st_size;
+			tdb->stats.remaps++;
+			return 0;
+		}
+	}
+#endif
+
 	/* Unmap, update size, remap */
 	if (tdb_munmap(tdb) == -1)
 		return TDB_ERRCODE(TDB_ERR_IO, -1);
 	tdb->map_size = st.st_size;
 	tdb_mmap(tdb);
+	tdb->stats.remaps++;
 	return 0;
 }
 
@@ -165,20 +180,40 @@ static int tdb_read(struct tdb_context *tdb, tdb_off_t off, void *buf,
 static void tdb_next_hash_chain(struct tdb_context *tdb, u32 *chain)
 {
 	u32 h = *chain;
-	if (tdb->map_ptr) {
-		for (;h < tdb->header.hash_size;h++) {
-			if (0 != *(u32 *)(TDB_HASH_TOP(h) + (unsigned char *)tdb->map_ptr)) {
-				break;
-			}
+	u32 n = tdb_hash_buckets(tdb);
+
+	while (h < n) {
+		u32 end;
+		tdb_off_t top = tdb_bucket_top(tdb, h, &end);
+
+		if (top == 0) {
+			break;
 		}
-	} else {
-		u32 off=0;
-		for (;h < tdb->header.hash_size;h++) {
-			if (tdb_ofs_read(tdb, TDB_HASH_TOP(h), &off) != 0 || off != 0) {
-				break;
+		if (end > n) {
+			end = n;
+		}
+
+		/* the heads of a grown table are in a record another
+		   process may have allocated beyond our mapping */
+		if (tdb->map_ptr &&
+		    tdb->methods->tdb_oob(tdb, top + (end-h)*sizeof(u32), 1) == 0 &&
+		    tdb->map_ptr) {
+			const u32 *heads = (const u32 *)(top + (unsigned char *)tdb->map_ptr);
+			for (;h < end;h++, heads++) {
+				if (0 != *heads) {
+					goto done;
+				}
+			}
+		} else {
+			u32 off=0;
+			for (;h < end;h++, top += sizeof(u32)) {
+				if (tdb_ofs_read(tdb, top, &off) != 0 || off != 0) {
+					goto done;
+				}
 			}
 		}
 	}
+done:
 	(*chain) = h;
 }
 
@@ -342,7 +377,9 @@ int tdb_expand(struct tdb_context *tdb, tdb_off_t size)
 
 		/* We're ok if the mmap fails as we'll fallback to read/write */
 		tdb_mmap(tdb);
+		tdb->stats.remaps++;
 	}
+	tdb->stats.expansions++;
 
 	/* form a new freelist record */
 	memset(&rec,'\0',sizeof(rec));
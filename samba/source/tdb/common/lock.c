@@ -45,7 +45,8 @@ int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset,
 	       int rw_type, int lck_type, int probe, size_t len)
 {
 	struct flock fl;
-	int ret;
+	struct timeval start;
+	int ret, waited = 0;
 
 	if (tdb->flags & TDB_NOLOCK) {
 		return 0;
@@ -62,6 +63,19 @@ int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset,
 	fl.l_len = len;
 	fl.l_pid = 0;
 
+	/* try without waiting first, so the stats can tell the locks
+	   we had to wait for */
+	if (lck_type == F_SETLKW && rw_type != F_UNLCK) {
+		if (fcntl(tdb->fd, F_SETLK, &fl) == 0) {
+			tdb->stats.locks++;
+			return 0;
+		}
+		if (errno == EAGAIN || errno == EACCES) {
+			gettimeofday(&start, NULL);
+			waited = 1;
+		}
+	}
+
 	do {
 		ret = fcntl(tdb->fd,lck_type,&fl);
 
@@ -73,6 +87,10 @@ int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset,
 		}
 	} while (ret == -1 && errno == EINTR);
 
+	if (waited) {
+		tdb_lock_waited(tdb, &start);
+	}
+
 	if (ret == -1) {
 		/* Generic lock error. errno set by fcntl.
 		 * EAGAIN is an expected return from non-blocking
@@ -85,9 +103,23 @@ int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset,
 		}
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
 	}
+	if (rw_type != F_UNLCK) {
+		tdb->stats.locks++;
+	}
 	return 0;
 }
 
+/* count a lock we had to wait for, since start */
+void tdb_lock_waited(struct tdb_context *tdb, const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	tdb->stats.lock_waits++;
+	tdb->stats.lock_wait_usec += (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+}
+
 
 /*
   upgrade a read lock to a write lock. This needs to be handled in a
@@ -120,7 +152,7 @@ int tdb_brlock_upgrade(struct tdb_context *tdb, tdb_off_t offset, size_t len)
 int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 {
 	struct tdb_lock_type *new_lck;
-	int i;
+	int i, ret;
 
 	/* a global lock allows us to avoid per chain locks */
 	if (tdb->global_lock.count && 
@@ -169,14 +201,33 @@ int tdb_lock(struct tdb_context *tdb, int list, int ltype)
 	tdb->lockrecs = new_lck;
 
 	/* Since fcntl locks don't nest, we do a lock for the first one,
-	   and simply bump the count for future ones */
-	if (tdb->methods->tdb_brlock(tdb,FREELIST_TOP+4*list,ltype,F_SETLKW,
-				     0, 1)) {
+	   and simply bump the count for future ones. Inside a transaction
+	   the allrecord mutex already covers us. */
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_lock(tdb, list, ltype);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb,FREELIST_TOP+4*list,ltype,
+					       F_SETLKW, 0, 1);
+	}
+	if (ret) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_lock failed on list %d "
 			 "ltype=%d (%s)\n",  list, ltype, strerror(errno)));
 		return -1;
 	}
 
+	/* a crash could roll a pending group commit back over what we
+	   are about to write */
+	if (ltype == F_WRLCK && tdb->transaction == NULL &&
+	    tdb_transaction_flush(tdb) == -1) {
+		if (tdb_have_mutexes(tdb)) {
+			tdb_mutex_unlock(tdb, list);
+		} else {
+			tdb->methods->tdb_brlock(tdb, FREELIST_TOP+4*list,
+						 F_UNLCK, F_SETLKW, 0, 1);
+		}
+		return -1;
+	}
+
 	tdb->num_locks++;
 
 	tdb->lockrecs[tdb->num_lockrecs].list = list;
@@ -239,8 +290,12 @@ int tdb_unlock(struct tdb_context *tdb, int list, int ltype)
 	 * anyway.
 	 */
 
-	ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP+4*list, F_UNLCK,
-				       F_SETLKW, 0, 1);
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_unlock(tdb, list);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP+4*list,
+					       F_UNLCK, F_SETLKW, 0, 1);
+	}
 	tdb->num_locks--;
 
 	/*
@@ -272,6 +327,8 @@ int tdb_unlock(struct tdb_context *tdb, int list, int ltype)
 /* lock/unlock entire database */
 static int _tdb_lockall(struct tdb_context *tdb, int ltype)
 {
+	int ret;
+
 	/* There are no locks on read-only dbs */
 	if (tdb->read_only || tdb->traverse_read)
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
@@ -291,12 +348,30 @@ static int _tdb_lockall(struct tdb_context *tdb, int ltype)
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
 	}
 
-	if (tdb->methods->tdb_brlock(tdb, FREELIST_TOP, ltype, F_SETLKW, 
-				     0, 4*tdb->header.hash_size)) {
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_allrecord_lock(tdb, ltype);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP, ltype,
+					       F_SETLKW, 0,
+					       4*tdb->header.hash_size);
+	}
+	if (ret) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_lockall failed (%s)\n", strerror(errno)));
 		return -1;
 	}
 
+	if (ltype == F_WRLCK && tdb->transaction == NULL &&
+	    tdb_transaction_flush(tdb) == -1) {
+		if (tdb_have_mutexes(tdb)) {
+			tdb_mutex_allrecord_unlock(tdb);
+		} else {
+			tdb->methods->tdb_brlock(tdb, FREELIST_TOP, F_UNLCK,
+						 F_SETLKW, 0,
+						 4*tdb->header.hash_size);
+		}
+		return -1;
+	}
+
 	tdb->global_lock.count = 1;
 	tdb->global_lock.ltype = ltype;
 
@@ -306,6 +381,8 @@ static int _tdb_lockall(struct tdb_context *tdb, int ltype)
 /* unlock entire db */
 static int _tdb_unlockall(struct tdb_context *tdb, int ltype)
 {
+	int ret;
+
 	/* There are no locks on read-only dbs */
 	if (tdb->read_only || tdb->traverse_read) {
 		return TDB_ERRCODE(TDB_ERR_LOCK, -1);
@@ -320,8 +397,14 @@ static int _tdb_unlockall(struct tdb_context *tdb, int ltype)
 		return 0;
 	}
 
-	if (tdb->methods->tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 
-				     0, 4*tdb->header.hash_size)) {
+	if (tdb_have_mutexes(tdb) && tdb->transaction == NULL) {
+		ret = tdb_mutex_allrecord_unlock(tdb);
+	} else {
+		ret = tdb->methods->tdb_brlock(tdb, FREELIST_TOP, F_UNLCK,
+					       F_SETLKW, 0,
+					       4*tdb->header.hash_size);
+	}
+	if (ret) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_unlockall failed (%s)\n", strerror(errno)));
 		return -1;
 	}
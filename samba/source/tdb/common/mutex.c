@@ -0,0 +1,467 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - robust mutex locking
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+  A database created with TDB_MUTEX_LOCKING carries an area of process
+  shared, robust pthread mutexes after its hash table: one for the
+  freelist and one for each hash chain. tdb_lock() takes these instead
+  of fcntl locks, so an uncontended chain lock is a couple of atomic
+  operations rather than two system calls.
+
+  A mutex can't be share locked, so chain read locks are exclusive.
+
+  The allrecord lock (tdb_lockall() and transactions) is a separate
+  mutex plus a marker saying which kind of allrecord lock is wanted.
+  Chain lockers look at the marker once they hold their chain and
+  back off if it conflicts. The allrecord locker sets the marker and
+  then waits for a moment at which it holds every chain mutex at once,
+  after which nobody can be inside a chain it excludes.
+
+  fcntl locks are still used for the global, active and transaction
+  locks, and for the record locks taken by traversals.
+*/
+
+#include "tdb_private.h"
+
+#if defined(HAVE_ROBUST_MUTEXES) && defined(HAVE_MMAP)
+
+#include <pthread.h>
+
+/* values of allrecord_draining */
+#define DRAIN_NONE	0
+#define DRAIN_LOCK	1	/* a new allrecord lock is being taken */
+#define DRAIN_UPGRADE	2	/* a read allrecord lock is becoming a write lock */
+
+struct tdb_mutexes {
+	pthread_mutex_t allrecord_mutex;
+	volatile short allrecord_lock;	/* F_UNLCK, F_RDLCK or F_WRLCK */
+	volatile short allrecord_draining;
+	pthread_mutex_t hashchains[1];	/* the freelist, then the chains */
+};
+
+int tdb_mutex_supported(void)
+{
+	return 1;
+}
+
+/*
+  bytes needed for the mutexes of a database with hash_size chains. The
+  last tdb_off_t of the area is left for the tailer of the record that
+  covers it.
+*/
+tdb_len_t tdb_mutex_size(u32 hash_size)
+{
+	return offsetof(struct tdb_mutexes, hashchains) +
+		(hash_size + 1) * sizeof(pthread_mutex_t) + sizeof(tdb_off_t);
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	void *ptr;
+
+	/* mutexes are in native format, they can't be shared with
+	   another architecture */
+	if ((tdb->flags & TDB_CONVERT) ||
+	    (tdb->header.mutex_offset % tdb->page_size) != 0 ||
+	    tdb->header.mutex_size < tdb_mutex_size(tdb->header.hash_size)) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: unusable mutex "
+			 "area at %u size %u\n", tdb->header.mutex_offset,
+			 tdb->header.mutex_size));
+		errno = EINVAL;
+		return -1;
+	}
+
+	ptr = mmap(NULL, tdb->header.mutex_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_FILE, tdb->fd, tdb->header.mutex_offset);
+	if (ptr == MAP_FAILED) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: mmap failed "
+			 "(%s)\n", strerror(errno)));
+		return -1;
+	}
+
+	tdb->mutexes = (struct tdb_mutexes *)ptr;
+	return 0;
+}
+
+void tdb_mutex_munmap(struct tdb_context *tdb)
+{
+	if (tdb->mutexes == NULL) {
+		return;
+	}
+	munmap((void *)tdb->mutexes, tdb->header.mutex_size);
+	tdb->mutexes = NULL;
+}
+
+/*
+  initialise the mutexes of a database we have just created. Nobody
+  else can be using it as we hold the global lock.
+*/
+int tdb_mutex_init(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	pthread_mutexattr_t ma;
+	u32 i;
+	int ret;
+
+	ret = pthread_mutexattr_init(&ma);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	ret = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	if (ret == 0) {
+		ret = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	}
+	if (ret == 0) {
+		ret = pthread_mutex_init(&m->allrecord_mutex, &ma);
+	}
+	for (i = 0; ret == 0 && i <= tdb->header.hash_size; i++) {
+		ret = pthread_mutex_init(&m->hashchains[i], &ma);
+	}
+	pthread_mutexattr_destroy(&ma);
+
+	if (ret != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_init: failed to "
+			 "initialise mutexes (%s)\n", strerror(ret)));
+		errno = ret;
+		return -1;
+	}
+
+	m->allrecord_lock = F_UNLCK;
+	m->allrecord_draining = DRAIN_NONE;
+	return 0;
+}
+
+/*
+  take a mutex, recovering it if its owner died. The data it protected
+  is left as a crashed fcntl locker would have left it.
+
+  pthread_mutex_lock() can't be interrupted, so when the caller has set
+  up an alarm (see tdb_setalarm_sigptr()) we wait in short slices and
+  give up with EINTR once it has fired.
+*/
+static int mutex_lock(struct tdb_context *tdb, pthread_mutex_t *mutex,
+		      int *owner_died)
+{
+	struct timeval start;
+	int ret;
+
+	/* only time the locks we have to wait for */
+	ret = pthread_mutex_trylock(mutex);
+	if (ret != EBUSY) {
+		goto locked;
+	}
+	gettimeofday(&start, NULL);
+
+	if (tdb->interrupt_sig_ptr == NULL) {
+		ret = pthread_mutex_lock(mutex);
+	} else {
+		do {
+			struct timeval tv;
+			struct timespec ts;
+
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = (tv.tv_usec + 100000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000;
+			}
+			ret = pthread_mutex_timedlock(mutex, &ts);
+			if (ret == ETIMEDOUT && *tdb->interrupt_sig_ptr) {
+				ret = EINTR;
+			}
+		} while (ret == ETIMEDOUT);
+	}
+	tdb_lock_waited(tdb, &start);
+
+ locked:
+	if (ret == 0 || ret == EOWNERDEAD) {
+		tdb->stats.locks++;
+	}
+	if (owner_died != NULL) {
+		*owner_died = (ret == EOWNERDEAD);
+	}
+	if (ret == EOWNERDEAD) {
+		ret = pthread_mutex_consistent(mutex);
+	}
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/* wait for the current allrecord lock holder, if any, to go away */
+static int allrecord_wait(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int died;
+
+	if (mutex_lock(tdb, &m->allrecord_mutex, &died) == -1) {
+		return -1;
+	}
+	if (died) {
+		m->allrecord_lock = F_UNLCK;
+		m->allrecord_draining = DRAIN_NONE;
+	}
+	pthread_mutex_unlock(&m->allrecord_mutex);
+	return 0;
+}
+
+/* lock a list in the database. list -1 is the freelist */
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	pthread_mutex_t *chain = &m->hashchains[list+1];
+	int nested = (tdb->num_locks != 0);
+
+	while (1) {
+		int allrecord, draining;
+
+		if (mutex_lock(tdb, chain, NULL) == -1) {
+			return -1;
+		}
+
+		allrecord = m->allrecord_lock;
+		draining = m->allrecord_draining;
+
+		if (allrecord == F_UNLCK ||
+		    (allrecord == F_RDLCK && ltype == F_RDLCK)) {
+			return 0;
+		}
+
+		/* A new allrecord lock can't be granted while we hold
+		   another chain, so it's safe to carry on. Backing off
+		   would deadlock against it waiting for our chain. */
+		if (nested && draining == DRAIN_LOCK) {
+			return 0;
+		}
+
+		pthread_mutex_unlock(chain);
+
+		if (!nested) {
+			if (allrecord_wait(tdb) == -1) {
+				return -1;
+			}
+			continue;
+		}
+
+		/* A transaction is committing and needs the chain we
+		   hold, while we need a chain it has read. This is the
+		   deadlock fcntl would have reported. */
+		if (draining == DRAIN_UPGRADE) {
+			errno = EDEADLK;
+			return -1;
+		}
+
+		/* The allrecord holder may yet upgrade and need our
+		   chain, so poll rather than block behind it. */
+		{
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 1000;
+			select(0, NULL, NULL, NULL, &tv);
+		}
+		if (tdb->interrupt_sig_ptr && *tdb->interrupt_sig_ptr) {
+			errno = EINTR;
+			return -1;
+		}
+	}
+}
+
+int tdb_mutex_unlock(struct tdb_context *tdb, int list)
+{
+	int ret;
+
+	ret = pthread_mutex_unlock(&tdb->mutexes->hashchains[list+1]);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  wait until we hold every chain mutex at the same time. Chain lockers
+  that see the allrecord marker after that stay out, so once this
+  returns nobody holds a chain in a conflicting mode.
+*/
+static int allrecord_drain(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	u32 i, j, n = tdb->header.hash_size + 1;
+	int ret;
+
+again:
+	for (i = 0; i < n; i++) {
+		ret = pthread_mutex_trylock(&m->hashchains[i]);
+		if (ret == EOWNERDEAD) {
+			ret = pthread_mutex_consistent(&m->hashchains[i]);
+		}
+		if (ret == 0) {
+			continue;
+		}
+
+		for (j = 0; j < i; j++) {
+			pthread_mutex_unlock(&m->hashchains[j]);
+		}
+		if (ret != EBUSY) {
+			errno = ret;
+			return -1;
+		}
+
+		/* wait for the holder of this one and start again */
+		if (mutex_lock(tdb, &m->hashchains[i], NULL) == -1) {
+			return -1;
+		}
+		pthread_mutex_unlock(&m->hashchains[i]);
+		goto again;
+	}
+
+	m->allrecord_draining = DRAIN_NONE;
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_unlock(&m->hashchains[i]);
+	}
+	return 0;
+}
+
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+
+	if (mutex_lock(tdb, &m->allrecord_mutex, NULL) == -1) {
+		return -1;
+	}
+
+	m->allrecord_lock = ltype;
+	m->allrecord_draining = DRAIN_LOCK;
+
+	if (allrecord_drain(tdb) == -1) {
+		int saved_errno = errno;
+		m->allrecord_lock = F_UNLCK;
+		m->allrecord_draining = DRAIN_NONE;
+		pthread_mutex_unlock(&m->allrecord_mutex);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+
+	m->allrecord_lock = F_WRLCK;
+	m->allrecord_draining = DRAIN_UPGRADE;
+
+	if (allrecord_drain(tdb) == -1) {
+		m->allrecord_lock = F_RDLCK;
+		m->allrecord_draining = DRAIN_NONE;
+		return -1;
+	}
+	return 0;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	struct tdb_mutexes *m = tdb->mutexes;
+	int ret;
+
+	m->allrecord_lock = F_UNLCK;
+	m->allrecord_draining = DRAIN_NONE;
+
+	ret = pthread_mutex_unlock(&m->allrecord_mutex);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+/* without robust mutexes TDB_MUTEX_LOCKING is ignored, and databases
+   created with it can't be opened read-write */
+
+int tdb_mutex_supported(void)
+{
+	return 0;
+}
+
+tdb_len_t tdb_mutex_size(u32 hash_size)
+{
+	return 0;
+}
+
+int tdb_mutex_mmap(struct tdb_context *tdb)
+{
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_mutex_mmap: %s uses mutex locking "
+		 "which is not supported on this system\n", tdb->name));
+	errno = EINVAL;
+	return -1;
+}
+
+void tdb_mutex_munmap(struct tdb_context *tdb)
+{
+}
+
+int tdb_mutex_init(struct tdb_context *tdb)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_unlock(struct tdb_context *tdb, int list)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+#endif
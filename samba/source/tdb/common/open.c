@@ -46,6 +46,31 @@ static unsigned int default_tdb_hash(TDB_DATA *key)
 }
 
 
+/* the mutex area of a new database is the end of a record that is on
+   no hash chain, so the rest of tdb never looks inside it. Its tailer
+   is the last word of the area. */
+static int tdb_new_mutex_area(struct tdb_context *tdb, tdb_off_t rec_off,
+			      tdb_off_t mutex_offset, tdb_len_t mutex_size)
+{
+	struct list_struct rec;
+	tdb_off_t totalsize = mutex_offset + mutex_size - rec_off;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.rec_len = totalsize - sizeof(rec);
+	rec.magic = TDB_MAGIC;
+
+	if (ftruncate(tdb->fd, mutex_offset + mutex_size) == -1 ||
+	    pwrite(tdb->fd, &rec, sizeof(rec), rec_off) != sizeof(rec) ||
+	    pwrite(tdb->fd, &totalsize, sizeof(totalsize),
+		   mutex_offset + mutex_size - sizeof(totalsize))
+	    != sizeof(totalsize)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_new_mutex_area: failed "
+			 "to write mutex area (%s)\n", strerror(errno)));
+		return -1;
+	}
+	return 0;
+}
+
 /* initialise a new database with a specified hash size */
 static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 {
@@ -62,6 +87,16 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 	/* Fill in the header */
 	newdb->version = TDB_VERSION;
 	newdb->hash_size = hash_size;
+	if (tdb->flags & TDB_GROWABLE) {
+		newdb->version = TDB_VERSION_GROWABLE;
+		newdb->hash_buckets = hash_size;
+	}
+	if (tdb->flags & TDB_MUTEX_LOCKING) {
+		newdb->mutex_offset = TDB_ALIGN(size + sizeof(struct list_struct),
+						tdb->page_size);
+		newdb->mutex_size = TDB_ALIGN(tdb_mutex_size(hash_size),
+					      tdb->page_size);
+	}
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->map_size = size;
 		tdb->map_ptr = (char *)newdb;
@@ -99,6 +134,11 @@ static int tdb_new_database(struct tdb_context *tdb, int hash_size)
 		}
 	}
 
+	if (ret == 0 && tdb->header.mutex_size != 0) {
+		ret = tdb_new_mutex_area(tdb, size, tdb->header.mutex_offset,
+					 tdb->header.mutex_size);
+	}
+
   fail:
 	SAFE_FREE(newdb);
 	return ret;
@@ -120,6 +160,99 @@ static int tdb_already_open(dev_t device,
 	return 0;
 }
 
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SHM_FCNTL_LOCK)
+/*
+  shared memory objects live in a namespace anyone can create names in,
+  so only trust one that is ours (or root's) and that nobody else can
+  write to. Otherwise someone could feed us records of their choosing.
+  Others may read it, as they may read the file it replaces.
+*/
+static int tdb_shm_trusted(struct tdb_context *tdb, int fd,
+			   const char *shm_name)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1) {
+		return 0;
+	}
+	if ((st.st_uid != geteuid() && st.st_uid != 0) ||
+	    (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_open_ex: not using "
+			 "shared memory object %s owned by uid %u with mode "
+			 "0%o\n", shm_name, (unsigned int)st.st_uid,
+			 (unsigned int)(st.st_mode & 07777)));
+		return 0;
+	}
+	return 1;
+}
+
+static int tdb_shm_open(struct tdb_context *tdb, const char *shm_name,
+			int open_flags, mode_t mode)
+{
+	int shm_flags = open_flags & (O_ACCMODE|O_CREAT|O_EXCL|O_TRUNC);
+	int fd;
+
+	fd = shm_open(shm_name, shm_flags, mode);
+	if (fd == -1 || tdb_shm_trusted(tdb, fd, shm_name)) {
+		return fd;
+	}
+	close(fd);
+
+	/* the contents of a CLEAR_IF_FIRST database don't matter, so
+	   replace the object with one of our own */
+	if ((tdb->flags & TDB_CLEAR_IF_FIRST) && (shm_flags & O_CREAT) &&
+	    shm_unlink(shm_name) == 0) {
+		fd = shm_open(shm_name, shm_flags | O_EXCL, mode);
+		if (fd != -1) {
+			return fd;
+		}
+	}
+	errno = EACCES;
+	return -1;
+}
+#endif
+
+/*
+  open the file behind a database. A TDB_VOLATILE database lives in a
+  shared memory object named after its path, so it is never written
+  back to disk. Where there is none we can trust, and nobody is
+  creating one, the path is used as usual and TDB_VOLATILE dropped.
+*/
+static int tdb_open_fd(struct tdb_context *tdb, const char *name,
+		       int open_flags, mode_t mode)
+{
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SHM_FCNTL_LOCK)
+	if (tdb->flags & TDB_VOLATILE) {
+		char *shm_name, *p;
+		int fd;
+
+		shm_name = (char *)malloc(strlen(name) + 2);
+		if (shm_name == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		shm_name[0] = '/';
+		strcpy(shm_name + 1, name);
+		for (p = shm_name + 1; *p; p++) {
+			if (*p == '/') {
+				*p = '_';
+			}
+		}
+
+		fd = tdb_shm_open(tdb, shm_name, open_flags, mode);
+		if (fd != -1) {
+			free(shm_name);
+			return fd;
+		}
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_open_ex: no shared memory "
+			 "object %s: %s\n", shm_name, strerror(errno)));
+		free(shm_name);
+	}
+#endif
+	tdb->flags &= ~TDB_VOLATILE;
+	return open(name, open_flags, mode);
+}
+
 /* open the database, creating it if necessary 
 
    The open_flags and mode are passed straight to the open call on the
@@ -150,7 +283,7 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 {
 	struct tdb_context *tdb;
 	struct stat st;
-	int rev = 0, locked = 0;
+	int rev = 0, locked = 0, created = 0, alone;
 	unsigned char *vp;
 	u32 vertest;
 
@@ -195,6 +328,21 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		tdb->flags &= ~TDB_CLEAR_IF_FIRST;
 	}
 
+	/* cached fetches are only as good as the sequence number */
+	if (tdb->flags & TDB_FETCH_CACHE) {
+		tdb->flags |= TDB_SEQNUM;
+	}
+
+	/* mutexes are only set up by whoever creates the file, so they
+	   need CLEAR_IF_FIRST. Otherwise quietly use fcntl locks. */
+	if ((tdb->flags & TDB_MUTEX_LOCKING) &&
+	    ((tdb->flags & (TDB_INTERNAL|TDB_NOLOCK|TDB_CONVERT)) ||
+	     !(tdb->flags & TDB_CLEAR_IF_FIRST) || !tdb_mutex_supported())) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_open_ex: not using mutex "
+			 "locking for %s\n", name ? name : "(internal)"));
+		tdb->flags &= ~TDB_MUTEX_LOCKING;
+	}
+
 	/* internal databases don't mmap or lock, and start off cleared */
 	if (tdb->flags & TDB_INTERNAL) {
 		tdb->flags |= (TDB_NOLOCK | TDB_NOMMAP);
@@ -206,7 +354,7 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		goto internal;
 	}
 
-	if ((tdb->fd = open(name, open_flags, mode)) == -1) {
+	if ((tdb->fd = tdb_open_fd(tdb, name, open_flags, mode)) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_WARNING, "tdb_open_ex: could not open file %s: %s\n",
 			 name, strerror(errno)));
 		goto fail;	/* errno set by open(2) */
@@ -235,7 +383,9 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	if (read(tdb->fd, &tdb->header, sizeof(tdb->header)) != sizeof(tdb->header)
 	    || strcmp(tdb->header.magic_food, TDB_MAGIC_FOOD) != 0
 	    || (tdb->header.version != TDB_VERSION
-		&& !(rev = (tdb->header.version==TDB_BYTEREV(TDB_VERSION))))) {
+		&& tdb->header.version != TDB_VERSION_GROWABLE
+		&& !(rev = (tdb->header.version==TDB_BYTEREV(TDB_VERSION) ||
+			    tdb->header.version==TDB_BYTEREV(TDB_VERSION_GROWABLE))))) {
 		/* its not a valid database - possibly initialise it */
 		if (!(open_flags & O_CREAT) || tdb_new_database(tdb, hash_size) == -1) {
 			if (errno == 0) {
@@ -244,11 +394,13 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 			goto fail;
 		}
 		rev = (tdb->flags & TDB_CONVERT);
+		created = 1;
 	}
 	vp = (unsigned char *)&tdb->header.version;
 	vertest = (((u32)vp[0]) << 24) | (((u32)vp[1]) << 16) |
 		  (((u32)vp[2]) << 8) | (u32)vp[3];
-	tdb->flags |= (vertest==TDB_VERSION) ? TDB_BIGENDIAN : 0;
+	tdb->flags |= (vertest==TDB_VERSION || vertest==TDB_VERSION_GROWABLE) ?
+		TDB_BIGENDIAN : 0;
 	if (!rev)
 		tdb->flags &= ~TDB_CONVERT;
 	else {
@@ -277,6 +429,20 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 		goto fail;
 	}
 
+	/* every locking user of a database with mutexes has to use them,
+	   whatever flags it was opened with */
+	if (tdb->header.mutex_offset != 0 && !(tdb->flags & TDB_NOLOCK)) {
+		if (tdb_mutex_mmap(tdb) == -1) {
+			goto fail;
+		}
+		if (created && tdb_mutex_init(tdb) == -1) {
+			goto fail;
+		}
+		tdb->flags |= TDB_MUTEX_LOCKING;
+	} else {
+		tdb->flags &= ~TDB_MUTEX_LOCKING;
+	}
+
 	tdb->map_size = st.st_size;
 	tdb->device = st.st_dev;
 	tdb->inode = st.st_ino;
@@ -302,8 +468,22 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 			goto fail;
 	}
 
-	/* if needed, run recovery */
-	if (tdb_transaction_recover(tdb) == -1) {
+	/* if needed, run recovery. A group commit that isn't on disk
+	   yet belongs to whoever else has the file open, if anyone */
+	alone = !tdb->read_only &&
+		tdb->methods->tdb_brlock(tdb, OPEN_LOCK, F_WRLCK, F_SETLK, 1, 1) == 0;
+	if ((alone || tdb_transaction_pending(tdb) != 1) &&
+	    tdb_transaction_recover(tdb) == -1) {
+		goto fail;
+	}
+
+	/* then bring it up to date with its log, if it has one */
+	if (tdb_wal_open(tdb, alone) == -1) {
+		goto fail;
+	}
+
+	/* let later openers know we have it open */
+	if (tdb->methods->tdb_brlock(tdb, OPEN_LOCK, F_RDLCK, F_SETLKW, 0, 1) == -1) {
 		goto fail;
 	}
 
@@ -323,6 +503,9 @@ struct tdb_context *tdb_open_ex(const char *name, int hash_size, int tdb_flags,
 	if (!tdb)
 		return NULL;
 	
+	tdb_cache_free(tdb);
+	tdb_wal_close(tdb);
+	tdb_mutex_munmap(tdb);
 	if (tdb->map_ptr) {
 		if (tdb->flags & TDB_INTERNAL)
 			SAFE_FREE(tdb->map_ptr);
@@ -362,6 +545,9 @@ int tdb_close(struct tdb_context *tdb)
 		tdb_transaction_cancel(tdb);
 	}
 
+	tdb_cache_free(tdb);
+	tdb_wal_close(tdb);
+	tdb_mutex_munmap(tdb);
 	if (tdb->map_ptr) {
 		if (tdb->flags & TDB_INTERNAL)
 			SAFE_FREE(tdb->map_ptr);
@@ -419,13 +605,16 @@ int tdb_reopen(struct tdb_context *tdb)
 		goto fail;
 	}
 
+	tdb_cache_free(tdb);
+
 	if (tdb_munmap(tdb) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: munmap failed (%s)\n", strerror(errno)));
 		goto fail;
 	}
 	if (close(tdb->fd) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: WARNING closing tdb->fd failed!\n"));
-	tdb->fd = open(tdb->name, tdb->open_flags & ~(O_CREAT|O_TRUNC), 0);
+	tdb->fd = tdb_open_fd(tdb, tdb->name,
+			      tdb->open_flags & ~(O_CREAT|O_TRUNC), 0);
 	if (tdb->fd == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: open failed (%s)\n", strerror(errno)));
 		goto fail;
@@ -435,6 +624,10 @@ int tdb_reopen(struct tdb_context *tdb)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: failed to obtain active lock\n"));
 		goto fail;
 	}
+	if (tdb->methods->tdb_brlock(tdb, OPEN_LOCK, F_RDLCK, F_SETLKW, 0, 1) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: failed to obtain open lock\n"));
+		goto fail;
+	}
 	if (fstat(tdb->fd, &st) != 0) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_reopen: fstat failed (%s)\n", strerror(errno)));
 		goto fail;
@@ -36,11 +36,19 @@ TDB_DATA tdb_null;
 */
 static void tdb_increment_seqnum(struct tdb_context *tdb)
 {
-	tdb_off_t seqnum=0;
-	
 	if (!(tdb->flags & TDB_SEQNUM)) {
 		return;
 	}
+	tdb_bump_seqnum(tdb);
+}
+
+/*
+  increment the tdb sequence number whatever the open flags, for a
+  caller that only wants it to change on the updates it cares about
+*/
+void tdb_bump_seqnum(struct tdb_context *tdb)
+{
+	tdb_off_t seqnum=0;
 
 	if (tdb_brlock(tdb, TDB_SEQNUM_OFS, F_WRLCK, F_SETLKW, 1, 1) != 0) {
 		return;
@@ -61,12 +69,26 @@ static int tdb_key_compare(TDB_DATA key, TDB_DATA data, void *private_data)
 	return memcmp(data.dptr, key.dptr, data.dsize);
 }
 
+/* keep a running average of the records walked per lookup, which
+   tells tdb_hash_maybe_grow() when the chains have got too long */
+static void tdb_chain_walked(struct tdb_context *tdb, u32 walked)
+{
+	tdb->chain_walk += walked - tdb->chain_walk/16;
+
+	tdb->stats.lookups++;
+	tdb->stats.chain_walk += walked;
+	if (walked > tdb->stats.chain_walk_max) {
+		tdb->stats.chain_walk_max = walked;
+	}
+}
+
 /* Returns 0 on fail.  On success, return offset of record, and fills
    in rec */
 static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, u32 hash,
 			struct list_struct *r)
 {
 	tdb_off_t rec_ptr;
+	u32 walked = 0;
 	
 	/* read in the hash top */
 	if (tdb_ofs_read(tdb, TDB_HASH_TOP(hash), &rec_ptr) == -1)
@@ -76,16 +98,19 @@ static tdb_off_t tdb_find(struct tdb_context *tdb, TDB_DATA key, u32 hash,
 	while (rec_ptr) {
 		if (tdb_rec_read(tdb, rec_ptr, r) == -1)
 			return 0;
+		walked++;
 
 		if (!TDB_DEAD(r) && hash==r->full_hash
 		    && key.dsize==r->key_len
 		    && tdb_parse_data(tdb, key, rec_ptr + sizeof(*r),
 				      r->key_len, tdb_key_compare,
 				      NULL) == 0) {
+			tdb_chain_walked(tdb, walked);
 			return rec_ptr;
 		}
 		rec_ptr = r->next;
 	}
+	tdb_chain_walked(tdb, walked);
 	return TDB_ERRCODE(TDB_ERR_NOEXIST, 0);
 }
 
@@ -107,7 +132,8 @@ tdb_off_t tdb_find_lock_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash, in
    is <= the old data size and the key exists.
    on failure return -1.
 */
-static int tdb_update_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash, TDB_DATA dbuf)
+static int tdb_update_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash,
+			   TDB_DATA dbuf, tdb_len_t unchanged)
 {
 	struct list_struct rec;
 	tdb_off_t rec_ptr;
@@ -122,8 +148,14 @@ static int tdb_update_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash, TDB_
 		return -1;
 	}
 
-	if (tdb->methods->tdb_write(tdb, rec_ptr + sizeof(rec) + rec.key_len,
-		      dbuf.dptr, dbuf.dsize) == -1)
+	/* the first unchanged bytes are already there */
+	if (unchanged > rec.data_len || unchanged > dbuf.dsize) {
+		unchanged = 0;
+	}
+
+	if (tdb->methods->tdb_write(tdb, rec_ptr + sizeof(rec) + rec.key_len +
+				    unchanged, dbuf.dptr + unchanged,
+				    dbuf.dsize - unchanged) == -1)
 		return -1;
 
 	if (dbuf.dsize != rec.data_len) {
@@ -145,18 +177,35 @@ TDB_DATA tdb_fetch(struct tdb_context *tdb, TDB_DATA key)
 {
 	tdb_off_t rec_ptr;
 	struct list_struct rec;
+	struct tdb_cache_entry *ce = NULL;
+	int cached = -1;
 	TDB_DATA ret;
 	u32 hash;
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
-	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec)))
+
+	if (tdb->flags & TDB_FETCH_CACHE) {
+		cached = tdb_cache_lookup(tdb, key, hash, &ce);
+		if (cached == 1) {
+			return tdb_cache_copy(tdb, ce);
+		}
+	}
+
+	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec))) {
+		if (cached == 0) {
+			tdb_cache_fill(tdb, ce, key, hash, tdb_null);
+		}
 		return tdb_null;
+	}
 
 	ret.dptr = tdb_alloc_read(tdb, rec_ptr + sizeof(rec) + rec.key_len,
 				  rec.data_len);
 	ret.dsize = rec.data_len;
 	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
+	if (cached == 0 && ret.dptr != NULL) {
+		tdb_cache_fill(tdb, ce, key, hash, ret);
+	}
 	return ret;
 }
 
@@ -183,12 +232,22 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 {
 	tdb_off_t rec_ptr;
 	struct list_struct rec;
+	struct tdb_cache_entry *ce;
 	int ret;
 	u32 hash;
 
 	/* find which hash bucket it is in */
 	hash = tdb->hash_fn(&key);
 
+	if ((tdb->flags & TDB_FETCH_CACHE) &&
+	    tdb_cache_lookup(tdb, key, hash, &ce) == 1) {
+		TDB_DATA data = tdb_cache_data(tdb, ce);
+		if (data.dptr == NULL) {
+			return 0;
+		}
+		return parser(key, data, private_data);
+	}
+
 	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec))) {
 		return TDB_ERRCODE(TDB_ERR_NOEXIST, 0);
 	}
@@ -201,6 +260,60 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 	return ret;
 }
 
+/*
+ * Find an entry in the database and point view->data at it in the mmap
+ * area, taking the chain read lock. The pointer is good until
+ * tdb_release_view(), which must be called on every successful view.
+ *
+ * The view nests inside a chain lock the caller already holds, so
+ * tdb_chainlock(), tdb_fetch_view(), tdb_release_view(), tdb_store()
+ * works. Nothing may be written to the database while the view is
+ * held, as that can move the mapping.
+ *
+ * The data is only aligned to 4 bytes. If a transaction is open or no
+ * mmap is available the record is read into a malloced copy instead.
+ *
+ * Returns 0, or -1 with the error TDB_ERR_NOEXIST if there is no
+ * such record, in which case there is nothing to release.
+ */
+int tdb_fetch_view(struct tdb_context *tdb, TDB_DATA key, TDB_VIEW *view)
+{
+	tdb_off_t rec_ptr, offset;
+	struct list_struct rec;
+	u32 hash;
+
+	/* find which hash bucket it is in */
+	hash = tdb->hash_fn(&key);
+	if (!(rec_ptr = tdb_find_lock_hash(tdb,key,hash,F_RDLCK,&rec)))
+		return -1;
+
+	offset = rec_ptr + sizeof(rec) + rec.key_len;
+	view->list = BUCKET(rec.full_hash);
+	view->data.dsize = rec.data_len;
+	view->copy = NULL;
+
+	if ((tdb->transaction == NULL) && (tdb->map_ptr != NULL) &&
+	    (tdb->methods->tdb_oob(tdb, offset+rec.data_len, 0) == 0)) {
+		view->data.dptr = offset + (char *)tdb->map_ptr;
+		return 0;
+	}
+
+	if (!(view->copy = tdb_alloc_read(tdb, offset, rec.data_len))) {
+		tdb_unlock(tdb, view->list, F_RDLCK);
+		return -1;
+	}
+	view->data.dptr = view->copy;
+	return 0;
+}
+
+/* drop the lock taken by tdb_fetch_view() */
+void tdb_release_view(struct tdb_context *tdb, TDB_VIEW *view)
+{
+	SAFE_FREE(view->copy);
+	view->data = tdb_null;
+	tdb_unlock(tdb, view->list, F_RDLCK);
+}
+
 /* check if an entry in the database exists 
 
    note that 1 is returned if the key is found and 0 is returned if not found
@@ -210,7 +323,12 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 static int tdb_exists_hash(struct tdb_context *tdb, TDB_DATA key, u32 hash)
 {
 	struct list_struct rec;
+	struct tdb_cache_entry *ce;
 	
+	if ((tdb->flags & TDB_FETCH_CACHE) &&
+	    tdb_cache_lookup(tdb, key, hash, &ce) == 1) {
+		return tdb_cache_data(tdb, ce).dptr != NULL;
+	}
 	if (tdb_find_lock_hash(tdb, key, hash, F_RDLCK, &rec) == 0)
 		return 0;
 	tdb_unlock(tdb, BUCKET(rec.full_hash), F_RDLCK);
@@ -411,7 +529,8 @@ static tdb_off_t tdb_find_dead(struct tdb_context *tdb, u32 hash,
 
    return 0 on success, -1 on failure
 */
-int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
+static int tdb_store_hash(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
+			  int flag, tdb_len_t unchanged)
 {
 	struct list_struct rec;
 	u32 hash;
@@ -437,7 +556,7 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 		}
 	} else {
 		/* first try in-place update, on modify or replace. */
-		if (tdb_update_hash(tdb, key, hash, dbuf) == 0) {
+		if (tdb_update_hash(tdb, key, hash, dbuf, unchanged) == 0) {
 			goto done;
 		}
 		if (tdb->ecode == TDB_ERR_NOEXIST &&
@@ -545,9 +664,28 @@ int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
 
 	SAFE_FREE(p); 
 	tdb_unlock(tdb, BUCKET(hash), F_WRLCK);
+	if (ret == 0) {
+		tdb_hash_maybe_grow(tdb);
+	}
 	return ret;
 }
 
+int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag)
+{
+	return tdb_store_hash(tdb, key, dbuf, flag, 0);
+}
+
+/*
+  like tdb_store(tdb, key, dbuf, TDB_REPLACE) for a caller that knows
+  the first unchanged bytes of dbuf are what the record holds now.
+  If the record can be updated in place only the rest is written.
+*/
+int tdb_store_tail(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
+		   size_t unchanged)
+{
+	return tdb_store_hash(tdb, key, dbuf, TDB_REPLACE, unchanged);
+}
+
 
 /* Append to an entry. Create if not exist. */
 int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf)
@@ -640,7 +778,7 @@ int tdb_get_seqnum(struct tdb_context *tdb)
 
 int tdb_hash_size(struct tdb_context *tdb)
 {
-	return tdb->header.hash_size;
+	return tdb_hash_buckets(tdb);
 }
 
 size_t tdb_map_size(struct tdb_context *tdb)
@@ -653,3 +791,17 @@ int tdb_get_flags(struct tdb_context *tdb)
 	return tdb->flags;
 }
 
+/*
+  what this context has done since it was opened or the stats were
+  last reset. Nothing here is shared with other users of the database
+*/
+void tdb_get_stats(struct tdb_context *tdb, struct tdb_stats *stats)
+{
+	*stats = tdb->stats;
+}
+
+void tdb_reset_stats(struct tdb_context *tdb)
+{
+	memset(&tdb->stats, 0, sizeof(tdb->stats));
+}
+
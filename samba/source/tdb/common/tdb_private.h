@@ -49,6 +49,7 @@ typedef u32 tdb_off_t;
 
 #define TDB_MAGIC_FOOD "TDB file\n"
 #define TDB_VERSION (0x26011967 + 6)
+#define TDB_VERSION_GROWABLE (0x26011967 + 7)
 #define TDB_MAGIC (0x26011999U)
 #define TDB_FREE_MAGIC (~TDB_MAGIC)
 #define TDB_DEAD_MAGIC (0xFEE1DEAD)
@@ -61,11 +62,21 @@ typedef u32 tdb_off_t;
 #define TDB_BYTEREV(x) (((((x)&0xff)<<24)|((x)&0xFF00)<<8)|(((x)>>8)&0xFF00)|((x)>>24))
 #define TDB_DEAD(r) ((r)->magic == TDB_DEAD_MAGIC)
 #define TDB_BAD_MAGIC(r) ((r)->magic != TDB_MAGIC && !TDB_DEAD(r))
-#define TDB_HASH_TOP(hash) (FREELIST_TOP + (BUCKET(hash)+1)*sizeof(tdb_off_t))
+#define TDB_HASH_TOP(hash) tdb_hash_top(tdb, hash)
 #define TDB_HASHTABLE_SIZE(tdb) ((tdb->header.hash_size+1)*sizeof(tdb_off_t))
-#define TDB_DATA_START(hash_size) TDB_HASH_TOP(hash_size-1)
+#define TDB_DATA_START(hash_size) (FREELIST_TOP + (hash_size)*sizeof(tdb_off_t))
 #define TDB_RECOVERY_HEAD offsetof(struct tdb_header, recovery_start)
 #define TDB_SEQNUM_OFS    offsetof(struct tdb_header, sequence_number)
+#define TDB_COMMIT_SEQ_OFS offsetof(struct tdb_header, commit_seq)
+#define TDB_DURABLE_SEQ_OFS offsetof(struct tdb_header, durable_seq)
+#define TDB_HASH_BUCKETS_OFS offsetof(struct tdb_header, hash_buckets)
+#define TDB_HASH_SEGMENT_OFS(i) (offsetof(struct tdb_header, hash_segments) + (i)*sizeof(tdb_off_t))
+#define TDB_HASH_SEGMENTS 16
+#define TDB_HASH_GROW_WALK 4 /* grow when lookups walk more records than this */
+#define TDB_FREE_LISTS 8 /* size classes below the one at FREELIST_TOP */
+#define TDB_FREE_LIST_OFS(c) (offsetof(struct tdb_header, free_lists) + (c)*sizeof(tdb_off_t))
+#define TDB_FREE_SCAN 16 /* free records to consider for a best fit */
+#define TDB_GROUP_ROOM 4 /* recovery space for a group commit, in commits */
 #define TDB_PAD_BYTE 0x42
 #define TDB_PAD_U32  0x42424242
 
@@ -78,12 +89,17 @@ typedef u32 tdb_off_t;
 #define GLOBAL_LOCK      0
 #define ACTIVE_LOCK      4
 #define TRANSACTION_LOCK 8
+#define OPEN_LOCK        12 /* read locked by everyone with the file open */
+#define FLUSH_LOCK       16 /* held while committing or syncing a group */
 
 /* free memory if the pointer is valid and zero the pointer */
 #ifndef SAFE_FREE
 #define SAFE_FREE(x) do { if ((x) != NULL) {free(x); (x)=NULL;} } while(0)
 #endif
 
+/* the lock covering a hash, or the bucket of one. The hash_size
+   chains the database was created with are also its locks, a growable
+   database's extra chains share the lock of their original chain */
 #define BUCKET(hash) ((hash) % tdb->header.hash_size)
 
 #define DOCONV() (tdb->flags & TDB_CONVERT)
@@ -99,6 +115,8 @@ struct list_struct {
 	tdb_len_t data_len; /* byte length of data */
 	u32 full_hash; /* the full 32 bit hash of the key */
 	u32 magic;   /* try to catch errors */
+	/* a free record has no key, its key_len holds the offset of
+	   the pointer to it instead */
 	/* the following union is implied:
 		union {
 			char record[rec_len];
@@ -120,7 +138,13 @@ struct tdb_header {
 	tdb_off_t rwlocks; /* obsolete - kept to detect old formats */
 	tdb_off_t recovery_start; /* offset of transaction recovery region */
 	tdb_off_t sequence_number; /* used when TDB_SEQNUM is set */
-	tdb_off_t reserved[29];
+	tdb_off_t mutex_offset; /* mutex area when TDB_MUTEX_LOCKING is used */
+	tdb_len_t mutex_size;
+	u32 hash_buckets; /* chains in use if growable, else 0 */
+	tdb_off_t hash_segments[TDB_HASH_SEGMENTS]; /* chains past hash_size */
+	tdb_off_t free_lists[TDB_FREE_LISTS]; /* small free records by size */
+	u32 commit_seq; /* transactions committed, see TDB_GROUP_COMMIT */
+	u32 durable_seq; /* the last of those known to be on disk */
 };
 
 struct tdb_lock_type {
@@ -172,6 +196,11 @@ struct tdb_context {
 	int page_size;
 	int max_dead_records;
 	volatile sig_atomic_t *interrupt_sig_ptr;
+	struct tdb_mutexes *mutexes; /* mapped mutex area, if any */
+	u32 chain_walk; /* average records walked per lookup, times 16 */
+	struct tdb_cache *cache; /* recent fetches, with TDB_FETCH_CACHE */
+	struct tdb_wal *wal; /* the write ahead log, with TDB_WAL */
+	struct tdb_stats stats; /* see tdb_get_stats() */
 };
 
 
@@ -184,6 +213,7 @@ int tdb_lock(struct tdb_context *tdb, int list, int ltype);
 int tdb_unlock(struct tdb_context *tdb, int list, int ltype);
 int tdb_brlock(struct tdb_context *tdb, tdb_off_t offset, int rw_type, int lck_type, int probe, size_t len);
 int tdb_brlock_upgrade(struct tdb_context *tdb, tdb_off_t offset, size_t len);
+void tdb_lock_waited(struct tdb_context *tdb, const struct timeval *start);
 int tdb_write_lock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_write_unlock_record(struct tdb_context *tdb, tdb_off_t off);
 int tdb_ofs_read(struct tdb_context *tdb, tdb_off_t offset, tdb_off_t *d);
@@ -210,5 +240,39 @@ void tdb_io_init(struct tdb_context *tdb);
 int tdb_expand(struct tdb_context *tdb, tdb_off_t size);
 int rec_free_read(struct tdb_context *tdb, tdb_off_t off,
 		  struct list_struct *rec);
+u32 tdb_hash_buckets(struct tdb_context *tdb);
+u32 tdb_hash_bucket(struct tdb_context *tdb, u32 hash);
+tdb_off_t tdb_bucket_top(struct tdb_context *tdb, u32 b, u32 *pend);
+tdb_off_t tdb_hash_top(struct tdb_context *tdb, u32 hash);
+void tdb_hash_maybe_grow(struct tdb_context *tdb);
+struct tdb_cache_entry;
+int tdb_cache_lookup(struct tdb_context *tdb, TDB_DATA key, u32 hash,
+		     struct tdb_cache_entry **entry);
+void tdb_cache_fill(struct tdb_context *tdb, struct tdb_cache_entry *e,
+		    TDB_DATA key, u32 hash, TDB_DATA data);
+TDB_DATA tdb_cache_data(struct tdb_context *tdb, struct tdb_cache_entry *e);
+TDB_DATA tdb_cache_copy(struct tdb_context *tdb, struct tdb_cache_entry *e);
+void tdb_cache_free(struct tdb_context *tdb);
+int tdb_transaction_pending(struct tdb_context *tdb);
+int tdb_transaction_flush(struct tdb_context *tdb);
+int tdb_wal_open(struct tdb_context *tdb, int alone);
+void tdb_wal_close(struct tdb_context *tdb);
+int tdb_wal_repair(struct tdb_context *tdb);
+int tdb_wal_flush(struct tdb_context *tdb);
+int tdb_wal_finish(struct tdb_context *tdb);
+int tdb_wal_append(struct tdb_context *tdb, const unsigned char *writes,
+		   tdb_len_t len);
+int tdb_wal_applied(struct tdb_context *tdb);
+#define tdb_have_mutexes(tdb) ((tdb)->mutexes != NULL)
+int tdb_mutex_supported(void);
+tdb_len_t tdb_mutex_size(u32 hash_size);
+int tdb_mutex_mmap(struct tdb_context *tdb);
+void tdb_mutex_munmap(struct tdb_context *tdb);
+int tdb_mutex_init(struct tdb_context *tdb);
+int tdb_mutex_lock(struct tdb_context *tdb, int list, int ltype);
+int tdb_mutex_unlock(struct tdb_context *tdb, int list);
+int tdb_mutex_allrecord_lock(struct tdb_context *tdb, int ltype);
+int tdb_mutex_allrecord_upgrade(struct tdb_context *tdb);
+int tdb_mutex_allrecord_unlock(struct tdb_context *tdb);
 
 
@@ -86,6 +86,37 @@
     still available, but no transaction recovery area is used and no
     fsync/msync calls are made.
 
+  - if TDB_NOSYNC_ORDERED is passed instead, the recovery area is
+    still written first, so a process dying part way through a commit
+    is recovered from, but nothing is synced. That suits caches, which
+    can lose recent changes but not their consistency.
+
+  - if TDB_GROUP_COMMIT is passed, a commit doesn't sync its data or
+    clear the recovery magic. It bumps commit_seq in the header and
+    leaves its recovery data in place, and the next committer appends
+    its own recovery data to it (2 syncs) instead of starting afresh.
+    A committer then waits for durable_seq to catch up with its
+    commit, and whoever gets the transaction lock next with nothing
+    to commit syncs the whole group and clears the magic (2 syncs).
+    With many committers most transactions so cost 2 syncs, not 4.
+
+  - while a group is pending its changes are visible but can still be
+    rolled back, so anybody else about to write takes over the group
+    and syncs it first, see tdb_transaction_flush(). Recovery undoes
+    the entries latest first, and on open it only rolls back a pending
+    group if nobody else has the file open (OPEN_LOCK): otherwise the
+    group belongs to a live committer.
+
+  - the recovery record's full_hash, unused otherwise, says how much
+    of the recovery data belongs to commits that finished. More than
+    that means a committer died part way through, and its part is
+    undone before the group is synced.
+
+  - if the database has a write ahead log (TDB_WAL, see wal.c) the
+    recovery area isn't used: the commit logs its writes and syncs
+    the log, then writes the database without syncing it. If the
+    writes fail they are finished from the log, not undone.
+
 */
 
 int transaction_brlock(struct tdb_context *tdb, tdb_off_t offset, 
@@ -128,6 +159,9 @@ struct tdb_transaction {
 
 	/* old file size before transaction */
 	tdb_len_t old_map_size;
+
+	/* where our recovery data starts if we joined a group commit */
+	tdb_len_t group_start;
 };
 
 
@@ -318,7 +352,9 @@ fail:
 }
 
 /*
-  accelerated hash chain head search, using the cached hash heads
+  accelerated hash chain head search, using the cached hash heads.
+  The chains a growable database has added past hash_size aren't
+  cached, so they are never skipped.
 */
 static void transaction_next_hash_chain(struct tdb_context *tdb, u32 *chain)
 {
@@ -383,6 +419,8 @@ static const struct tdb_methods transaction_methods = {
 */
 int tdb_transaction_start(struct tdb_context *tdb)
 {
+	int mutex_locked = 0;
+
 	/* some sanity checks */
 	if (tdb->read_only || (tdb->flags & TDB_INTERNAL) || tdb->traverse_read) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_start: cannot start a transaction on a read-only or internal db\n"));
@@ -433,6 +471,13 @@ int tdb_transaction_start(struct tdb_context *tdb)
 		return -1;
 	}
 	
+	/* finish off a commit that died before it wrote everything
+	   it logged */
+	if (tdb->wal && tdb_wal_repair(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_start: failed to replay the log\n"));
+		goto fail;
+	}
+
 	/* get a read lock from the freelist to the end of file. This
 	   is upgraded to a write lock during the commit */
 	if (tdb_brlock(tdb, FREELIST_TOP, F_RDLCK, F_SETLKW, 0, 0) == -1) {
@@ -441,6 +486,17 @@ int tdb_transaction_start(struct tdb_context *tdb)
 		goto fail;
 	}
 
+	/* chain lockers using mutexes don't see the fcntl lock above,
+	   so hold the allrecord mutex as well */
+	if (tdb_have_mutexes(tdb)) {
+		if (tdb_mutex_allrecord_lock(tdb, F_RDLCK) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_start: failed to get allrecord mutex\n"));
+			tdb->ecode = TDB_ERR_LOCK;
+			goto fail;
+		}
+		mutex_locked = 1;
+	}
+
 	/* setup a copy of the hash table heads so the hash scan in
 	   traverse can be fast */
 	tdb->transaction->hash_heads = (u32 *)
@@ -478,6 +534,9 @@ int tdb_transaction_start(struct tdb_context *tdb)
 	return 0;
 	
 fail:
+	if (mutex_locked) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
 	tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
 	tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 	SAFE_FREE(tdb->transaction->hash_heads);
@@ -533,6 +592,9 @@ int tdb_transaction_cancel(struct tdb_context *tdb)
 	/* restore the normal io methods */
 	tdb->methods = tdb->transaction->io_methods;
 
+	if (tdb_have_mutexes(tdb)) {
+		tdb_mutex_allrecord_unlock(tdb);
+	}
 	tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
 	tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 	SAFE_FREE(tdb->transaction->hash_heads);
@@ -546,6 +608,9 @@ int tdb_transaction_cancel(struct tdb_context *tdb)
 */
 static int transaction_sync(struct tdb_context *tdb, tdb_off_t offset, tdb_len_t length)
 {	
+	if (tdb->flags & TDB_NOSYNC_ORDERED) {
+		return 0;
+	}
 	if (fsync(tdb->fd) != 0) {
 		tdb->ecode = TDB_ERR_IO;
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction: fsync failed\n"));
@@ -636,8 +701,13 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 	/* the tdb_free() call might have increased the recovery size */
 	*recovery_size = tdb_recovery_size(tdb);
 
-	/* round up to a multiple of page size */
-	*recovery_max_size = TDB_ALIGN(sizeof(rec) + *recovery_size, tdb->page_size) - sizeof(rec);
+	/* round up to a multiple of page size, leaving room for the
+	   commits of a group to join this one */
+	*recovery_max_size = *recovery_size;
+	if (tdb->flags & TDB_GROUP_COMMIT) {
+		*recovery_max_size *= TDB_GROUP_ROOM;
+	}
+	*recovery_max_size = TDB_ALIGN(sizeof(rec) + *recovery_max_size, tdb->page_size) - sizeof(rec);
 	*recovery_offset = tdb->map_size;
 	recovery_head = *recovery_offset;
 
@@ -668,13 +738,49 @@ static int tdb_recovery_allocate(struct tdb_context *tdb,
 }
 
 
+/*
+  save the data the transaction overwrites below old_map_size as
+  recovery entries at p, returning the end of them
+*/
+static unsigned char *transaction_old_data(struct tdb_context *tdb,
+					   tdb_off_t old_map_size,
+					   unsigned char *p)
+{
+	struct tdb_transaction_el *el;
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+
+	for (el=tdb->transaction->elements;el;el=el->next) {
+		if (el->offset >= old_map_size) {
+			continue;
+		}
+		if (el->offset + el->length > tdb->transaction->old_map_size) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: transaction data over new region boundary\n"));
+			tdb->ecode = TDB_ERR_CORRUPT;
+			return NULL;
+		}
+		memcpy(p, &el->offset, 4);
+		memcpy(p+4, &el->length, 4);
+		if (DOCONV()) {
+			tdb_convert(p, 8);
+		}
+		/* the recovery area contains the old data, not the
+		   new data, so we have to call the original tdb_read
+		   method to get it */
+		if (methods->tdb_read(tdb, el->offset, p + 8, el->length, 0) != 0) {
+			tdb->ecode = TDB_ERR_IO;
+			return NULL;
+		}
+		p += 8 + el->length;
+	}
+	return p;
+}
+
 /*
   setup the recovery data that will be used on a crash during commit
 */
 static int transaction_setup_recovery(struct tdb_context *tdb, 
 				      tdb_off_t *magic_offset)
 {
-	struct tdb_transaction_el *el;
 	tdb_len_t recovery_size;
 	unsigned char *data, *p;
 	const struct tdb_methods *methods = tdb->transaction->io_methods;
@@ -708,31 +814,10 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 
 	/* build the recovery data into a single blob to allow us to do a single
 	   large write, which should be more efficient */
-	p = data + sizeof(*rec);
-	for (el=tdb->transaction->elements;el;el=el->next) {
-		if (el->offset >= old_map_size) {
-			continue;
-		}
-		if (el->offset + el->length > tdb->transaction->old_map_size) {
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_setup_recovery: transaction data over new region boundary\n"));
-			free(data);
-			tdb->ecode = TDB_ERR_CORRUPT;
-			return -1;
-		}
-		memcpy(p, &el->offset, 4);
-		memcpy(p+4, &el->length, 4);
-		if (DOCONV()) {
-			tdb_convert(p, 8);
-		}
-		/* the recovery area contains the old data, not the
-		   new data, so we have to call the original tdb_read
-		   method to get it */
-		if (methods->tdb_read(tdb, el->offset, p + 8, el->length, 0) != 0) {
-			free(data);
-			tdb->ecode = TDB_ERR_IO;
-			return -1;
-		}
-		p += 8 + el->length;
+	p = transaction_old_data(tdb, old_map_size, data + sizeof(*rec));
+	if (p == NULL) {
+		free(data);
+		return -1;
 	}
 
 	/* and the tailer */
@@ -777,6 +862,424 @@ static int transaction_setup_recovery(struct tdb_context *tdb,
 	return 0;
 }
 
+/*
+  read a header word with the given io methods
+*/
+static int transaction_hdr_read(struct tdb_context *tdb,
+				const struct tdb_methods *methods,
+				tdb_off_t ofs, u32 *v)
+{
+	return methods->tdb_read(tdb, ofs, v, sizeof(*v), DOCONV());
+}
+
+static int transaction_hdr_write(struct tdb_context *tdb,
+				 const struct tdb_methods *methods,
+				 tdb_off_t ofs, u32 v)
+{
+	CONVERT(v);
+	return methods->tdb_write(tdb, ofs, &v, sizeof(v));
+}
+
+/*
+  read the recovery record, returning its offset or 0 if there is none
+*/
+static tdb_off_t transaction_recovery_rec(struct tdb_context *tdb,
+					  const struct tdb_methods *methods,
+					  struct list_struct *rec)
+{
+	tdb_off_t recovery_head;
+
+	if (transaction_hdr_read(tdb, methods, TDB_RECOVERY_HEAD,
+				 &recovery_head) == -1 ||
+	    recovery_head == 0) {
+		return 0;
+	}
+	if (methods->tdb_read(tdb, recovery_head, rec, sizeof(*rec),
+			      DOCONV()) == -1) {
+		return 0;
+	}
+	return recovery_head;
+}
+
+/*
+  undo the recovery entries from start on. They are undone latest
+  first, as a later transaction of a group may have changed data an
+  earlier one saved
+*/
+static int transaction_apply_recovery(struct tdb_context *tdb,
+				      const struct tdb_methods *methods,
+				      tdb_off_t recovery_head,
+				      const struct list_struct *rec,
+				      tdb_len_t start)
+{
+	unsigned char *data, *p, **entries;
+	tdb_len_t len;
+	int n = 0, i;
+
+	if (start > rec->data_len) {
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+	len = rec->data_len - start;
+
+	data = (unsigned char *)malloc(len);
+	if (data == NULL) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to allocate recovery data\n"));		
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+
+	/* read the recovery data */
+	if (methods->tdb_read(tdb, recovery_head + sizeof(*rec) + start, data,
+			      len, 0) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read recovery data\n"));		
+		free(data);
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	/* find the entries */
+	p = data;
+	while (p+8 < data + len) {
+		u32 elen;
+		if (DOCONV()) {
+			tdb_convert(p, 8);
+		}
+		memcpy(&elen, p+4, 4);
+		if (elen > (tdb_len_t)(data + len - (p+8))) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: corrupt recovery data\n"));
+			free(data);
+			tdb->ecode = TDB_ERR_CORRUPT;
+			return -1;
+		}
+		p += 8 + elen;
+		n++;
+	}
+
+	entries = (unsigned char **)malloc(sizeof(*entries) * (n+1));
+	if (entries == NULL) {
+		free(data);
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	for (p = data, i = 0; i < n; i++) {
+		u32 elen;
+		entries[i] = p;
+		memcpy(&elen, p+4, 4);
+		p += 8 + elen;
+	}
+
+	/* recover the file data */
+	for (i = n-1; i >= 0; i--) {
+		u32 ofs, elen;
+		memcpy(&ofs, entries[i], 4);
+		memcpy(&elen, entries[i]+4, 4);
+
+		if (methods->tdb_write(tdb, ofs, entries[i]+8, elen) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to recover %d bytes at offset %d\n", elen, ofs));
+			free(entries);
+			free(data);
+			tdb->ecode = TDB_ERR_IO;
+			return -1;
+		}
+	}
+
+	free(entries);
+	free(data);
+	return 0;
+}
+
+/*
+  add our recovery data to that of a pending group commit. Returns 1
+  if there is no room for it
+*/
+static int transaction_append_recovery(struct tdb_context *tdb)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	struct list_struct rec;
+	tdb_off_t recovery_head, ofs;
+	tdb_len_t size;
+	unsigned char *data, *p;
+	u32 tailer;
+
+	recovery_head = transaction_recovery_rec(tdb, methods, &rec);
+	if (recovery_head == 0 || rec.magic != TDB_RECOVERY_MAGIC) {
+		return 1;
+	}
+
+	/* the entries replace the old tailer */
+	size = tdb_recovery_size(tdb);
+	if (rec.data_len + size - sizeof(u32) > rec.rec_len) {
+		return 1;
+	}
+
+	data = (unsigned char *)malloc(size);
+	if (data == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	p = transaction_old_data(tdb, tdb->transaction->old_map_size, data);
+	if (p == NULL) {
+		free(data);
+		return -1;
+	}
+	tailer = sizeof(rec) + rec.rec_len;
+	memcpy(p, &tailer, 4);
+	CONVERT(p);
+
+	ofs = recovery_head + sizeof(rec) + rec.data_len - sizeof(u32);
+	if (methods->tdb_write(tdb, ofs, data, size) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_append_recovery: failed to write recovery data\n"));
+		free(data);
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	free(data);
+
+	/* the entries have to be on disk before the length covers them */
+	if (transaction_sync(tdb, ofs, size) == -1) {
+		return -1;
+	}
+
+	tdb->transaction->group_start = rec.data_len - sizeof(u32);
+	ofs = recovery_head + offsetof(struct list_struct, data_len);
+	if (transaction_hdr_write(tdb, methods, ofs,
+				  rec.data_len + size - sizeof(u32)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_append_recovery: failed to write recovery length\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	if (transaction_sync(tdb, ofs, sizeof(u32)) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+  put the transactions of a pending group commit on disk. The caller
+  holds FLUSH_LOCK, which stops anyone committing meanwhile
+*/
+static int transaction_flush_group(struct tdb_context *tdb,
+				   const struct tdb_methods *methods)
+{
+	struct list_struct rec;
+	tdb_off_t recovery_head;
+	u32 commit_seq, durable_seq;
+
+	if (transaction_hdr_read(tdb, methods, TDB_COMMIT_SEQ_OFS,
+				 &commit_seq) == -1 ||
+	    transaction_hdr_read(tdb, methods, TDB_DURABLE_SEQ_OFS,
+				 &durable_seq) == -1) {
+		return -1;
+	}
+	if (commit_seq == durable_seq) {
+		/* someone else got there first */
+		return 0;
+	}
+
+	recovery_head = transaction_recovery_rec(tdb, methods, &rec);
+	if (recovery_head != 0 && rec.magic == TDB_RECOVERY_MAGIC) {
+		if (rec.full_hash + sizeof(u32) != rec.data_len) {
+			/* the last committer died before finishing its
+			   writes, undo them */
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_flush: "
+				 "rolling back an unfinished commit on %s\n",
+				 tdb->name));
+			if (transaction_apply_recovery(tdb, methods,
+						       recovery_head, &rec,
+						       rec.full_hash) == -1) {
+				return -1;
+			}
+		}
+
+		if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
+			return -1;
+		}
+		if (transaction_hdr_write(tdb, methods, recovery_head +
+					  offsetof(struct list_struct, magic),
+					  0) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_flush: failed to remove recovery magic\n"));
+			tdb->ecode = TDB_ERR_IO;
+			return -1;
+		}
+		if (transaction_sync(tdb, recovery_head, sizeof(rec)) == -1) {
+			return -1;
+		}
+	}
+
+	return transaction_hdr_write(tdb, methods, TDB_DURABLE_SEQ_OFS,
+				     commit_seq);
+}
+
+/*
+  does a group commit have transactions that aren't on disk yet?
+*/
+int tdb_transaction_pending(struct tdb_context *tdb)
+{
+	const struct tdb_methods *methods = tdb->transaction ?
+		tdb->transaction->io_methods : tdb->methods;
+	u32 commit_seq, durable_seq;
+
+	if (transaction_hdr_read(tdb, methods, TDB_COMMIT_SEQ_OFS,
+				 &commit_seq) == -1 ||
+	    transaction_hdr_read(tdb, methods, TDB_DURABLE_SEQ_OFS,
+				 &durable_seq) == -1) {
+		return -1;
+	}
+	return commit_seq != durable_seq;
+}
+
+/*
+  called by anyone about to write outside a transaction with a lock
+  that keeps committers out. A crash would roll a pending group commit
+  back over the new data, so put the group on disk first
+*/
+int tdb_transaction_flush(struct tdb_context *tdb)
+{
+	int ret;
+
+	if (tdb->wal) {
+		return tdb_wal_flush(tdb);
+	}
+
+	if (tdb->read_only || tdb_transaction_pending(tdb) != 1) {
+		return 0;
+	}
+
+	if (tdb_brlock(tdb, FLUSH_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
+		return -1;
+	}
+	ret = transaction_flush_group(tdb, tdb->methods);
+	tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	return ret;
+}
+
+/*
+  wait for our group commit to be on disk. Until someone needing the
+  transaction lock is done with it, more commits can join the group,
+  after that flush it ourselves
+*/
+static int transaction_wait_durable(struct tdb_context *tdb, u32 seq)
+{
+	u32 durable_seq;
+	int ret;
+
+	while (1) {
+		struct timeval tv;
+
+		if (tdb_ofs_read(tdb, TDB_DURABLE_SEQ_OFS, &durable_seq) == -1) {
+			return -1;
+		}
+		if ((int)(durable_seq - seq) >= 0) {
+			return 0;
+		}
+
+		/* we just dropped the transaction lock: give those
+		   waiting for it a chance to get it before we do */
+		tv.tv_sec = 0;
+		tv.tv_usec = 1;
+		select(0, NULL, NULL, NULL, &tv);
+
+		if (tdb_brlock(tdb, TRANSACTION_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
+			return -1;
+		}
+		if (tdb_brlock(tdb, FLUSH_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
+			tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+			return -1;
+		}
+		/* leave a group we aren't in to its own committers */
+		ret = tdb_ofs_read(tdb, TDB_DURABLE_SEQ_OFS, &durable_seq);
+		if (ret == 0 && (int)(durable_seq - seq) < 0) {
+			ret = transaction_flush_group(tdb, tdb->methods);
+		}
+		tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+		tdb_brlock(tdb, TRANSACTION_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+		if (ret == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+  record that a group commit finished its writes: its recovery data
+  is complete and it has a commit_seq
+*/
+static int transaction_group_done(struct tdb_context *tdb, u32 *seq)
+{
+	const struct tdb_methods *methods = tdb->transaction->io_methods;
+	struct list_struct rec;
+	tdb_off_t recovery_head;
+
+	recovery_head = transaction_recovery_rec(tdb, methods, &rec);
+	if (recovery_head != 0 &&
+	    transaction_hdr_write(tdb, methods, recovery_head +
+				  offsetof(struct list_struct, full_hash),
+				  rec.data_len - sizeof(u32)) == -1) {
+		return -1;
+	}
+
+	if (transaction_hdr_read(tdb, methods, TDB_COMMIT_SEQ_OFS, seq) == -1) {
+		return -1;
+	}
+	(*seq)++;
+	return transaction_hdr_write(tdb, methods, TDB_COMMIT_SEQ_OFS, *seq);
+}
+
+/*
+  a commit that joined a group failed part way through its writes:
+  undo them, leaving the group as it was
+*/
+static int transaction_undo_joined(struct tdb_context *tdb)
+{
+	struct list_struct rec;
+	tdb_off_t recovery_head;
+
+	recovery_head = transaction_recovery_rec(tdb, tdb->methods, &rec);
+	if (recovery_head == 0 ||
+	    transaction_apply_recovery(tdb, tdb->methods, recovery_head, &rec,
+				       tdb->transaction->group_start) == -1) {
+		return -1;
+	}
+	return transaction_hdr_write(tdb, tdb->methods, recovery_head +
+				     offsetof(struct list_struct, data_len),
+				     tdb->transaction->group_start + sizeof(u32));
+}
+
+/*
+  log the writes of the transaction, as (offset, length, data) for
+  each element
+*/
+static int transaction_wal_append(struct tdb_context *tdb)
+{
+	struct tdb_transaction_el *el;
+	unsigned char *buf, *p;
+	tdb_len_t len = 0;
+	int ret;
+
+	for (el = tdb->transaction->elements; el; el = el->next) {
+		len += 2*sizeof(tdb_off_t) + el->length;
+	}
+
+	buf = (unsigned char *)malloc(len);
+	if (buf == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+
+	p = buf;
+	for (el = tdb->transaction->elements; el; el = el->next) {
+		memcpy(p, &el->offset, sizeof(tdb_off_t));
+		memcpy(p + sizeof(tdb_off_t), &el->length, sizeof(tdb_len_t));
+		memcpy(p + 2*sizeof(tdb_off_t), el->data, el->length);
+		p += 2*sizeof(tdb_off_t) + el->length;
+	}
+
+	ret = tdb_wal_append(tdb, buf, len);
+	free(buf);
+	return ret;
+}
+
 /*
   commit the current transaction
 */
@@ -785,6 +1288,10 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 	const struct tdb_methods *methods;
 	tdb_off_t magic_offset = 0;
 	u32 zero = 0;
+	int group = (tdb->flags & (TDB_GROUP_COMMIT|TDB_NOSYNC)) == TDB_GROUP_COMMIT;
+	int joined = 0;
+	int wal = (tdb->wal != NULL);
+	u32 seq = 0;
 
 	if (tdb->transaction == NULL) {
 		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: no transaction\n"));
@@ -810,6 +1317,11 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 	}
 
 	methods = tdb->transaction->io_methods;
+
+	/* the log does the job of the recovery area, with one sync */
+	if (wal) {
+		group = 0;
+	}
 	
 	/* if there are any locks pending then the caller has not
 	   nested their locks properly, so fail the transaction */
@@ -828,6 +1340,13 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
+	if (tdb_have_mutexes(tdb) && tdb_mutex_allrecord_upgrade(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: failed to upgrade allrecord mutex\n"));
+		tdb->ecode = TDB_ERR_LOCK;
+		tdb_transaction_cancel(tdb);
+		return -1;
+	}
+
 	/* get the global lock - this prevents new users attaching to the database
 	   during the commit */
 	if (tdb_brlock(tdb, GLOBAL_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
@@ -837,13 +1356,45 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		return -1;
 	}
 
-	if (!(tdb->flags & TDB_NOSYNC)) {
+	/* keep anyone flushing a group commit out of the recovery area */
+	if (tdb_brlock(tdb, FLUSH_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_transaction_commit: failed to get flush lock\n"));
+		tdb->ecode = TDB_ERR_LOCK;
+		tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+		tdb_transaction_cancel(tdb);
+		return -1;
+	}
+
+	/* join a pending group commit, or put it on disk so the recovery
+	   area can be reused */
+	if (tdb_transaction_pending(tdb) == 1) {
+		if (group) {
+			joined = transaction_append_recovery(tdb);
+			if (joined == -1) {
+				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to add to recovery data\n"));
+				goto fail_unlock;
+			}
+			joined = !joined;
+		}
+		if (!joined &&
+		    transaction_flush_group(tdb, methods) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to flush group commit\n"));
+			goto fail_unlock;
+		}
+	}
+
+	if (wal) {
+		/* once the log is synced the commit is durable, the
+		   writes below can be redone from it */
+		if (transaction_wal_append(tdb) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to write the log\n"));
+			goto fail_unlock;
+		}
+	} else if (!(tdb->flags & TDB_NOSYNC) && !joined) {
 		/* write the recovery data to the end of the file */
 		if (transaction_setup_recovery(tdb, &magic_offset) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to setup recovery data\n"));
-			tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
-			tdb_transaction_cancel(tdb);
-			return -1;
+			goto fail_unlock;
 		}
 	}
 
@@ -854,9 +1405,11 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 					     tdb->transaction->old_map_size) == -1) {
 			tdb->ecode = TDB_ERR_IO;
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: expansion failed\n"));
-			tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
-			tdb_transaction_cancel(tdb);
-			return -1;
+			if (wal) {
+				tdb->map_size = tdb->transaction->old_map_size;
+				goto fail_logged;
+			}
+			goto fail_unlock;
 		}
 		tdb->map_size = tdb->transaction->old_map_size;
 		methods->tdb_oob(tdb, tdb->map_size + 1, 1);
@@ -869,13 +1422,23 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		if (methods->tdb_write(tdb, el->offset, el->data, el->length) == -1) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed during commit\n"));
 			
+			if (wal) {
+				goto fail_logged;
+			}
+
 			/* we've overwritten part of the data and
 			   possibly expanded the file, so we need to
-			   run the crash recovery code */
+			   run the crash recovery code. If we joined a
+			   group only our part of it is undone */
 			tdb->methods = methods;
-			tdb_transaction_recover(tdb); 
+			if (joined) {
+				transaction_undo_joined(tdb);
+			} else {
+				tdb_transaction_recover(tdb); 
+			}
 
 			tdb_transaction_cancel(tdb);
+			tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 			tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: write failed\n"));
@@ -886,7 +1449,19 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		free(el);
 	} 
 
-	if (!(tdb->flags & TDB_NOSYNC)) {
+	if (group) {
+		/* say our writes are done and leave syncing them to
+		   whoever finishes the group */
+		if (transaction_group_done(tdb, &seq) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to mark commit done\n"));
+			return -1;
+		}
+	} else if (wal) {
+		if (tdb_wal_applied(tdb) == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to mark the log applied\n"));
+			goto fail_logged;
+		}
+	} else if (!(tdb->flags & TDB_NOSYNC)) {
 		/* ensure the new data is on disk */
 		if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
 			return -1;
@@ -904,6 +1479,7 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 		}
 	}
 
+	tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 	tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
 
 	/*
@@ -924,7 +1500,32 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 	/* use a transaction cancel to free memory and remove the
 	   transaction locks */
 	tdb_transaction_cancel(tdb);
+
+	if (group) {
+		return transaction_wait_durable(tdb, seq);
+	}
+	return 0;
+
+fail_logged:
+	/* the commit is in the synced log, so it has happened and a
+	   replay would bring it back anyway: finish the writes from the
+	   log rather than fail. If even that fails the database has the
+	   commit half written, and the next writer finishes it */
+	tdb->methods = methods;
+	if (tdb_wal_finish(tdb) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_commit: failed to finish the commit from the log\n"));
+	}
+	tdb->transaction->old_map_size = tdb->map_size;
+	tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	tdb_transaction_cancel(tdb);
 	return 0;
+
+fail_unlock:
+	tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	tdb_brlock(tdb, GLOBAL_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	tdb_transaction_cancel(tdb);
+	return -1;
 }
 
 
@@ -936,8 +1537,7 @@ int tdb_transaction_commit(struct tdb_context *tdb)
 int tdb_transaction_recover(struct tdb_context *tdb)
 {
 	tdb_off_t recovery_head, recovery_eof;
-	unsigned char *data, *p;
-	u32 zero = 0;
+	u32 zero = 0, commit_seq;
 	struct list_struct rec;
 
 	/* find the recovery area */
@@ -973,42 +1573,12 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 
 	recovery_eof = rec.key_len;
 
-	data = (unsigned char *)malloc(rec.data_len);
-	if (data == NULL) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to allocate recovery data\n"));		
-		tdb->ecode = TDB_ERR_OOM;
-		return -1;
-	}
-
-	/* read the full recovery data */
-	if (tdb->methods->tdb_read(tdb, recovery_head + sizeof(rec), data,
-				   rec.data_len, 0) == -1) {
-		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to read recovery data\n"));		
-		tdb->ecode = TDB_ERR_IO;
-		return -1;
-	}
-
 	/* recover the file data */
-	p = data;
-	while (p+8 < data + rec.data_len) {
-		u32 ofs, len;
-		if (DOCONV()) {
-			tdb_convert(p, 8);
-		}
-		memcpy(&ofs, p, 4);
-		memcpy(&len, p+4, 4);
-
-		if (tdb->methods->tdb_write(tdb, ofs, p+8, len) == -1) {
-			free(data);
-			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to recover %d bytes at offset %d\n", len, ofs));
-			tdb->ecode = TDB_ERR_IO;
-			return -1;
-		}
-		p += 8 + len;
+	if (transaction_apply_recovery(tdb, tdb->methods, recovery_head,
+				       &rec, 0) == -1) {
+		return -1;
 	}
 
-	free(data);
-
 	if (transaction_sync(tdb, 0, tdb->map_size) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to sync recovery\n"));
 		tdb->ecode = TDB_ERR_IO;
@@ -1042,6 +1612,14 @@ int tdb_transaction_recover(struct tdb_context *tdb)
 	tdb->map_size = recovery_eof;
 	tdb_mmap(tdb);
 
+	/* any group commit pending has been undone with the rest */
+	if (tdb_ofs_read(tdb, TDB_COMMIT_SEQ_OFS, &commit_seq) == -1 ||
+	    tdb_ofs_write(tdb, TDB_DURABLE_SEQ_OFS, &commit_seq) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to reset group commit\n"));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
 	if (transaction_sync(tdb, 0, recovery_eof) == -1) {
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_transaction_recover: failed to sync2 recovery\n"));
 		tdb->ecode = TDB_ERR_IO;
@@ -34,8 +34,10 @@ static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tloc
 {
 	int want_next = (tlock->off != 0);
 
-	/* Lock each chain from the start one. */
-	for (; tlock->hash < tdb->header.hash_size; tlock->hash++) {
+	/* Lock each chain from the start one. tlock->hash is the chain
+	   number, which in a growable database may be past the lock
+	   for it. */
+	for (; tlock->hash < tdb_hash_buckets(tdb); tlock->hash++) {
 		if (!tlock->off && tlock->hash != 0) {
 			/* this is an optimisation for the common case where
 			   the hash chain is empty, which is particularly
@@ -66,12 +68,12 @@ static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tloc
 			   system (testing using ldbtest).
 			*/
 			tdb->methods->next_hash_chain(tdb, &tlock->hash);
-			if (tlock->hash == tdb->header.hash_size) {
+			if (tlock->hash >= tdb_hash_buckets(tdb)) {
 				continue;
 			}
 		}
 
-		if (tdb_lock(tdb, tlock->hash, tlock->lock_rw) == -1)
+		if (tdb_lock(tdb, BUCKET(tlock->hash), tlock->lock_rw) == -1)
 			return -1;
 
 		/* No previous record?  Start at top of chain. */
@@ -118,7 +120,7 @@ static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tloc
 			    tdb_do_delete(tdb, current, rec) != 0)
 				goto fail;
 		}
-		tdb_unlock(tdb, tlock->hash, tlock->lock_rw);
+		tdb_unlock(tdb, BUCKET(tlock->hash), tlock->lock_rw);
 		want_next = 0;
 	}
 	/* We finished iteration without finding anything */
@@ -126,7 +128,7 @@ static int tdb_next_lock(struct tdb_context *tdb, struct tdb_traverse_lock *tloc
 
  fail:
 	tlock->off = 0;
-	if (tdb_unlock(tdb, tlock->hash, tlock->lock_rw) != 0)
+	if (tdb_unlock(tdb, BUCKET(tlock->hash), tlock->lock_rw) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_next_lock: On error unlock failed!\n"));
 	return -1;
 }
@@ -160,7 +162,7 @@ static int tdb_traverse_internal(struct tdb_context *tdb,
 					  rec.key_len + rec.data_len);
 		if (!key.dptr) {
 			ret = -1;
-			if (tdb_unlock(tdb, tl->hash, tl->lock_rw) != 0)
+			if (tdb_unlock(tdb, BUCKET(tl->hash), tl->lock_rw) != 0)
 				goto out;
 			if (tdb_unlock_record(tdb, tl->off) != 0)
 				TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_traverse: key.dptr == NULL and unlock_record failed!\n"));
@@ -171,7 +173,7 @@ static int tdb_traverse_internal(struct tdb_context *tdb,
 		dbuf.dsize = rec.data_len;
 
 		/* Drop chain lock, call out */
-		if (tdb_unlock(tdb, tl->hash, tl->lock_rw) != 0) {
+		if (tdb_unlock(tdb, BUCKET(tl->hash), tl->lock_rw) != 0) {
 			ret = -1;
 			SAFE_FREE(key.dptr);
 			goto out;
@@ -251,6 +253,259 @@ int tdb_traverse(struct tdb_context *tdb,
 }
 
 
+/*
+  the records of one hash chain, copied out as
+  [u32 key_len][u32 data_len][key][data] ...
+*/
+struct tdb_snapshot {
+	char *buf;
+	size_t used, size;
+};
+
+/* read part of a record, which must lie within the mapping */
+static int tdb_snapshot_read(struct tdb_context *tdb, tdb_off_t off,
+			     void *buf, tdb_len_t len, int cv)
+{
+	if (off + len < off || off + len > tdb->map_size) {
+		return -1;
+	}
+	return tdb->methods->tdb_read(tdb, off, buf, len, cv);
+}
+
+/*
+  copy the live records of chain b. The caller holds the chain's
+  read lock.
+*/
+static int tdb_snapshot_chain(struct tdb_context *tdb, u32 b,
+			      struct tdb_snapshot *snap)
+{
+	struct list_struct rec;
+	tdb_off_t rec_ptr;
+	tdb_len_t max = tdb->map_size / sizeof(rec);
+	u32 lens[2];
+
+	snap->used = 0;
+
+	if (tdb_ofs_read(tdb, TDB_HASH_TOP(b), &rec_ptr) == -1) {
+		return -1;
+	}
+
+	while (rec_ptr) {
+		if (max-- == 0) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL,
+				 "tdb_snapshot_chain: loop detected.\n"));
+			return -1;
+		}
+		if (rec_ptr < TDB_DATA_START(tdb->header.hash_size) ||
+		    tdb_snapshot_read(tdb, rec_ptr, &rec, sizeof(rec),
+				      DOCONV()) == -1 ||
+		    TDB_BAD_MAGIC(&rec) ||
+		    rec.key_len + rec.data_len < rec.key_len ||
+		    rec.key_len + rec.data_len > rec.rec_len ||
+		    tdb_hash_bucket(tdb, rec.full_hash) != b) {
+			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_snapshot_chain: "
+				 "bad record at %u in chain %u\n",
+				 rec_ptr, b));
+			tdb->ecode = TDB_ERR_CORRUPT;
+			return -1;
+		}
+
+		if (!TDB_DEAD(&rec)) {
+			size_t len = sizeof(lens) + rec.key_len + rec.data_len;
+
+			if (snap->used + len > snap->size) {
+				size_t size = MAX(snap->size * 2, snap->used + len);
+				char *buf = (char *)realloc(snap->buf, size);
+				if (buf == NULL) {
+					tdb->ecode = TDB_ERR_OOM;
+					return -1;
+				}
+				snap->buf = buf;
+				snap->size = size;
+			}
+			lens[0] = rec.key_len;
+			lens[1] = rec.data_len;
+			memcpy(snap->buf + snap->used, lens, sizeof(lens));
+			if (tdb_snapshot_read(tdb, rec_ptr + sizeof(rec),
+					      snap->buf + snap->used + sizeof(lens),
+					      rec.key_len + rec.data_len, 0) == -1) {
+				return -1;
+			}
+			snap->used += len;
+		}
+		rec_ptr = rec.next;
+	}
+	return 0;
+}
+
+/*
+  traverse chains first to last-1 from copies. Each chain is copied
+  under its read lock, which is only held for the copy, so fn is never
+  called with a lock held. Writers don't bump the sequence number
+  until they are done, so it can't tell us a copy made without the
+  lock is whole.
+*/
+static int tdb_traverse_chains(struct tdb_context *tdb, u32 first, u32 last,
+			       tdb_traverse_func fn, void *private_data)
+{
+	struct tdb_snapshot snap;
+	TDB_DATA key, dbuf;
+	u32 b, lens[2];
+	size_t ofs;
+	int count = 0, ret;
+
+	memset(&snap, 0, sizeof(snap));
+
+	/* re-read the number of chains each time round: records moved to
+	   a new chain after we passed their old one are seen twice, but
+	   none are missed */
+	for (b = first; b < last && b < tdb_hash_buckets(tdb); b++) {
+		if (tdb_lock(tdb, BUCKET(b), F_RDLCK) == -1) {
+			goto fail;
+		}
+		/* the file may have grown since we last looked */
+		tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+		ret = tdb_snapshot_chain(tdb, b, &snap);
+		tdb_unlock(tdb, BUCKET(b), F_RDLCK);
+		if (ret == -1) {
+			goto fail;
+		}
+
+		for (ofs = 0; ofs < snap.used;
+		     ofs += sizeof(lens) + key.dsize + dbuf.dsize) {
+			memcpy(lens, snap.buf + ofs, sizeof(lens));
+			key.dptr = snap.buf + ofs + sizeof(lens);
+			key.dsize = lens[0];
+			dbuf.dptr = key.dptr + key.dsize;
+			dbuf.dsize = lens[1];
+			count++;
+			if (fn && fn(tdb, key, dbuf, private_data)) {
+				SAFE_FREE(snap.buf);
+				return count;
+			}
+		}
+	}
+
+	SAFE_FREE(snap.buf);
+	return count;
+
+ fail:
+	SAFE_FREE(snap.buf);
+	return -1;
+}
+
+/*
+  a read only traverse that doesn't hold locks while fn runs and
+  doesn't keep transactions out. Each chain is seen as it was at some
+  moment during the traverse, but records added, changed or deleted
+  while it runs may or may not be seen, so it suits listings and
+  statistics of busy databases. fn may change the database.
+*/
+int tdb_traverse_snapshot(struct tdb_context *tdb,
+			  tdb_traverse_func fn, void *private_data)
+{
+	/* the file may have grown since we last looked */
+	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+
+	return tdb_traverse_chains(tdb, 0, (u32)-1, fn, private_data);
+}
+
+/*
+  tdb_traverse_snapshot() with the chains split between nprocs child
+  processes, for tools walking large databases. fn runs in the
+  children, so it can only pass results back through the file system
+  or a pipe of its own. Returns the total number of records seen.
+*/
+int tdb_traverse_parallel(struct tdb_context *tdb, int nprocs,
+			  tdb_traverse_func fn, void *private_data)
+{
+	int fds[2], i, count = 0, status;
+	u32 n;
+	pid_t *pids;
+
+	if (nprocs <= 1) {
+		return tdb_traverse_snapshot(tdb, fn, private_data);
+	}
+
+	/* the children would believe they hold our locks */
+	if (tdb->num_locks != 0 || tdb->global_lock.count != 0 ||
+	    tdb->transaction != NULL) {
+		tdb->ecode = TDB_ERR_LOCK;
+		return -1;
+	}
+
+	tdb->methods->tdb_oob(tdb, tdb->map_size + 1, 1);
+	n = tdb_hash_buckets(tdb);
+
+	pids = (pid_t *)calloc(nprocs, sizeof(pid_t));
+	if (pids == NULL) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	if (pipe(fds) == -1) {
+		SAFE_FREE(pids);
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+
+	/* don't let the children repeat our buffered output */
+	fflush(NULL);
+
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_traverse_parallel: "
+				 "fork failed: %s\n", strerror(errno)));
+			count = -1;
+			break;
+		}
+		if (pids[i] == 0) {
+			int ret;
+			u32 first = (u32)(((double)n * i) / nprocs);
+			u32 last = (i == nprocs - 1) ? (u32)-1 :
+				(u32)(((double)n * (i+1)) / nprocs);
+
+			close(fds[0]);
+			ret = tdb_traverse_chains(tdb, first, last, fn,
+						  private_data);
+			fflush(NULL);
+			_exit(write(fds[1], &ret, sizeof(ret)) == sizeof(ret) ?
+			      0 : 1);
+		}
+	}
+	close(fds[1]);
+
+	nprocs = i;
+	for (i = 0; i < nprocs; i++) {
+		int ret;
+
+		if (read(fds[0], &ret, sizeof(ret)) != sizeof(ret) ||
+		    ret == -1) {
+			count = -1;
+		} else if (count != -1) {
+			count += ret;
+		}
+	}
+	close(fds[0]);
+
+	for (i = 0; i < nprocs; i++) {
+		pid_t pid;
+
+		while ((pid = waitpid(pids[i], &status, 0)) == -1 &&
+		       errno == EINTR) {
+			/* try again */
+		}
+		if (pid == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			count = -1;
+		}
+	}
+	SAFE_FREE(pids);
+
+	return count;
+}
+
+
 /* find the first entry in the database and return its key */
 TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 {
@@ -271,7 +526,7 @@ TDB_DATA tdb_firstkey(struct tdb_context *tdb)
 	key.dptr =tdb_alloc_read(tdb,tdb->travlocks.off+sizeof(rec),key.dsize);
 
 	/* Unlock the hash chain of the record we just read. */
-	if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
+	if (tdb_unlock(tdb, BUCKET(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0)
 		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_firstkey: error occurred while tdb_unlocking!\n"));
 	return key;
 }
@@ -286,7 +541,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 
 	/* Is locked key the old key?  If so, traverse will be reliable. */
 	if (tdb->travlocks.off) {
-		if (tdb_lock(tdb,tdb->travlocks.hash,tdb->travlocks.lock_rw))
+		if (tdb_lock(tdb,BUCKET(tdb->travlocks.hash),tdb->travlocks.lock_rw))
 			return tdb_null;
 		if (tdb_rec_read(tdb, tdb->travlocks.off, &rec) == -1
 		    || !(k = tdb_alloc_read(tdb,tdb->travlocks.off+sizeof(rec),
@@ -297,7 +552,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 				SAFE_FREE(k);
 				return tdb_null;
 			}
-			if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0) {
+			if (tdb_unlock(tdb, BUCKET(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0) {
 				SAFE_FREE(k);
 				return tdb_null;
 			}
@@ -312,7 +567,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 		tdb->travlocks.off = tdb_find_lock_hash(tdb, oldkey, tdb->hash_fn(&oldkey), tdb->travlocks.lock_rw, &rec);
 		if (!tdb->travlocks.off)
 			return tdb_null;
-		tdb->travlocks.hash = BUCKET(rec.full_hash);
+		tdb->travlocks.hash = tdb_hash_bucket(tdb, rec.full_hash);
 		if (tdb_lock_record(tdb, tdb->travlocks.off) != 0) {
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_nextkey: lock_record failed (%s)!\n", strerror(errno)));
 			return tdb_null;
@@ -327,7 +582,7 @@ TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA oldkey)
 		key.dptr = tdb_alloc_read(tdb, tdb->travlocks.off+sizeof(rec),
 					  key.dsize);
 		/* Unlock the chain of this new record */
-		if (tdb_unlock(tdb, tdb->travlocks.hash, tdb->travlocks.lock_rw) != 0)
+		if (tdb_unlock(tdb, BUCKET(tdb->travlocks.hash), tdb->travlocks.lock_rw) != 0)
 			TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_nextkey: WARNING tdb_unlock failed!\n"));
 	}
 	/* Unlock the chain of old record */
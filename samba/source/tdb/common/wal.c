@@ -0,0 +1,599 @@
+ /*
+   Unix SMB/CIFS implementation.
+
+   trivial database library - write ahead log
+
+     ** NOTE! The following LGPL license applies to the tdb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+  A database opened with TDB_WAL commits through a redo log in a
+  sidecar file, the database name with ".wal" on the end:
+
+  - a commit appends the new contents of everything the transaction
+    wrote to the log and syncs the log, once. It then writes the
+    same data into the database, without syncing it, and marks the
+    log record as applied. Readers just read the database, as usual.
+
+  - a checkpoint syncs the database and empties the log by bumping
+    the generation in the log header and syncing that. Records of
+    an older generation are never replayed. A commit checkpoints
+    once the log passes TDB_WAL_CHECKPOINT bytes.
+
+  - the log can only be replayed over data its commits wrote, so
+    anybody about to write outside a transaction checkpoints first,
+    see tdb_transaction_flush().
+
+  - the first process to open the database replays every complete
+    record of the current generation, whatever the header says, and
+    checkpoints: the database may have lost any of its unsynced
+    writes. If somebody died part way through writing a commit into
+    the database, the header shows it (applied != tail) and whoever
+    next starts a transaction or writes replays the log.
+
+  - all of this happens under the locks a commit already takes, with
+    FLUSH_LOCK to keep two checkpoints or replays apart.
+
+  Once a database has a log, every writer uses it, whether or not it
+  passed TDB_WAL.
+*/
+
+#include "tdb_private.h"
+
+#define TDB_WAL_MAGIC (0xf53bc0e8U)
+#define TDB_WAL_VERSION 1
+#define TDB_WAL_CHECKPOINT (1024*1024)
+
+struct tdb_wal_header {
+	u32 magic;
+	u32 version;
+	u32 generation; /* only records of this generation are live */
+	tdb_off_t tail; /* end of the records */
+	tdb_off_t applied; /* end of the records written to the database */
+};
+
+#define TDB_WAL_START sizeof(struct tdb_wal_header)
+
+/* a commit, followed by (offset, length, data) for each write */
+struct tdb_wal_rec {
+	u32 magic;
+	u32 generation;
+	tdb_len_t len; /* of the writes that follow */
+	tdb_off_t map_size; /* size of the database after the commit */
+	u32 checksum; /* of the record, with this zero, and the writes */
+};
+
+struct tdb_wal {
+	int fd;
+	struct tdb_wal_header *hdr; /* mapped read only, or &copy */
+	struct tdb_wal_header copy;
+};
+
+static u32 tdb_wal_checksum(u32 sum, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum = (sum ^ p[i]) * 16777619;
+	}
+	return sum;
+}
+
+static int tdb_wal_sync(struct tdb_context *tdb, int fd)
+{
+#ifdef HAVE_FDATASYNC
+	if (fdatasync(fd) == 0) {
+		return 0;
+	}
+#else
+	if (fsync(fd) == 0) {
+		return 0;
+	}
+#endif
+	TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal: sync of %s failed (%s)\n",
+		 fd == tdb->fd ? "database" : "log", strerror(errno)));
+	tdb->ecode = TDB_ERR_IO;
+	return -1;
+}
+
+/* read the header, if it isn't mapped */
+static int tdb_wal_load(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (wal->hdr != &wal->copy) {
+		return 0;
+	}
+	if (pread(wal->fd, &wal->copy, sizeof(wal->copy), 0) !=
+	    sizeof(wal->copy)) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+static int tdb_wal_store(struct tdb_context *tdb,
+			 const struct tdb_wal_header *hdr)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (pwrite(wal->fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal: failed to write log "
+			 "header (%s)\n", strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	if (wal->hdr == &wal->copy) {
+		wal->copy = *hdr;
+	}
+	return 0;
+}
+
+/* make the database at least size bytes long */
+static int tdb_wal_grow(struct tdb_context *tdb, tdb_off_t size)
+{
+	struct stat st;
+
+	if (fstat(tdb->fd, &st) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	if (st.st_size < size &&
+	    tdb->methods->tdb_expand_file(tdb, st.st_size,
+					  size - st.st_size) == -1) {
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	return tdb->methods->tdb_oob(tdb, size, 0);
+}
+
+/* write one commit, checksum already checked, into the database */
+static int tdb_wal_apply(struct tdb_context *tdb, const struct tdb_wal_rec *rec,
+			 const unsigned char *p)
+{
+	const unsigned char *end = p + rec->len;
+
+	if (tdb_wal_grow(tdb, rec->map_size) == -1) {
+		return -1;
+	}
+
+	while (p < end) {
+		tdb_off_t ofs;
+		tdb_len_t len;
+
+		if (end - p < 2*sizeof(tdb_off_t)) {
+			break;
+		}
+		memcpy(&ofs, p, sizeof(ofs));
+		memcpy(&len, p + sizeof(ofs), sizeof(len));
+		p += 2*sizeof(tdb_off_t);
+		if (len > end - p) {
+			break;
+		}
+		if (tdb->methods->tdb_write(tdb, ofs, p, len) == -1) {
+			return -1;
+		}
+		p += len;
+	}
+	if (p != end) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal: malformed record\n"));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  write the log into the database again, from the start up to end or,
+  if end is 0, up to the first record that isn't complete. Returns
+  where it stopped
+*/
+static tdb_off_t tdb_wal_replay(struct tdb_context *tdb, tdb_off_t end)
+{
+	struct tdb_wal *wal = tdb->wal;
+	tdb_off_t off = TDB_WAL_START;
+	unsigned char *buf = NULL;
+	struct stat st;
+	int n = 0;
+
+	if (end == 0) {
+		if (fstat(wal->fd, &st) == -1) {
+			tdb->ecode = TDB_ERR_IO;
+			return 0;
+		}
+		end = st.st_size;
+	}
+
+	while (off + sizeof(struct tdb_wal_rec) <= end) {
+		struct tdb_wal_rec rec;
+		u32 sum;
+
+		if (pread(wal->fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+		    rec.magic != TDB_WAL_MAGIC ||
+		    rec.generation != wal->hdr->generation ||
+		    rec.len > end - off - sizeof(rec)) {
+			break;
+		}
+		SAFE_FREE(buf);
+		if (!(buf = (unsigned char *)malloc(rec.len + 1))) {
+			tdb->ecode = TDB_ERR_OOM;
+			return 0;
+		}
+		if (pread(wal->fd, buf, rec.len, off + sizeof(rec)) != rec.len) {
+			break;
+		}
+		sum = rec.checksum;
+		rec.checksum = 0;
+		if (tdb_wal_checksum(tdb_wal_checksum(2166136261U,
+			(unsigned char *)&rec, sizeof(rec)), buf, rec.len) != sum) {
+			break;
+		}
+		if (tdb_wal_apply(tdb, &rec, buf) == -1) {
+			SAFE_FREE(buf);
+			return 0;
+		}
+		off += sizeof(rec) + rec.len;
+		n++;
+	}
+	SAFE_FREE(buf);
+
+	if (n != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_TRACE, "tdb_wal: replayed %d commits "
+			 "into %s\n", n, tdb->name));
+	}
+	return off;
+}
+
+/* sync the database and start a new, empty log */
+static int tdb_wal_checkpoint(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+	struct tdb_wal_header hdr = *wal->hdr;
+
+	if (hdr.tail == TDB_WAL_START) {
+		return 0;
+	}
+
+	if (tdb_wal_sync(tdb, tdb->fd) == -1) {
+		return -1;
+	}
+#ifdef MS_SYNC
+	if (tdb->map_ptr && msync(tdb->map_ptr, tdb->map_size, MS_SYNC) != 0) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal: msync failed (%s)\n",
+			 strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+#endif
+
+	hdr.generation++;
+	hdr.tail = hdr.applied = TDB_WAL_START;
+	if (tdb_wal_store(tdb, &hdr) == -1 ||
+	    tdb_wal_sync(tdb, wal->fd) == -1) {
+		return -1;
+	}
+
+	/* the old records are dead already. Overwriting them is cheaper
+	   than a truncate, which can cost a journal commit, so only give
+	   the space back once the log has got big */
+	if (lseek(wal->fd, 0, SEEK_END) > TDB_WAL_CHECKPOINT) {
+		ftruncate(wal->fd, TDB_WAL_START);
+	}
+	return 0;
+}
+
+/*
+  finish the writes of a commit that died part way through. Called
+  with FLUSH_LOCK held, also by a commit whose own writes failed
+  after its record was synced: it has happened, so it mustn't fail
+*/
+int tdb_wal_finish(struct tdb_context *tdb)
+{
+	struct tdb_wal_header hdr;
+
+	if (tdb_wal_load(tdb) == -1) {
+		return -1;
+	}
+	hdr = *tdb->wal->hdr;
+	if (hdr.applied == hdr.tail) {
+		return 0;
+	}
+	TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal: finishing an "
+		 "interrupted commit on %s\n", tdb->name));
+	if (tdb_wal_replay(tdb, hdr.tail) != hdr.tail) {
+		return -1;
+	}
+	hdr.applied = hdr.tail;
+	return tdb_wal_store(tdb, &hdr);
+}
+
+/*
+  finish any interrupted commit and, if asked, checkpoint. The caller
+  keeps committers out
+*/
+static int tdb_wal_catch_up(struct tdb_context *tdb, int checkpoint)
+{
+	int ret = -1;
+
+	if (tdb_brlock(tdb, FLUSH_LOCK, F_WRLCK, F_SETLKW, 0, 1) == -1) {
+		return -1;
+	}
+	if (tdb_wal_finish(tdb) == -1) {
+		goto out;
+	}
+	ret = checkpoint ? tdb_wal_checkpoint(tdb) : 0;
+
+ out:
+	tdb_brlock(tdb, FLUSH_LOCK, F_UNLCK, F_SETLKW, 0, 1);
+	return ret;
+}
+
+/*
+  called by tdb_transaction_start() with the transaction lock held,
+  before it locks the chains: the transaction mustn't read the half
+  written data of a commit that died
+*/
+int tdb_wal_repair(struct tdb_context *tdb)
+{
+	int ret;
+
+	if (tdb_wal_load(tdb) == -1) {
+		return -1;
+	}
+	if (tdb->wal->hdr->applied == tdb->wal->hdr->tail) {
+		return 0;
+	}
+	if (tdb_brlock(tdb, FREELIST_TOP, F_WRLCK, F_SETLKW, 0, 0) == -1) {
+		return -1;
+	}
+	ret = tdb_wal_catch_up(tdb, 0);
+	tdb_brlock(tdb, FREELIST_TOP, F_UNLCK, F_SETLKW, 0, 0);
+	return ret;
+}
+
+/*
+  called by anyone about to write outside a transaction, holding a
+  lock that keeps committers out: the log mustn't be replayed over
+  what they write, so empty it
+*/
+int tdb_wal_flush(struct tdb_context *tdb)
+{
+	if (tdb->read_only || tdb_wal_load(tdb) == -1) {
+		return 0;
+	}
+	if (tdb->wal->hdr->tail == TDB_WAL_START) {
+		return 0;
+	}
+	return tdb_wal_catch_up(tdb, 1);
+}
+
+/*
+  put the writes of the transaction being committed, as a list of
+  (offset, length, data), in the log and sync it. After this the
+  commit survives a crash. If it fails the commit didn't happen
+*/
+int tdb_wal_append(struct tdb_context *tdb, const unsigned char *writes,
+		   tdb_len_t len)
+{
+	struct tdb_wal *wal = tdb->wal;
+	struct tdb_wal_header hdr;
+	struct tdb_wal_rec rec, end;
+	tdb_off_t off;
+
+	if (tdb_wal_load(tdb) == -1) {
+		return -1;
+	}
+	hdr = *wal->hdr;
+	off = hdr.tail;
+
+	rec.magic = TDB_WAL_MAGIC;
+	rec.generation = hdr.generation;
+	rec.len = len;
+	rec.map_size = tdb->map_size;
+	rec.checksum = 0;
+	rec.checksum = tdb_wal_checksum(tdb_wal_checksum(2166136261U,
+		(unsigned char *)&rec, sizeof(rec)), writes, len);
+
+	/* a replay stops at the zeroed record after ours, rather than
+	   at whatever an unfinished commit left there */
+	memset(&end, 0, sizeof(end));
+
+	if (pwrite(wal->fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+	    pwrite(wal->fd, writes, len, off + sizeof(rec)) != len ||
+	    pwrite(wal->fd, &end, sizeof(end), off + sizeof(rec) + len)
+	    != sizeof(end)) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_append: failed to "
+			 "write %u bytes to the log (%s)\n",
+			 (unsigned)(sizeof(rec) + len), strerror(errno)));
+		tdb->ecode = TDB_ERR_IO;
+		goto fail;
+	}
+
+	if (tdb_wal_sync(tdb, wal->fd) == -1) {
+		goto fail;
+	}
+
+	hdr.tail += sizeof(rec) + len;
+	if (tdb_wal_store(tdb, &hdr) == -1) {
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	/* the record may be complete, and even on disk, and the first
+	   opener replays every complete record: kill it, as best we can */
+	if (pwrite(wal->fd, &end.magic, sizeof(end.magic), off) ==
+	    sizeof(end.magic)) {
+		tdb_wal_sync(tdb, wal->fd);
+	}
+	tdb->ecode = TDB_ERR_IO;
+	return -1;
+}
+
+/*
+  the commit's writes are all in the database. Checkpoint if the log
+  has got big, while we still hold the commit locks
+*/
+int tdb_wal_applied(struct tdb_context *tdb)
+{
+	struct tdb_wal_header hdr;
+
+	if (tdb_wal_load(tdb) == -1) {
+		return -1;
+	}
+	hdr = *tdb->wal->hdr;
+	hdr.applied = hdr.tail;
+	if (tdb_wal_store(tdb, &hdr) == -1) {
+		return -1;
+	}
+	if (hdr.tail - TDB_WAL_START >= TDB_WAL_CHECKPOINT) {
+		return tdb_wal_checkpoint(tdb);
+	}
+	return 0;
+}
+
+/*
+  called from tdb_open_ex() with the global lock held. Open the log if
+  the database has one or TDB_WAL asks for one, and bring the
+  database up to date with it. If nobody else has the file open the
+  database may have lost unsynced writes, so replay all of it
+*/
+int tdb_wal_open(struct tdb_context *tdb, int alone)
+{
+	struct tdb_wal *wal;
+	struct stat st;
+	char *name;
+	size_t len;
+
+	/* none of these keep a database across a crash */
+	if (tdb->read_only ||
+	    (tdb->flags & (TDB_INTERNAL|TDB_CLEAR_IF_FIRST|TDB_VOLATILE))) {
+		tdb->flags &= ~TDB_WAL;
+		return 0;
+	}
+
+	len = strlen(tdb->name) + 5;
+	if (!(name = (char *)malloc(len))) {
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	snprintf(name, len, "%s.wal", tdb->name);
+
+	/* a database that has a log is always written through it, even
+	   by openers that didn't ask for syncs */
+	if (stat(name, &st) == -1 &&
+	    (!(tdb->flags & TDB_WAL) ||
+	     (tdb->flags & (TDB_NOSYNC|TDB_NOSYNC_ORDERED)))) {
+		tdb->flags &= ~TDB_WAL;
+		free(name);
+		return 0;
+	}
+	tdb->flags |= TDB_WAL;
+
+	if (!(wal = (struct tdb_wal *)calloc(1, sizeof(*wal)))) {
+		free(name);
+		tdb->ecode = TDB_ERR_OOM;
+		return -1;
+	}
+	wal->hdr = &wal->copy;
+	tdb->wal = wal;
+
+	if (fstat(tdb->fd, &st) == -1 ||
+	    (wal->fd = open(name, O_RDWR|O_CREAT, st.st_mode & 0777)) == -1) {
+		TDB_LOG((tdb, TDB_DEBUG_ERROR, "tdb_wal_open: can't open %s "
+			 "(%s)\n", name, strerror(errno)));
+		free(name);
+		SAFE_FREE(tdb->wal);
+		tdb->ecode = TDB_ERR_IO;
+		return -1;
+	}
+	free(name);
+
+	if (fstat(wal->fd, &st) == -1) {
+		goto fail;
+	}
+	if (st.st_size < TDB_WAL_START) {
+		struct tdb_wal_header hdr;
+
+		hdr.magic = TDB_WAL_MAGIC;
+		hdr.version = TDB_WAL_VERSION;
+		hdr.generation = 1;
+		hdr.tail = hdr.applied = TDB_WAL_START;
+		if (tdb_wal_store(tdb, &hdr) == -1 ||
+		    tdb_wal_sync(tdb, wal->fd) == -1) {
+			goto fail;
+		}
+	}
+	if (tdb_wal_load(tdb) == -1) {
+		goto fail;
+	}
+	if (wal->copy.magic != TDB_WAL_MAGIC ||
+	    wal->copy.version != TDB_WAL_VERSION) {
+		TDB_LOG((tdb, TDB_DEBUG_FATAL, "tdb_wal_open: %s.wal is not "
+			 "a tdb log\n", tdb->name));
+		tdb->ecode = TDB_ERR_CORRUPT;
+		goto fail;
+	}
+
+#ifdef HAVE_MMAP
+	if (!(tdb->flags & TDB_NOMMAP)) {
+		void *p = mmap(NULL, TDB_WAL_START, PROT_READ, MAP_SHARED,
+			       wal->fd, 0);
+		if (p != MAP_FAILED) {
+			wal->hdr = (struct tdb_wal_header *)p;
+		}
+	}
+#endif
+
+	if (alone) {
+		struct tdb_wal_header hdr = *wal->hdr;
+
+		hdr.tail = hdr.applied = tdb_wal_replay(tdb, 0);
+		if (hdr.tail == 0 || tdb_wal_store(tdb, &hdr) == -1 ||
+		    tdb_wal_checkpoint(tdb) == -1) {
+			goto fail;
+		}
+		return 0;
+	}
+
+	if (tdb_wal_catch_up(tdb, 0) == -1) {
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	tdb_wal_close(tdb);
+	return -1;
+}
+
+void tdb_wal_close(struct tdb_context *tdb)
+{
+	struct tdb_wal *wal = tdb->wal;
+
+	if (wal == NULL) {
+		return;
+	}
+#ifdef HAVE_MMAP
+	if (wal->hdr != &wal->copy) {
+		munmap((void *)wal->hdr, TDB_WAL_START);
+	}
+#endif
+	close(wal->fd);
+	SAFE_FREE(tdb->wal);
+}
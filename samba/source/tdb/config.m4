@@ -13,7 +13,8 @@ if test x"$tdbdir" = "x"; then
    AC_MSG_ERROR([cannot find tdb source in $tdbpaths])
 fi
 TDBOBJ="common/tdb.o common/dump.o common/transaction.o common/error.o common/traverse.o"
-TDBOBJ="$TDBOBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/open.o"
+TDBOBJ="$TDBOBJ common/freelist.o common/freelistcheck.o common/io.o common/lock.o common/mutex.o common/open.o"
+TDBOBJ="$TDBOBJ common/hashtable.o common/cache.o common/wal.o"
 AC_SUBST(TDBOBJ)
 
 libreplacedir=../lib/replace
@@ -5,9 +5,10 @@ VERSION = 0.0.1
 SO_VERSION = 0
 DESCRIPTION = Trivial Database Library
 OBJ_FILES = \
-	common/tdb.o common/dump.o common/io.o common/lock.o \
+	common/tdb.o common/dump.o common/io.o common/lock.o common/mutex.o \
 	common/open.o common/traverse.o common/freelist.o \
-	common/error.o common/transaction.o common/tdbutil.o
+	common/error.o common/transaction.o common/hashtable.o \
+	common/cache.o common/wal.o common/tdbutil.o
 CFLAGS = -Ilib/tdb/include
 PUBLIC_HEADERS = include/tdb.h
 #
@@ -37,6 +38,17 @@ PRIVATE_DEPENDENCIES = \
 # End BINARY tdbtorture
 ################################################
 
+################################################
+# Start BINARY tdbbench
+[BINARY::tdbbench]
+INSTALLDIR = BINDIR
+OBJ_FILES= \
+		tools/tdbbench.o
+PRIVATE_DEPENDENCIES = \
+		LIBTDB
+# End BINARY tdbbench
+################################################
+
 ################################################
 # Start BINARY tdbdump
 [BINARY::tdbdump]
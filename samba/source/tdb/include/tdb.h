@@ -47,6 +47,13 @@ extern "C" {
 #define TDB_BIGENDIAN 32 /* header is big-endian (internal use) */
 #define TDB_NOSYNC   64 /* don't use synchronous transactions */
 #define TDB_SEQNUM   128 /* maintain a sequence number */
+#define TDB_MUTEX_LOCKING 256 /* lock chains with shared mutexes, needs CLEAR_IF_FIRST */
+#define TDB_GROWABLE 512 /* new file may grow its hash table as it fills */
+#define TDB_GROUP_COMMIT 1024 /* share the syncs of concurrent commits */
+#define TDB_NOSYNC_ORDERED 2048 /* keep the recovery area but don't sync */
+#define TDB_VOLATILE 4096 /* keep the file in shared memory, not on disk */
+#define TDB_FETCH_CACHE 8192 /* cache fetches, checked against the seqnum */
+#define TDB_WAL 16384 /* commit through a write ahead log, one sync each */
 
 #define TDB_ERRCODE(code, ret) ((tdb->ecode = (code)), ret)
 
@@ -64,6 +71,27 @@ typedef struct TDB_DATA {
 	size_t dsize;
 } TDB_DATA;
 
+/* a record looked at in place, see tdb_fetch_view() */
+typedef struct TDB_VIEW {
+	TDB_DATA data;
+	int list;	/* the chain read lock held for the view */
+	char *copy;	/* set if the record had to be read out */
+} TDB_VIEW;
+
+/* what a tdb_context has been up to, see tdb_get_stats() */
+struct tdb_stats {
+	unsigned long locks;		/* byte range and chain locks taken */
+	unsigned long lock_waits;	/* of those, ones that had to wait */
+	unsigned long lock_wait_usec;	/* time spent waiting for them */
+	unsigned long lookups;		/* hash chain searches */
+	unsigned long chain_walk;	/* records looked at by them */
+	unsigned long chain_walk_max;	/* most looked at by one of them */
+	unsigned long allocs;		/* records allocated */
+	unsigned long freelist_walk;	/* free records looked at for them */
+	unsigned long expansions;	/* times the file was grown */
+	unsigned long remaps;		/* times it was mapped again */
+};
+
 #ifndef PRINTF_ATTRIBUTE
 #if (__GNUC__ >= 3)
 /** Use gcc attribute to check printf fns.  a1 is the 1-based index of
@@ -106,14 +134,20 @@ int tdb_parse_record(struct tdb_context *tdb, TDB_DATA key,
 		     int (*parser)(TDB_DATA key, TDB_DATA data,
 				   void *private_data),
 		     void *private_data);
+int tdb_fetch_view(struct tdb_context *tdb, TDB_DATA key, TDB_VIEW *view);
+void tdb_release_view(struct tdb_context *tdb, TDB_VIEW *view);
 int tdb_delete(struct tdb_context *tdb, TDB_DATA key);
 int tdb_store(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf, int flag);
+int tdb_store_tail(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
+		   size_t unchanged);
 int tdb_append(struct tdb_context *tdb, TDB_DATA key, TDB_DATA new_dbuf);
 int tdb_close(struct tdb_context *tdb);
 TDB_DATA tdb_firstkey(struct tdb_context *tdb);
 TDB_DATA tdb_nextkey(struct tdb_context *tdb, TDB_DATA key);
 int tdb_traverse(struct tdb_context *tdb, tdb_traverse_func fn, void *);
 int tdb_traverse_read(struct tdb_context *tdb, tdb_traverse_func fn, void *);
+int tdb_traverse_snapshot(struct tdb_context *tdb, tdb_traverse_func fn, void *);
+int tdb_traverse_parallel(struct tdb_context *tdb, int nprocs, tdb_traverse_func fn, void *);
 int tdb_exists(struct tdb_context *tdb, TDB_DATA key);
 int tdb_lockall(struct tdb_context *tdb);
 int tdb_unlockall(struct tdb_context *tdb);
@@ -128,9 +162,13 @@ int tdb_transaction_commit(struct tdb_context *tdb);
 int tdb_transaction_cancel(struct tdb_context *tdb);
 int tdb_transaction_recover(struct tdb_context *tdb);
 int tdb_get_seqnum(struct tdb_context *tdb);
+void tdb_bump_seqnum(struct tdb_context *tdb);
 int tdb_hash_size(struct tdb_context *tdb);
+int tdb_hash_grow(struct tdb_context *tdb);
 size_t tdb_map_size(struct tdb_context *tdb);
 int tdb_get_flags(struct tdb_context *tdb);
+void tdb_get_stats(struct tdb_context *tdb, struct tdb_stats *stats);
+void tdb_reset_stats(struct tdb_context *tdb);
 
 /* Low level locking functions: use with care */
 int tdb_chainlock(struct tdb_context *tdb, TDB_DATA key);
@@ -0,0 +1,432 @@
+/* this measures tdb under load from several processes, replaying the
+   access patterns of the busiest samba databases, and prints the
+   statistics each database kept (see tdb_get_stats()).
+
+   sharemode - open and close records of a few hundred bytes growing and
+               shrinking under a chain lock, as locking.tdb
+   brlock    - mostly lookups, with small entries added and removed
+               under a chain lock, as brlock.tdb
+   messages  - appends to another process's record, which it then
+               fetches and deletes, as messages.tdb
+   gencache  - mostly lookups of string keys, some stores, as
+               gencache.tdb
+*/
+
+#include "replace.h"
+#include "tdb.h"
+#include "system/time.h"
+#include "system/wait.h"
+#include "system/filesys.h"
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#define SHARE_ENTRY_LEN 96
+#define LOCK_ENTRY_LEN 40
+#define MESSAGE_LEN 64
+
+enum workload { W_SHAREMODE, W_BRLOCK, W_MESSAGES, W_GENCACHE, W_MAX };
+
+static const char *workload_names[W_MAX] = {
+	"sharemode", "brlock", "messages", "gencache"
+};
+
+/* what a child sends back for each database */
+struct bench_result {
+	unsigned long ops;
+	struct tdb_stats stats;
+};
+
+static int num_procs = 4;
+static int num_loops = 10000;
+static int num_keys = 256;
+static int hash_size = 0;
+static int tdb_flags = 0;
+static int error_count;
+
+#ifdef PRINTF_ATTRIBUTE
+static void tdb_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...) PRINTF_ATTRIBUTE(3,4);
+#endif
+static void tdb_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...)
+{
+	va_list ap;
+
+	if (level > TDB_DEBUG_ERROR) {
+		return;
+	}
+	error_count++;
+
+	va_start(ap, format);
+	vfprintf(stdout, format, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+/* a device/inode pair, the key of the share mode and brlock records */
+static TDB_DATA file_key(char *buf, int i)
+{
+	TDB_DATA key;
+
+	memset(buf, 0, 16);
+	memcpy(buf, &i, sizeof(i));
+	buf[8] = 0x2a;
+	key.dptr = buf;
+	key.dsize = 16;
+	return key;
+}
+
+/* add an entry of len bytes to the record, or take the last one off */
+static int update_entries(struct tdb_context *tdb, TDB_DATA key, int len,
+			  int add)
+{
+	TDB_DATA data;
+	char *p;
+	int ret;
+
+	if (tdb_chainlock(tdb, key) == -1) {
+		return -1;
+	}
+	data = tdb_fetch(tdb, key);
+
+	if (add) {
+		p = (char *)realloc(data.dptr, data.dsize + len);
+		if (p == NULL) {
+			tdb_chainunlock(tdb, key);
+			return -1;
+		}
+		memset(p + data.dsize, getpid() & 0xff, len);
+		data.dptr = p;
+		data.dsize += len;
+		ret = tdb_store(tdb, key, data, TDB_REPLACE);
+	} else if (data.dsize <= len) {
+		ret = data.dptr ? tdb_delete(tdb, key) : 0;
+	} else {
+		data.dsize -= len;
+		ret = tdb_store(tdb, key, data, TDB_REPLACE);
+	}
+
+	free(data.dptr);
+	tdb_chainunlock(tdb, key);
+	return ret;
+}
+
+static int sharemode_op(struct tdb_context *tdb, int *held)
+{
+	char buf[16];
+	int i = random() % num_keys;
+	TDB_DATA key = file_key(buf, i);
+	TDB_DATA data;
+
+	/* every open looks at the record first */
+	data = tdb_fetch(tdb, key);
+	free(data.dptr);
+
+	if (held[i] < 2 && (held[i] == 0 || random() % 2)) {
+		held[i]++;
+		return update_entries(tdb, key, SHARE_ENTRY_LEN, 1);
+	}
+	held[i]--;
+	return update_entries(tdb, key, SHARE_ENTRY_LEN, 0);
+}
+
+static int brlock_op(struct tdb_context *tdb, int *held)
+{
+	char buf[16];
+	int i = random() % num_keys;
+	int r = random() % 100;
+	TDB_DATA key = file_key(buf, i);
+	TDB_DATA data;
+
+	/* most reads and writes only check for conflicting locks */
+	if (r < 70 || (r < 85 && held[i] == 0)) {
+		data = tdb_fetch(tdb, key);
+		free(data.dptr);
+		return 0;
+	}
+	if (r < 85) {
+		held[i]--;
+		return update_entries(tdb, key, LOCK_ENTRY_LEN, 0);
+	}
+	held[i]++;
+	return update_entries(tdb, key, LOCK_ENTRY_LEN, 1);
+}
+
+static int messages_op(struct tdb_context *tdb, int id)
+{
+	char kbuf[32], msg[MESSAGE_LEN];
+	TDB_DATA key, data;
+	int ret = 0;
+
+	if (random() % 2) {
+		/* send to somebody */
+		snprintf(kbuf, sizeof(kbuf), "PID/%d", (int)(random() % num_procs));
+		key.dptr = kbuf;
+		key.dsize = strlen(kbuf) + 1;
+		memset(msg, id, sizeof(msg));
+		data.dptr = msg;
+		data.dsize = sizeof(msg);
+		return tdb_append(tdb, key, data);
+	}
+
+	/* receive our own */
+	snprintf(kbuf, sizeof(kbuf), "PID/%d", id);
+	key.dptr = kbuf;
+	key.dsize = strlen(kbuf) + 1;
+	if (tdb_chainlock(tdb, key) == -1) {
+		return -1;
+	}
+	data = tdb_fetch(tdb, key);
+	if (data.dptr != NULL) {
+		ret = tdb_delete(tdb, key);
+		free(data.dptr);
+	}
+	tdb_chainunlock(tdb, key);
+	return ret;
+}
+
+static int gencache_op(struct tdb_context *tdb)
+{
+	char kbuf[64], vbuf[64];
+	TDB_DATA key, data;
+
+	snprintf(kbuf, sizeof(kbuf), "NBT/HOST%d#20", (int)(random() % num_keys));
+	key.dptr = kbuf;
+	key.dsize = strlen(kbuf) + 1;
+
+	if (random() % 10) {
+		data = tdb_fetch(tdb, key);
+		free(data.dptr);
+		return 0;
+	}
+
+	snprintf(vbuf, sizeof(vbuf), "%lu/10.0.%d.%d", (unsigned long)time(NULL),
+		 (int)(random() % 256), (int)(random() % 256));
+	data.dptr = vbuf;
+	data.dsize = strlen(vbuf) + 1;
+	return tdb_store(tdb, key, data, TDB_REPLACE);
+}
+
+static void child(const char *dir, int id, int mask, int fd)
+{
+	struct tdb_logging_context log_ctx;
+	struct tdb_context *dbs[W_MAX];
+	struct bench_result res[W_MAX];
+	int *held[W_MAX];
+	char name[1024];
+	int i, w;
+
+	log_ctx.log_fn = tdb_log;
+	log_ctx.log_private = NULL;
+
+	memset(dbs, 0, sizeof(dbs));
+	memset(res, 0, sizeof(res));
+
+	for (w = 0; w < W_MAX; w++) {
+		if (!(mask & (1 << w))) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s/%s.tdb", dir, workload_names[w]);
+		dbs[w] = tdb_open_ex(name, hash_size, tdb_flags,
+				     O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
+		held[w] = (int *)calloc(num_keys, sizeof(int));
+		if (dbs[w] == NULL || held[w] == NULL) {
+			perror(name);
+			exit(1);
+		}
+		tdb_reset_stats(dbs[w]);
+	}
+
+	srandom(getpid());
+
+	for (i = 0; i < num_loops && error_count == 0; i++) {
+		int ret = 0;
+
+		do {
+			w = random() % W_MAX;
+		} while (!(mask & (1 << w)));
+
+		switch (w) {
+		case W_SHAREMODE:
+			ret = sharemode_op(dbs[w], held[w]);
+			break;
+		case W_BRLOCK:
+			ret = brlock_op(dbs[w], held[w]);
+			break;
+		case W_MESSAGES:
+			ret = messages_op(dbs[w], id);
+			break;
+		case W_GENCACHE:
+			ret = gencache_op(dbs[w]);
+			break;
+		}
+		if (ret != 0) {
+			printf("%s: %s\n", workload_names[w],
+			       tdb_errorstr(dbs[w]));
+			error_count++;
+		}
+		res[w].ops++;
+	}
+
+	for (w = 0; w < W_MAX; w++) {
+		if (dbs[w] != NULL) {
+			tdb_get_stats(dbs[w], &res[w].stats);
+			tdb_close(dbs[w]);
+		}
+	}
+
+	if (write(fd, res, sizeof(res)) != sizeof(res)) {
+		perror("write");
+		error_count++;
+	}
+	exit(error_count);
+}
+
+static void print_result(const char *name, const struct bench_result *r,
+			 double secs)
+{
+	const struct tdb_stats *st = &r->stats;
+
+	printf("%s: %lu ops, %.0f ops/sec\n", name, r->ops, r->ops / secs);
+	printf("  locks %lu, %lu waited (%.2f%%) for %.1f us each\n",
+	       st->locks, st->lock_waits,
+	       st->locks ? 100.0 * st->lock_waits / st->locks : 0.0,
+	       st->lock_waits ? (double)st->lock_wait_usec / st->lock_waits : 0.0);
+	printf("  lookups %lu walking %.2f records on average, %lu at most\n",
+	       st->lookups,
+	       st->lookups ? (double)st->chain_walk / st->lookups : 0.0,
+	       st->chain_walk_max);
+	printf("  allocations %lu walking %.2f free records on average\n",
+	       st->allocs,
+	       st->allocs ? (double)st->freelist_walk / st->allocs : 0.0);
+	printf("  expansions %lu, remaps %lu\n", st->expansions, st->remaps);
+}
+
+static void usage(void)
+{
+	printf("Usage: tdbbench [-n NUM_PROCS] [-l NUM_LOOPS] [-k NUM_KEYS] [-H HASH_SIZE]\n"
+	       "                [-f TDB_FLAGS] [-w sharemode,brlock,messages,gencache] [DIR]\n");
+	exit(0);
+}
+
+ int main(int argc, char * const *argv)
+{
+	struct bench_result total[W_MAX], res[W_MAX];
+	struct timeval start, end;
+	const char *dir = ".";
+	char name[1024];
+	int mask = (1 << W_MAX) - 1;
+	int fds[2];
+	int c, i, w;
+	double secs;
+	extern char *optarg;
+	extern int optind;
+
+	while ((c = getopt(argc, argv, "n:l:k:H:f:w:h")) != -1) {
+		switch (c) {
+		case 'n':
+			num_procs = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			num_loops = strtol(optarg, NULL, 0);
+			break;
+		case 'k':
+			num_keys = strtol(optarg, NULL, 0);
+			break;
+		case 'H':
+			hash_size = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			tdb_flags = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			mask = 0;
+			for (w = 0; w < W_MAX; w++) {
+				if (strstr(optarg, workload_names[w])) {
+					mask |= 1 << w;
+				}
+			}
+			if (mask == 0) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc) {
+		dir = argv[optind];
+	}
+	if (num_procs < 1 || num_keys < 1) {
+		usage();
+	}
+
+	for (w = 0; w < W_MAX; w++) {
+		snprintf(name, sizeof(name), "%s/%s.tdb", dir, workload_names[w]);
+		unlink(name);
+	}
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+
+	printf("%d processes doing %d operations each on %d keys\n",
+	       num_procs, num_loops, num_keys);
+	fflush(stdout);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_procs; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			child(dir, i, mask, fds[1]);
+		}
+	}
+	close(fds[1]);
+
+	memset(total, 0, sizeof(total));
+	while (read(fds[0], res, sizeof(res)) == sizeof(res)) {
+		for (w = 0; w < W_MAX; w++) {
+			struct tdb_stats *t = &total[w].stats, *s = &res[w].stats;
+
+			total[w].ops += res[w].ops;
+			t->locks += s->locks;
+			t->lock_waits += s->lock_waits;
+			t->lock_wait_usec += s->lock_wait_usec;
+			t->lookups += s->lookups;
+			t->chain_walk += s->chain_walk;
+			if (s->chain_walk_max > t->chain_walk_max) {
+				t->chain_walk_max = s->chain_walk_max;
+			}
+			t->allocs += s->allocs;
+			t->freelist_walk += s->freelist_walk;
+			t->expansions += s->expansions;
+			t->remaps += s->remaps;
+		}
+	}
+
+	while (wait(&i) > 0) {
+		if (!WIFEXITED(i) || WEXITSTATUS(i) != 0) {
+			error_count++;
+		}
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1.0e6;
+
+	printf("%.2f seconds\n", secs);
+	for (w = 0; w < W_MAX; w++) {
+		if (mask & (1 << w)) {
+			print_result(workload_names[w], &total[w], secs);
+		}
+	}
+
+	if (error_count != 0) {
+		printf("%d processes failed\n", error_count);
+	}
+	return error_count;
+}
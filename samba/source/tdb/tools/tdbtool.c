@@ -62,6 +62,9 @@ enum commands {
 	CMD_LIST_HASH_FREE,
 	CMD_LIST_FREE,
 	CMD_INFO,
+	CMD_COUNT,
+	CMD_STATS,
+	CMD_GROW,
 	CMD_FIRST,
 	CMD_NEXT,
 	CMD_SYSTEM,
@@ -90,6 +93,9 @@ COMMAND_TABLE cmd_table[] = {
 	{"list",	CMD_LIST_HASH_FREE},
 	{"free",	CMD_LIST_FREE},
 	{"info",	CMD_INFO},
+	{"count",	CMD_COUNT},
+	{"stats",	CMD_STATS},
+	{"grow",	CMD_GROW},
 	{"first",	CMD_FIRST},
 	{"1",		CMD_FIRST},
 	{"next",	CMD_NEXT},
@@ -189,6 +195,8 @@ static void help(void)
 "  keys                 : dump the database keys as strings\n"
 "  hexkeys              : dump the database keys as hex values\n"
 "  info                 : print summary info about the database\n"
+"  count     [nprocs]   : count the records, from nprocs processes at once\n"
+"  stats                : look up every key and print the lookup statistics\n"
 "  insert    key  data  : insert a record\n"
 "  move      key  file  : move a record to a destination tdb\n"
 "  store     key  data  : store a record (replace)\n"
@@ -196,6 +204,7 @@ static void help(void)
 "  delete    key        : delete a record by key\n"
 "  list                 : print the database hash table and freelist\n"
 "  free                 : print the database freelist\n"
+"  grow                 : double the number of hash chains\n"
 "  ! command            : execute system command\n"             
 "  1 | first            : print the first record\n"
 "  n | next             : print the next record\n"
@@ -441,7 +450,62 @@ static void info_tdb(void)
 	if ((count = tdb_traverse(tdb, traverse_fn, NULL)) == -1)
 		printf("Error = %s\n", tdb_errorstr(tdb));
 	else
-		printf("%d records totalling %d bytes\n", count, total_bytes);
+		printf("%d records totalling %d bytes in %d hash chains\n",
+		       count, total_bytes, tdb_hash_size(tdb));
+}
+
+static void count_tdb(const char *nprocs)
+{
+	int count;
+
+	count = tdb_traverse_parallel(tdb, nprocs ? atoi(nprocs) : 1,
+				      NULL, NULL);
+	if (count == -1)
+		printf("Error = %s\n", tdb_errorstr(tdb));
+	else
+		printf("%d records\n", count);
+}
+
+static int stats_fn(TDB_CONTEXT *the_tdb, TDB_DATA key, TDB_DATA dbuf, void *state)
+{
+	TDB_DATA d = tdb_fetch(the_tdb, key);
+	free(d.dptr);
+	return 0;
+}
+
+static void stats_tdb(void)
+{
+	struct tdb_stats st;
+	int count, free_count;
+
+	tdb_reset_stats(tdb);
+	if ((count = tdb_traverse_read(tdb, stats_fn, NULL)) == -1) {
+		printf("Error = %s\n", tdb_errorstr(tdb));
+		return;
+	}
+	tdb_get_stats(tdb, &st);
+
+	printf("%d records in %d hash chains, %lu bytes mapped\n",
+	       count, tdb_hash_size(tdb), (unsigned long)tdb_map_size(tdb));
+	printf("lookups:         %lu walking %.2f records on average, %lu at most\n",
+	       st.lookups, st.lookups ? (double)st.chain_walk / st.lookups : 0.0,
+	       st.chain_walk_max);
+	printf("locks:           %lu, %lu waited for %lu us\n",
+	       st.locks, st.lock_waits, st.lock_wait_usec);
+	if (tdb_validate_freelist(tdb, &free_count) == 0) {
+		printf("freelist:        %d records\n", free_count);
+	}
+	printf("allocations:     %lu walking %lu free records\n",
+	       st.allocs, st.freelist_walk);
+	printf("expansions:      %lu, %lu remaps\n", st.expansions, st.remaps);
+}
+
+static void grow_tdb(void)
+{
+	if (tdb_hash_grow(tdb) == -1)
+		printf("Error = %s\n", tdb_errorstr(tdb));
+	else
+		printf("now %d hash chains\n", tdb_hash_size(tdb));
 }
 
 static char *tdb_getline(const char *prompt)
@@ -579,6 +643,15 @@ static int do_command(void)
 	    case CMD_INFO:
 		info_tdb();
 		return 0;
+	    case CMD_COUNT:
+		count_tdb(arg1);
+		return 0;
+	    case CMD_STATS:
+		stats_tdb();
+		return 0;
+	    case CMD_GROW:
+		grow_tdb();
+		return 0;
 	    case CMD_FIRST:
 		bIterate = 1;
 		first_record(tdb, &iterate_kbuf);
@@ -24,6 +24,8 @@
 #define CULL_PROB 100
 #define KEYLEN 3
 #define DATALEN 100
+#define WAL_CRASH_ROUNDS 20
+#define WAL_CRASH_KEYS 10
 
 static struct tdb_context *db;
 static int in_transaction;
@@ -200,16 +202,192 @@ static int traverse_fn(struct tdb_context *tdb, TDB_DATA key, TDB_DATA dbuf,
 
 static void usage(void)
 {
-	printf("Usage: tdbtorture [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE]\n");
+	printf("Usage: tdbtorture [-n NUM_PROCS] [-l NUM_LOOPS] [-s SEED] [-H HASH_SIZE] [-w]\n");
+	printf("  -w  use a write ahead log, then kill writers mid-commit and check what survives\n");
 	exit(0);
 }
 
+/* writers killed mid-commit are expected, only count real failures */
+static void wal_crash_log(struct tdb_context *tdb, enum tdb_debug_level level, const char *format, ...)
+{
+	va_list ap;
+
+	if (level != TDB_DEBUG_FATAL) {
+		return;
+	}
+
+	error_count++;
+
+	va_start(ap, format);
+	vfprintf(stdout, format, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+static TDB_DATA wal_crash_key(int round, int writer, int k)
+{
+	static char buf[32];
+	TDB_DATA key;
+
+	snprintf(buf, sizeof(buf), "r%dw%dk%d", round, writer, k);
+	key.dptr = (unsigned char *)buf;
+	key.dsize = strlen(buf) + 1;
+	return key;
+}
+
+/*
+  commit transactions setting all of this writer's keys to the same
+  count, telling the parent each count that committed, until killed
+*/
+static void wal_crash_writer(int round, int writer, int hash_size, int fd)
+{
+	struct tdb_logging_context log_ctx;
+	int n, k;
+
+	log_ctx.log_fn = wal_crash_log;
+	db = tdb_open_ex("torture.tdb", hash_size, TDB_WAL, O_RDWR, 0600,
+			 &log_ctx, NULL);
+	if (!db) {
+		fatal("db open failed");
+		_exit(1);
+	}
+
+	for (n = 1; error_count == 0; n++) {
+		if (tdb_transaction_start(db) != 0) {
+			fatal("tdb_transaction_start failed");
+			break;
+		}
+		for (k = 0; k < WAL_CRASH_KEYS; k++) {
+			int dlen = 10 + (random() % (10*DATALEN));
+			char *d = randbuf(dlen);
+			TDB_DATA data;
+
+			snprintf(d, dlen, "%d", n);
+			data.dptr = (unsigned char *)d;
+			data.dsize = dlen + 1;
+			if (tdb_store(db, wal_crash_key(round, writer, k),
+				      data, TDB_REPLACE) != 0) {
+				fatal("tdb_store failed");
+			}
+			free(d);
+		}
+		if (tdb_transaction_commit(db) != 0) {
+			fatal("tdb_transaction_commit failed");
+			break;
+		}
+		if (write(fd, &n, sizeof(n)) != sizeof(n)) {
+			fatal("write failed");
+			break;
+		}
+		/* writes outside a transaction empty the log */
+		if (random() % 20 == 0) {
+			TDB_DATA data;
+			data.dptr = (unsigned char *)&n;
+			data.dsize = sizeof(n);
+			tdb_store(db, wal_crash_key(round, writer, -1), data,
+				  TDB_REPLACE);
+		}
+	}
+	_exit(1);
+}
+
+/*
+  kill writers at random points, then open the database alone, which
+  replays the log, and check every writer's last commit is there,
+  whole, and nothing later than it is half there
+*/
+static void wal_crash_test(int num_procs, int hash_size)
+{
+	struct tdb_logging_context log_ctx;
+	int round, w, k;
+	pid_t *pids = calloc(sizeof(pid_t), num_procs);
+	int *fds = calloc(sizeof(int), num_procs);
+
+	log_ctx.log_fn = wal_crash_log;
+
+	for (round = 0; round < WAL_CRASH_ROUNDS && error_count == 0; round++) {
+		for (w = 0; w < num_procs; w++) {
+			int p[2];
+
+			if (pipe(p) != 0) {
+				fatal("pipe failed");
+				return;
+			}
+			if ((pids[w] = fork()) == 0) {
+				close(p[0]);
+				srandom(getpid());
+				wal_crash_writer(round, w, hash_size, p[1]);
+			}
+			close(p[1]);
+			fds[w] = p[0];
+		}
+
+		usleep(10000 + random() % 100000);
+
+		for (w = 0; w < num_procs; w++) {
+			kill(pids[w], SIGKILL);
+		}
+		for (w = 0; w < num_procs; w++) {
+			int status;
+			waitpid(pids[w], &status, 0);
+		}
+
+		db = tdb_open_ex("torture.tdb", hash_size, TDB_WAL, O_RDWR,
+				 0600, &log_ctx, NULL);
+		if (!db) {
+			fatal("db reopen failed");
+			return;
+		}
+
+		for (w = 0; w < num_procs; w++) {
+			int acked = 0, n, first = -1;
+
+			while (read(fds[w], &n, sizeof(n)) == sizeof(n)) {
+				acked = n;
+			}
+			close(fds[w]);
+
+			for (k = 0; k < WAL_CRASH_KEYS; k++) {
+				TDB_DATA data;
+
+				data = tdb_fetch(db, wal_crash_key(round, w, k));
+				n = data.dptr ? atoi((char *)data.dptr) : 0;
+				free(data.dptr);
+				if (k == 0) {
+					first = n;
+				} else if (n != first) {
+					printf("round %d writer %d: key %d has "
+					       "commit %d, key 0 has %d\n",
+					       round, w, k, n, first);
+					error_count++;
+				}
+			}
+			if (first < acked) {
+				printf("round %d writer %d: commit %d was "
+				       "acknowledged, found %d\n",
+				       round, w, acked, first);
+				error_count++;
+			}
+		}
+
+		if (tdb_traverse_read(db, NULL, NULL) == -1) {
+			printf("round %d: traverse failed\n", round);
+			error_count++;
+		}
+		tdb_close(db);
+	}
+
+	free(pids);
+	free(fds);
+}
+
  int main(int argc, char * const *argv)
 {
 	int i, seed = -1;
 	int num_procs = 3;
 	int num_loops = 5000;
 	int hash_size = 2;
+	int wal = 0;
 	int c;
 	extern char *optarg;
 	pid_t *pids;
@@ -217,7 +395,7 @@ static void usage(void)
 	struct tdb_logging_context log_ctx;
 	log_ctx.log_fn = tdb_log;
 
-	while ((c = getopt(argc, argv, "n:l:s:H:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:l:s:H:wh")) != -1) {
 		switch (c) {
 		case 'n':
 			num_procs = strtol(optarg, NULL, 0);
@@ -231,12 +409,16 @@ static void usage(void)
 		case 's':
 			seed = strtol(optarg, NULL, 0);
 			break;
+		case 'w':
+			wal = 1;
+			break;
 		default:
 			usage();
 		}
 	}
 
 	unlink("torture.tdb");
+	unlink("torture.tdb.wal");
 
 	pids = calloc(sizeof(pid_t), num_procs);
 	pids[0] = getpid();
@@ -245,7 +427,9 @@ static void usage(void)
 		if ((pids[i+1]=fork()) == 0) break;
 	}
 
-	db = tdb_open_ex("torture.tdb", hash_size, TDB_CLEAR_IF_FIRST, 
+	/* a logged database can't be cleared, it has to survive a crash */
+	db = tdb_open_ex("torture.tdb", hash_size,
+			 wal ? TDB_WAL : TDB_CLEAR_IF_FIRST,
 			 O_RDWR | O_CREAT, 0600, &log_ctx, NULL);
 	if (!db) {
 		fatal("db open failed");
@@ -310,6 +494,10 @@ static void usage(void)
 		pids[j] = 0;
 	}
 
+	if (wal && error_count == 0) {
+		wal_crash_test(num_procs, hash_size);
+	}
+
 	if (error_count == 0) {
 		printf("OK\n");
 	}
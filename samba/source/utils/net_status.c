@@ -71,7 +71,7 @@ static int net_status_sessions(int argc, const char **argv)
 	}
 
 	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0,
-			   TDB_DEFAULT, O_RDONLY, 0);
+			   TDB_VOLATILE, O_RDONLY, 0);
 
 	if (tdb == NULL) {
 		d_fprintf(stderr, "%s not initialised\n", lock_path("sessionid.tdb"));
@@ -187,7 +187,7 @@ static int net_status_shares_parseable(int argc, const char **argv)
 	ids.entries = NULL;
 
 	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0,
-			   TDB_DEFAULT, O_RDONLY, 0);
+			   TDB_VOLATILE, O_RDONLY, 0);
 
 	if (tdb == NULL) {
 		d_fprintf(stderr, "%s not initialised\n", lock_path("sessionid.tdb"));
@@ -198,7 +198,7 @@ static int net_status_shares_parseable(int argc, const char **argv)
 	tdb_close(tdb);
 
 	tdb = tdb_open_log(lock_path("connections.tdb"), 0,
-			   TDB_DEFAULT, O_RDONLY, 0);
+			   TDB_VOLATILE, O_RDONLY, 0);
 
 	if (tdb == NULL) {
 		d_fprintf(stderr, "%s not initialised\n", lock_path("connections.tdb"));
@@ -227,7 +227,7 @@ static int net_status_shares(int argc, const char **argv)
 			 "------------------\n");
 
 		tdb = tdb_open_log(lock_path("connections.tdb"), 0,
-				   TDB_DEFAULT, O_RDONLY, 0);
+				   TDB_VOLATILE, O_RDONLY, 0);
 
 		if (tdb == NULL) {
 			d_fprintf(stderr, "%s not initialised\n",
@@ -63,7 +63,7 @@ static BOOL send_message(struct process_id pid, int msg_type,
 							duplicates));
 
 	tdb = tdb_open_log(lock_path("connections.tdb"), 0, 
-			   TDB_DEFAULT, O_RDWR, 0);
+			   TDB_VOLATILE, O_RDWR, 0);
 	if (!tdb) {
 		fprintf(stderr,"Failed to open connections database"
 			": %s\n", strerror(errno));
@@ -289,7 +289,7 @@ static BOOL do_daemon_stack_trace(const struct process_id pid,
 		TDB_CONTEXT * tdb;
 
 		tdb = tdb_open_log(lock_path("connections.tdb"), 0, 
-				   TDB_DEFAULT, O_RDONLY, 0);
+				   TDB_VOLATILE, O_RDONLY, 0);
 		if (!tdb) {
 			fprintf(stderr,
 				"Failed to open connections database: %s\n",
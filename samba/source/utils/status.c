@@ -51,6 +51,7 @@ const char *username = NULL;
 
 extern BOOL status_profile_dump(BOOL be_verbose);
 extern BOOL status_profile_rates(BOOL be_verbose);
+extern BOOL status_iostats_dump(BOOL be_verbose);
 
 /* added by OH */
 static void Ucrit_addUid(uid_t uid)
@@ -261,7 +262,7 @@ static BOOL send_status_message(struct process_id pid)
 	}
 
 	tdb = tdb_open_log(lock_path("connections.tdb"), 0,
-			   TDB_DEFAULT, O_RDWR, 0);
+			   TDB_VOLATILE, O_RDWR, 0);
 	if (!tdb) {
 		fprintf(stderr,"Failed to open connections database"
 			": %s\n", strerror(errno));
@@ -336,13 +337,13 @@ static void dump_user_stats(void)
 	TDB_CONTEXT *tdb;
 	int nump = 0;
 	message_register(MSG_USR_STATS, handle_usr_stat_reply, NULL);
-	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+	tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_VOLATILE, O_RDONLY, 0);
 	if (!tdb) {
 		d_printf("\nsessionid.tdb not initialised\n");
 	} else {
 		d_printf("\nPID     Username      Group         OpCount              ByteCount            \n");
 		d_printf("------------------------------------------------------------------------------\n");
-		nump = tdb_traverse(tdb, traverse_processes, NULL);
+		nump = tdb_traverse_snapshot(tdb, traverse_processes, NULL);
 		//DEBUG(10,("Total %d procs traversed\n", nump));
 		tdb_close(tdb);
 	}
@@ -385,6 +386,7 @@ static void dump_service_stats(void)
 		{"brief",	'b', POPT_ARG_NONE, 	&brief, 'b', "Be brief" },
 		{"profile",     'P', POPT_ARG_NONE, NULL, 'P', "Do profiling" },
 		{"profile-rates", 'R', POPT_ARG_NONE, NULL, 'R', "Show call rates" },
+		{"iostats",	'I', POPT_ARG_NONE, NULL, 'I', "Show per-share and per-client I/O" },
 		{"byterange",	'B', POPT_ARG_NONE,	&show_brl, 'B', "Include byte range locks"},
 		{"numeric",	'n', POPT_ARG_NONE,	&numeric_only, 'n', "Numeric uid/gid"},
 		{"counts",	'C', POPT_ARG_NONE,	&show_counts, 'n', "Show all user op/bytes counts"},
@@ -414,6 +416,7 @@ static void dump_service_stats(void)
 			break;
 		case 'P':
 		case 'R':
+		case 'I':
 			profile_only = c;
 		}
 	}
@@ -443,12 +446,15 @@ static void dump_service_stats(void)
 		case 'R':
 			/* Continuously display rate-converted data */
 			return status_profile_rates(verbose);
+		case 'I':
+			/* Dump the "io stats" counters */
+			return status_iostats_dump(verbose);
 		default:
 			break;
 	}
 
 	if ( show_processes ) {
-		tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(lock_path("sessionid.tdb"), 0, TDB_VOLATILE, O_RDONLY, 0);
 		if (!tdb) {
 			d_printf("sessionid.tdb not initialised\n");
 		} else {
@@ -456,7 +462,7 @@ static void dump_service_stats(void)
 			d_printf("PID     Username      Group         Machine                        \n");
 			d_printf("-------------------------------------------------------------------\n");
 
-			tdb_traverse(tdb, traverse_sessionid, NULL);
+			tdb_traverse_snapshot(tdb, traverse_sessionid, NULL);
 			tdb_close(tdb);
 		}
 
@@ -473,7 +479,7 @@ static void dump_service_stats(void)
 #endif /*WITH_DARWIN_STATS*/
 
 	if ( show_shares ) {
-		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_VOLATILE, O_RDONLY, 0);
 		if (!tdb) {
 			d_printf("%s not initialised\n", lock_path("connections.tdb"));
 			d_printf("This is normal if an SMB client has never connected to your server.\n");
@@ -488,7 +494,7 @@ static void dump_service_stats(void)
 			d_printf("\nService      pid     machine       Connected at\n");
 			d_printf("-------------------------------------------------------\n");
 	
-			tdb_traverse(tdb, traverse_fn1, NULL);
+			tdb_traverse_snapshot(tdb, traverse_fn1, NULL);
 			tdb_close(tdb);
 
 			d_printf("\n");
@@ -501,7 +507,7 @@ static void dump_service_stats(void)
 	if ( show_locks ) {
 		int ret;
 
-		tdb = tdb_open_log(lock_path("locking.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+		tdb = tdb_open_log(lock_path("locking.tdb"), 0, TDB_VOLATILE, O_RDONLY, 0);
 
 		if (!tdb) {
 			d_printf("%s not initialised\n", lock_path("locking.tdb"));
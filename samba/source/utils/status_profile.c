@@ -23,6 +23,7 @@
 
 BOOL status_profile_dump(BOOL be_verbose);
 BOOL status_profile_rates(BOOL be_verbose);
+BOOL status_iostats_dump(BOOL be_verbose);
 
 #ifdef WITH_PROFILE
 static void profile_separator(const char * title)
@@ -39,6 +40,45 @@ static void profile_separator(const char * title)
     line[sizeof(line) - 1] = '\0';
     d_printf("%s\n", line);
 }
+
+/*******************************************************************
+ dump the non-empty latency histograms, one line per used bucket
+  ******************************************************************/
+static void profile_dump_histograms(void)
+{
+	int i, b;
+
+	for (i = 0; i < PR_VALUE_MAX; ++i) {
+		const unsigned * hist = profile_p->histogram[i];
+
+		for (b = 0; b < PROF_HISTOGRAM_BUCKETS; ++b) {
+			if (hist[b]) {
+				break;
+			}
+		}
+
+		if (b == PROF_HISTOGRAM_BUCKETS) {
+			continue;
+		}
+
+		d_printf("%s:\n", profile_value_name(i));
+		for (b = 0; b < PROF_HISTOGRAM_BUCKETS; ++b) {
+			unsigned long lower = b ? (1UL << (b - 1)) : 0;
+
+			if (hist[b] == 0) {
+				continue;
+			}
+
+			if (b == PROF_HISTOGRAM_BUCKETS - 1) {
+				d_printf("    %10lu usec and up:   %u\n",
+					lower, hist[b]);
+			} else {
+				d_printf("    %10lu - %-10lu usec: %u\n",
+					lower, (1UL << b) - 1, hist[b]);
+			}
+		}
+	}
+}
 #endif
 
 /*******************************************************************
@@ -87,6 +127,9 @@ BOOL status_profile_dump(BOOL verbose)
 	d_printf("sendfile_time:                  %u\n", profile_p->syscall_sendfile_time);
 	d_printf("sendfile_bytes:                 %u\n", profile_p->syscall_sendfile_bytes);
 #endif
+	d_printf("recvfile_count:                 %u\n", profile_p->syscall_recvfile_count);
+	d_printf("recvfile_time:                  %u\n", profile_p->syscall_recvfile_time);
+	d_printf("recvfile_bytes:                 %u\n", profile_p->syscall_recvfile_bytes);
 	d_printf("lseek_count:                    %u\n", profile_p->syscall_lseek_count);
 	d_printf("lseek_time:                     %u\n", profile_p->syscall_lseek_time);
 	d_printf("rename_count:                   %u\n", profile_p->syscall_rename_count);
@@ -144,6 +187,7 @@ BOOL status_profile_dump(BOOL verbose)
 	d_printf("flushed_writes[CLOSE]:          %u\n", profile_p->writecache_flushed_writes[CLOSE_FLUSH]);
 	d_printf("flushed_writes[SYNC]:           %u\n", profile_p->writecache_flushed_writes[SYNC_FLUSH]);
 	d_printf("flushed_writes[SIZECHANGE]:     %u\n", profile_p->writecache_flushed_writes[SIZECHANGE_FLUSH]);
+	d_printf("flushed_writes[IDLE]:           %u\n", profile_p->writecache_flushed_writes[IDLE_FLUSH]);
 	d_printf("num_perfect_writes:             %u\n", profile_p->writecache_num_perfect_writes);
 	d_printf("num_write_caches:               %u\n", profile_p->writecache_num_write_caches);
 	d_printf("allocated_write_caches:         %u\n", profile_p->writecache_allocated_write_caches);
@@ -403,6 +447,9 @@ BOOL status_profile_dump(BOOL verbose)
 	d_printf("run_elections_time:             %u\n", profile_p->run_elections_time);
 	d_printf("election_count:                 %u\n", profile_p->election_count);
 	d_printf("election_time:                  %u\n", profile_p->election_time);
+
+	profile_separator("Latency Histograms");
+	profile_dump_histograms();
 #else /* WITH_PROFILE */
 	fprintf(stderr, "Profile data unavailable\n");
 #endif /* WITH_PROFILE */
@@ -542,3 +589,56 @@ BOOL status_profile_rates(BOOL verbose)
 
 #endif /* WITH_PROFILE */
 
+
+/*******************************************************************
+ dump the "io stats" share and client slots
+  ******************************************************************/
+
+static void iostats_dump_slots(const char * title,
+			       const struct iostats_slot * slots,
+			       int num_slots)
+{
+	int i, c;
+
+	d_printf("\n%-20s %14s %14s %9s %9s %9s %9s %9s %9s %10s\n",
+		title, "ReadBytes", "WriteBytes", "Reads", "Writes",
+		"Meta", "Dir", "Lock", "Other", "Time(ms)");
+	d_printf("-------------------------------------------------------"
+		 "-------------------------------------------------------"
+		 "--------\n");
+
+	for (i = 0; i < num_slots && slots[i].name[0]; ++i) {
+		const struct iostats_counters * ctr = &slots[i].counters;
+		SMB_BIG_UINT usec = 0;
+
+		for (c = 0; c < IOSTATS_NUM_OP_CLASSES; ++c) {
+			usec += ctr->usec[c];
+		}
+
+		d_printf("%-20.*s %14.0f %14.0f %9.0f %9.0f %9.0f %9.0f "
+			"%9.0f %9.0f %10.0f\n",
+			IOSTATS_NAME_LEN, slots[i].name,
+			(double)ctr->read_bytes,
+			(double)ctr->write_bytes,
+			(double)ctr->ops[IOSTATS_OP_READ],
+			(double)ctr->ops[IOSTATS_OP_WRITE],
+			(double)ctr->ops[IOSTATS_OP_META],
+			(double)ctr->ops[IOSTATS_OP_DIR],
+			(double)ctr->ops[IOSTATS_OP_LOCK],
+			(double)ctr->ops[IOSTATS_OP_OTHER],
+			(double)(usec / 1000));
+	}
+}
+
+BOOL status_iostats_dump(BOOL verbose)
+{
+	if (!iostats_setup(True)) {
+		fprintf(stderr, "Failed to attach the io stats area. "
+			"Is \"io stats\" enabled?\n");
+		return False;
+	}
+
+	iostats_dump_slots("Share", iostats_h->shares, IOSTATS_MAX_SHARES);
+	iostats_dump_slots("Client", iostats_h->clients, IOSTATS_MAX_CLIENTS);
+	return True;
+}
@@ -322,7 +322,7 @@ void status_page(void)
 		PID_or_Machine = 0;
 	}
 
-	tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_DEFAULT, O_RDONLY, 0);
+	tdb = tdb_open_log(lock_path("connections.tdb"), 0, TDB_VOLATILE, O_RDONLY, 0);
 	if (tdb) tdb_traverse(tdb, traverse_fn1, NULL);
  
 	initPid2Machine ();